@@ -0,0 +1,98 @@
+#include <lemon/syscall.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#ifndef SYS_FORK
+    #define SYS_FORK 76
+#endif
+
+#define DEFAULT_ITERATIONS 1000UL
+
+unsigned long iterations = DEFAULT_ITERATIONS;
+
+long ElapsedNs(const timespec& from, const timespec& to){
+    return (to.tv_sec - from.tv_sec) * 1000000000L + (to.tv_nsec - from.tv_nsec);
+}
+
+// Fork a child that exits straight away, creating and tearing down a process and its thread.
+// There is no fork() in the libc yet so the syscall is made directly.
+void SpawnProcess(){
+    long pid = syscall(SYS_FORK, 0, 0, 0, 0, 0);
+    if(pid < 0){
+        printf("Fork failed: %ld\n", pid);
+        exit(1);
+    } else if(pid == 0){
+        _exit(0);
+    }
+
+    waitpid(pid, nullptr, 0);
+}
+
+// Create and close a socket, allocating a socket, a file descriptor and list nodes
+void ChurnSocket(){
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd >= 0){
+        close(fd);
+    }
+}
+
+void ChurnFile(){
+    int fd = open("/dev/null", O_RDWR);
+    if(fd >= 0){
+        close(fd);
+    }
+}
+
+// Returns the mean time (in ns) taken by one call of op
+long Run(void(*op)(), unsigned long count){
+    timespec start, end;
+    clock_gettime(CLOCK_BOOTTIME, &start);
+
+    for(unsigned long i = 0; i < count; i++){
+        op();
+    }
+
+    clock_gettime(CLOCK_BOOTTIME, &end);
+
+    return ElapsedNs(start, end) / (long)count;
+}
+
+void PrintSlabInfo(){
+    FILE* f = fopen("/dev/slabinfo", "r");
+    if(!f){
+        return;
+    }
+
+    char line[256];
+    while(fgets(line, sizeof(line), f)){
+        printf("    %s", line);
+    }
+
+    fclose(f);
+}
+
+int main(int argc, char** argv){
+    if(argc > 1){
+        iterations = strtoul(argv[1], nullptr, 10);
+    }
+
+    if(!iterations){
+        printf("Usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    printf("Process spawn: %ld ns\n", Run(SpawnProcess, iterations));
+    printf("Socket create/close: %ld ns\n", Run(ChurnSocket, iterations * 10));
+    printf("File open/close: %ld ns\n", Run(ChurnFile, iterations * 10));
+
+    printf("Object caches:\n");
+    PrintSlabInfo();
+
+    return 0;
+}
@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#define DEFAULT_DIRECTORY "/system/pathbench"
+#define DEFAULT_ENTRIES 10000U
+#define LOOKUPS 10000U
+
+const char* directory = DEFAULT_DIRECTORY;
+unsigned entries = DEFAULT_ENTRIES;
+
+long ElapsedNs(const timespec& from, const timespec& to){
+    return (to.tv_sec - from.tv_sec) * 1000000000L + (to.tv_nsec - from.tv_nsec);
+}
+
+void EntryPath(char* path, size_t size, unsigned index){
+    snprintf(path, size, "%s/entry%05u", directory, index);
+}
+
+// Creates any missing entries, a directory left from a previous run is reused as is
+int Populate(){
+    char path[256];
+    struct stat st;
+
+    EntryPath(path, sizeof(path), entries - 1);
+    if(!stat(path, &st)){
+        return 0;
+    }
+
+    if(stat(directory, &st) && mkdir(directory, 0755)){
+        perror("Failed to create directory: ");
+        return -1;
+    }
+
+    printf("Creating %u entries in %s\n", entries, directory);
+    for(unsigned i = 0; i < entries; i++){
+        EntryPath(path, sizeof(path), i);
+
+        int fd = open(path, O_CREAT | O_WRONLY, 0644);
+        if(fd < 0){
+            perror("Failed to create entry: ");
+            return -1;
+        }
+        close(fd);
+    }
+
+    return 0;
+}
+
+// Returns the mean time (in ns) taken to resolve one path, lookups are spread over the whole directory
+long Run(bool existing, bool openFile){
+    char path[256];
+    struct stat st;
+
+    timespec start, end;
+    clock_gettime(CLOCK_BOOTTIME, &start);
+
+    for(unsigned i = 0; i < LOOKUPS; i++){
+        unsigned index = (i * 7919U) % entries; // 7919 is prime, so every entry is visited in a scattered order
+        if(existing){
+            EntryPath(path, sizeof(path), index);
+        } else {
+            snprintf(path, sizeof(path), "%s/missing%05u", directory, index);
+        }
+
+        if(openFile){
+            int fd = open(path, O_RDONLY);
+            if(fd >= 0){
+                close(fd);
+            } else if(existing){
+                printf("Failed to open %s\n", path);
+                exit(1);
+            }
+        } else {
+            bool found = !stat(path, &st);
+            if(found != existing){
+                printf("Unexpected result resolving %s\n", path);
+                exit(1);
+            }
+        }
+    }
+
+    clock_gettime(CLOCK_BOOTTIME, &end);
+
+    return ElapsedNs(start, end) / (long)LOOKUPS;
+}
+
+int main(int argc, char** argv){
+    if(argc > 1){
+        directory = argv[1];
+    }
+
+    if(argc > 2){
+        entries = strtoul(argv[2], nullptr, 10);
+    }
+
+    if(!entries){
+        printf("Usage: %s [directory] [entries]\n", argv[0]);
+        return 1;
+    }
+
+    if(Populate()){
+        return 1;
+    }
+
+    // Directories written by Lemon are linear, running e2fsck -fD on the image indexes them for the hash tree path
+    printf("Resolving paths in %s (%u entries), %u lookups each\n", directory, entries, LOOKUPS);
+    printf("stat existing: %ld ns\n", Run(true, false));
+    printf("stat missing: %ld ns\n", Run(false, false));
+    printf("open/close existing: %ld ns\n", Run(true, true));
+
+    return 0;
+}
@@ -1,6 +1,12 @@
-#include <stdio.h> 
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
 #include <pthread.h>
 
+#define CONTENTION_THREADS 8
+#define MUTEX_ITERATIONS 100000UL
+#define BROADCAST_ROUNDS 2000UL
+
 void* PrintMessage(void* msg){
     printf((char*)msg);
 
@@ -9,6 +15,102 @@ void* PrintMessage(void* msg){
 
 pthread_t t1, t2, t3;
 
+long ElapsedNs(const timespec& from, const timespec& to){
+    return (to.tv_sec - from.tv_sec) * 1000000000L + (to.tv_nsec - from.tv_nsec);
+}
+
+// Every thread increments the counter under the same mutex
+pthread_mutex_t counterMutex = PTHREAD_MUTEX_INITIALIZER;
+unsigned long counter = 0;
+
+void* IncrementCounter(void*){
+    for(unsigned long i = 0; i < MUTEX_ITERATIONS; i++){
+        pthread_mutex_lock(&counterMutex);
+        counter++;
+        pthread_mutex_unlock(&counterMutex);
+    }
+
+    return nullptr;
+}
+
+// The main thread starts a round by broadcasting, each waiter checks in once it has seen the round
+pthread_mutex_t roundMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t roundStart = PTHREAD_COND_INITIALIZER;
+pthread_cond_t roundDone = PTHREAD_COND_INITIALIZER;
+unsigned long currentRound = 0;
+unsigned checkedIn = 0;
+
+void* WaitForRounds(void*){
+    pthread_mutex_lock(&roundMutex);
+    for(unsigned long r = 1; r <= BROADCAST_ROUNDS; r++){
+        while(currentRound < r){
+            pthread_cond_wait(&roundStart, &roundMutex);
+        }
+
+        if(++checkedIn == CONTENTION_THREADS){
+            pthread_cond_signal(&roundDone);
+        }
+    }
+    pthread_mutex_unlock(&roundMutex);
+
+    return nullptr;
+}
+
+void MutexContention(){
+    pthread_t threads[CONTENTION_THREADS];
+
+    timespec start, end;
+    clock_gettime(CLOCK_BOOTTIME, &start);
+
+    for(int i = 0; i < CONTENTION_THREADS; i++){
+        pthread_create(&threads[i], nullptr, IncrementCounter, nullptr);
+    }
+
+    for(int i = 0; i < CONTENTION_THREADS; i++){
+        pthread_join(threads[i], nullptr);
+    }
+
+    clock_gettime(CLOCK_BOOTTIME, &end);
+
+    if(counter != CONTENTION_THREADS * MUTEX_ITERATIONS){
+        printf("Mutex contention: counter is %lu, expected %lu!\n", counter, CONTENTION_THREADS * MUTEX_ITERATIONS);
+        exit(1);
+    }
+
+    printf("Mutex contention (%d threads): %ld ns per lock/unlock\n", CONTENTION_THREADS, ElapsedNs(start, end) / (long)(CONTENTION_THREADS * MUTEX_ITERATIONS));
+}
+
+void BroadcastContention(){
+    pthread_t threads[CONTENTION_THREADS];
+
+    for(int i = 0; i < CONTENTION_THREADS; i++){
+        pthread_create(&threads[i], nullptr, WaitForRounds, nullptr);
+    }
+
+    timespec start, end;
+    clock_gettime(CLOCK_BOOTTIME, &start);
+
+    pthread_mutex_lock(&roundMutex);
+    for(unsigned long r = 1; r <= BROADCAST_ROUNDS; r++){
+        checkedIn = 0;
+        currentRound = r;
+        pthread_cond_broadcast(&roundStart);
+
+        while(checkedIn < CONTENTION_THREADS){
+            pthread_cond_wait(&roundDone, &roundMutex);
+        }
+    }
+    pthread_mutex_unlock(&roundMutex);
+
+    clock_gettime(CLOCK_BOOTTIME, &end);
+
+    for(int i = 0; i < CONTENTION_THREADS; i++){
+        pthread_join(threads[i], nullptr);
+    }
+
+    printf("Condition variable broadcast (%d waiters): %ld ns per round\n", CONTENTION_THREADS, ElapsedNs(start, end) / (long)BROADCAST_ROUNDS);
+}
+
 int main(){
     pthread_create(&t1, nullptr, PrintMessage, (void*)"Thread 1\n");
     pthread_create(&t2, nullptr, PrintMessage, (void*)"Thread 2\n");
@@ -20,5 +122,8 @@ int main(){
     pthread_join(t2, nullptr);
     pthread_join(t3, nullptr);
 
+    MutexContention();
+    BroadcastContention();
+
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#define MAX_CPUS 64
+#define DEFAULT_ITERATIONS 200000000UL
+
+struct CPUStats{
+    unsigned long busyTicks;
+    unsigned long idleTicks;
+    unsigned long migrations;
+};
+
+struct BenchThread{
+    pthread_t thread;
+    timespec finish;
+};
+
+timespec start;
+unsigned long iterations = DEFAULT_ITERATIONS;
+
+// Returns the amount of CPUs found in /dev/schedstats
+int ReadCPUStats(CPUStats* stats){
+    FILE* file = fopen("/dev/schedstats", "r");
+    if(!file){
+        return 0;
+    }
+
+    int count = 0;
+    char line[256];
+    while(count < MAX_CPUS && fgets(line, sizeof(line), file)){
+        unsigned cpu;
+        unsigned long threads;
+        if(sscanf(line, "cpu%u: %lu threads, %lu busy ticks, %lu idle ticks, %lu migrations", &cpu, &threads, &stats[count].busyTicks, &stats[count].idleTicks, &stats[count].migrations) == 5){
+            count++;
+        }
+    }
+
+    fclose(file);
+    return count;
+}
+
+long ElapsedMs(const timespec& from, const timespec& to){
+    return (to.tv_sec - from.tv_sec) * 1000 + (to.tv_nsec - from.tv_nsec) / 1000000;
+}
+
+void* Spin(void* arg){
+    BenchThread* bench = reinterpret_cast<BenchThread*>(arg);
+
+    volatile unsigned long counter = 0;
+    for(unsigned long i = 0; i < iterations; i++){
+        counter += i;
+    }
+
+    clock_gettime(CLOCK_BOOTTIME, &bench->finish);
+    return nullptr;
+}
+
+int main(int argc, char** argv){
+    CPUStats before[MAX_CPUS];
+    CPUStats after[MAX_CPUS];
+
+    int cpuCount = ReadCPUStats(before);
+
+    int threadCount = cpuCount ? cpuCount * 2 : 8;
+    if(argc > 1){
+        threadCount = atoi(argv[1]);
+    }
+
+    if(argc > 2){
+        iterations = strtoul(argv[2], nullptr, 10);
+    }
+
+    if(threadCount <= 0){
+        printf("Usage: %s [threads] [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    printf("Running %d CPU bound threads on %d CPUs (%lu iterations each)\n", threadCount, cpuCount, iterations);
+
+    BenchThread* threads = new BenchThread[threadCount];
+
+    clock_gettime(CLOCK_BOOTTIME, &start);
+    for(int i = 0; i < threadCount; i++){
+        pthread_create(&threads[i].thread, nullptr, Spin, &threads[i]);
+    }
+
+    for(int i = 0; i < threadCount; i++){
+        pthread_join(threads[i].thread, nullptr);
+    }
+
+    long minMs = -1;
+    long maxMs = 0;
+    long totalMs = 0;
+    for(int i = 0; i < threadCount; i++){
+        long ms = ElapsedMs(start, threads[i].finish);
+        printf("Thread %d finished after %ld ms\n", i, ms);
+
+        if(minMs < 0 || ms < minMs) minMs = ms;
+        if(ms > maxMs) maxMs = ms;
+        totalMs += ms;
+    }
+
+    printf("Finish time: min %ld ms, max %ld ms, mean %ld ms, spread %ld%%\n", minMs, maxMs, totalMs / threadCount, maxMs ? (maxMs - minMs) * 100 / maxMs : 0);
+
+    if(cpuCount && ReadCPUStats(after) == cpuCount){
+        unsigned long totalBusy = 0;
+        for(int i = 0; i < cpuCount; i++){
+            totalBusy += after[i].busyTicks - before[i].busyTicks;
+        }
+
+        for(int i = 0; i < cpuCount; i++){
+            unsigned long busy = after[i].busyTicks - before[i].busyTicks;
+            unsigned long idle = after[i].idleTicks - before[i].idleTicks;
+
+            printf("CPU %d: %lu busy ticks (%lu%% of work), %lu idle ticks, %lu threads migrated in\n", i, busy, totalBusy ? busy * 100 / totalBusy : 0, idle, after[i].migrations - before[i].migrations);
+        }
+    }
+
+    delete[] threads;
+    return 0;
+}
@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define SOCKET_ADDRESS "socketpolltest"
+#define POLL_TIMEOUT 5000 // 5 seconds
+#define DRAIN_SIZE 4096
+
+sockaddr_un address;
+int clientFd = -1;
+int serverFd = -1;
+
+// Connecting blocks until the connection has been accepted, so it is done from another thread
+void* Connect(void*){
+    if(connect(clientFd, (sockaddr*)&address, sizeof(sockaddr_un))){
+        perror("Connect: ");
+    }
+
+    return nullptr;
+}
+
+// Give the main thread time to start polling, then free some space in the client's outbound buffer
+void* Drain(void*){
+    usleep(100000); // 100ms
+
+    char buffer[DRAIN_SIZE];
+    if(recv(serverFd, buffer, DRAIN_SIZE, 0) <= 0){
+        perror("Recv: ");
+    }
+
+    return nullptr;
+}
+
+// Send until the socket will not take even a single byte
+size_t Fill(int fd){
+    char buffer[DRAIN_SIZE];
+    memset(buffer, 0xAA, DRAIN_SIZE);
+
+    size_t total = 0;
+    for(size_t len = DRAIN_SIZE; len > 0;){
+        ssize_t ret = send(fd, buffer, len, MSG_DONTWAIT);
+        if(ret > 0){
+            total += ret;
+        } else if(ret < 0 && errno == EAGAIN){
+            len /= 2; // Try smaller writes to use up what is left
+        } else {
+            perror("Send: ");
+            break;
+        }
+    }
+
+    return total;
+}
+
+int main(int argc, char** argv){
+    strcpy(address.sun_path, SOCKET_ADDRESS);
+    address.sun_family = AF_UNIX;
+
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listenFd < 0 || bind(listenFd, (sockaddr*)&address, sizeof(sockaddr_un)) || listen(listenFd, 1)){
+        perror("Failed to create listening socket: ");
+        return 1;
+    }
+
+    clientFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(clientFd < 0){
+        perror("Failed to create client socket: ");
+        return 1;
+    }
+
+    pthread_t connectThread;
+    pthread_create(&connectThread, nullptr, Connect, nullptr);
+
+    serverFd = accept(listenFd, nullptr, nullptr);
+    pthread_join(connectThread, nullptr);
+
+    if(serverFd < 0){
+        perror("Accept: ");
+        return 1;
+    }
+
+    size_t filled = Fill(clientFd);
+    printf("Filled socket with %lu bytes\n", filled);
+
+    pollfd pfd = {.fd = clientFd, .events = POLLOUT, .revents = 0};
+    if(poll(&pfd, 1, 0) != 0){
+        printf("FAIL: Full socket reported as writable (revents: %x)\n", pfd.revents);
+        return 1;
+    }
+
+    pthread_t drainThread;
+    pthread_create(&drainThread, nullptr, Drain, nullptr);
+
+    pfd.revents = 0;
+    int ret = poll(&pfd, 1, POLL_TIMEOUT);
+    pthread_join(drainThread, nullptr);
+
+    if(ret != 1 || !(pfd.revents & POLLOUT)){
+        printf("FAIL: Poller was not woken for POLLOUT after the peer read (poll: %d, revents: %x)\n", ret, pfd.revents);
+        return 1;
+    }
+
+    printf("PASS: Poller was woken for POLLOUT after the peer read\n");
+
+    close(clientFd);
+    close(serverFd);
+    close(listenFd);
+
+    return 0;
+}
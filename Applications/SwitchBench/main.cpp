@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#define DEFAULT_ITERATIONS 100000UL
+#define DEFAULT_BLOCKED_THREADS 64
+
+// Two threads take turns, each waking the other and then blocking until it is woken back up
+struct PingPong{
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+    unsigned long turn = 0;
+};
+
+PingPong pingPong;
+unsigned long iterations = DEFAULT_ITERATIONS;
+
+// Sleeping threads wait on this and are only woken once the benchmark is done
+pthread_mutex_t sleepMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t sleepCond = PTHREAD_COND_INITIALIZER;
+bool finished = false;
+
+long ElapsedNs(const timespec& from, const timespec& to){
+    return (to.tv_sec - from.tv_sec) * 1000000000L + (to.tv_nsec - from.tv_nsec);
+}
+
+void* Sleep(void*){
+    pthread_mutex_lock(&sleepMutex);
+    while(!finished){
+        pthread_cond_wait(&sleepCond, &sleepMutex);
+    }
+    pthread_mutex_unlock(&sleepMutex);
+
+    return nullptr;
+}
+
+void* Pong(void*){
+    pthread_mutex_lock(&pingPong.mutex);
+    for(unsigned long i = 0; i < iterations; i++){
+        while(!(pingPong.turn & 1)){
+            pthread_cond_wait(&pingPong.cond, &pingPong.mutex);
+        }
+
+        pingPong.turn++;
+        pthread_cond_signal(&pingPong.cond);
+    }
+    pthread_mutex_unlock(&pingPong.mutex);
+
+    return nullptr;
+}
+
+// Returns the mean time (in ns) taken for one thread to wake the other
+long Run(){
+    pingPong.turn = 0;
+
+    pthread_t pong;
+    pthread_create(&pong, nullptr, Pong, nullptr);
+
+    timespec start, end;
+    clock_gettime(CLOCK_BOOTTIME, &start);
+
+    pthread_mutex_lock(&pingPong.mutex);
+    for(unsigned long i = 0; i < iterations; i++){
+        pingPong.turn++;
+        pthread_cond_signal(&pingPong.cond);
+
+        while(pingPong.turn & 1){
+            pthread_cond_wait(&pingPong.cond, &pingPong.mutex);
+        }
+    }
+    pthread_mutex_unlock(&pingPong.mutex);
+
+    clock_gettime(CLOCK_BOOTTIME, &end);
+    pthread_join(pong, nullptr);
+
+    return ElapsedNs(start, end) / (long)(iterations * 2);
+}
+
+int main(int argc, char** argv){
+    int blockedCount = DEFAULT_BLOCKED_THREADS;
+    if(argc > 1){
+        blockedCount = atoi(argv[1]);
+    }
+
+    if(argc > 2){
+        iterations = strtoul(argv[2], nullptr, 10);
+    }
+
+    if(blockedCount < 0 || !iterations){
+        printf("Usage: %s [blocked threads] [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    printf("Measuring switch latency over %lu round trips\n", iterations);
+
+    long baseline = Run();
+    printf("0 blocked threads: %ld ns per switch\n", baseline);
+
+    pthread_t* sleepers = new pthread_t[blockedCount];
+    for(int i = 0; i < blockedCount; i++){
+        pthread_create(&sleepers[i], nullptr, Sleep, nullptr);
+    }
+
+    long loaded = Run();
+    printf("%d blocked threads: %ld ns per switch (%+ld ns)\n", blockedCount, loaded, loaded - baseline);
+
+    pthread_mutex_lock(&sleepMutex);
+    finished = true;
+    pthread_cond_broadcast(&sleepCond);
+    pthread_mutex_unlock(&sleepMutex);
+
+    for(int i = 0; i < blockedCount; i++){
+        pthread_join(sleepers[i], nullptr);
+    }
+
+    delete[] sleepers;
+    return 0;
+}
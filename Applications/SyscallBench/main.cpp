@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define DEFAULT_ITERATIONS 1000000UL
+
+// Out of range of the syscall table so the kernel returns straight away,
+// this measures only the cost of getting into the kernel and back out
+#define NULL_SYSCALL 0xFFFF
+
+#define SYS_LSEEK 19
+
+unsigned long iterations = DEFAULT_ITERATIONS;
+
+long ElapsedNs(const timespec& from, const timespec& to){
+    return (to.tv_sec - from.tv_sec) * 1000000000L + (to.tv_nsec - from.tv_nsec);
+}
+
+inline void InterruptSyscall(){
+    uint64_t num = NULL_SYSCALL;
+    asm volatile("int $0x69" : "+a"(num) :: "memory");
+}
+
+inline void FastSyscall(){
+    uint64_t num = NULL_SYSCALL;
+    asm volatile("syscall" : "+a"(num) :: "rcx", "r11", "memory"); // SYSCALL clobbers RCX (RIP) and R11 (RFLAGS)
+}
+
+// Arguments go in RBX, RCX, RDX... for int 0x69, SYSCALL takes RCX so argument 2 goes in R10 instead
+inline long InterruptSeek(long fd, long offset, long whence){
+    long ret = SYS_LSEEK;
+    asm volatile("int $0x69" : "+a"(ret) : "b"(fd), "c"(offset), "d"(whence) : "memory");
+    return ret;
+}
+
+inline long FastSeek(long fd, long offset, long whence){
+    long ret = SYS_LSEEK;
+    register long r10 asm("r10") = offset;
+    asm volatile("syscall" : "+a"(ret) : "b"(fd), "r"(r10), "d"(whence) : "rcx", "r11", "memory");
+    return ret;
+}
+
+// Seek to a different offset through each path and check that all the arguments arrived
+bool CheckArguments(){
+    int fd = open("/dev/null", O_RDONLY);
+    if(fd < 0){
+        printf("Failed to open /dev/null\n");
+        return false;
+    }
+
+    bool passed = true;
+    for(long offset = 1; offset <= 4096; offset <<= 1){
+        long ret = InterruptSeek(fd, offset, SEEK_SET);
+        if(ret != offset){
+            printf("int 0x69: lseek to %ld returned %ld\n", offset, ret);
+            passed = false;
+        }
+
+        ret = FastSeek(fd, offset + 1, SEEK_SET);
+        if(ret != offset + 1){
+            printf("syscall: lseek to %ld returned %ld\n", offset + 1, ret);
+            passed = false;
+        }
+    }
+
+    close(fd);
+    return passed;
+}
+
+// Returns the mean round trip time (in ns) of a null syscall
+template<void(*call)()>
+long Run(){
+    timespec start, end;
+    clock_gettime(CLOCK_BOOTTIME, &start);
+
+    for(unsigned long i = 0; i < iterations; i++){
+        call();
+    }
+
+    clock_gettime(CLOCK_BOOTTIME, &end);
+
+    return ElapsedNs(start, end) / (long)iterations;
+}
+
+int main(int argc, char** argv){
+    if(argc > 1){
+        iterations = strtoul(argv[1], nullptr, 10);
+    }
+
+    if(!iterations){
+        printf("Usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    if(!CheckArguments()){
+        printf("Syscall arguments were not passed correctly\n");
+        return 1;
+    }
+
+    printf("Measuring null syscall round trip over %lu calls\n", iterations);
+
+    // Warm up both paths first
+    for(int i = 0; i < 1000; i++){
+        InterruptSyscall();
+        FastSyscall();
+    }
+
+    long legacy = Run<InterruptSyscall>();
+    printf("int 0x69: %ld ns per call\n", legacy);
+
+    long fast = Run<FastSyscall>();
+    printf("syscall: %ld ns per call (%+ld ns)\n", fast, fast - legacy);
+
+    return 0;
+}
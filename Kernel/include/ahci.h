@@ -299,6 +299,7 @@ typedef struct tagHBA_CMD_TBL
 } __attribute__((packed)) hba_cmd_tbl_t;
 
 #define AHCI_GHC_ENABLE (1 << 31)
+#define AHCI_GHC_IE (1 << 1) // Interrupt enable
 
 #define AHCI_CAP_S64A (1 << 31) // 64-bit addressing
 #define AHCI_CAP_NCQ (1 << 30) // Support for Native Command Queueing?
@@ -307,6 +308,7 @@ typedef struct tagHBA_CMD_TBL
 #define AHCI_CAP_SSC (1 << 14) // Slumber state capable?
 #define AHCI_CAP_PSC (1 << 13) // Partial state capable
 #define AHCI_CAP_SALP (1 << 26) // Supports aggressive link power management
+#define AHCI_CAP_NCS(cap) ((((cap) >> 8) & 0x1f) + 1) // Number of command slots
 
 #define AHCI_CAP2_NVMHCI (1 << 1) // NVMHCI Present
 #define AHCI_CAP2_BOHC (1 << 0) // BIOS/OS Handoff
@@ -329,6 +331,16 @@ typedef struct tagHBA_CMD_TBL
 #define HBA_PxCMD_ICC 	(0xf << 28)
 #define HBA_PxCMD_ICC_ACTIVE (1 << 28)
 
+#define HBA_PxIS_DHRS (1 << 0) // Device to host register FIS received
+#define HBA_PxIS_PSS (1 << 1) // PIO setup FIS received
+#define HBA_PxIS_DSS (1 << 2) // DMA setup FIS received
+#define HBA_PxIS_SDBS (1 << 3) // Set device bits FIS received (NCQ completion)
+#define HBA_PxIS_IFS (1 << 27) // Interface fatal error
+#define HBA_PxIS_HBDS (1 << 28) // Host bus data error
+#define HBA_PxIS_HBFS (1 << 29) // Host bus fatal error
+#define HBA_PxIS_TFES (1 << 30) // Task file error
+#define HBA_PxIS_ERROR (HBA_PxIS_IFS | HBA_PxIS_HBDS | HBA_PxIS_HBFS | HBA_PxIS_TFES)
+
 #define HBA_PORT_IPM_ACTIVE 1
 
 #define HBA_PxSSTS_DET 0xfULL
@@ -337,6 +349,18 @@ typedef struct tagHBA_CMD_TBL
 
 #include <devicemanager.h>
 
+// Maximum amount of commands that can be outstanding on a port
+#define AHCI_MAX_COMMAND_SLOTS 32
+// Size of the bounce buffer of each command slot, used for buffers the controller cannot access directly
+#define AHCI_SLOT_BUFFER_SIZE 4096
+// Size of each command table (command FIS and PRDT)
+#define AHCI_COMMAND_TABLE_PAGES 4
+// Amount of PRDT entries that fit in a command table, the PRDT starts at 0x80
+#define AHCI_PRDT_ENTRIES ((AHCI_COMMAND_TABLE_PAGES * 4096 - 0x80) / sizeof(hba_prdt_entry_t))
+// Maximum size of a single PRDT entry and of a single command
+#define AHCI_MAX_PRDT_ENTRY_SIZE 0x400000 // 4MB
+#define AHCI_MAX_TRANSFER_SIZE 0x400000 // 4MB
+
 namespace AHCI{
 	enum AHCIStatus{
 		Uninitialized = 0,
@@ -350,27 +374,61 @@ namespace AHCI{
 
 		int ReadDiskBlock(uint64_t lba, uint32_t count, void* buffer);
 		int WriteDiskBlock(uint64_t lba, uint32_t count, void* buffer);
+		int ReadDiskBlocks(uint64_t lba, const disk_segment_t* segments, unsigned count);
+		int WriteDiskBlocks(uint64_t lba, const disk_segment_t* segments, unsigned count);
+
+		// Called from the controller interrupt handler when the port has raised an interrupt
+		void OnInterrupt();
 
         int blocksize = 512;
 		AHCIStatus status = AHCIStatus::Uninitialized;
 	private:
-		int FindCmdSlot();
-		int Access(uint64_t lba, uint32_t count, int write);
-		void Identify();
+		// Get a free command slot, if wait is not set returns -1 when all slots are in use
+		int AcquireSlot(bool wait = true);
+		void ReleaseSlot(int slot);
+
+		// Point the PRDT of slot at its bounce buffer
+		void SetSlotBuffer(int slot, uint32_t size);
+		// Point the PRDT of slot at the physical pages of the segments, starting at offset into the first.
+		// Returns the amount of bytes mapped (a multiple of 512), 0 if the buffer cannot be accessed directly.
+		uint32_t MapBuffer(int slot, const disk_segment_t* segments, unsigned count, uint32_t offset);
+		// Issue a command without waiting for it to complete, the PRDT must already be set up
+		void Issue(int slot, uint8_t command, uint64_t lba, uint32_t count);
+		// Block until the command in slot has completed, returns non-zero on error
+		int WaitForCompletion(int slot);
+		// Complete commands the device has finished, issueLock must be held with interrupts disabled
+		void CheckCompletions();
+
+		int Transfer(uint64_t lba, const disk_segment_t* segments, unsigned segmentCount, bool write);
+		void Identify(hba_mem_t* hbaMem);
 
 		hba_port_t* registers;
 
 		hba_cmd_header_t* commandList; // Address Mapping of the Command List
 		hba_fis_t* fis; // Address Mapping of the FIS
 
-		hba_cmd_tbl_t* commandTables[8];
+		hba_cmd_tbl_t* commandTables[AHCI_MAX_COMMAND_SLOTS];
 
-		uint64_t bufPhys;
-		void* bufVirt;
+		uint64_t slotBufferPhys[AHCI_MAX_COMMAND_SLOTS];
+		uint8_t* slotBuffers[AHCI_MAX_COMMAND_SLOTS];
 
-		Semaphore portLock = Semaphore(1); // Binary semaphore for the port
+		int commandSlotCount = 1;
+		bool ncq = false; // Use READ/WRITE FPDMA QUEUED
+
+		Semaphore slotSemaphore = Semaphore(0); // Amount of free command slots
+		lock_t slotLock = 0;
+		uint32_t freeSlots = 0;
+
+		lock_t issueLock = 0; // Taken with interrupts disabled as the interrupt handler also takes it
+		uint32_t activeSlots = 0; // Commands issued that have not completed
+		uint32_t failedSlots = 0; // Commands that completed with an error
+		thread_t* slotWaiters[AHCI_MAX_COMMAND_SLOTS];
 	};
 
+	extern Port* ports[32];
+	// Set if the controller interrupt is in use, otherwise port completions are polled
+	extern bool interruptsEnabled;
+
 	int Init();
 
 	inline void startCMD(hba_port_t *port)
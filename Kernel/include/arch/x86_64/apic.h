@@ -30,6 +30,13 @@
 
 #define LOCAL_APIC_BASE 0xFFFFFFFFFF000
 
+#define LOCAL_APIC_LVT_MASKED (1 << 16)
+#define LOCAL_APIC_TIMER_MODE_ONESHOT (0 << 17)
+#define LOCAL_APIC_TIMER_MODE_TSC_DEADLINE (2 << 17) // Fires when the TSC reaches the value in IA32_TSC_DEADLINE
+#define LOCAL_APIC_TIMER_DIVIDE_16 0x3
+
+#define MSR_IA32_TSC_DEADLINE 0x6E0
+
 #define ICR_VECTOR(x) (x & 0xFF)
 #define ICR_MESSAGE_TYPE_FIXED 0
 #define ICR_MESSAGE_TYPE_LOW_PRIORITY (1 << 8)
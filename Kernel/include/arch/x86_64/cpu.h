@@ -13,13 +13,23 @@ typedef struct {
 
 struct CPU{
 	CPU* self;
+	uintptr_t syscallKernelStack; // Kernel stack of the current thread, switched to on SYSCALL (offset used in syscall.asm)
+	uintptr_t syscallUserStack; // User stack pointer saved on SYSCALL (offset used in syscall.asm)
     uint64_t id; // APIC/CPU id
+    volatile bool online = false; // Started and handling interrupts, CPUs that failed to start never are
     void* gdt; // GDT
 	gdt_ptr_t gdtPtr;
 	thread_t* currentThread = nullptr;
 	process_t* idleProcess = nullptr;
 	volatile int runQueueLock = 0;
 	FastList<thread_t*>* runQueue;
+	uint64_t minVruntime = 0; // vruntime of the last thread picked to run, only ever increases. New and woken threads are placed relative to this
+	thread_t* previousThread = nullptr; // Thread switched away from in the last call to Schedule, its kernel stack may still be in use
+	unsigned balanceTicks = 0; // Scheduler ticks since the run queue was last balanced
+	uint64_t busyTicks = 0; // Scheduler ticks spent running threads
+	uint64_t idleTicks = 0; // Scheduler ticks spent in the idle thread
+	uint64_t migrations = 0; // Threads pulled from the run queues of other CPUs
+	frame_cache_t frameCache = {}; // Free physical blocks for this CPU only
     tss_t tss __attribute__((aligned(16))); 
 };
 
@@ -46,6 +56,7 @@ enum {
 	CPUID_ECX_x2APIC = 1 << 21,
 	CPUID_ECX_MOVBE = 1 << 22,
 	CPUID_ECX_POPCNT = 1 << 23,
+	CPUID_ECX_TSC_DEADLINE = 1 << 24,
 	CPUID_ECX_AES = 1 << 25,
 	CPUID_ECX_XSAVE = 1 << 26,
 	CPUID_ECX_OSXSAVE = 1 << 27,
@@ -7,6 +7,8 @@
 
 #define IPI_HALT 0xFE
 #define IPI_SCHEDULE 0xFD
+#define IPI_TLB_SHOOTDOWN 0xFB
+#define IRQ_LOCAL_TIMER 0xFC // Local APIC timer
 
 typedef struct {
 	uint16_t base_low;
@@ -24,16 +26,16 @@ typedef struct {
 } __attribute__((packed)) idt_ptr_t;
 
 typedef void(*isr_t)(void*, regs64_t*);
+typedef void(*exception_handler_t)(void*, regs64_t*, int errCode); // errCode is the error code pushed by the CPU or 0
 
 extern "C" void idt_flush();
 
 namespace IDT{
 	void Initialize();
 	void RegisterInterruptHandler(uint8_t interrupt, isr_t handler, void* data = nullptr);
+	void RegisterExceptionHandler(uint8_t exception, exception_handler_t handler, void* data = nullptr);
 	
 	void DisablePIC();
 
 	uint8_t ReserveUnusedInterrupt();
-
-	int GetErrCode();
 }
\ No newline at end of file
@@ -7,4 +7,43 @@
 typedef struct {
     uint64_t base;
     uint64_t pageCount;
-} mem_region_t;
\ No newline at end of file
+    uint64_t key; // Shared memory key, 0 if the region is not shared memory (e.g. the framebuffer)
+} mem_region_t;
+
+enum {
+    VMRegionAnonymous = 1, // Pages are allocated and zeroed on first access
+    VMRegionFile = 2, // Pages are mapped from the page cache on first access
+    VMRegionShared = 4, // Writes to file pages go back to the file instead of a private copy
+};
+
+class FsNode;
+
+typedef struct {
+    uintptr_t base;
+    uint64_t pageCount;
+    uint64_t flags;
+
+    FsNode* node; // File backing the region, the region holds a handle to it
+    uint64_t offset; // Offset of the region within node, page aligned
+} vm_region_t;
+
+struct process;
+
+namespace Memory{
+    // Reserves pageCount pages at base in the address space of proc, physical memory is only allocated once a page is accessed
+    // Returns false if the range overlaps another region or mapped memory
+    bool MapAnonymousRegion(struct process* proc, uintptr_t base, uint64_t pageCount);
+    // Reserves pageCount pages at base in the address space of proc backed by node from offset, pages are mapped from the page cache once accessed
+    // Returns false if the range overlaps another region or mapped memory
+    bool MapFileRegion(struct process* proc, uintptr_t base, uint64_t pageCount, FsNode* node, uint64_t offset, bool shared);
+    // Frees any physical memory backing regions in the range and removes it from the region list, modified pages of shared file regions are written back
+    void UnmapRegion(struct process* proc, uintptr_t base, uint64_t pageCount);
+    // Returns the region containing addr or nullptr, the region lock of proc should be held
+    vm_region_t* FindRegion(struct process* proc, uintptr_t addr);
+    // Allocates and maps the page containing addr if it is part of a region, returns false if the address is invalid
+    bool HandleDemandPageFault(struct process* proc, uintptr_t addr);
+    // Shares the user memory of src with dest, writable pages become copy-on-write in both processes
+    void CloneAddressSpace(struct process* src, struct process* dest);
+    // Gives proc its own copy of a copy-on-write page, returns false if the page is not copy-on-write
+    bool HandleCopyOnWriteFault(struct process* proc, uintptr_t addr);
+}
\ No newline at end of file
@@ -33,6 +33,9 @@
 #define PAGE_USER (1 << 2)
 #define PAGE_WRITETHROUGH (1 << 3)
 #define PAGE_CACHE_DISABLED (1 << 4)
+#define PAGE_DIRTY (1 << 6)
+#define PAGE_DEMAND (1 << 9) // Page is not present and will be allocated on first access (Available for OS use)
+#define PAGE_COW (1 << 10) // Page is shared read only and will be copied on the first write (Available for OS use)
 #define PAGE_FRAME 0xFFFFFFFFFF000
 
 #define PAGE_SIZE_4K 4096
@@ -114,8 +117,10 @@ namespace Memory{
     uint64_t VirtualToPhysicalAddress(uint64_t addr, address_space_t* addressSpace);
 
     void SwitchPageDirectory(uint64_t phys);
+
+    void FlushTLBAllCPUs(); // Needed when mappings other CPUs may have cached lose permissions
     
-	void PageFaultHandler(void*, regs64_t* regs);
+	void PageFaultHandler(void*, regs64_t* regs, int err_code);
 
     inline void SetPageFrame(uint64_t* page, uint64_t addr){
         *page = (*page & ~PAGE_FRAME) | (addr & PAGE_FRAME);
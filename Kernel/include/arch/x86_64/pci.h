@@ -72,6 +72,13 @@
 #define PCI_CAP_MSI_CONTROL_MMC(x) ((x >> 1) & 0x7) // Multiple Message Capable
 #define PCI_CAP_MSI_CONTROL_ENABLE (1 << 0) // MSI Enable
 
+#define PCI_CAP_MSIX_CONTROL_TABLE_SIZE(x) (((x) & 0x7FFU) + 1U) // Amount of entries in the MSI-X table
+#define PCI_CAP_MSIX_CONTROL_FUNCTION_MASK (1 << 14) // Mask all MSI-X vectors
+#define PCI_CAP_MSIX_CONTROL_ENABLE (1 << 15) // MSI-X Enable
+#define PCI_CAP_MSIX_TABLE_BIR 0x7 // BAR containing the MSI-X table
+
+#define PCI_MSIX_VECTOR_CONTROL_MASK (1 << 0)
+
 enum PCIConfigRegisters{
 	PCIDeviceID = 0x2,
 	PCIVendorID = 0x0,
@@ -104,6 +111,7 @@ enum PCIConfigRegisters{
 
 enum PCICapabilityIDs{
 	PCICapMSI = 0x5,
+	PCICapMSIX = 0x11,
 };
 
 enum PCIVectors{
@@ -160,6 +168,13 @@ struct PCIMSICapability{
 	}
 } __attribute__((packed));
 
+typedef volatile struct PCIMSIXTableEntry{
+	uint32_t addressLow;
+	uint32_t addressHigh;
+	uint32_t data;
+	uint32_t vectorControl;
+} __attribute__((packed)) pci_msix_table_entry_t;
+
 class PCIDevice;
 namespace PCI{
 	enum PCIConfigurationAccessMode {
@@ -170,6 +185,7 @@ namespace PCI{
 	uint16_t ReadWord(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset);
 
 	uint32_t ConfigReadDword(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset);
+	void ConfigWriteDword(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t data);
 
 	uint16_t ConfigReadWord(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset);
 	void ConfigWriteWord(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint16_t data);
@@ -206,12 +222,16 @@ public:
 	PCIMSICapability msiCap;
 	bool msiCapable = false;
 
+	uint8_t msixPtr;
+	bool msixCapable = false;
+	PCIMSIXTableEntry* msixTable = nullptr; // Mapped on first use
+
 	inline uintptr_t GetBaseAddressRegister(uint8_t idx){
 		assert(idx >= 0 && idx <= 5);
 
 		uintptr_t bar = PCI::ConfigReadDword(bus, slot, func, PCIBAR0 + (idx * sizeof(uint32_t)));
 		if(!(bar & 0x1) /* Not MMIO */ && bar & 0x4 /* 64-bit */ && idx < 5){
-			bar |= static_cast<uintptr_t>(PCI::ConfigReadDword(bus, slot, func, PCIBAR0 + ((bar + 1) * sizeof(uint32_t)))) << 32;
+			bar |= static_cast<uintptr_t>(PCI::ConfigReadDword(bus, slot, func, PCIBAR0 + ((idx + 1) * sizeof(uint32_t)))) << 32;
 		}
 
 		return (bar & 0x1) ? (bar & 0xFFFFFFFFFFFFFFFC) : (bar & 0xFFFFFFFFFFFFFFF0);
@@ -275,4 +295,9 @@ public:
 	}
 
 	uint8_t AllocateVector(PCIVectors type);
+
+	// Amount of MSI-X vectors supported by the device, 0 if not MSI-X capable
+	unsigned MSIXVectorCount();
+	// Program MSI-X table entry index to raise a new interrupt on the CPU with APIC ID cpu, returns 0xFF on failure
+	uint8_t AllocateMSIXVector(unsigned index, uint64_t cpu);
 };
\ No newline at end of file
@@ -10,8 +10,35 @@
 // The amount of blocks in a byte
 #define PHYSALLOC_BLOCKS_PER_BYTE 8
 
-// The size of the memory bitmap in dwords
-#define PHYSALLOC_BITMAP_SIZE_DWORDS 524488 // 64GB
+// Maximum amount of physical memory blocks we can track
+#define PHYSALLOC_MAX_BLOCKS (1ULL << 24) // 64GB
+
+// Largest buddy order, a block of order n is (2^n) * PHYSALLOC_BLOCK_SIZE bytes
+#define PHYSALLOC_MAX_ORDER 9 // 2MB
+// Order of a 2MB block
+#define PHYSALLOC_LARGE_ORDER 9
+
+// Amount of free blocks each CPU can hold on to
+#define PHYSALLOC_FRAME_CACHE_SIZE 64
+// Amount of blocks moved between a CPU's cache and the global allocator at once
+#define PHYSALLOC_FRAME_CACHE_BATCH 32
+
+// Amount of blocks allocated and freed by each part of the allocator benchmark
+#define PHYSALLOC_BENCHMARK_FRAMES (1U << 20)
+// Amount of blocks held at once by the batched part of the allocator benchmark
+#define PHYSALLOC_BENCHMARK_BATCH 4096U
+
+// Amount of shared block reference counts held in each page of the reference count table
+#define PHYSALLOC_REFCOUNTS_PER_PAGE (PHYSALLOC_BLOCK_SIZE / sizeof(uint32_t))
+
+typedef struct {
+    uint64_t frames[PHYSALLOC_FRAME_CACHE_SIZE];
+    unsigned count;
+
+    uint64_t hits; // Allocations served from the cache
+    uint64_t misses; // Allocations that had to refill from the global allocator
+    uint64_t drains; // Frees that had to give blocks back to the global allocator
+} frame_cache_t;
 
 extern void* kernel_end;
 
@@ -20,8 +47,8 @@ namespace Memory{
     // Initialize the physical page allocator
     void InitializePhysicalAllocator(memory_info_t* mem_info);
 
-    // Finds the first free block in physical memory
-    uint64_t GetFirstFreeMemoryBlock();
+    // Start using the per-CPU frame caches, CPU local data must be set up on every CPU that allocates memory
+    void EnableFrameCaches();
 
     // Marks a region in physical memory as being used
     void MarkMemoryRegionUsed(uint64_t base, size_t size);
@@ -32,13 +59,41 @@ namespace Memory{
     // Allocates a block of physical memory
     uint64_t AllocatePhysicalMemoryBlock();
 
-    // Allocates a 2MB block of physical memory
+    // Allocates count physically contiguous blocks of memory, returns 0 on failure
+    uint64_t AllocatePhysicalMemoryBlocks(uint64_t count);
+
+    // Allocates count physically contiguous blocks of memory ending at or below the physical address limit, for devices that cannot address all memory. Returns 0 on failure
+    uint64_t AllocatePhysicalMemoryBlocks(uint64_t count, uint64_t limit);
+
+    // Allocates a 2MB block of physical memory, returns 0 on failure
     uint64_t AllocateLargePhysicalMemoryBlock();
 
     // Frees a block of physical memory
     void FreePhysicalMemoryBlock(uint64_t addr);
 
+    // Frees count physically contiguous blocks of memory
+    void FreePhysicalMemoryBlocks(uint64_t addr, uint64_t count);
+
+    // Frees a 2MB block of physical memory
+    void FreeLargePhysicalMemoryBlock(uint64_t addr);
+
+    // Adds a reference to an allocated block, FreePhysicalMemoryBlock will only free it once every reference is gone
+    void SharePhysicalMemoryBlock(uint64_t addr);
+
+    // Returns true if more than one reference to the block exists
+    bool IsPhysicalMemoryBlockShared(uint64_t addr);
+
+#ifdef PHYSALLOC_BENCHMARK
+    /////////////////////////////
+    /// \brief Time allocating and freeing PHYSALLOC_BENCHMARK_FRAMES blocks in different patterns and write the results to buffer
+    ///
+    /// \return Length of the string written
+    /////////////////////////////
+    size_t RunAllocatorBenchmark(char* buffer, size_t size);
+#endif
+
     // Used Blocks of Memory
     extern uint64_t usedPhysicalBlocks;
+    // Usable Blocks of Memory
     extern uint64_t maxPhysicalBlocks;
-}
\ No newline at end of file
+}
@@ -10,10 +10,20 @@
 #include <lock.h>
 #include <timer.h>
 #include <hash.h>
+#include <handle.h>
 
 #include <thread.h>
 
-typedef void* handle_t;
+// Amount of scheduler ticks between each CPU pulling threads from busier CPUs
+#define SCHEDULER_BALANCE_INTERVAL 50
+// vruntime gained by a thread of default priority each scheduler tick
+#define SCHEDULER_VRUNTIME_TICK 1024
+// vruntime a waking thread may be behind the run queue, so threads that mostly sleep run ahead of CPU bound threads
+#define SCHEDULER_WAKEUP_CREDIT (4 * SCHEDULER_VRUNTIME_TICK)
+// Threads woken by user input are always placed this far behind the run queue
+#define SCHEDULER_INPUT_CREDIT (20 * SCHEDULER_VRUNTIME_TICK)
+// Woken threads only preempt the running thread when their vruntime is lower by at least this
+#define SCHEDULER_WAKEUP_GRANULARITY SCHEDULER_VRUNTIME_TICK
 
 typedef struct HandleIndex {
 	uint32_t owner_pid;
@@ -33,6 +43,8 @@ typedef struct process {
 	pid_t pid = -1; // PID
 	address_space_t* addressSpace; // Pointer to page directory and tables
 	List<mem_region_t> sharedMemory; // Used to ensure these memory regions don't get freed when a process is terminated
+	List<vm_region_t> vmRegions; // Demand paged memory regions
+	lock_t vmRegionLock = 0;
 	uint8_t state = ThreadStateRunning; // Process state
 	Vector<thread_t*> threads;
 	uint32_t threadCount = 0; // Amount of threads
@@ -49,9 +61,9 @@ typedef struct process {
 	uint64_t activeTicks = 0; // How many ticks this process has been active
 
 	Vector<fs_fd_t*> fileDescriptors;
+	HandleTable handles; // Kernel object handles, lookups are lock free
 	List<message_t> messageQueue;
 	List<thread_t*> blocking; // Threads blocking awaiting a state change
-	HashMap<uintptr_t, Scheduler::FutexThreadBlocker*> futexWaitQueue;
 } process_t;
 
 typedef struct {
@@ -75,13 +87,15 @@ namespace Scheduler{
 
     process_t* CreateProcess(void* entry);
 	process_t* CreateELFProcess(void* elf, int argc = 0, char** argv = nullptr, int envc = 0, char** envp = nullptr);
+	process_t* ForkProcess(process_t* process, regs64_t* r);
 
 	process_t* GetCurrentProcess();
 
 	void Yield();
 
-	handle_t RegisterHandle(void* handle);
-	void* FindHandle(handle_t handle);
+	handle_t RegisterHandle(process_t* process, void* pointer);
+	void* FindHandle(process_t* process, handle_t handle);
+	void* DestroyHandle(process_t* process, handle_t handle);
 
 	int SendMessage(message_t msg);
 	int SendMessage(process_t* proc, message_t msg);
@@ -96,4 +110,11 @@ namespace Scheduler{
     void Tick(regs64_t* r);
 
 	void EndProcess(process_t* process);
+
+	/////////////////////////////
+	/// \brief Set the priority of every thread in process
+	///
+	/// \param priority Priority between THREAD_PRIORITY_MAX and THREAD_PRIORITY_MIN
+	/////////////////////////////
+	void SetProcessPriority(process_t* process, uint8_t priority);
 }
\ No newline at end of file
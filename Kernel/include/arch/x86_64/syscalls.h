@@ -1,3 +1,17 @@
 #pragma once
 
-void InitializeSyscalls();
\ No newline at end of file
+#define MSR_EFER 0xC0000080
+#define MSR_STAR 0xC0000081
+#define MSR_LSTAR 0xC0000082
+#define MSR_SFMASK 0xC0000084
+
+#define EFER_SCE 0x1 // System call extensions
+
+#define SYSCALL_RFLAGS_MASK 0x40700 // IF, TF, DF and AC are cleared on SYSCALL
+
+void InitializeSyscalls();
+
+/////////////////////////////
+/// \brief Enable SYSCALL/SYSRET on the current CPU
+/////////////////////////////
+void InitializeSyscallMSRs();
\ No newline at end of file
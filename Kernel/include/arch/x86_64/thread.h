@@ -4,6 +4,13 @@
 #include <list.h>
 
 #define THREAD_TIMESLICE_DEFAULT 7
+
+// Thread priorities, lower values are given more CPU time.
+// Each level corresponds to 5 nice values, with the default priority being a nice value of 0.
+#define THREAD_PRIORITY_MAX 0
+#define THREAD_PRIORITY_KERNEL 1
+#define THREAD_PRIORITY_DEFAULT 4
+#define THREAD_PRIORITY_MIN 7
 typedef uint64_t pid_t;
 
 enum {
@@ -14,6 +21,7 @@ enum {
 
 struct process;
 struct thread;
+struct CPU;
 
 typedef struct thread {
 	lock_t lock = 0; // Thread lock
@@ -30,15 +38,23 @@ typedef struct thread {
 
 	thread* next; // Next thread in queue
 	thread* prev; // Previous thread in queue
+
+	CPU* cpu = nullptr; // CPU whose run queue the thread was last placed in
+	bool queued = false; // Thread is in the run queue of cpu, only changed with both the state lock and the run queue lock held
 	
-	uint8_t priority = 0; // Thread priority
+	uint8_t priority = THREAD_PRIORITY_DEFAULT; // Thread priority, determines how fast vruntime increases
 	uint8_t state; // Thread state
 
+	uint64_t vruntime = 0; // Time spent running scaled by priority, the runnable thread with the lowest vruntime is run next
+
 	uint64_t fsBase = 0;
 	
 	pid_t tid = 0;
 
 	List<List<thread*>*> waiting; // Thread is waiting in these queues
+
+	static void* operator new(size_t size); // Threads are allocated from their own object cache
+	static void operator delete(void* thread);
 } thread_t;
 
 namespace Scheduler{
@@ -66,11 +82,50 @@ namespace Scheduler{
 		}
 	};
 
-	using FutexThreadBlocker = GenericThreadBlocker;
-
 	void BlockCurrentThread(ThreadBlocker& blocker);
 	void BlockCurrentThread(List<thread_t*>& list);
 	void BlockCurrentThread(ThreadBlocker& blocker, lock_t& lock);
 	void BlockCurrentThread(List<thread_t*>& list, lock_t& lock);
-	void UnblockThread(thread_t* thread);
+	void UnblockThread(thread_t* thread, bool input = false); // Threads woken by user input are boosted ahead of other threads
+
+	// Used by BlockUntil
+	bool BlockCurrentThreadOnce(lock_t* volatile& lock, bool intsEnabled, uint64_t deadline, bool killable);
+	void AddCurrentThreadWakeup(uint64_t deadline);
+	void RemoveCurrentThreadWakeup();
+
+	/////////////////////////////
+	/// \brief Block the current thread until condition is true
+	///
+	/// lock protects the condition, it must be held with interrupts disabled and is held again on return.
+	/// Anything making the condition true must call UnblockThread with lock held, so the wakeup cannot be missed.
+	/// lock may be changed while the thread is blocked by a thread holding both the old and new lock (see Futex::Requeue).
+	///
+	/// \param intsEnabled Whether interrupts were enabled before lock was taken, if not the thread cannot block and polls the condition instead
+	/// \param condition Checked with lock held, every time the thread wakes up
+	/// \param deadline System uptime in ns to give up at, 0 to wait indefinitely
+	/// \param killable Give up if the thread is killed. Otherwise a killed thread keeps waiting, so only use this if nothing still refers to the waiter.
+	///
+	/// \return Value of condition, false if the deadline passed or the thread was killed first
+	/////////////////////////////
+	template<typename Condition>
+	bool BlockUntil(lock_t* volatile& lock, bool intsEnabled, Condition condition, uint64_t deadline = 0, bool killable = false){
+		if(deadline && intsEnabled){
+			AddCurrentThreadWakeup(deadline);
+		}
+
+		bool met;
+		while(!(met = condition()) && BlockCurrentThreadOnce(lock, intsEnabled, deadline, killable));
+
+		if(deadline && intsEnabled){
+			RemoveCurrentThreadWakeup();
+		}
+
+		return met;
+	}
+
+	template<typename Condition>
+	inline bool BlockUntil(lock_t& lock, bool intsEnabled, Condition condition, uint64_t deadline = 0, bool killable = false){
+		lock_t* volatile l = &lock;
+		return BlockUntil(l, intsEnabled, condition, deadline, killable);
+	}
 }
\ No newline at end of file
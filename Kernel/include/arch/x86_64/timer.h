@@ -19,6 +19,11 @@ typedef struct timespec {
 
 struct thread;
 
+// How often (in ms) idle CPUs wake up to look for threads to take from other CPUs when using clock events
+#define TIMER_IDLE_INTERVAL 20
+// Minimum time (in ns) between now and the next timer interrupt
+#define TIMER_MIN_DELAY 10000
+
 namespace Timer{
 
     timeval_t GetSystemUptimeStruct();
@@ -28,11 +33,53 @@ namespace Timer{
     uint32_t GetTicks();
     uint32_t GetFrequency();
 
+    /////////////////////////////
+    /// \brief Get the time since boot in nanoseconds
+    ///
+    /// Read from the TSC once clock events are enabled, otherwise only as precise as the PIT tick
+    /////////////////////////////
+    uint64_t GetSystemUptimeNs();
+
     void Wait(long ms);
 
     void SleepCurrentThread(timeval_t& time);
     void SleepCurrentThread(long ticks);
+    void SleepCurrentThreadNs(uint64_t ns);
+
+    /////////////////////////////
+    /// \brief Unblock thread once the uptime reaches deadline (in ns), without blocking it
+    ///
+    /// Lets a thread blocked on something else time out. The wakeup must be removed with RemoveWakeup once the thread is done waiting.
+    /////////////////////////////
+    void AddWakeup(thread* thread, uint64_t deadline);
+
+    /////////////////////////////
+    /// \brief Cancel a wakeup added by AddWakeup, does nothing if it has already happened
+    /////////////////////////////
+    void RemoveWakeup(thread* thread);
 
     // Initialize
     void Initialize(uint32_t freq);
+
+    /////////////////////////////
+    /// \brief Switch from the PIT to the local APIC timer of each CPU
+    ///
+    /// Calibrates the TSC and local APIC timer against the PIT, must be called on the BSP after the local APIC is enabled.
+    /// Nothing changes if the CPU has no TSC.
+    /////////////////////////////
+    void InitializeClockEvents();
+
+    /////////////////////////////
+    /// \brief Start the local APIC timer of the calling CPU, does nothing unless clock events are enabled
+    /////////////////////////////
+    void InitializeLocalTimer();
+
+    /////////////////////////////
+    /// \brief Program the timer of the calling CPU for its next interrupt
+    ///
+    /// \param idle Idle CPUs only wake up for sleeping threads and every TIMER_IDLE_INTERVAL ms instead of every tick
+    /////////////////////////////
+    void SetNextEvent(bool idle);
+
+    bool ClockEventsEnabled();
 }
\ No newline at end of file
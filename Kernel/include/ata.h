@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <lock.h>
 
 #define ATA_REGISTER_DATA 0
 #define ATA_REGISTER_ERROR 1
@@ -24,6 +25,19 @@
 #define ATA_BMR_DEV_SPECIFIC_2_SECONDARY 11
 #define ATA_BMR_PRDT_ADDRESS_SECONDARY 12
 
+#define ATA_BMR_CMD_START 0x1 // Start bus master transfer
+#define ATA_BMR_CMD_READ 0x8 // Transfer direction is device to memory
+
+#define ATA_BMR_STATUS_ACTIVE 0x1 // Bus master transfer in progress
+#define ATA_BMR_STATUS_ERROR 0x2 // Write 1 to clear
+#define ATA_BMR_STATUS_INTERRUPT 0x4 // Device raised an interrupt, write 1 to clear
+
+#define ATA_CONTROL_NIEN 0x2 // Disable device interrupts
+#define ATA_CONTROL_SRST 0x4 // Software reset
+
+#define ATA_PROGIF_PRIMARY_NATIVE 0x1 // Primary channel is in PCI native mode
+#define ATA_PROGIF_SECONDARY_NATIVE 0x4 // Secondary channel is in PCI native mode
+
 #define ATA_DEV_BUSY     0x80    // Busy
 #define ATA_DEV_DRDY    0x40    // Drive ready
 #define ATA_DEV_DF      0x20    // Drive write fault
@@ -36,10 +50,21 @@
 #define ATA_CMD_READ_DMA_EX     0x25
 #define ATA_CMD_WRITE_DMA_EX    0x35
 #define ATA_CMD_IDENTIFY        0xec
+#define ATA_CMD_READ_FPDMA_QUEUED   0x60 // NCQ read
+#define ATA_CMD_WRITE_FPDMA_QUEUED  0x61 // NCQ write
+
+#define ATA_IDENTIFY_QUEUE_DEPTH 75 // Word of IDENTIFY data containing the maximum queue depth - 1
+#define ATA_IDENTIFY_SATA_CAPABILITIES 76 // Word of IDENTIFY data containing the SATA capabilities
+#define ATA_SATA_CAP_NCQ (1 << 8) // Native Command Queuing supported
 
 #define ATA_PRD_BUFFER(x) (x & 0xFFFFFFFF)
 #define ATA_PRD_TRANSFER_SIZE(x) ((x & 0xFFFFULL) << 32)
 #define ATA_PRD_END 0x8000000000000000ULL
+#define ATA_PRD_MAX_SIZE 0x10000 // A region cannot be larger than or cross a 64K boundary
+
+// Maximum size of a single DMA command
+#define ATA_MAX_TRANSFER_SIZE 0x20000 // 128KB
+#define ATA_DMA_LIMIT 0x100000000ULL // Bus master DMA only takes 32-bit addresses
 
 #define ATA_PRIMARY_IRQ 14
 #define ATA_SECONDARY_IRQ 15
@@ -47,6 +72,20 @@
 namespace ATA{
     class ATADiskDevice;
 
+    typedef struct {
+        int port; // 0 - Primary, 1 - Secondary
+        uint16_t busMaster; // Bus master registers of the channel
+
+        Semaphore semaphore = Semaphore(1); // Only one command can be outstanding per channel
+        lock_t lock = 0; // Taken with interrupts disabled as the interrupt handler also takes it
+
+        bool interruptsEnabled = false; // Completions are polled until set
+        thread_t* waiter = nullptr;
+        volatile bool done = false;
+        uint8_t busMasterStatus = 0;
+        uint8_t status = 0;
+    } ata_channel_t;
+
     void SendCommand(uint8_t drive, uint8_t command);
 
     int Init();
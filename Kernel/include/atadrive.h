@@ -11,7 +11,7 @@ namespace ATA{
         int ReadDiskBlock(uint64_t lba, uint32_t count, void* buffer); // Read bytes
         int WriteDiskBlock(uint64_t lba, uint32_t count, void* buffer); // Write bytes
 
-        uint32_t prdBufferPhys;
+        uint32_t prdBufferPhys; // Bounce buffer of ATA_MAX_TRANSFER_SIZE for buffers we cannot DMA to directly
         uint8_t* prdBuffer;
 
         uint32_t prdtPhys;
@@ -24,6 +24,10 @@ namespace ATA{
         int blocksize = 512;
         
     private:
+        int Transfer(uint64_t lba, uint32_t count, uint8_t* buffer, bool write);
+        // Fill the PRDT with the physical pages of buffer, returns 0 if they cannot be used for DMA
+        int MapBuffer(uint8_t* buffer, uint32_t size);
+
         Semaphore driveLock = Semaphore(1);
         char* name = "Generic ATA Disk Device";
     };
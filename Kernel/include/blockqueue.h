@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdint.h>
+#include <list.h>
+#include <lock.h>
+#include <timer.h>
+#include <device.h>
+
+// Amount of threads dispatching requests to disks
+#define BLOCK_QUEUE_WORKERS 8
+// Maximum size of a request after merging
+#define BLOCK_QUEUE_MAX_MERGE_SIZE 0x100000 // 1MB
+// Maximum amount of requests merged together
+#define BLOCK_QUEUE_MAX_SEGMENTS 32
+// Size of the stack of each worker thread
+#define BLOCK_QUEUE_WORKER_STACK_SIZE 16384
+
+typedef struct BlockRequest {
+    uint64_t lba; // First block of the request
+    uint32_t size; // Size of the request in bytes
+    uint8_t* buffer;
+    bool write;
+
+    void (*callback)(BlockRequest* request) = nullptr; // Called from a worker thread once the request has completed
+    void* data = nullptr; // For use by the submitter
+    int status = 0; // Zero on success
+
+    timeval_t submitTime;
+    BlockRequest* next = nullptr; // Next request in the queue or in a merged request
+} block_request_t;
+
+// Queues requests to a disk, sorting them by LBA (C-SCAN) and merging requests to adjacent blocks
+class BlockQueue{
+public:
+    BlockQueue(DiskDevice* disk);
+
+    /////////////////////////////
+    /// \brief Queue a request and wait for it to complete
+    ///
+    /// \return Zero on success
+    /////////////////////////////
+    int Read(uint64_t lba, uint32_t size, void* buffer);
+    int Write(uint64_t lba, uint32_t size, void* buffer);
+
+    DiskDevice* disk;
+
+    // Statistics
+    unsigned queued = 0; // Requests waiting to be dispatched
+    unsigned inFlight = 0; // Requests dispatched to the disk
+    unsigned maxDepth = 0; // Highest amount of queued and in flight requests
+    uint64_t completed = 0;
+    uint64_t merged = 0; // Requests dispatched together with another request
+    uint64_t errors = 0;
+    uint64_t totalLatency = 0; // Total time (in ms) between requests being submitted and completing
+    uint64_t maxLatency = 0;
+
+    static List<BlockQueue*> queues; // Queues of every disk
+    static lock_t lock; // Protects every queue, taken with interrupts disabled as idle workers are woken with it held
+private:
+    void Submit(block_request_t* request); // Queue a request, its callback is called once it completes
+    block_request_t* Dequeue();
+    void Dispatch(block_request_t* request);
+
+    [[noreturn]] static void WorkerThread();
+
+    block_request_t* pending = nullptr; // Sorted by LBA
+    uint64_t nextLBA = 0; // Block after the last dispatched request
+};
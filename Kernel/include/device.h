@@ -39,6 +39,13 @@ protected:
 };
 
 class PartitionDevice;
+class BlockQueue;
+
+// Part of the memory of a disk transfer
+typedef struct DiskSegment {
+    uint8_t* buffer;
+    uint32_t size;
+} disk_segment_t;
 
 class DiskDevice : public Device{
     friend class PartitionDevice;
@@ -52,6 +59,11 @@ public:
     virtual int ReadDiskBlock(uint64_t lba, uint32_t count, void* buffer);
     virtual int WriteDiskBlock(uint64_t lba, uint32_t count, void* buffer);
 
+    // Transfer consecutive blocks starting at lba to or from each segment in turn.
+    // Every segment but the last must be a multiple of the block size.
+    virtual int ReadDiskBlocks(uint64_t lba, const disk_segment_t* segments, unsigned count);
+    virtual int WriteDiskBlocks(uint64_t lba, const disk_segment_t* segments, unsigned count);
+
     virtual ssize_t Read(size_t off, size_t size, uint8_t* buffer);
     virtual ssize_t Write(size_t off, size_t size, uint8_t* buffer);
 
@@ -59,6 +71,8 @@ public:
     
     List<PartitionDevice*> partitions;
     int blocksize = 512;
+
+    BlockQueue* queue; // Requests from partitions go through the queue
 private:
 };
 
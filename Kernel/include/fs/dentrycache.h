@@ -0,0 +1,46 @@
+#pragma once
+
+#include <fs/filesystem.h>
+
+// Maximum amount of cached directory entries
+#define DENTRY_CACHE_MAX_ENTRIES 8192
+// Amount of hash buckets used to look up cached directory entries
+#define DENTRY_CACHE_BUCKETS 2048
+
+// Caches the results of FindDir (including names that were not found) for directories with dentryCached set.
+// Cached entries hold a handle to both the directory and the node they refer to, so neither gets freed while cached.
+namespace fs::DentryCache{
+    // Amount of entries currently cached
+    extern uint64_t cachedEntries;
+    // Lookups that were answered by the cache
+    extern uint64_t hits;
+    // Lookups that had to go to the filesystem
+    extern uint64_t misses;
+
+    /////////////////////////////
+    /// \brief Look up name in directory parent
+    ///
+    /// \param node Set to the cached node (nullptr if the name is known not to exist)
+    /// \param generation Set on a miss, to be passed to Insert
+    ///
+    /// \return true if the entry was cached
+    /////////////////////////////
+    bool Lookup(FsNode* parent, const char* name, FsNode*& node, uint64_t& generation);
+
+    /////////////////////////////
+    /// \brief Cache the result of a lookup, node may be nullptr if name does not exist
+    ///
+    /// The entry is not cached if anything was invalidated since Lookup returned generation
+    /////////////////////////////
+    void Insert(FsNode* parent, const char* name, FsNode* node, uint64_t generation);
+
+    /////////////////////////////
+    /// \brief Drop the cached entry for name in parent, filesystems must call this whenever an entry is created or removed
+    /////////////////////////////
+    void Invalidate(FsNode* parent, const char* name);
+
+    /////////////////////////////
+    /// \brief Drop every cached entry in directory dir (e.g. when it is removed)
+    /////////////////////////////
+    void InvalidateDirectory(FsNode* dir);
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <fs/filesystem.h>
+#include <list.h>
+
+#define EPOLLIN 0x001
+#define EPOLLPRI 0x002
+#define EPOLLOUT 0x004
+#define EPOLLERR 0x008
+#define EPOLLHUP 0x010
+#define EPOLLONESHOT (1u << 30)
+#define EPOLLET (1u << 31)
+
+#define EPOLL_CTL_ADD 1
+#define EPOLL_CTL_DEL 2
+#define EPOLL_CTL_MOD 3
+
+typedef union epoll_data {
+    void* ptr;
+    int fd;
+    uint32_t u32;
+    uint64_t u64;
+} epoll_data_t;
+
+struct epoll_event {
+    uint32_t events;
+    epoll_data_t data;
+} __attribute__((packed));
+
+namespace fs{
+    // A persistent set of watched file descriptors.
+    // Each watched node signals its interest, which puts itself on the ready list, so waiting only looks at nodes that have changed.
+    // Each interest holds a handle to its node, so the node stays around if the file descriptor is closed without removing it.
+    // Interests are looked up by fd and node, so a reused file descriptor does not find the interest of the closed one.
+    class EPoll final : public FsNode {
+        struct Interest final : public FilesystemWatcher {
+            EPoll* epoll;
+            int fd;
+            FsNode* node;
+            uint32_t events; // Requested EPOLL* events including EPOLLET and EPOLLONESHOT
+            epoll_data_t data;
+
+            bool ready = false; // On the ready list, protected by the ready lock of epoll
+            Interest* nextReady = nullptr;
+            volatile bool disabled = false; // EPOLLONESHOT interest that has been reported, until modified
+
+            Interest(EPoll* epoll, int fd, FsNode* node) : epoll(epoll), fd(fd), node(node) {
+                node->handleCount++;
+            }
+
+            ~Interest(){
+                UnwatchNodes(); // Must not be signalled once the node is closed
+                fs::Close(node);
+            }
+
+            void Signal() override;
+        };
+
+        lock_t interestsLock = 0; // Held while changing the interests or checking ready interests so they cannot be freed underneath
+        List<Interest*> interests;
+
+        lock_t readyLock = 0; // Taken with interrupts disabled, interests are signalled from interrupt handlers
+        Interest* readyFront = nullptr;
+        Interest* readyBack = nullptr;
+        unsigned readyCount = 0;
+
+        Interest* FindInterest(int fd, FsNode* node); // interestsLock must be held
+        void QueueReady(Interest* interest);
+        void UnqueueReady(Interest* interest);
+
+        int CollectEvents(epoll_event* events, int maxEvents);
+    public:
+        EPoll();
+        ~EPoll();
+
+        void Close();
+
+        bool CanRead() { return readyFront; }
+        bool CanWrite() { return false; }
+        bool IsEPoll() const { return true; }
+
+        /////////////////////////////
+        /// \brief Add, modify or remove the interest in fd (epoll_ctl)
+        ///
+        /// \param op EPOLL_CTL_ADD, EPOLL_CTL_MOD or EPOLL_CTL_DEL
+        /// \param node Node fd refers to
+        /// \param event Requested events and the data returned with them, ignored by EPOLL_CTL_DEL
+        ///
+        /// \return 0 on success, negative error code on failure
+        /////////////////////////////
+        int Control(int op, int fd, FsNode* node, epoll_event* event);
+
+        /////////////////////////////
+        /// \brief Wait for events on the watched file descriptors (epoll_wait)
+        ///
+        /// Level triggered interests stay on the ready list and are reported again until they are no longer ready,
+        /// edge triggered (EPOLLET) interests are only reported again once the node signals another change.
+        ///
+        /// \param timeout Timeout in ms, 0 returns immediately and negative waits indefinitely
+        ///
+        /// \return Amount of events written to events
+        /////////////////////////////
+        int Wait(epoll_event* events, int maxEvents, long timeout);
+    };
+}
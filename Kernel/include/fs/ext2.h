@@ -44,6 +44,18 @@
 #define EXT2_DOUBLY_INDIRECT_INDEX 13
 #define EXT2_TRIPLY_INDIRECT_INDEX 14
 
+#define EXT2_INDEX_FL 0x1000 // Directory is indexed with a hash tree
+
+#define EXT2_FLAGS_SIGNED_HASH 0x1 // Directory hashes treat names as signed chars
+#define EXT2_FLAGS_UNSIGNED_HASH 0x2 // Directory hashes treat names as unsigned chars
+
+#define EXT2_HTREE_MAX_LEVELS 2 // Maximum amount of index levels below the root
+
+#define EXT2_BLOCK_CACHE_SIZE (8 * 1024 * 1024) // Maximum amount of memory (in bytes) used to cache the blocks of a volume
+#define EXT2_WRITEBACK_INTERVAL 5 // Seconds between writing dirty cached blocks back to disk
+#define EXT2_WRITEBACK_STACK_SIZE 16384
+#define EXT2_MAX_READ_SIZE (1024 * 1024) // Maximum amount of data (in bytes) read from disk in one go
+
 namespace fs::Ext2{
     enum ErrorAction{
         Continue = 1,       // Continue
@@ -146,6 +158,24 @@ namespace fs::Ext2{
         uint8_t preallocatedBlocks; // Blocks to preallocate when a file is created
         uint8_t preallocdDirBlocks; // Blocks to preallocate when a directory is created
         uint16_t align;
+        uint8_t journalUUID[16];    // UUID of the journal superblock (Ext3)
+        uint32_t journalInode;      // Inode of the journal file (Ext3)
+        uint32_t journalDevice;     // Device of the journal file (Ext3)
+        uint32_t lastOrphan;        // Start of the list of inodes to delete (Ext3)
+        uint32_t hashSeed[4];       // Seed used by directory index hashes
+        uint8_t defHashVersion;     // Default directory index hash version
+        uint8_t journalBackupType;
+        uint16_t descSize;
+        uint32_t defaultMountOpts;
+        uint32_t firstMetaBg;
+        uint32_t mkfsTime;
+        uint32_t journalBlocks[17];
+        uint32_t blockCountHigh;
+        uint32_t resvBlockCountHigh;
+        uint32_t freeBlockCountHigh;
+        uint16_t minExtraInodeSize;
+        uint16_t wantExtraInodeSize;
+        uint32_t flags;             // Miscellaneous flags (e.g. signedness of directory hashes)
     } __attribute__((packed)) ext2_superblock_extended_t; // Ext2 extended superblock
 
     typedef struct {
@@ -191,6 +221,50 @@ namespace fs::Ext2{
         char name[];
     } __attribute__((packed)) ext2_directory_entry_t;
 
+    enum DirectoryHashVersion {
+        HashLegacy = 0,
+        HashHalfMD4 = 1,
+        HashTea = 2,
+        HashLegacyUnsigned = 3,
+        HashHalfMD4Unsigned = 4,
+        HashTeaUnsigned = 5,
+    };
+
+    typedef struct {
+        uint32_t reservedZero;
+        uint8_t hashVersion;        // Hash used for the directory (DirectoryHashVersion)
+        uint8_t infoLength;         // Length of this structure (8)
+        uint8_t indirectLevels;     // Amount of index levels below the root
+        uint8_t unusedFlags;
+    } __attribute__((packed)) ext2_dx_root_info_t; // Stored after the '.' and '..' entries of the first block of an indexed directory
+
+    typedef struct {
+        uint16_t limit;             // Maximum amount of index entries in the block
+        uint16_t count;             // Amount of index entries in the block
+    } __attribute__((packed)) ext2_dx_countlimit_t; // Overlays the hash of the first index entry
+
+    typedef struct {
+        uint32_t hash;              // Lowest hash of the names in block (0 for the first entry)
+        uint32_t block;             // Logical block of the directory
+    } __attribute__((packed)) ext2_dx_entry_t;
+
+    typedef struct Ext2CachedBlock {
+        uint32_t block;
+        uint8_t* data;
+        bool dirty = false; // Modified since it was last written to disk
+        unsigned writesInFlight = 0; // Writes of the block to disk that have not completed, until then the copy on disk may be stale
+
+        Ext2CachedBlock* lruPrev = nullptr;
+        Ext2CachedBlock* lruNext = nullptr;
+    } ext2_cached_block_t;
+
+    // Block cache statistics for all volumes
+    extern uint64_t blockCacheMemoryUsage;
+    extern uint64_t blockCacheHits;
+    extern uint64_t blockCacheMisses;
+    extern uint64_t blockCacheEvictions;
+    extern uint64_t blockCacheWritebacks;
+
     class Ext2Volume;
 
     class Ext2Node : public FsNode{ 
@@ -200,7 +274,7 @@ namespace fs::Ext2{
         Ext2Volume* vol;
         ext2_inode_t e2inode;
 
-        FilesystemLock flock; // Lock on file data
+        ReadWriteLock flock; // Lock on file data
 
         friend class Ext2Volume;
     public:
@@ -242,13 +316,20 @@ namespace fs::Ext2{
         int error = false;
         bool readOnly = false;
         
-        bool sparse, largeFiles, filetype;
+        bool sparse, largeFiles, filetype, dirIndex;
         uint32_t inodeSize = 128;
 
         HashMap<uint32_t, Ext2Node*> inodeCache;
-        HashMap<uint32_t, uint8_t*> blockCache;
+        HashMap<uint32_t, ext2_cached_block_t*> blockCache;
         HashMap<uint32_t, uint8_t*> bitmapCache;
-        unsigned blockCacheMemoryUsage;
+
+        ext2_cached_block_t* blockCacheFront = nullptr; // Least recently used block
+        ext2_cached_block_t* blockCacheBack = nullptr; // Most recently used block
+        unsigned blockCacheCount = 0; // Amount of cached blocks
+        unsigned blockCacheDirtyCount = 0; // Amount of cached blocks waiting to be written back
+        unsigned blockCacheCapacity; // Maximum amount of cached blocks
+        lock_t blockCacheLock = 0;
+        lock_t syncLock = 0;
 
         inline uint32_t LocationToBlock(uint64_t l){
             return (l >> super.logBlockSize) >> 10;
@@ -285,10 +366,18 @@ namespace fs::Ext2{
 
         int ReadBlock(uint32_t block, void* buffer);
         int ReadBlockCached(uint32_t block, void* buffer);
+        int ReadBlocks(uint32_t block, uint32_t count, void* buffer); // Read count contiguous blocks, bypassing the cache
         
         int WriteBlock(uint32_t block, void* buffer);
         int WriteBlockCached(uint32_t block, void* buffer);
 
+        // The following require blockCacheLock to be held
+        void TouchCachedBlock(ext2_cached_block_t* cached);
+        void EvictBlocks();
+
+        // Discard a cached block without writing it back (e.g. when it has been freed)
+        void DropCachedBlock(uint32_t block);
+
         Ext2Node* CreateNode();
         int EraseInode(ext2_inode_t& e2inode, uint32_t inode);
         void SyncInode(ext2_inode_t& e2ino, uint32_t inode);
@@ -296,6 +385,11 @@ namespace fs::Ext2{
         uint32_t AllocateBlock();
         int FreeBlock(uint32_t block);
 
+        uint32_t DirectoryHash(const char* name, int len, int version);
+        int HTreeLookup(Ext2Node* node, const char* name, uint32_t& inode);
+
+        Ext2Node* GetNode(uint32_t inode);
+
         int ListDir(Ext2Node* node, List<DirectoryEntry>& entries);
         int WriteDir(Ext2Node* node, List<DirectoryEntry>& entries);
         int InsertDir(Ext2Node* node, List<DirectoryEntry>& entries);
@@ -317,6 +411,9 @@ namespace fs::Ext2{
         void SyncNode(Ext2Node* node);
         void CleanNode(Ext2Node* node);
 
+        // Write dirty cached blocks back to disk
+        void SyncBlocks();
+
         int Error() { return error; }
     };
     
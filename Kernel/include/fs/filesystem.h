@@ -104,6 +104,9 @@ typedef struct fs_fd{
     FsNode* node;
     off_t pos;
     mode_t mode;
+
+    static void* operator new(size_t size); // File descriptors are allocated from their own object cache
+    static void operator delete(void* fd);
 } fs_fd_t;
 
 struct pollfd {
@@ -149,6 +152,9 @@ public:
 class FilesystemWatcher;
 
 class FsNode{
+protected:
+    lock_t watchingLock = 0; // Taken with interrupts disabled, nodes can be signalled from interrupt handlers
+    List<FilesystemWatcher*> watching;
 public:
     uint32_t flags = 0; // Flags
     uint32_t pmask = 0; // Permission mask
@@ -159,6 +165,9 @@ public:
     unsigned handleCount = 0; // Amount of file handles that point to this node
     volume_id_t volumeID;
 
+    bool pageCached = false; // Reads and writes go through the page cache, set by filesystems for regular files
+    bool dentryCached = false; // Results of FindDir can be cached, set by filesystems that invalidate entries when they change
+
     int error = 0;
 
     virtual ~FsNode();
@@ -208,24 +217,41 @@ public:
     virtual bool CanRead() { return true; }
     virtual bool CanWrite() { return true; }
 
+    virtual bool IsEPoll() const { return false; }
+
+    /////////////////////////////
+    /// \brief Signal watcher whenever the state of the node changes, until Unwatch is called
+    ///
+    /// \param events Events (POLLIN, POLLOUT, etc.) the watcher is interested in
+    /////////////////////////////
     virtual void Watch(FilesystemWatcher& watcher, int events);
     virtual void Unwatch(FilesystemWatcher& watcher);
 
+    /////////////////////////////
+    /// \brief Signal everything watching the node, called by nodes when they may have become readable, writable or hung up
+    ///
+    /// Safe to call from interrupt handlers.
+    /////////////////////////////
+    void SignalWatchers();
+
     FsNode* link;
     FsNode* parent;
 
-    FilesystemLock nodeLock; // Lock on FsNode info
+    ReadWriteLock nodeLock; // Lock on FsNode info
 };
 
-// FilesystemWatcher is a semaphore initialized to 0.
-// A thread can wait on it like any semaphore,
-// and when a file is ready it will signal and waiting thread(s) will get woken
-class FilesystemWatcher : public Semaphore{
+// A thread waits on a FilesystemWatcher for any of the nodes it watches to change state.
+// Signals are remembered until the next wait, so the watcher should be set up before checking the nodes to not miss any.
+class FilesystemWatcher {
+    lock_t lock = 0; // Taken with interrupts disabled
+    thread* waiter = nullptr;
+    bool signalled = false;
+
     List<FsNode*> watching;
-public:
-    FilesystemWatcher() : Semaphore(0){
 
-    }
+    bool WaitUntil(uint64_t deadline); // Returns false if the deadline (uptime in ns, 0 for none) passed
+public:
+    FilesystemWatcher() {}
 
     void WatchNode(FsNode* node, int events){
         node->Watch(*this, events);
@@ -233,11 +259,39 @@ public:
         watching.add_back(node);
     }
 
-    ~FilesystemWatcher(){
-        for(auto& node : watching){
-            node->Unwatch(*this);
+    /////////////////////////////
+    /// \brief Stop watching all nodes
+    ///
+    /// Signal is not called once this returns.
+    /////////////////////////////
+    void UnwatchNodes(){
+        while(watching.get_length()){
+            watching.remove_at(0)->Unwatch(*this);
         }
     }
+
+    /////////////////////////////
+    /// \brief Wake the waiting thread, or make the next wait return immediately
+    ///
+    /// Safe to call from interrupt handlers.
+    /////////////////////////////
+    virtual void Signal();
+
+    /////////////////////////////
+    /// \brief Sleep until signalled
+    /////////////////////////////
+    void Wait();
+
+    /////////////////////////////
+    /// \brief Sleep until signalled or timeout (in ns) has passed
+    ///
+    /// \return false if timed out, otherwise true
+    /////////////////////////////
+    bool WaitTimeout(uint64_t timeout);
+
+    virtual ~FilesystemWatcher(){
+        UnwatchNodes();
+    }
 };
 
 typedef struct fs_dirent {
@@ -255,6 +309,7 @@ namespace fs{
     FsNode* GetRoot();
     void RegisterDevice(DirectoryEntry* device);
 	void RegisterVolume(FsVolume* vol);
+	volume_id_t GetVolumeID();
 
     /////////////////////////////
     /// \brief Follow symbolic link
@@ -332,6 +387,13 @@ namespace fs{
     ssize_t Write(fs_fd_t* handle, size_t size, uint8_t *buffer);
     int ReadDir(fs_fd_t* handle, DirectoryEntry* dirent, uint32_t index);
     FsNode* FindDir(fs_fd_t* handle, char* name);
+
+    /////////////////////////////
+    /// \brief Check which of events (POLLIN, POLLOUT, etc.) node is ready for
+    ///
+    /// \return Events that are ready, POLLHUP is returned even if not requested
+    /////////////////////////////
+    int PollNode(FsNode* node, int events);
     
     int Link(FsNode*, FsNode*, DirectoryEntry*);
     int Unlink(FsNode*, DirectoryEntry*, bool unlinkDirectories = false);
@@ -6,7 +6,7 @@ namespace fs{
 
     class FsVolume{
     public:
-        volume_id_t volumeID;
+        volume_id_t volumeID = GetVolumeID(); // Unique for every volume, nodes are cached by volume and inode
         FsNode* mountPoint;
         DirectoryEntry mountPointDirent;
     };    
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <fs/filesystem.h>
+
+// Maximum amount of pages held by the page cache
+#define PAGE_CACHE_MAX_PAGES 16384 // 64MB
+// Amount of hash buckets used to look up cached pages
+#define PAGE_CACHE_BUCKETS 4096
+// Maximum amount of pages read at once when a file is being read sequentially
+#define PAGE_CACHE_READAHEAD_PAGES 32 // 128KB
+// Maximum amount of pages read in at once
+#define PAGE_CACHE_MAX_READ_PAGES 256 // 1MB
+
+// Pages are keyed by (volume, inode, page index) so they outlive the FsNode objects of filesystems that free unused nodes
+namespace fs::PageCache{
+    // Amount of pages currently cached
+    extern uint64_t cachedPages;
+    // Lookups that found the page in the cache
+    extern uint64_t hits;
+    // Lookups that had to read the page from the filesystem
+    extern uint64_t misses;
+    // Pages dropped to stay within the cache size
+    extern uint64_t evictions;
+
+    /////////////////////////////
+    /// \brief Read data from a filesystem node through the page cache
+    ///
+    /// \param node Node to read from, must have pageCached set
+    /// \param off Offset of data to read
+    /// \param size Amount of data (in bytes) to read
+    ///
+    /// \return Bytes read or if negative an error code
+    /////////////////////////////
+    ssize_t Read(FsNode* node, size_t offset, size_t size, uint8_t* buffer);
+
+    /////////////////////////////
+    /// \brief Update cached pages of node after data has been written to it
+    /////////////////////////////
+    void Update(FsNode* node, size_t offset, size_t size, uint8_t* buffer);
+
+    /////////////////////////////
+    /// \brief Get the page at index of node for mapping into memory
+    ///
+    /// \return Physical address of the page with a reference held for the caller, 0 on failure or if the page is past the end of the file
+    /////////////////////////////
+    uintptr_t GetPage(FsNode* node, uint64_t index);
+
+    /////////////////////////////
+    /// \brief Write the page at index back to node (e.g. after it has been modified through a shared mapping)
+    /////////////////////////////
+    void SyncPage(FsNode* node, uint64_t index);
+
+    /////////////////////////////
+    /// \brief Drop cached pages of node past offset (e.g. after truncation or when the inode is freed)
+    /////////////////////////////
+    void Invalidate(FsNode* node, size_t offset = 0);
+}
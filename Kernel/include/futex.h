@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdint.h>
+
+// Amount of hash buckets futex waiters are spread over
+#define FUTEX_HASH_BUCKETS 256
+
+struct process;
+
+namespace Futex{
+    /////////////////////////////
+    /// \brief Block the current thread while the futex at address holds expected
+    ///
+    /// The value is checked with the bucket lock held so a wake between the check and the block is never missed.
+    ///
+    /// \param process Process owning the address space of address
+    /// \param address User address of the futex
+    /// \param expected Value the futex must hold for the thread to block
+    /// \param timeout Maximum time to wait (in ns), 0 waits forever
+    ///
+    /// \return 0 when woken or if the value did not match, -ETIMEDOUT on timeout, -EFAULT if address is invalid
+    /////////////////////////////
+    long Wait(process* process, uintptr_t address, int expected, uint64_t timeout);
+
+    /////////////////////////////
+    /// \brief Wake threads waiting on the futex at address
+    ///
+    /// \param count Maximum amount of threads to wake
+    ///
+    /// \return Amount of threads woken, -EFAULT if address is invalid
+    /////////////////////////////
+    long Wake(process* process, uintptr_t address, int count);
+
+    /////////////////////////////
+    /// \brief Wake threads waiting on a futex and move the rest to another futex
+    ///
+    /// Does nothing if the futex at address no longer holds expected.
+    ///
+    /// \param count Maximum amount of threads to wake
+    /// \param target User address of the futex to move waiters to
+    /// \param requeueCount Maximum amount of threads to move to target
+    /// \param expected Value the futex must hold
+    ///
+    /// \return Amount of threads woken or requeued, -EAGAIN if the value did not match, -EFAULT if an address is invalid
+    /////////////////////////////
+    long Requeue(process* process, uintptr_t address, int count, uintptr_t target, int requeueCount, int expected);
+}
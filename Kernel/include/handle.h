@@ -0,0 +1,110 @@
+#pragma once
+
+#include <stdint.h>
+#include <spin.h>
+
+typedef void* handle_t;
+
+// Handle slots are allocated in chunks that never move, so readers never see a slot being copied
+#define HANDLE_TABLE_CHUNK_SIZE 64
+#define HANDLE_TABLE_INITIAL_CHUNKS 4
+
+// A handle is the slot index (plus one so that handles are never null) in the low 32 bits
+// and the generation of the slot in the high 32 bits
+#define HANDLE_INDEX(h) ((uint32_t)((uintptr_t)(h) & 0xFFFFFFFF) - 1)
+#define HANDLE_GENERATION(h) ((uint32_t)((uintptr_t)(h) >> 32))
+#define HANDLE_VALUE(index, generation) ((handle_t)((((uintptr_t)(generation)) << 32) | ((uintptr_t)(index) + 1)))
+
+class HandleTable {
+protected:
+    struct Slot {
+        void* volatile pointer; // Null when the slot is free
+        volatile uint32_t generation; // Incremented every time the slot is freed, invalidating old handles
+        uint32_t nextFree; // Next slot in the free list
+    };
+
+    struct Directory {
+        unsigned capacity; // Amount of chunk pointers
+        Directory* retired; // Previous (smaller) directory, readers may still be using it
+        Slot* chunks[];
+    };
+
+    Directory* volatile directory = nullptr;
+    unsigned chunkCount = 0;
+
+    uint32_t freeList = UINT32_MAX; // Head of the list of free slots
+    unsigned handleCount = 0;
+
+    lock_t lock = 0; // Held by writers only, lookups are lock free
+
+    void AddChunk();
+public:
+    HandleTable() = default;
+    HandleTable(const HandleTable&) = delete;
+    HandleTable& operator=(const HandleTable&) = delete;
+
+    /////////////////////////////
+    /// \brief Allocate a handle for pointer
+    ///
+    /// Free slots are reused, the generation of the slot makes sure handles to the old object stay invalid.
+    ///
+    /// \param pointer Object referred to by the handle, must not be null
+    ///
+    /// \return New handle, null if out of memory
+    /////////////////////////////
+    handle_t Register(void* pointer);
+
+    /////////////////////////////
+    /// \brief Find the object referred to by handle
+    ///
+    /// Does not take the table lock, so it may be called from any thread of the process.
+    ///
+    /// \return Pointer to the object, null if the handle is invalid or has been destroyed
+    /////////////////////////////
+    inline void* Find(handle_t handle) const {
+        uint32_t index = HANDLE_INDEX(handle);
+        uint32_t generation = HANDLE_GENERATION(handle);
+
+        Directory* dir = __atomic_load_n(&directory, __ATOMIC_ACQUIRE);
+        if(!dir || index / HANDLE_TABLE_CHUNK_SIZE >= dir->capacity){
+            return nullptr;
+        }
+
+        Slot* chunk = __atomic_load_n(&dir->chunks[index / HANDLE_TABLE_CHUNK_SIZE], __ATOMIC_ACQUIRE);
+        if(!chunk){
+            return nullptr;
+        }
+
+        Slot& slot = chunk[index % HANDLE_TABLE_CHUNK_SIZE];
+        if(__atomic_load_n(&slot.generation, __ATOMIC_ACQUIRE) != generation){
+            return nullptr;
+        }
+
+        void* pointer = __atomic_load_n(&slot.pointer, __ATOMIC_ACQUIRE);
+
+        // Make sure the slot was not freed and reused while we were reading it
+        if(__atomic_load_n(&slot.generation, __ATOMIC_ACQUIRE) != generation){
+            return nullptr;
+        }
+
+        return pointer;
+    }
+
+    /////////////////////////////
+    /// \brief Destroy a handle and recycle its slot
+    ///
+    /// \return Pointer the handle referred to, null if the handle was invalid
+    /////////////////////////////
+    void* Destroy(handle_t handle);
+
+    /////////////////////////////
+    /// \brief Free all slots and chunks
+    ///
+    /// Must not be called while other threads may be using the table.
+    /////////////////////////////
+    void Clear();
+
+    inline unsigned Count() const { return handleCount; }
+
+    ~HandleTable() { Clear(); }
+};
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <memory.h>
+#include <slab.h>
 #include <spin.h>
 #include <assert.h>
 
@@ -102,6 +103,7 @@ public:
 		} else if (back) {
 			back->next = obj;
 			obj->prev = back;
+			front->prev = obj; // Keep the list circular so the front can be removed
 		}
 		back = obj;
 		obj->next = front;//obj->next = nullptr;
@@ -215,7 +217,7 @@ public:
 		clear();
 
 		while(cache.get_length()){
-			kfree(cache.remove_at(0));
+			Memory::SlabFree(cache.remove_at(0), sizeof(ListNode<T>));
 		}
 	}
 
@@ -225,7 +227,7 @@ public:
 		ListNode<T>* node = front;
 		while (node && node->next) {
 			ListNode<T>* n = node->next;
-			kfree(node);
+			Memory::SlabFree(node, sizeof(ListNode<T>));
 			node = n;
 		}
 		front = NULL;
@@ -240,7 +242,7 @@ public:
 
 		ListNode<T>* node;
 		if(cache.get_length() <= 0){
-			node = (ListNode<T>*)kmalloc(sizeof(ListNode<T>));
+			node = (ListNode<T>*)Memory::SlabAllocate(sizeof(ListNode<T>));
 		} else {
 			node = cache.remove_at(0);
 		}
@@ -268,7 +270,7 @@ public:
 
 		ListNode<T>* node;
 		if(!cache.get_length()){
-			node = (ListNode<T>*)kmalloc(sizeof(ListNode<T>));
+			node = (ListNode<T>*)Memory::SlabAllocate(sizeof(ListNode<T>));
 		} else {
 			node = cache.remove_at(0);
 		}
@@ -307,7 +309,7 @@ public:
 
 		ListNode<T>* node;
 		if(!cache.get_length()){
-			node = (ListNode<T>*)kmalloc(sizeof(ListNode<T>));
+			node = (ListNode<T>*)Memory::SlabAllocate(sizeof(ListNode<T>));
 		} else {
 			node = cache.remove_at(0);
 		}
@@ -385,7 +387,7 @@ public:
 		if (pos == num) back = current->prev;
 
 		if(cache.get_length() >= maxCache){
-			kfree(current);
+			Memory::SlabFree(current, sizeof(ListNode<T>));
 		} else {
 			cache.add_back(current);
 		}
@@ -406,18 +408,18 @@ public:
 
 		ListNode<T>* current = front;
 
-		while(current && current != back && current->obj != val) current = current->next;
+		while(current && current->obj != val) current = current->next;
 
 		if(current){
-			current->prev->next = current->next;
-			current->next->prev = current->prev;
+			if (current->prev) current->prev->next = current->next;
+			if (current->next) current->next->prev = current->prev;
 			if (front == current) front = current->next;
 			if (back == current) back = current->prev;
 
 			num--;
 
 			if(cache.get_length() >= maxCache){
-				kfree(current);
+				Memory::SlabFree(current, sizeof(ListNode<T>));
 			} else {
 				cache.add_back(current);
 			}
@@ -432,8 +434,8 @@ public:
 
 		acquireLock(&lock);
 
-		it.node->prev->next = it.node->next;
-		it.node->next->prev = it.node->prev;
+		if (it.node->prev) it.node->prev->next = it.node->next;
+		if (it.node->next) it.node->next->prev = it.node->prev;
 
 		if (front == it.node) front = it.node->next;
 		if (back == it.node) back = it.node->prev;
@@ -441,7 +443,7 @@ public:
 		num--;
 
 		if(cache.get_length() >= maxCache){
-			kfree(it.node);
+			Memory::SlabFree(it.node, sizeof(ListNode<T>));
 		} else {
 			cache.add_back(it.node);
 		}
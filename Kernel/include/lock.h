@@ -8,46 +8,42 @@ struct thread;
 #include <thread.h>
 #include <logging.h>
 
-class FilesystemLock {
+// Sleeping reader-writer lock, any number of readers or a single writer.
+// New readers queue behind waiting writers so writers are not starved, a releasing writer hands the lock to all waiting readers first.
+class ReadWriteLock {
+    struct Waiter {
+        thread* waiter;
+        volatile bool granted;
+    };
+
+    lock_t lock = 0; // Protects everything below, taken with interrupts disabled as waiters are woken with it held
     unsigned activeReaders = 0;
-    lock_t fileLock = 0;
+    bool writerActive = false;
 
-    FastList<thread*> readers;
-    FastList<thread*> writers;
-public:
-    lock_t lock = 0;
-
-    FilesystemLock() {}
-
-    void AcquireRead(){
-        acquireLock(&lock);
-
-        activeReaders++;
-
-        if(activeReaders == 1){
-            acquireLock(&fileLock);
-        }
+    List<Waiter*> readers;
+    List<Waiter*> writers;
 
-        releaseLock(&lock);
-    }
-
-    void AcquireWrite(){
-        acquireLock(&fileLock);
-    }
-
-    void ReleaseRead(){
-        if(activeReaders == 1){
-            releaseLock(&fileLock);
-        }
+    void Wait(Waiter& waiter, bool intsEnabled); // lock must be held with interrupts disabled, returns with lock released and interrupts restored
+    void Grant(Waiter* waiter); // lock must be held
+public:
+    ReadWriteLock() {}
 
-        activeReaders--;
-    }
+    void AcquireRead();
+    void AcquireWrite();
 
-    void ReleaseWrite(){
-        releaseLock(&fileLock);
-    }
+    void ReleaseRead();
+    void ReleaseWrite();
 };
 
+#ifdef LOCK_STATISTICS
+/////////////////////////////
+/// \brief Write the locks with the most spin cycles to buffer
+///
+/// \return Length of the string written
+/////////////////////////////
+size_t GetLockStatistics(char* buffer, size_t size);
+#endif
+
 class Semaphore : public Scheduler::GenericThreadBlocker{
 protected:
     lock_t value = 0;
@@ -65,6 +61,20 @@ public:
 
     void WaitTimeout(long timeout);
 
+    // Decrement the semaphore only if it would not block, returns true on success
+    inline bool TryWait(){
+        int val = value;
+        while(val > 0){
+            if(__sync_bool_compare_and_swap(&value, val, val - 1)){
+                return true;
+            }
+
+            val = value;
+        }
+
+        return false;
+    }
+
     inline void Signal(){
         __sync_fetch_and_add(&value, 1);
 
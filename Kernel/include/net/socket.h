@@ -132,9 +132,6 @@ public:
     virtual fs_fd_t* Open(size_t flags);
     virtual void Close();
 
-    virtual void Watch(FilesystemWatcher& watcher, int events);
-    virtual void Unwatch(FilesystemWatcher& watcher);
-
     virtual int GetDomain() { return domain; }
     virtual int IsListening() { return passive; }
     virtual int IsBlocking() { return blocking; }
@@ -145,8 +142,6 @@ public:
 
 class LocalSocket : public Socket {
     lock_t slock = 0;
-
-    List<FilesystemWatcher*> watching;
 public:
     LocalSocket* peer = nullptr;
 
@@ -170,11 +165,9 @@ public:
     
     int64_t ReceiveFrom(void* buffer, size_t len, int flags, sockaddr* src, socklen_t* addrlen);
     int64_t SendTo(void* buffer, size_t len, int flags, const sockaddr* src, socklen_t addrlen);
-    
-    void Watch(FilesystemWatcher& watcher, int events);
-    void Unwatch(FilesystemWatcher& watcher);
 
     bool CanRead() { if(inbound) return !inbound->Empty(); else return false; }
+    bool CanWrite() { if(type == StreamSocket && outbound) return outbound->Pos() + 1 < STREAM_MAX_BUFSIZE; else return true; } // Room for at least one byte, see SendTo
 };
 
 class IPSocket : public Socket {
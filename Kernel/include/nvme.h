@@ -1,3 +1,240 @@
+#pragma once
+
+#include <stdint.h>
+#include <lock.h>
+#include <device.h>
+#include <pci.h>
+
+#define NVME_CAP_MQES(x) (((x) & 0xFFFF) + 1) // Maximum queue entries supported
+#define NVME_CAP_TO(x) (((x) >> 24) & 0xFF) // Timeout in 500ms units
+#define NVME_CAP_DSTRD(x) (((x) >> 32) & 0xF) // Doorbell stride
+#define NVME_CAP_CSS_NVM (1ULL << 37) // NVM command set supported
+#define NVME_CAP_MPSMIN(x) (((x) >> 48) & 0xF) // Minimum memory page size (2 ^ (12 + MPSMIN))
+
+#define NVME_CC_ENABLE (1 << 0)
+#define NVME_CC_CSS_NVM (0 << 4)
+#define NVME_CC_MPS(x) ((x) << 7) // Memory page size (2 ^ (12 + MPS))
+#define NVME_CC_AMS_RR (0 << 11) // Round robin arbitration
+#define NVME_CC_IOSQES(x) ((x) << 16) // I/O submission queue entry size (2 ^ n)
+#define NVME_CC_IOCQES(x) ((x) << 20) // I/O completion queue entry size (2 ^ n)
+
+#define NVME_CSTS_READY (1 << 0)
+#define NVME_CSTS_FATAL (1 << 1)
+
+#define NVME_ADMIN_DELETE_SQ 0x00
+#define NVME_ADMIN_CREATE_SQ 0x01
+#define NVME_ADMIN_DELETE_CQ 0x04
+#define NVME_ADMIN_CREATE_CQ 0x05
+#define NVME_ADMIN_IDENTIFY 0x06
+#define NVME_ADMIN_SET_FEATURES 0x09
+
+#define NVME_CMD_FLUSH 0x00
+#define NVME_CMD_WRITE 0x01
+#define NVME_CMD_READ 0x02
+
+#define NVME_IDENTIFY_NAMESPACE 0x0
+#define NVME_IDENTIFY_CONTROLLER 0x1
+
+#define NVME_FEATURE_NUMBER_OF_QUEUES 0x07
+
+#define NVME_QUEUE_PHYS_CONTIGUOUS (1 << 0)
+#define NVME_CQ_IRQ_ENABLED (1 << 1)
+
+#define NVME_COMPLETION_PHASE (1 << 0)
+#define NVME_COMPLETION_STATUS(x) (((x) >> 1) & 0x7FFF)
+
+// Amount of entries in the admin queues
+#define NVME_ADMIN_QUEUE_SIZE 32
+// Amount of entries in each I/O queue, one less command than this can be outstanding
+#define NVME_IO_QUEUE_SIZE 64
+// Maximum size of a single command, limited by the PRP list fitting in a page
+#define NVME_MAX_TRANSFER_SIZE 0x100000 // 1MB
+// Maximum amount of outstanding commands on a queue
+#define NVME_MAX_QUEUE_COMMANDS 64
+// Maximum amount of namespaces we look for
+#define NVME_MAX_NAMESPACES 16
+
 namespace NVMe{
+    typedef volatile struct NVMeRegisters {
+        uint64_t cap; // Controller capabilities
+        uint32_t version;
+        uint32_t intms; // Interrupt mask set
+        uint32_t intmc; // Interrupt mask clear
+        uint32_t cc; // Controller configuration
+        uint32_t rsv0;
+        uint32_t csts; // Controller status
+        uint32_t nssr; // NVM subsystem reset
+        uint32_t aqa; // Admin queue attributes
+        uint64_t asq; // Admin submission queue base address
+        uint64_t acq; // Admin completion queue base address
+    } __attribute__((packed)) nvme_registers_t;
+
+    typedef struct {
+        uint8_t opcode;
+        uint8_t flags;
+        uint16_t commandID;
+        uint32_t namespaceID;
+        uint64_t rsv0;
+        uint64_t metadata;
+        uint64_t prp1;
+        uint64_t prp2;
+        uint32_t cdw10;
+        uint32_t cdw11;
+        uint32_t cdw12;
+        uint32_t cdw13;
+        uint32_t cdw14;
+        uint32_t cdw15;
+    } __attribute__((packed)) nvme_command_t;
+
+    typedef volatile struct NVMeCompletion {
+        uint32_t result; // Command specific
+        uint32_t rsv0;
+        uint16_t sqHead; // Submission queue head pointer
+        uint16_t sqID;
+        uint16_t commandID;
+        uint16_t status; // Bit 0 is the phase tag
+    } __attribute__((packed)) nvme_completion_t;
+
+    typedef struct {
+        uint16_t vendorID;
+        uint16_t subsystemVendorID;
+        char serialNumber[20];
+        char modelNumber[40];
+        char firmwareRevision[8];
+        uint8_t recommendedArbitrationBurst;
+        uint8_t ieeeOUI[3];
+        uint8_t cmic;
+        uint8_t mdts; // Maximum data transfer size (2 ^ n minimum pages, 0 for no limit)
+        uint8_t rsv0[438];
+        uint32_t namespaceCount;
+        uint8_t rsv1[3576];
+    } __attribute__((packed)) nvme_identify_controller_t;
+
+    typedef struct {
+        uint16_t metadataSize;
+        uint8_t lbaDataSize; // Block size (2 ^ n)
+        uint8_t relativePerformance;
+    } __attribute__((packed)) nvme_lba_format_t;
+
+    typedef struct {
+        uint64_t size; // Namespace size in blocks
+        uint64_t capacity;
+        uint64_t utilization;
+        uint8_t features;
+        uint8_t lbaFormatCount;
+        uint8_t formattedLBASize; // Bits 3:0 index the LBA format in use
+        uint8_t rsv0[101];
+        nvme_lba_format_t lbaFormats[16];
+        uint8_t rsv1[3904];
+    } __attribute__((packed)) nvme_identify_namespace_t;
+
+    class Controller;
+
+    // A submission and completion queue pair
+    class Queue{
+    public:
+        Queue(Controller* controller, uint16_t id, uint16_t size);
+
+        /////////////////////////////
+        /// \brief Submit a command and wait for it to complete
+        ///
+        /// \param pages Physical addresses of the data pages, the first may start part way into a page
+        /// \param pageCount Amount of pages, PRP1 and PRP2 (or a PRP list) are filled in from them
+        ///
+        /// \return NVMe status of the command (zero on success)
+        /////////////////////////////
+        int Execute(nvme_command_t& command, uint32_t* result = nullptr, const uintptr_t* pages = nullptr, unsigned pageCount = 0);
+
+        // Process new completions, called from the interrupt handler
+        void OnInterrupt();
+
+        uint16_t id;
+        uint16_t size;
+
+        uintptr_t sqPhys;
+        uintptr_t cqPhys;
+
+        bool interruptsEnabled = false; // Completions are polled until set
+
+    private:
+        // lock must be held with interrupts disabled
+        void CheckCompletions();
+
+        Controller* controller;
+
+        nvme_command_t* sq;
+        nvme_completion_t* cq;
+
+        uint16_t sqTail = 0;
+        uint16_t cqHead = 0;
+        uint16_t phase = 1;
+
+        lock_t lock = 0; // Taken with interrupts disabled as the interrupt handler also takes it
+
+        Semaphore commandSemaphore = Semaphore(0); // Amount of free command IDs
+        uint64_t freeCommandIDs = 0; // Protected by lock
+
+        struct {
+            thread_t* waiter;
+            volatile bool done;
+            uint16_t status;
+            uint32_t result;
+
+            uintptr_t prpListPhys; // Allocated the first time the command ID is used for a large transfer
+            uint64_t* prpList;
+        } commands[NVME_MAX_QUEUE_COMMANDS];
+    };
+
+    class Namespace : public DiskDevice{
+    public:
+        Namespace(Controller* controller, uint32_t id, nvme_identify_namespace_t& identify);
+
+        int ReadDiskBlock(uint64_t lba, uint32_t count, void* buffer);
+        int WriteDiskBlock(uint64_t lba, uint32_t count, void* buffer);
+
+        uint32_t id;
+        uint64_t blockCount;
+    private:
+        int Transfer(uint64_t lba, uint32_t count, uint8_t* buffer, bool write);
+
+        Controller* controller;
+    };
+
+    class Controller{
+        friend class Queue;
+        friend class Namespace;
+    public:
+        Controller(PCIDevice* device);
+
+        // Get the I/O queue of the current CPU
+        Queue* GetIOQueue();
+
+        bool error = false;
+    private:
+        bool WaitForReady(bool ready);
+        int CreateIOQueues();
+        void IdentifyNamespaces();
+
+        inline volatile uint32_t* SubmissionDoorbell(uint16_t queue){
+            return reinterpret_cast<volatile uint32_t*>(reinterpret_cast<uintptr_t>(registers) + 0x1000 + (2 * queue) * (4 << doorbellStride));
+        }
+
+        inline volatile uint32_t* CompletionDoorbell(uint16_t queue){
+            return reinterpret_cast<volatile uint32_t*>(reinterpret_cast<uintptr_t>(registers) + 0x1000 + (2 * queue + 1) * (4 << doorbellStride));
+        }
+
+        PCIDevice* pciDevice;
+        nvme_registers_t* registers;
+
+        unsigned doorbellStride;
+        uint32_t maxTransferSize = NVME_MAX_TRANSFER_SIZE;
+
+        Queue* adminQueue;
+        List<Queue*> ioQueues;
+        Queue* cpuQueues[256] = {}; // I/O queue of each CPU indexed by APIC ID, CPUs share queues if the controller has too few
+
+        List<Namespace*> namespaces;
+    };
+
     void Initialize();
-}
\ No newline at end of file
+}
@@ -24,5 +24,6 @@ namespace Memory{
     
     uint64_t CreateSharedMemory(uint64_t size, uint64_t flags, pid_t owner, pid_t recipient);
     void* MapSharedMemory(uint64_t key, process_t* proc, uint64_t hint);
+    void ReferenceSharedMemory(uint64_t key); // Another mapping of the shared memory was created without MapSharedMemory (e.g. by fork)
     void DestroySharedMemory(uint64_t key);
 }
\ No newline at end of file
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <spin.h>
+
+// Slabs are a single page, the slab header sits at the start of the page so objects can find their slab by masking their address
+#define SLAB_SIZE 4096
+// Largest object that a cache will take, anything bigger (or of odd sizes) should go to kmalloc
+#define SLAB_MAX_OBJECT_SIZE (SLAB_SIZE / 8)
+#define SLAB_OBJECT_ALIGNMENT 16
+
+// Amount of free objects each CPU can hold on to per cache
+#define SLAB_MAGAZINE_SIZE 32
+// Amount of objects moved between a CPU's magazine and the slabs at once
+#define SLAB_MAGAZINE_BATCH 16
+
+#define SLAB_MAX_CPUS 256
+
+// Amount of empty slabs kept around instead of giving the pages back
+#define SLAB_MAX_EMPTY_SLABS 2
+
+class ObjectCache {
+protected:
+    struct Slab {
+        ObjectCache* cache;
+        Slab* next;
+        Slab* prev;
+        void* freeList; // First free object in the slab, each free object points to the next one
+        unsigned inUse; // Objects allocated from this slab (including those sitting in magazines)
+    };
+
+    struct Magazine {
+        void* objects[SLAB_MAGAZINE_SIZE];
+        unsigned count;
+
+        uint64_t hits; // Allocations served from the magazine
+        uint64_t misses; // Allocations that had to refill from the slabs
+        uint64_t drains; // Frees that had to give objects back to the slabs
+    };
+
+    const char* name;
+    size_t objectSize;
+    unsigned objectsPerSlab;
+
+    lock_t lock = 0; // Protects the slab lists, always held with interrupts disabled
+
+    Slab* partial = nullptr; // Slabs with free objects
+    Slab* full = nullptr;
+    Slab* empty = nullptr;
+    unsigned emptyCount = 0;
+
+    Magazine* magazines[SLAB_MAX_CPUS] = {};
+
+    bool registered = false; // Caches are constant initialized so are only added to the list of caches once used
+    ObjectCache* nextCache = nullptr;
+
+    uint64_t slabCount = 0;
+    uint64_t objectsInUse = 0; // Objects handed out of the slabs, including those in magazines
+
+    void* AllocateFromSlab(); // lock must be held
+    void FreeToSlab(void* object); // lock must be held
+    bool Grow(); // lock must be held
+
+    Magazine* GetMagazine(bool canAllocate); // Interrupts must be disabled
+
+    static void SlabUnlink(Slab* slab, Slab** list);
+    static void SlabPush(Slab* slab, Slab** list);
+
+    static constexpr size_t AlignedObjectSize(size_t size){
+        if(size < sizeof(void*)){
+            size = sizeof(void*); // Free objects hold the free list pointer
+        }
+
+        return (size + SLAB_OBJECT_ALIGNMENT - 1) & ~(size_t)(SLAB_OBJECT_ALIGNMENT - 1);
+    }
+
+    static constexpr size_t SlabHeaderSize(){
+        return (sizeof(Slab) + SLAB_OBJECT_ALIGNMENT - 1) & ~(size_t)(SLAB_OBJECT_ALIGNMENT - 1);
+    }
+
+    static ObjectCache* caches;
+    static lock_t cachesLock;
+public:
+    // Constant initialized, so caches with static storage are usable before global constructors run
+    constexpr ObjectCache(const char* name, size_t size) : name(name), objectSize(AlignedObjectSize(size)),
+        objectsPerSlab((SLAB_SIZE - SlabHeaderSize()) / AlignedObjectSize(size)) {}
+
+    ObjectCache(const ObjectCache&) = delete;
+    ObjectCache& operator=(const ObjectCache&) = delete;
+
+    /////////////////////////////
+    /// \brief Allocate an object
+    ///
+    /// Served from the magazine of the current CPU without taking any locks when possible.
+    ///
+    /// \return Pointer to the (uninitialized) object, null if out of memory
+    /////////////////////////////
+    void* Allocate();
+
+    /////////////////////////////
+    /// \brief Free an object allocated from this cache
+    /////////////////////////////
+    void Free(void* object);
+
+    inline const char* Name() const { return name; }
+    inline size_t ObjectSize() const { return objectSize; }
+
+    /////////////////////////////
+    /// \brief Write the statistics of every cache to buffer
+    ///
+    /// \return Length of the string written
+    /////////////////////////////
+    static size_t GetStatistics(char* buffer, size_t size);
+};
+
+namespace Memory{
+    /////////////////////////////
+    /// \brief Start using per-CPU magazines
+    ///
+    /// Every CPU must set up its CPU local data before allocating.
+    /////////////////////////////
+    void EnableObjectCacheMagazines();
+
+    /////////////////////////////
+    /// \brief Allocate a small object from the closest size class, falls back to kmalloc for large sizes
+    ///
+    /// The same size must be passed to SlabFree.
+    /////////////////////////////
+    void* SlabAllocate(size_t size);
+    void SlabFree(void* object, size_t size);
+}
@@ -1,20 +1,82 @@
 #pragma once
 
+#include <stdint.h>
+
+// Ticket spinlock, the low 16 bits hold the next ticket to hand out and the high 16 bits the ticket currently holding the lock.
+// Waiters get the lock in the order they arrived, each one spinning on a read of the lock until its ticket comes up.
 typedef volatile int lock_t;
 
+#define LOCK_NEXT_TICKET(lock) (reinterpret_cast<volatile uint16_t*>(lock))
+#define LOCK_OWNER_TICKET(lock) (reinterpret_cast<volatile uint16_t*>(lock) + 1)
+
+#ifdef LOCK_STATISTICS
+// Record an acquisition of lock that spun for spinCycles TSC cycles, site is the address the lock was acquired from
+void RecordLockAcquisition(lock_t* lock, uint64_t spinCycles, void* site);
+
+static inline uint64_t LockReadTSC(){
+    uint32_t low, high;
+    asm volatile("rdtsc" : "=a"(low), "=d"(high));
+    return (static_cast<uint64_t>(high) << 32) | low;
+}
+
+// Only used from always inlined functions, so this is an address in the function taking the lock
+__attribute__((always_inline)) static inline void* LockSite(){
+    void* rip;
+    asm volatile("lea 0(%%rip), %0" : "=r"(rip));
+    return rip;
+}
+#endif
+
 #define CHECK_DEADLOCK
 #ifdef CHECK_DEADLOCK
 #include <assert.h>
+#endif
+
+__attribute__((always_inline)) static inline void acquireLock(lock_t* lock){
+    uint16_t ticket = __atomic_fetch_add(LOCK_NEXT_TICKET(lock), 1, __ATOMIC_ACQUIRE);
 
-#define acquireLock(lock) ({ \
-    volatile unsigned i = 0; \
-    while(__sync_lock_test_and_set(lock, 1) && ++i < 0xFFFFFFF) asm("pause"); \
-    if( i >= 0xFFFFFFF) { assert(!"Deadlock!"); } \
-    })
+#ifdef LOCK_STATISTICS
+    uint64_t spinStart = 0;
+    if(__atomic_load_n(LOCK_OWNER_TICKET(lock), __ATOMIC_ACQUIRE) != ticket){
+        spinStart = LockReadTSC();
+    }
+#endif
+
+#ifdef CHECK_DEADLOCK
+    volatile unsigned i = 0;
+    while(__atomic_load_n(LOCK_OWNER_TICKET(lock), __ATOMIC_ACQUIRE) != ticket && ++i < 0xFFFFFFF) asm("pause");
+    if(i >= 0xFFFFFFF) { assert(!"Deadlock!"); }
 #else
-#define acquireLock(lock) ({while(__sync_lock_test_and_set(lock, 1)) asm("pause");})
+    while(__atomic_load_n(LOCK_OWNER_TICKET(lock), __ATOMIC_ACQUIRE) != ticket) asm("pause");
+#endif
+
+#ifdef LOCK_STATISTICS
+    RecordLockAcquisition(lock, spinStart ? LockReadTSC() - spinStart : 0, LockSite());
 #endif
+}
+
+// Releasing a lock that is not held does nothing
+__attribute__((always_inline)) static inline void releaseLock(lock_t* lock){
+    uint16_t owner = *LOCK_OWNER_TICKET(lock);
+    if(owner != *LOCK_NEXT_TICKET(lock)){
+        __atomic_store_n(LOCK_OWNER_TICKET(lock), static_cast<uint16_t>(owner + 1), __ATOMIC_RELEASE);
+    }
+}
 
-#define releaseLock(lock) ({ __sync_lock_release(lock); });
+// Take the lock only if it is free, returns 0 if the lock was acquired and nonzero if it is held by someone else
+__attribute__((always_inline)) static inline int acquireTestLock(lock_t* lock){
+    int value = *lock;
+    if((value & 0xFFFF) != ((value >> 16) & 0xFFFF)){
+        return 1;
+    }
 
-#define acquireTestLock(lock) ({int status; status = __sync_lock_test_and_set(lock, 1); status;})
\ No newline at end of file
+    int next = (value & 0xFFFF0000) | ((value + 1) & 0xFFFF);
+    if(!__atomic_compare_exchange_n(lock, &value, next, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+        return 1;
+    }
+
+#ifdef LOCK_STATISTICS
+    RecordLockAcquisition(lock, 0, LockSite());
+#endif
+    return 0;
+}
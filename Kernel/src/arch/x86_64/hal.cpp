@@ -98,7 +98,6 @@ namespace HAL{
                         }
                         currentEntry = reinterpret_cast<multiboot2_mmap_entry_t*>((uintptr_t)currentEntry + mbMemMap->entrySize);
                     }
-                    Memory::usedPhysicalBlocks = 0;
                     break;
                 }
                 case Mboot2FramebufferInfo: {
@@ -156,7 +155,7 @@ namespace HAL{
         for(unsigned i = 0; i < bootModuleCount; i++){
             multiboot2_module_t& mod = *modules[i];
             Log::Info("    Multiboot Module %d [Start: %x, End: %x, Cmdline: %s]", i, mod.moduleStart, mod.moduleEnd, mod.string);
-            Memory::MarkMemoryRegionUsed(mod.moduleStart, mod.moduleEnd);
+            Memory::MarkMemoryRegionUsed(mod.moduleStart, mod.moduleEnd - mod.moduleStart);
             bootModules[i] = {
                 .base = Memory::GetIOMapping(mod.moduleStart),
                 .size = mod.moduleEnd - mod.moduleStart,
@@ -193,6 +192,8 @@ namespace HAL{
         Log::Info("Initializing Local and I/O APIC...");
         APIC::Initialize();
         Log::Write("OK");
+
+        Timer::InitializeClockEvents(); // Needs the local APIC, and has to be done before other CPUs start
         
         Log::Info("Initializing SMP...");
         SMP::Initialize();
@@ -19,6 +19,13 @@ struct ISRDataPair
 };
 ISRDataPair interrupt_handlers[256];
 
+struct ExceptionDataPair
+{
+	exception_handler_t handler;
+	void* data;
+};
+ExceptionDataPair exception_handlers[32];
+
 extern "C"
 void isr0();
 extern "C"
@@ -125,8 +132,6 @@ void idt_flush();
 
 extern uint64_t int_vectors[];
 
-int errCode = 0;
-
 namespace IDT{
 	void IPIHalt(void*, regs64_t* r){
 		asm("cli");
@@ -234,6 +239,11 @@ namespace IDT{
 		interrupt_handlers[interrupt] = {.handler = handler, .data = data};
 	}
 
+	void RegisterExceptionHandler(uint8_t exception, exception_handler_t handler, void* data) {
+		assert(exception < 32);
+		exception_handlers[exception] = {.handler = handler, .data = data};
+	}
+
 	uint8_t ReserveUnusedInterrupt(){
 		uint8_t interrupt = 0xFF;
 		for(unsigned i = IRQ0 + 16 /* Ignore all legacy IRQs and exceptions */; i < 255 /* Ignore 0xFF */ && interrupt == 0xFF; i++){
@@ -259,15 +269,13 @@ namespace IDT{
 		outportb(0xA1, 0xFF);
 	}
 
-	int GetErrCode(){
-		return errCode;
-	}
 }
 
 extern "C"
 	void isr_handler(int int_num, regs64_t* regs, int err_code) {
-		errCode = err_code;
-		if (interrupt_handlers[int_num].handler != 0) {
+		if (int_num < 32 && exception_handlers[int_num].handler != 0) {
+			exception_handlers[int_num].handler(exception_handlers[int_num].data, regs, err_code);
+		} else if (interrupt_handlers[int_num].handler != 0) {
 			interrupt_handlers[int_num].handler(interrupt_handlers[int_num].data, regs);
 		} else if(int_num == 0x69){
 			Log::Warning("\r\nEarly syscall");
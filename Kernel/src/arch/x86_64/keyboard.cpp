@@ -54,6 +54,8 @@ namespace Keyboard{
 
             return size;
 		}
+
+        bool CanRead() { return keyCount > 0; }
 	};
 
     KeyboardDevice kbDev("keyboard0");
@@ -76,6 +78,8 @@ namespace Keyboard{
         }
 
         keyCount++;
+
+        kbDev.SignalWatchers();
     }
 
     // Register interrupt handler
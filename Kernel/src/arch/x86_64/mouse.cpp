@@ -32,6 +32,41 @@ namespace Mouse{
 
 	bool dataUpdated = false;
 
+	class MouseDevice : public Device{
+	public:
+		DirectoryEntry dirent;
+
+		MouseDevice(char* name) : Device(name, TypeInputDevice){
+			flags = FS_NODE_CHARDEVICE;
+			strcpy(dirent.name, name);
+			dirent.flags = flags;
+			dirent.node = this;
+		}
+
+		ssize_t Read(size_t offset, size_t size, uint8_t *buffer){
+			if(size < sizeof(MousePacket)) return 0;
+
+			if(packetCount <= 0) return 0; // No packets
+
+			MousePacket* pkt = (MousePacket*)buffer;
+			*pkt = packetQueue[packetQueueStart];
+
+			packetQueueStart++;
+
+			if(packetQueueStart >= PACKET_QUEUE_SIZE) {
+				packetQueueStart = 0;
+			}
+
+			packetCount--;
+
+			return sizeof(MousePacket);
+		}
+
+		bool CanRead() { return packetCount > 0; }
+	};
+
+	MouseDevice mouseDev("mouse0");
+
 	void Handler(void*, regs64_t* regs) {
 		switch (mouseCycle)
 		{
@@ -68,7 +103,8 @@ namespace Mouse{
 			}
 
 			packetCount++;
-			
+
+			mouseDev.SignalWatchers();
 			break;
 		} default: {
 			mouseCycle = 0;
@@ -113,38 +149,6 @@ namespace Mouse{
 		return updated;
 	}
 
-	class MouseDevice : public Device{
-	public:
-		DirectoryEntry dirent;
-
-		MouseDevice(char* name) : Device(name, TypeInputDevice){
-			flags = FS_NODE_CHARDEVICE;
-			strcpy(dirent.name, name);
-			dirent.flags = flags;
-			dirent.node = this;
-		}
-
-		ssize_t Read(size_t offset, size_t size, uint8_t *buffer){
-			if(size < sizeof(MousePacket)) return 0;
-
-			if(packetCount <= 0) return 0; // No packets
-
-			MousePacket* pkt = (MousePacket*)buffer;
-			*pkt = packetQueue[packetQueueStart];
-
-			packetQueueStart++;
-
-			if(packetQueueStart >= PACKET_QUEUE_SIZE) {
-				packetQueueStart = 0;
-			}
-
-			packetCount--;
-
-			return sizeof(MousePacket);
-		}
-	};
-
-	MouseDevice mouseDev("mouse0");
 
 	void Install()
 	{
@@ -178,4 +182,4 @@ namespace Mouse{
 	int8_t* GetData() {
 		return mouseData;
 	}
-}
\ No newline at end of file
+}
\ No newline at end of file
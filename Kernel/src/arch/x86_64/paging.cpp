@@ -10,6 +10,10 @@
 #include <panic.h>
 #include <apic.h>
 #include <strace.h>
+#include <cpu.h>
+#include <fs/pagecache.h>
+#include <sharedmem.h>
+#include <smp.h>
 
 //extern uint32_t kernel_end;
 
@@ -30,22 +34,26 @@ namespace Memory{
 	page_dir_t ioDirs[4] __attribute__((aligned(4096)));
 
 	uint64_t VirtualToPhysicalAddress(uint64_t addr) {
-		uint64_t address = 0;
-
 		uint32_t pml4Index = PML4_GET_INDEX(addr);
+		uint32_t pdptIndex = PDPT_GET_INDEX(addr);
 		uint32_t pageDirIndex = PAGE_DIR_GET_INDEX(addr);
 		uint32_t pageTableIndex = PAGE_TABLE_GET_INDEX(addr);
 
 		if(pml4Index < 511){ // From Process Address Space
-			
-		} else { // From Kernel Address Space
+			return 0;
+		} else if(pdptIndex == KERNEL_HEAP_PDPT_INDEX){ // From Kernel Heap
 			if(kernelHeapDir[pageDirIndex] & 0x80){
-				address = (GetPageFrame(kernelHeapDir[pageDirIndex])) << 12;
-			} else {
-				address = (GetPageFrame(kernelHeapDirTables[pageDirIndex][pageTableIndex])) << 12;
+				return ((GetPageFrame(kernelHeapDir[pageDirIndex])) << 12) + (addr & (PAGE_SIZE_2M - 1));
+			} else if(kernelHeapDirTables[pageDirIndex][pageTableIndex] & PAGE_PRESENT){
+				return ((GetPageFrame(kernelHeapDirTables[pageDirIndex][pageTableIndex])) << 12) + (addr & (PAGE_SIZE_4K - 1));
 			}
+		} else if(addr >= KERNEL_VIRTUAL_BASE){ // The kernel is mapped linearly
+			return addr - KERNEL_VIRTUAL_BASE;
+		} else if(addr >= IO_VIRTUAL_BASE){
+			return addr - IO_VIRTUAL_BASE;
 		}
-		return address;
+
+		return 0;
 	}
 
 	uint64_t VirtualToPhysicalAddress(uint64_t addr, address_space_t* addressSpace) {
@@ -70,9 +78,52 @@ namespace Memory{
 		return address;
 	}
 
+	lock_t tlbShootdownLock = 0;
+	volatile unsigned tlbShootdownPending = 0; // CPUs yet to flush their TLB
+
+	void TLBShootdownHandler(void*, regs64_t*){
+		asm volatile("mov %%cr3, %%rax; mov %%rax, %%cr3" ::: "rax", "memory");
+
+		__sync_fetch_and_sub(&tlbShootdownPending, 1);
+	}
+
+	void FlushTLBAllCPUs(){
+		asm volatile("mov %%cr3, %%rax; mov %%rax, %%cr3" ::: "rax", "memory");
+
+		if(SMP::processorCount <= 1){
+			return;
+		}
+
+		assert(CheckInterrupts()); // Another CPU may be waiting on us to flush our TLB
+		acquireLock(&tlbShootdownLock);
+
+		// Only wait on CPUs that have started, any that failed to would never answer
+		CPU* self = GetCPULocal();
+		unsigned pending = 0;
+		for(unsigned i = 0; i < SMP::processorCount; i++){
+			if(SMP::cpus[i] && SMP::cpus[i] != self && SMP::cpus[i]->online){
+				pending++;
+			}
+		}
+		tlbShootdownPending = pending;
+
+		for(unsigned i = 0; i < SMP::processorCount; i++){
+			if(SMP::cpus[i] && SMP::cpus[i] != self && SMP::cpus[i]->online){
+				APIC::Local::SendIPI(SMP::cpus[i]->id, ICR_DSH_DEST, ICR_MESSAGE_TYPE_FIXED, IPI_TLB_SHOOTDOWN);
+			}
+		}
+
+		while(tlbShootdownPending){
+			asm("pause");
+		}
+
+		releaseLock(&tlbShootdownLock);
+	}
+
 	void InitializeVirtualMemory()
 	{
-		IDT::RegisterInterruptHandler(14,PageFaultHandler);
+		IDT::RegisterExceptionHandler(14,PageFaultHandler);
+		IDT::RegisterInterruptHandler(IPI_TLB_SHOOTDOWN, TLBShootdownHandler);
 		memset(kernelPML4, 0, sizeof(pml4_t));
 		memset(kernelPDPT, 0, sizeof(pdpt_t));
 		memset(kernelHeapDir, 0, sizeof(page_dir_t));
@@ -160,11 +211,11 @@ namespace Memory{
 			for(int j = 0; j < TABLES_PER_DIR; j++){
 				pd_entry_t dirEnt = addressSpace->pageDirs[i][j];
 				if(dirEnt & PAGE_PRESENT){
-					uint64_t phys = GetPageFrame(dirEnt);
+					uint64_t phys = dirEnt & PAGE_FRAME;
 
 					for(int k = 0; k < PAGES_PER_TABLE; k++){
 						if(addressSpace->pageTables[i][j][k] & 0x1){
-							uint64_t pagePhys = GetPageFrame(addressSpace->pageTables[i][j][k]);
+							uint64_t pagePhys = addressSpace->pageTables[i][j][k] & PAGE_FRAME;
 							FreePhysicalMemoryBlock(pagePhys);
 						}
 					}
@@ -195,11 +246,15 @@ namespace Memory{
 			return 0;
 		}
 
-		if(!((addressSpace->pageTables[PDPT_GET_INDEX(addr)][PAGE_DIR_GET_INDEX(addr)][PAGE_TABLE_GET_INDEX(addr)] & (PAGE_PRESENT)) && addressSpace->pageTables[PDPT_GET_INDEX(addr)][PAGE_DIR_GET_INDEX(addr)][PAGE_TABLE_GET_INDEX(addr)] & (PAGE_USER))){
+		page_t start = addressSpace->pageTables[PDPT_GET_INDEX(addr)][PAGE_DIR_GET_INDEX(addr)][PAGE_TABLE_GET_INDEX(addr)];
+		page_t end = addressSpace->pageTables[PDPT_GET_INDEX(addr + len)][PAGE_DIR_GET_INDEX(addr + len)][PAGE_TABLE_GET_INDEX(addr + len)];
+
+		// Demand paged memory will be faulted in when the kernel accesses it
+		if(!(((start & PAGE_PRESENT) && (start & PAGE_USER)) || (start & PAGE_DEMAND))){
 			return 0;
 		}
 		
-		if(!((addressSpace->pageTables[PDPT_GET_INDEX(addr + len)][PAGE_DIR_GET_INDEX(addr + len)][PAGE_TABLE_GET_INDEX(addr + len)] & (PAGE_PRESENT)) && addressSpace->pageTables[PDPT_GET_INDEX(addr + len)][PAGE_DIR_GET_INDEX(addr + len)][PAGE_TABLE_GET_INDEX(addr + len)] & (PAGE_USER))){
+		if(!(((end & PAGE_PRESENT) && (end & PAGE_USER)) || (end & PAGE_DEMAND))){
 			return 0;
 		}
 
@@ -244,7 +299,7 @@ namespace Memory{
 			for(int i = 0; i < TABLES_PER_DIR; i++){
 				if(addressSpace->pageDirs[d][i] & 0x1 && !(addressSpace->pageDirs[d][i] & 0x80)){
 					for(int j = 0; j < PAGES_PER_TABLE; j++){
-						if(addressSpace->pageTables[d][i][j] & 0x1){
+						if(addressSpace->pageTables[d][i][j] & (PAGE_PRESENT | PAGE_DEMAND)){
 							pageDirOffset = i;
 							offset = j+1;
 							counter = 0;
@@ -548,17 +603,364 @@ namespace Memory{
 		currentAddressSpace = addressSpace;
 	}
 
-	void PageFaultHandler(void*, regs64_t* regs)
+	// Marks the pages of a new region as reserved, the region lock of the process should be held
+	static void ReserveRegionPages(address_space_t* addressSpace, uintptr_t base, uint64_t pageCount){
+		for(uintptr_t virt = base; virt < base + pageCount * PAGE_SIZE_4K; virt += PAGE_SIZE_4K){
+			uint64_t pdptIndex = PDPT_GET_INDEX(virt);
+			uint64_t pageDirIndex = PAGE_DIR_GET_INDEX(virt);
+
+			if(!(addressSpace->pageDirs[pdptIndex][pageDirIndex] & PAGE_PRESENT)) CreatePageTable(pdptIndex, pageDirIndex, addressSpace);
+
+			page_t& page = addressSpace->pageTables[pdptIndex][pageDirIndex][PAGE_TABLE_GET_INDEX(virt)];
+			if(page & PAGE_PRESENT && page & PAGE_FRAME){
+				continue; // Already backed by physical memory
+			}
+
+			page = PAGE_DEMAND; // Not present, but still reserved
+			invlpg(virt);
+		}
+	}
+
+	// Checks whether the range overlaps a region or memory mapped outside of one, the region lock of the process should be held
+	static bool RegionInUse(process_t* proc, uintptr_t base, uint64_t pageCount){
+		uintptr_t end = base + pageCount * PAGE_SIZE_4K;
+
+		for(unsigned i = 0; i < proc->vmRegions.get_length(); i++){
+			vm_region_t region = proc->vmRegions.get_at(i);
+			if(region.base < end && region.base + region.pageCount * PAGE_SIZE_4K > base){
+				return true;
+			}
+		}
+
+		address_space_t* addressSpace = proc->addressSpace;
+		for(uintptr_t virt = base; virt < end; virt += PAGE_SIZE_4K){
+			if(!(addressSpace->pageDirs[PDPT_GET_INDEX(virt)][PAGE_DIR_GET_INDEX(virt)] & PAGE_PRESENT)) continue;
+
+			page_t page = addressSpace->pageTables[PDPT_GET_INDEX(virt)][PAGE_DIR_GET_INDEX(virt)][PAGE_TABLE_GET_INDEX(virt)];
+			if(page & PAGE_PRESENT && page & PAGE_FRAME){
+				return true; // Backed by physical memory the region does not own, UnmapRegion would free it
+			}
+		}
+
+		return false;
+	}
+
+	bool MapAnonymousRegion(process_t* proc, uintptr_t base, uint64_t pageCount){
+		acquireLock(&proc->vmRegionLock);
+
+		if(RegionInUse(proc, base, pageCount)){
+			releaseLock(&proc->vmRegionLock);
+			return false;
+		}
+
+		ReserveRegionPages(proc->addressSpace, base, pageCount);
+		proc->vmRegions.add_back({.base = base, .pageCount = pageCount, .flags = VMRegionAnonymous, .node = nullptr, .offset = 0});
+
+		releaseLock(&proc->vmRegionLock);
+		return true;
+	}
+
+	bool MapFileRegion(process_t* proc, uintptr_t base, uint64_t pageCount, FsNode* node, uint64_t offset, bool shared){
+		acquireLock(&proc->vmRegionLock);
+
+		if(RegionInUse(proc, base, pageCount)){
+			releaseLock(&proc->vmRegionLock);
+			return false;
+		}
+
+		node->handleCount++; // Make sure the node stays around while it is mapped
+
+		ReserveRegionPages(proc->addressSpace, base, pageCount);
+		proc->vmRegions.add_back({.base = base, .pageCount = pageCount, .flags = static_cast<uint64_t>(VMRegionFile | (shared ? VMRegionShared : 0)), .node = node, .offset = offset});
+
+		releaseLock(&proc->vmRegionLock);
+		return true;
+	}
+
+	void UnmapRegion(process_t* proc, uintptr_t base, uint64_t pageCount){
+		address_space_t* addressSpace = proc->addressSpace;
+		uintptr_t end = base + pageCount * PAGE_SIZE_4K;
+
+		struct DirtyPage {
+			FsNode* node;
+			uint64_t index;
+			uint64_t phys;
+		};
+
+		List<DirtyPage> dirtyPages; // Pages of shared file regions that have been written to
+		List<FsNode*> closeNodes; // Files of removed regions
+
+		acquireLock(&proc->vmRegionLock);
+
+		for(unsigned i = 0; i < proc->vmRegions.get_length(); i++){
+			vm_region_t region = proc->vmRegions.get_at(i);
+			uintptr_t regionEnd = region.base + region.pageCount * PAGE_SIZE_4K;
+
+			if(regionEnd <= base || region.base >= end) continue; // No overlap
+
+			uintptr_t unmapBase = region.base > base ? region.base : base;
+			uintptr_t unmapEnd = regionEnd < end ? regionEnd : end;
+
+			for(uintptr_t virt = unmapBase; virt < unmapEnd; virt += PAGE_SIZE_4K){
+				if(!(addressSpace->pageDirs[PDPT_GET_INDEX(virt)][PAGE_DIR_GET_INDEX(virt)] & PAGE_PRESENT)) continue;
+
+				page_t& page = addressSpace->pageTables[PDPT_GET_INDEX(virt)][PAGE_DIR_GET_INDEX(virt)][PAGE_TABLE_GET_INDEX(virt)];
+				if(page & PAGE_PRESENT && page & PAGE_FRAME){
+					if((region.flags & VMRegionShared) && (page & PAGE_DIRTY)){
+						dirtyPages.add_back({.node = region.node, .index = (region.offset + (virt - region.base)) / PAGE_SIZE_4K, .phys = page & PAGE_FRAME}); // Keep our reference until it has been written back
+					} else {
+						FreePhysicalMemoryBlock(page & PAGE_FRAME); // Only drops our reference to page cache and copy-on-write pages
+					}
+				}
+
+				page = 0;
+				invlpg(virt);
+			}
+
+			proc->vmRegions.remove_at(i--);
+
+			if(region.base < unmapBase){ // Keep what is left below the unmapped range
+				if(region.flags & VMRegionFile) region.node->handleCount++;
+
+				proc->vmRegions.add_back({.base = region.base, .pageCount = (unmapBase - region.base) / PAGE_SIZE_4K, .flags = region.flags, .node = region.node, .offset = region.offset});
+			}
+
+			if(regionEnd > unmapEnd){ // Keep what is left above the unmapped range
+				if(region.flags & VMRegionFile) region.node->handleCount++;
+
+				proc->vmRegions.add_back({.base = unmapEnd, .pageCount = (regionEnd - unmapEnd) / PAGE_SIZE_4K, .flags = region.flags, .node = region.node, .offset = region.offset + (unmapEnd - region.base)});
+			}
+
+			if(region.flags & VMRegionFile){
+				closeNodes.add_back(region.node);
+			}
+		}
+
+		releaseLock(&proc->vmRegionLock);
+
+		// Writing back and closing files may block, so do it without the lock
+		for(DirtyPage& dirty : dirtyPages){
+			fs::PageCache::SyncPage(dirty.node, dirty.index);
+			FreePhysicalMemoryBlock(dirty.phys);
+		}
+
+		for(FsNode* node : closeNodes){
+			fs::Close(node);
+		}
+	}
+
+	vm_region_t* FindRegion(process_t* proc, uintptr_t addr){
+		for(vm_region_t& region : proc->vmRegions){
+			if(addr >= region.base && addr < region.base + region.pageCount * PAGE_SIZE_4K){
+				return &region;
+			}
+		}
+
+		return nullptr;
+	}
+
+	bool HandleDemandPageFault(process_t* proc, uintptr_t addr){
+		if(!proc || addr >= PDPT_SIZE){
+			return false;
+		}
+
+		address_space_t* addressSpace = proc->addressSpace;
+
+		acquireLock(&proc->vmRegionLock);
+
+		vm_region_t* region = FindRegion(proc, addr);
+		if(!region || !(addressSpace->pageDirs[PDPT_GET_INDEX(addr)][PAGE_DIR_GET_INDEX(addr)] & PAGE_PRESENT)){
+			releaseLock(&proc->vmRegionLock);
+			return false;
+		}
+
+		uintptr_t virt = addr & ~(PAGE_SIZE_4K - 1);
+		page_t& page = addressSpace->pageTables[PDPT_GET_INDEX(virt)][PAGE_DIR_GET_INDEX(virt)][PAGE_TABLE_GET_INDEX(virt)];
+
+		if((page & PAGE_DEMAND) && (region->flags & VMRegionFile)){
+			FsNode* node = region->node;
+			uint64_t index = (region->offset + (virt - region->base)) / PAGE_SIZE_4K;
+
+			releaseLock(&proc->vmRegionLock); // Reading the page in may block
+
+			uint64_t phys = fs::PageCache::GetPage(node, index);
+			if(!phys){
+				return false; // Past the end of the file or the read failed
+			}
+
+			acquireLock(&proc->vmRegionLock);
+
+			region = FindRegion(proc, addr);
+			if(!region || region->node != node || (region->offset + (virt - region->base)) / PAGE_SIZE_4K != index || !(page & PAGE_DEMAND)){ // Changed while we were reading
+				releaseLock(&proc->vmRegionLock);
+
+				FreePhysicalMemoryBlock(phys);
+				return true; // Retry the access
+			}
+
+			if(region->flags & VMRegionShared){
+				page = phys | PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER;
+			} else {
+				page = phys | PAGE_PRESENT | PAGE_USER | PAGE_COW; // We get our own copy on the first write
+			}
+			invlpg(virt);
+		} else if(page & PAGE_DEMAND){
+			uint64_t phys = AllocatePhysicalMemoryBlock();
+			page = phys | PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER;
+			invlpg(virt);
+
+			memset((void*)virt, 0, PAGE_SIZE_4K); // Address space of proc is active
+		} else if(!(page & PAGE_PRESENT)){ // Unmapped
+			releaseLock(&proc->vmRegionLock);
+			return false;
+		} // Otherwise another thread got here first
+
+		releaseLock(&proc->vmRegionLock);
+		return true;
+	}
+
+	void CloneAddressSpace(process_t* src, process_t* dest){
+		address_space_t* srcSpace = src->addressSpace;
+		address_space_t* destSpace = dest->addressSpace;
+
+		acquireLock(&src->vmRegionLock);
+
+		for(int i = 0; i < DIRS_PER_PDPT; i++){
+			for(int j = 0; j < TABLES_PER_DIR; j++){
+				pd_entry_t dirEnt = srcSpace->pageDirs[i][j];
+				if(!(dirEnt & PAGE_PRESENT) || (dirEnt & PDE_2M)) continue;
+
+				CreatePageTable(i, j, destSpace);
+
+				page_t* srcTable = srcSpace->pageTables[i][j];
+				page_t* destTable = destSpace->pageTables[i][j];
+				for(int k = 0; k < PAGES_PER_TABLE; k++){
+					page_t& page = srcTable[k];
+					uint64_t phys = page & PAGE_FRAME;
+
+					if((page & PAGE_PRESENT) && phys){
+						uintptr_t virt = i * PAGE_SIZE_1G + j * PAGE_SIZE_2M + k * PAGE_SIZE_4K;
+
+						bool sharedMemory = false; // Shared memory and the framebuffer stay shared
+						for(mem_region_t& region : src->sharedMemory){
+							if(virt >= region.base && virt < region.base + region.pageCount * PAGE_SIZE_4K){
+								sharedMemory = true;
+								break;
+							}
+						}
+
+						vm_region_t* region = FindRegion(src, virt);
+						bool sharedFile = region && (region->flags & VMRegionShared); // Writes go to the page cache in both processes
+
+						if(!sharedMemory){
+							if((page & PAGE_WRITABLE) && !sharedFile){
+								page = (page & ~PAGE_WRITABLE) | PAGE_COW;
+							}
+
+							SharePhysicalMemoryBlock(phys);
+						}
+					}
+
+					destTable[k] = page;
+				}
+			}
+		}
+
+		for(vm_region_t& region : src->vmRegions){
+			if(region.flags & VMRegionFile){
+				region.node->handleCount++;
+			}
+
+			dest->vmRegions.add_back(region);
+		}
+
+		for(mem_region_t& region : src->sharedMemory){
+			if(region.key){
+				ReferenceSharedMemory(region.key); // The child has its own mapping, which keeps the shared memory alive after src unmaps it
+			}
+
+			dest->sharedMemory.add_back(region);
+		}
+
+		releaseLock(&src->vmRegionLock);
+
+		// Other threads of src may be running with the writable mappings in their TLB.
+		// Flushed without the region lock, a CPU faulting in src could be spinning on it with interrupts disabled.
+		// dest cannot run before we return, so it never sees writes made through the stale mappings after this.
+		FlushTLBAllCPUs();
+	}
+
+	bool HandleCopyOnWriteFault(process_t* proc, uintptr_t addr){
+		if(!proc || addr >= PDPT_SIZE){
+			return false;
+		}
+
+		address_space_t* addressSpace = proc->addressSpace;
+
+		acquireLock(&proc->vmRegionLock);
+
+		if(!(addressSpace->pageDirs[PDPT_GET_INDEX(addr)][PAGE_DIR_GET_INDEX(addr)] & PAGE_PRESENT)){
+			releaseLock(&proc->vmRegionLock);
+			return false;
+		}
+
+		uintptr_t virt = addr & ~(PAGE_SIZE_4K - 1);
+		page_t& page = addressSpace->pageTables[PDPT_GET_INDEX(virt)][PAGE_DIR_GET_INDEX(virt)][PAGE_TABLE_GET_INDEX(virt)];
+
+		if(!(page & PAGE_COW)){
+			bool resolved = (page & PAGE_PRESENT) && (page & PAGE_WRITABLE); // Another thread got here first
+
+			releaseLock(&proc->vmRegionLock);
+			return resolved;
+		}
+
+		uint64_t phys = page & PAGE_FRAME;
+		if(IsPhysicalMemoryBlockShared(phys)){
+			uint64_t newPhys = AllocatePhysicalMemoryBlock();
+
+			void* copy = KernelAllocate4KPages(1);
+			KernelMapVirtualMemory4K(newPhys, (uintptr_t)copy, 1);
+			memcpy(copy, (void*)virt, PAGE_SIZE_4K); // Address space of proc is active
+			KernelFree4KPages(copy, 1);
+
+			page = (page & ~(PAGE_FRAME | PAGE_COW)) | newPhys | PAGE_WRITABLE;
+			invlpg(virt);
+
+			FreePhysicalMemoryBlock(phys); // Drop our reference to the shared block
+		} else { // Everyone else has made their own copy
+			page = (page & ~PAGE_COW) | PAGE_WRITABLE;
+			invlpg(virt);
+		}
+
+		releaseLock(&proc->vmRegionLock);
+		return true;
+	}
+
+	void PageFaultHandler(void*, regs64_t* regs, int err_code)
 	{
 		asm("cli");
-		Log::Error("Page Fault!\r\n");
-		Log::SetVideoConsole(nullptr);
-
-		int err_code = IDT::GetErrCode();
 
 		uint64_t faultAddress;
 		asm volatile("movq %%cr2, %0" : "=r" (faultAddress));
 
+		if(!(err_code & 0x1) || (err_code & 0x2)){
+			thread_t* thread = GetCPULocal()->currentThread;
+
+			if(regs->rflags & 0x200){ // Only if the faulting context had interrupts enabled, it may be holding a lock taken with interrupts disabled
+				asm("sti"); // Allocating the page may need to wait on locks
+			}
+
+			if(thread && !(err_code & 0x1) && HandleDemandPageFault(thread->parent, faultAddress)){
+				return; // Page was not present and has now been allocated
+			} else if(thread && (err_code & 0x1) && HandleCopyOnWriteFault(thread->parent, faultAddress)){
+				return; // Write to a shared page, we now have our own copy
+			}
+			asm("cli");
+		}
+
+		Log::Error("Page Fault!\r\n");
+		Log::SetVideoConsole(nullptr);
+
 		int present = !(err_code & 0x1); // Page not present
 		int rw = err_code & 0x2;           // Attempted write to read only page
 		int us = err_code & 0x4;           // Processor was in user-mode and tried to access kernel page
@@ -7,6 +7,7 @@
 #include <apic.h>
 #include <idt.h>
 #include <cpu.h>
+#include <paging.h>
 
 namespace PCI{
 	Vector<PCIDevice>* devices;
@@ -48,7 +49,7 @@ namespace PCI{
 		return data;
 	}
 
-	void ConfigWriteDword(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint16_t data){
+	void ConfigWriteDword(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t data){
 		uint32_t address = (uint32_t)((bus << 16) | (slot << 11) | (func << 8) | (offset & 0xfc) | 0x80000000);
 
 		outportl(0xCF8, address);
@@ -168,8 +169,8 @@ namespace PCI{
 		device.capabilities = new Vector<uint16_t>();
 		if(device.Status() & PCI_STATUS_CAPABILITIES){
 			uint8_t ptr = ConfigReadWord(bus, slot, func, PCICapabilitiesPointer) & 0xFC;
-			uint16_t cap = ConfigReadDword(bus, slot, func, ptr);
-			do {
+			while(ptr){
+				uint32_t cap = ConfigReadDword(bus, slot, func, ptr);
 				//Log::Info("PCI Capability: %x", cap & 0xFF);
 
 				if((cap & 0xFF) == PCICapabilityIDs::PCICapMSI){
@@ -182,13 +183,15 @@ namespace PCI{
 					if(device.msiCap.msiControl & PCI_CAP_MSI_CONTROL_64){ // 64-bit capable
 						device.msiCap.data64 = ConfigReadDword(bus, slot, func, ptr + sizeof(uint32_t) * 3);
 					}
+				} else if((cap & 0xFF) == PCICapabilityIDs::PCICapMSIX){
+					device.msixPtr = ptr;
+					device.msixCapable = true;
 				}
 
-				ptr = (cap >> 8);
-				cap = ConfigReadDword(bus, slot, func, ptr);
-
 				device.capabilities->add_back(cap & 0xFF);
-			} while((cap >> 8));
+
+				ptr = (cap >> 8) & 0xFC;
+			}
 		}
 
 		int ret = devices->get_length();
@@ -280,4 +283,52 @@ uint8_t PCIDevice::AllocateVector(PCIVectors type){
 
 	Log::Error("[PCIDevice] AllocateVector: Could not allocate interrupt (type %i)!", static_cast<int>(type));
 	return 0xFF;
+}
+
+unsigned PCIDevice::MSIXVectorCount(){
+	if(!msixCapable){
+		return 0;
+	}
+
+	return PCI_CAP_MSIX_CONTROL_TABLE_SIZE(PCI::ConfigReadWord(bus, slot, func, msixPtr + sizeof(uint16_t)));
+}
+
+uint8_t PCIDevice::AllocateMSIXVector(unsigned index, uint64_t cpu){
+	if(!msixCapable){
+		Log::Error("[PCIDevice] AllocateMSIXVector: Device not MSI-X capable!");
+		return 0xFF;
+	} else if(index >= MSIXVectorCount()){
+		Log::Error("[PCIDevice] AllocateMSIXVector: Invalid table entry %u!", index);
+		return 0xFF;
+	}
+
+	uint16_t control = PCI::ConfigReadWord(bus, slot, func, msixPtr + sizeof(uint16_t));
+
+	if(!msixTable){
+		uint32_t table = PCI::ConfigReadDword(bus, slot, func, msixPtr + sizeof(uint32_t)); // BAR index and offset of the table
+		msixTable = reinterpret_cast<PCIMSIXTableEntry*>(Memory::GetIOMapping(GetBaseAddressRegister(table & PCI_CAP_MSIX_TABLE_BIR) + (table & ~PCI_CAP_MSIX_TABLE_BIR)));
+
+		// Enable MSI-X with every vector masked, this also disables legacy interrupts and MSIs
+		control |= PCI_CAP_MSIX_CONTROL_ENABLE | PCI_CAP_MSIX_CONTROL_FUNCTION_MASK;
+		PCI::ConfigWriteWord(bus, slot, func, msixPtr + sizeof(uint16_t), control);
+
+		for(unsigned i = 0; i < PCI_CAP_MSIX_CONTROL_TABLE_SIZE(control); i++){
+			msixTable[i].vectorControl |= PCI_MSIX_VECTOR_CONTROL_MASK;
+		}
+	}
+
+	uint8_t interrupt = IDT::ReserveUnusedInterrupt();
+	if(interrupt == 0xFF){
+		Log::Error("[PCIDevice] AllocateMSIXVector: Could not reserve unused interrupt (no free interrupts?)!");
+		return interrupt;
+	}
+
+	msixTable[index].addressLow = PCI_CAP_MSI_ADDRESS_BASE | (static_cast<uint32_t>(cpu) << 12);
+	msixTable[index].addressHigh = 0;
+	msixTable[index].data = ICR_VECTOR(interrupt) | ICR_MESSAGE_TYPE_FIXED;
+	msixTable[index].vectorControl &= ~PCI_MSIX_VECTOR_CONTROL_MASK;
+
+	PCI::ConfigWriteWord(bus, slot, func, msixPtr + sizeof(uint16_t), control & ~PCI_CAP_MSIX_CONTROL_FUNCTION_MASK);
+
+	return interrupt;
 }
\ No newline at end of file
@@ -6,68 +6,302 @@
 #include <logging.h>
 #include <panic.h>
 #include <lock.h>
+#include <assert.h>
+#include <cpu.h>
+#include <timer.h>
+#include <liballoc.h>
+
+// Maximum depth of a free block bitmap (64^4 blocks covers PHYSALLOC_MAX_BLOCKS)
+#define PHYSALLOC_BITMAP_MAX_LEVELS 5
 
 namespace Memory{
-    uint32_t physicalMemoryBitmap[PHYSALLOC_BITMAP_SIZE_DWORDS];
+    // Free blocks of each buddy order are kept in a hierarchical bitmap.
+    // Level 0 has a bit for every block of the order, a set bit in level n + 1 means that the corresponding word in level n is not empty.
+    // This keeps the free lists out of physical memory (which is not necessarily mapped) and lets us find a free block in O(log n).
+    struct FreeBlockBitmap{
+        uint64_t* levels[PHYSALLOC_BITMAP_MAX_LEVELS];
+        unsigned levelCount;
+
+        inline bool Test(uint64_t block) const {
+            return levels[0][block >> 6] & (1ULL << (block & 63));
+        }
+
+        // Mark block as free
+        inline void Set(uint64_t block){
+            for(unsigned i = 0; i < levelCount; i++){
+                uint64_t& word = levels[i][block >> 6];
+                bool wasEmpty = !word;
+
+                word |= (1ULL << (block & 63));
+                if(!wasEmpty) break; // Upper levels already know about this word
+
+                block >>= 6;
+            }
+        }
+
+        // Mark block as used
+        inline void Clear(uint64_t block){
+            for(unsigned i = 0; i < levelCount; i++){
+                uint64_t& word = levels[i][block >> 6];
+
+                word &= ~(1ULL << (block & 63));
+                if(word) break; // Still free blocks in this word
+
+                block >>= 6;
+            }
+        }
+
+        // Returns the first free block or -1 if there are none
+        inline int64_t FindFirst() const {
+            uint64_t index = 0;
+            for(int i = levelCount - 1; i >= 0; i--){
+                uint64_t word = levels[i][index];
+                if(!word) return -1;
+
+                index = (index << 6) + __builtin_ctzll(word);
+            }
+
+            return index;
+        }
+    };
+
+    // Returns the amount of 64-bit words used for the free block bitmaps of every order
+    constexpr uint64_t GetFreeBlockBitmapSize(){
+        uint64_t total = 0;
+        for(unsigned order = 0; order <= PHYSALLOC_MAX_ORDER; order++){
+            uint64_t bits = PHYSALLOC_MAX_BLOCKS >> order;
+            uint64_t words;
+            do {
+                words = (bits + 63) / 64;
+                total += words;
+                bits = words;
+            } while (words > 1);
+        }
+
+        return total;
+    }
 
-    uint64_t usedPhysicalBlocks = PHYSALLOC_BITMAP_SIZE_DWORDS * 32;
-    uint64_t maxPhysicalBlocks = PHYSALLOC_BITMAP_SIZE_DWORDS * 32;
+    uint64_t freeBlockBitmapPool[GetFreeBlockBitmapSize()];
+    FreeBlockBitmap freeBlocks[PHYSALLOC_MAX_ORDER + 1];
+
+    uint64_t usedPhysicalBlocks = 0;
+    uint64_t maxPhysicalBlocks = 0;
 
     lock_t allocatorLock = 0;
 
+    bool frameCachesEnabled = false;
+
+    // Extra references to shared blocks (e.g. copy-on-write pages), a count of 0 means the block has a single owner.
+    // Pages of the table are only allocated once a block in their range is shared.
+    uint32_t* sharedRefCounts[PHYSALLOC_MAX_BLOCKS / PHYSALLOC_REFCOUNTS_PER_PAGE];
+    lock_t sharedRefCountLock = 0;
+
     // Initialize the physical page allocator
     void InitializePhysicalAllocator(memory_info_t* mem_info)
     {
-        memset(physicalMemoryBitmap, 0xFFFFFFFF, PHYSALLOC_BITMAP_SIZE_DWORDS * sizeof(uint32_t));
+        memset(freeBlockBitmapPool, 0, sizeof(freeBlockBitmapPool));
 
-        maxPhysicalBlocks = PHYSALLOC_BITMAP_SIZE_DWORDS;
-        usedPhysicalBlocks = maxPhysicalBlocks;
+        uint64_t* pool = freeBlockBitmapPool;
+        for(unsigned order = 0; order <= PHYSALLOC_MAX_ORDER; order++){
+            FreeBlockBitmap& bitmap = freeBlocks[order];
+            bitmap.levelCount = 0;
+
+            uint64_t bits = PHYSALLOC_MAX_BLOCKS >> order;
+            uint64_t words;
+            do {
+                assert(bitmap.levelCount < PHYSALLOC_BITMAP_MAX_LEVELS);
+
+                words = (bits + 63) / 64;
+                bitmap.levels[bitmap.levelCount++] = pool;
+                pool += words;
+                bits = words;
+            } while (words > 1);
+        }
+
+        // Nothing is usable until the memory map tells us otherwise
+        maxPhysicalBlocks = 0;
+        usedPhysicalBlocks = 0;
     }
 
-    // Sets a bit in the physical memory bitmap
-    inline void bit_set(uint64_t bit) {  
-        physicalMemoryBitmap[bit >> 5] |= (1 << (bit % 32));
+    void EnableFrameCaches(){
+        frameCachesEnabled = true;
     }
 
-    // Clears a bit in the physical memory bitmap
-    inline void bit_clear(uint64_t bit) {
-        physicalMemoryBitmap[bit >> 5] &= ~ (1 << (bit % 32));
+    // Returns the order of the free block containing frame, or -1 if the frame is in use
+    static int GetFreeBlockOrder(uint64_t frame){
+        for(int order = 0; order <= PHYSALLOC_MAX_ORDER; order++){
+            if(freeBlocks[order].Test(frame >> order)){
+                return order;
+            }
+        }
+
+        return -1;
     }
 
-    // Tests a bit in the physical memory bitmap
-    inline bool bit_test(uint64_t bit) {
-        return physicalMemoryBitmap[bit >> 5] & (1 << (bit % 32));
+    // Returns true if none of the frames in the range are free
+    static bool IsRangeAllocated(uint64_t frame, uint64_t count){
+        while(count--){
+            if(GetFreeBlockOrder(frame++) >= 0){
+                return false;
+            }
+        }
+
+        return true;
     }
 
-    // Finds the first free block in physical memory
-    uint64_t GetFirstFreeMemoryBlock() {
-        for (uint32_t i = 0; i < maxPhysicalBlocks / 32; i++)
-            if (physicalMemoryBitmap[i] != 0xffffffff) // If all 32 bits at the index are used then ignore them
-                for (uint32_t j = 0; j < 32; j++) // Test each bit in the dword
-                    if (!(physicalMemoryBitmap[i] & (1 << j)) && (i || j))
-                        return i * 32 + j;
+    // Allocates a block of the given order ending at or below the frame limit, returns its first frame or 0 if there are none
+    static uint64_t AllocateBlock(unsigned order, uint64_t limit = PHYSALLOC_MAX_BLOCKS){
+        for(unsigned i = order; i <= PHYSALLOC_MAX_ORDER; i++){
+            int64_t block = freeBlocks[i].FindFirst(); // Lowest free block of the order, we keep its lowest part when splitting
+            if(block < 0 || (static_cast<uint64_t>(block) << i) + (1ULL << order) > limit){
+                continue;
+            }
+
+            freeBlocks[i].Clear(block);
+
+            while(i > order){ // Split the block, giving the upper half back
+                i--;
+                block <<= 1;
+                freeBlocks[i].Set(block + 1);
+            }
+
+            return block << order;
+        }
 
-        // The first block is always reserved
         return 0;
     }
 
+    // Frees a block of the given order, coalescing with its buddies
+    static void FreeBlock(uint64_t frame, unsigned order){
+        uint64_t block = frame >> order;
+
+        while(order < PHYSALLOC_MAX_ORDER && freeBlocks[order].Test(block ^ 1)){
+            freeBlocks[order].Clear(block ^ 1);
+
+            block >>= 1;
+            order++;
+        }
+
+        freeBlocks[order].Set(block);
+    }
+
+    // Removes a single frame from whichever free block contains it, returns false if it is not free
+    static bool ReserveFrame(uint64_t frame){
+        int order = GetFreeBlockOrder(frame);
+        if(order < 0){
+            return false;
+        }
+
+        freeBlocks[order].Clear(frame >> order);
+
+        while(order > 0){ // Split the block, giving back the half that does not contain the frame
+            order--;
+            freeBlocks[order].Set((frame >> order) ^ 1);
+        }
+
+        return true;
+    }
+
+    // Frees count frames in the largest aligned blocks possible, returns the amount of frames freed
+    static uint64_t FreeRange(uint64_t frame, uint64_t count){
+        uint64_t freed = 0;
+
+        while(count){
+            if(frame + count > PHYSALLOC_MAX_BLOCKS){
+                Log::Warning("[PhysAlloc] Attempted to free untracked block %x", frame * PHYSALLOC_BLOCK_SIZE);
+                break;
+            }
+
+            unsigned order = frame ? __builtin_ctzll(frame) : 0;
+            unsigned countOrder = 63 - __builtin_clzll(count);
+
+            if(order > countOrder) order = countOrder;
+            if(order > PHYSALLOC_MAX_ORDER) order = PHYSALLOC_MAX_ORDER;
+
+            if(order > 0 && !IsRangeAllocated(frame, 1ULL << order)){
+                order = 0; // Part of the range is already free, go frame by frame
+            }
+
+            if(!frame){
+                Log::Warning("[PhysAlloc] Attempted to free the first block"); // Always reserved, an index of 0 means out of memory
+            } else if(!order && GetFreeBlockOrder(frame) >= 0){
+                Log::Warning("[PhysAlloc] Attempted to free block %x which is already free", frame * PHYSALLOC_BLOCK_SIZE);
+            } else {
+                FreeBlock(frame, order);
+                freed += (1ULL << order);
+            }
+
+            frame += (1ULL << order);
+            count -= (1ULL << order);
+        }
+
+        return freed;
+    }
+
     // Marks a region in physical memory as being used
     void MarkMemoryRegionUsed(uint64_t base, size_t size) {
-        for (uint32_t blocks = (size + (PHYSALLOC_BLOCK_SIZE - 1)) / PHYSALLOC_BLOCK_SIZE, align = base / PHYSALLOC_BLOCK_SIZE; blocks > 0; blocks--, usedPhysicalBlocks++)
-            bit_set(align++);
+        uint64_t frame = base / PHYSALLOC_BLOCK_SIZE;
+        uint64_t end = (base + size + (PHYSALLOC_BLOCK_SIZE - 1)) / PHYSALLOC_BLOCK_SIZE;
+
+        if(end > PHYSALLOC_MAX_BLOCKS) end = PHYSALLOC_MAX_BLOCKS;
+
+        acquireLock(&allocatorLock);
+        for(; frame < end; frame++){
+            if(ReserveFrame(frame)){
+                __sync_fetch_and_add(&usedPhysicalBlocks, 1);
+            }
+        }
+        releaseLock(&allocatorLock);
     }
 
-    // Marks a region in physical memory as being free
+    // Marks a region in physical memory as being free, only used for regions of usable memory
     void MarkMemoryRegionFree(uint64_t base, size_t size) {
-        for (uint32_t blocks = (size + (PHYSALLOC_BLOCK_SIZE - 1)) / PHYSALLOC_BLOCK_SIZE, align = base / PHYSALLOC_BLOCK_SIZE; blocks > 0; blocks--, usedPhysicalBlocks--)
-            bit_clear(align++);
+        uint64_t frame = (base + (PHYSALLOC_BLOCK_SIZE - 1)) / PHYSALLOC_BLOCK_SIZE; // Only use whole blocks
+        uint64_t end = (base + size) / PHYSALLOC_BLOCK_SIZE;
+
+        if(!frame) frame = 1; // The first block is always reserved
+        if(end > PHYSALLOC_MAX_BLOCKS) end = PHYSALLOC_MAX_BLOCKS;
+
+        acquireLock(&allocatorLock);
+        for(; frame < end; frame++){
+            if(GetFreeBlockOrder(frame) < 0){ // Memory map entries may overlap
+                FreeBlock(frame, 0);
+                maxPhysicalBlocks++;
+            }
+        }
+        releaseLock(&allocatorLock);
     }
 
     // Allocates a block of physical memory
     uint64_t AllocatePhysicalMemoryBlock() {
-        acquireLock(&allocatorLock);
+        uint64_t index = 0;
+
+        if(frameCachesEnabled){
+            bool intsEnabled = CheckInterrupts();
+            asm("cli"); // Make sure we stay on this CPU
+
+            frame_cache_t& cache = GetCPULocal()->frameCache;
+            if(cache.count){
+                cache.hits++;
+            } else { // Refill from the global allocator
+                cache.misses++;
+
+                acquireLock(&allocatorLock);
+                while(cache.count < PHYSALLOC_FRAME_CACHE_BATCH && (index = AllocateBlock(0))){
+                    cache.frames[cache.count++] = index;
+                }
+                releaseLock(&allocatorLock);
+            }
+
+            index = cache.count ? cache.frames[--cache.count] : 0;
+
+            if(intsEnabled) asm("sti");
+        } else {
+            acquireLock(&allocatorLock);
+            index = AllocateBlock(0);
+            releaseLock(&allocatorLock);
+        }
 
-        uint64_t index = GetFirstFreeMemoryBlock();
         if (!index){
             Log::Error("Out of memory!");
             KernelPanic((const char**)(&"Out of memory!"),1);
@@ -75,8 +309,39 @@ namespace Memory{
             //return 0;
         }
 
-        bit_set(index);
-        usedPhysicalBlocks++;
+        __sync_fetch_and_add(&usedPhysicalBlocks, 1);
+
+        return index * PHYSALLOC_BLOCK_SIZE;
+    }
+
+    // Allocates count physically contiguous blocks of memory
+    uint64_t AllocatePhysicalMemoryBlocks(uint64_t count) {
+        return AllocatePhysicalMemoryBlocks(count, PHYSALLOC_MAX_BLOCKS * PHYSALLOC_BLOCK_SIZE);
+    }
+
+    uint64_t AllocatePhysicalMemoryBlocks(uint64_t count, uint64_t limit) {
+        if(!count){
+            return 0;
+        }
+
+        unsigned order = 0;
+        while((1ULL << order) < count) order++;
+
+        if(order > PHYSALLOC_MAX_ORDER){
+            Log::Warning("[PhysAlloc] Cannot allocate %u contiguous blocks", count);
+            return 0;
+        }
+
+        acquireLock(&allocatorLock);
+
+        uint64_t index = AllocateBlock(order, limit / PHYSALLOC_BLOCK_SIZE);
+        if(!index){
+            releaseLock(&allocatorLock);
+            return 0;
+        }
+
+        FreeRange(index + count, (1ULL << order) - count); // Give back what we do not need
+        __sync_fetch_and_add(&usedPhysicalBlocks, count);
 
         releaseLock(&allocatorLock);
 
@@ -84,46 +349,209 @@ namespace Memory{
     }
 
     // Allocates a block of 2MB physical memory
-    /*uint64_t AllocateLargePhysicalMemoryBlock() {
-        uint64_t index = GetFirstFreeMemoryBlock();
-        uint64_t blockCount = 0x200000
-        uint64_t counter = 0;
-        while(counter < blockCount){
-            if(bit_test(index)){
-                index++;
-                counter = 0;
-                continue;
+    uint64_t AllocateLargePhysicalMemoryBlock() {
+        return AllocatePhysicalMemoryBlocks(1ULL << PHYSALLOC_LARGE_ORDER);
+    }
+
+    // Drops a reference to a shared block, returns false if the caller held the last reference
+    static bool ReleaseSharedReference(uint64_t index){
+        uint32_t* counts = __atomic_load_n(&sharedRefCounts[index / PHYSALLOC_REFCOUNTS_PER_PAGE], __ATOMIC_ACQUIRE);
+        if(!counts){
+            return false;
+        }
+
+        uint32_t* count = &counts[index % PHYSALLOC_REFCOUNTS_PER_PAGE];
+        uint32_t references = *count;
+        while(references){
+            if(__sync_bool_compare_and_swap(count, references, references - 1)){
+                return true;
             }
 
-            index++;
-            counter++;
+            references = *count;
         }
 
-        if (index == 0)
-            return 0;
+        return false;
+    }
+
+    void SharePhysicalMemoryBlock(uint64_t addr){
+        uint64_t index = addr / PHYSALLOC_BLOCK_SIZE;
+        if(!index || index >= PHYSALLOC_MAX_BLOCKS){
+            Log::Warning("[PhysAlloc] Attempted to share untracked block %x", addr);
+            return;
+        }
+
+        uint32_t*& counts = sharedRefCounts[index / PHYSALLOC_REFCOUNTS_PER_PAGE];
+        if(!__atomic_load_n(&counts, __ATOMIC_ACQUIRE)){
+            acquireLock(&sharedRefCountLock);
+            if(!counts){
+                uint32_t* page = (uint32_t*)KernelAllocate4KPages(1);
+                KernelMapVirtualMemory4K(AllocatePhysicalMemoryBlock(), (uintptr_t)page, 1);
+                memset(page, 0, PHYSALLOC_BLOCK_SIZE);
+
+                __atomic_store_n(&counts, page, __ATOMIC_RELEASE);
+            }
+            releaseLock(&sharedRefCountLock);
+        }
+
+        __sync_fetch_and_add(&counts[index % PHYSALLOC_REFCOUNTS_PER_PAGE], 1);
+    }
 
-        uint64_t addr = index * PHYSALLOC_BLOCK_SIZE;
-        
-        while(blockCount--)
-            bit_set(index++);
-        usedPhysicalBlocks += counter;
+    bool IsPhysicalMemoryBlockShared(uint64_t addr){
+        uint64_t index = addr / PHYSALLOC_BLOCK_SIZE;
+        if(index >= PHYSALLOC_MAX_BLOCKS){
+            return false;
+        }
 
-        return addr;
-    }*/
+        uint32_t* counts = __atomic_load_n(&sharedRefCounts[index / PHYSALLOC_REFCOUNTS_PER_PAGE], __ATOMIC_ACQUIRE);
+        return counts && __atomic_load_n(&counts[index % PHYSALLOC_REFCOUNTS_PER_PAGE], __ATOMIC_ACQUIRE);
+    }
 
     // Frees a block of physical memory
     void FreePhysicalMemoryBlock(uint64_t addr) {
         uint64_t index = addr / PHYSALLOC_BLOCK_SIZE;
-        bit_clear(index);
-        usedPhysicalBlocks--;
+        if(index < PHYSALLOC_MAX_BLOCKS && ReleaseSharedReference(index)){
+            return; // Still in use by someone else
+        }
+
+        if(!frameCachesEnabled || !index || index >= PHYSALLOC_MAX_BLOCKS){
+            FreePhysicalMemoryBlocks(addr, 1); // Let the global allocator deal with it
+            return;
+        }
+
+        bool intsEnabled = CheckInterrupts();
+        asm("cli"); // Make sure we stay on this CPU
+
+        frame_cache_t& cache = GetCPULocal()->frameCache;
+        for(unsigned i = 0; i < cache.count; i++){
+            if(cache.frames[i] == index){
+                if(intsEnabled) asm("sti");
+
+                Log::Warning("[PhysAlloc] Attempted to free block %x which is already free", addr);
+                return;
+            }
+        }
+
+        if(cache.count >= PHYSALLOC_FRAME_CACHE_SIZE){ // Give the oldest blocks back to the global allocator
+            cache.drains++;
+
+            acquireLock(&allocatorLock);
+            for(unsigned i = 0; i < PHYSALLOC_FRAME_CACHE_BATCH; i++){
+                FreeRange(cache.frames[i], 1);
+            }
+            releaseLock(&allocatorLock);
+
+            cache.count -= PHYSALLOC_FRAME_CACHE_BATCH;
+            memcpy(cache.frames, cache.frames + PHYSALLOC_FRAME_CACHE_BATCH, cache.count * sizeof(uint64_t));
+        }
+
+        cache.frames[cache.count++] = index;
+        __sync_fetch_and_sub(&usedPhysicalBlocks, 1);
+
+        if(intsEnabled) asm("sti");
     }
 
-    // Frees a block of physical memory
+    // Frees count physically contiguous blocks of memory
+    void FreePhysicalMemoryBlocks(uint64_t addr, uint64_t count) {
+        acquireLock(&allocatorLock);
+
+        __sync_fetch_and_sub(&usedPhysicalBlocks, FreeRange(addr / PHYSALLOC_BLOCK_SIZE, count));
+
+        releaseLock(&allocatorLock);
+    }
+
+    // Frees a 2MB block of physical memory
     void FreeLargePhysicalMemoryBlock(uint64_t addr) {
-        uint64_t index = addr / PHYSALLOC_BLOCK_SIZE;
-        uint64_t blockCount = 0x200000 /* 2MB */ / PHYSALLOC_BLOCK_SIZE;
-        usedPhysicalBlocks-=blockCount;
-        while(blockCount--)
-            bit_clear(index++);
+        FreePhysicalMemoryBlocks(addr, 1ULL << PHYSALLOC_LARGE_ORDER);
+    }
+
+#ifdef PHYSALLOC_BENCHMARK
+    // Appends "name: <ns per block> ns/block (<blocks> blocks)" to buffer
+    static size_t BenchmarkResult(char* buffer, size_t len, size_t size, const char* name, uint64_t elapsedNs, uint64_t blocks){
+        char line[128];
+        char num[24];
+
+        line[0] = 0;
+        strcat(line, name);
+        strcat(line, ": ");
+        strcat(line, itoa(blocks ? elapsedNs / blocks : 0, num, 10));
+        strcat(line, " ns/block (");
+        strcat(line, itoa(blocks, num, 10));
+        strcat(line, " blocks)\n");
+
+        size_t lineLength = strlen(line);
+        if(len + lineLength >= size){
+            return len;
+        }
+
+        strcpy(buffer + len, line);
+        return len + lineLength;
+    }
+
+    size_t RunAllocatorBenchmark(char* buffer, size_t size){
+        size_t len = 0;
+        buffer[0] = 0;
+
+        uint64_t usedBefore = usedPhysicalBlocks;
+        uint64_t* blocks = reinterpret_cast<uint64_t*>(kmalloc(PHYSALLOC_BENCHMARK_BATCH * sizeof(uint64_t)));
+
+        // Allocate and free straight away, mostly served by the frame cache of this CPU
+        uint64_t start = Timer::GetSystemUptimeNs();
+        for(unsigned i = 0; i < PHYSALLOC_BENCHMARK_FRAMES; i++){
+            FreePhysicalMemoryBlock(AllocatePhysicalMemoryBlock());
+        }
+        len = BenchmarkResult(buffer, len, size, "single alloc/free", Timer::GetSystemUptimeNs() - start, PHYSALLOC_BENCHMARK_FRAMES);
+
+        // Hold a batch of frames before freeing them, going through the buddy allocator and coalescing
+        start = Timer::GetSystemUptimeNs();
+        for(unsigned i = 0; i < PHYSALLOC_BENCHMARK_FRAMES / PHYSALLOC_BENCHMARK_BATCH; i++){
+            for(unsigned j = 0; j < PHYSALLOC_BENCHMARK_BATCH; j++){
+                blocks[j] = AllocatePhysicalMemoryBlock();
+            }
+
+            for(unsigned j = 0; j < PHYSALLOC_BENCHMARK_BATCH; j++){
+                FreePhysicalMemoryBlock(blocks[j]);
+            }
+        }
+        len = BenchmarkResult(buffer, len, size, "batched alloc/free", Timer::GetSystemUptimeNs() - start, PHYSALLOC_BENCHMARK_FRAMES);
+
+        // Contiguous 64KB ranges, each counted as the 16 blocks it covers
+        uint64_t contiguous = 0;
+        start = Timer::GetSystemUptimeNs();
+        for(unsigned i = 0; i < PHYSALLOC_BENCHMARK_FRAMES / 16; i++){
+            uint64_t addr = AllocatePhysicalMemoryBlocks(16);
+            if(!addr){
+                break;
+            }
+
+            FreePhysicalMemoryBlocks(addr, 16);
+            contiguous += 16;
+        }
+        len = BenchmarkResult(buffer, len, size, "contiguous 64KB alloc/free", Timer::GetSystemUptimeNs() - start, contiguous);
+
+        // 2MB blocks, may run out early if memory is fragmented
+        uint64_t large = 0;
+        start = Timer::GetSystemUptimeNs();
+        for(unsigned i = 0; i < PHYSALLOC_BENCHMARK_FRAMES >> PHYSALLOC_LARGE_ORDER; i++){
+            uint64_t addr = AllocateLargePhysicalMemoryBlock();
+            if(!addr){
+                break;
+            }
+
+            FreeLargePhysicalMemoryBlock(addr);
+            large += 1ULL << PHYSALLOC_LARGE_ORDER;
+        }
+        len = BenchmarkResult(buffer, len, size, "2MB alloc/free", Timer::GetSystemUptimeNs() - start, large);
+
+        kfree(blocks);
+
+        // Other CPUs keep allocating while we run, so a leak only shows up reliably on an otherwise idle system
+        const char* accounting = usedPhysicalBlocks == usedBefore ? "accounting: exact\n" : "accounting: used blocks changed during the run\n";
+        if(len + strlen(accounting) < size){
+            strcpy(buffer + len, accounting);
+            len += strlen(accounting);
+        }
+
+        return len;
     }
+#endif
 }
\ No newline at end of file
@@ -17,8 +17,8 @@
 #include <smp.h>
 #include <apic.h>
 #include <timer.h>
+#include <slab.h>
 
-#define INITIAL_HANDLE_TABLE_SIZE 0xFFFF
 
 extern "C" [[noreturn]] void TaskSwitch(regs64_t* r, uint64_t pml4);
 
@@ -27,6 +27,19 @@ void IdleProc();
 
 void KernelProcess();
 
+static_assert(sizeof(thread_t) <= SLAB_MAX_OBJECT_SIZE, "thread_t is too large for an object cache");
+static ObjectCache threadCache("thread", sizeof(thread_t));
+
+void* thread::operator new(size_t size){
+    assert(size == sizeof(thread_t));
+
+    return threadCache.Allocate();
+}
+
+void thread::operator delete(void* thread){
+    threadCache.Free(thread);
+}
+
 namespace Scheduler{
     int schedulerLock = 0;
     bool schedulerReady = false;
@@ -35,11 +48,21 @@ namespace Scheduler{
     unsigned processTableSize = 512;
     uint64_t nextPID = 1;
 
-    handle_t handles[INITIAL_HANDLE_TABLE_SIZE];
-    uint64_t handleCount = 1; // We don't want null handles
-    uint32_t handleTableSize = INITIAL_HANDLE_TABLE_SIZE;
-    
     void Schedule(void*, regs64_t* r);
+
+    // Weight of each priority level (from the nice values of the level), each level gets around three times the CPU time of the level below
+    static const uint32_t priorityWeights[THREAD_PRIORITY_MIN + 1] = {88761, 29154, 9548, 3121, 1024, 335, 110, 36};
+
+    // Place a thread being woken behind the other threads of cpu by at most credit.
+    // Threads woken by input always get the full credit, even if they have been running more than other threads.
+    static inline void PlaceWokenThread(CPU* cpu, thread_t* thread, bool input){
+        uint64_t credit = input ? SCHEDULER_INPUT_CREDIT : SCHEDULER_WAKEUP_CREDIT;
+        uint64_t vruntime = cpu->minVruntime > credit ? cpu->minVruntime - credit : 0;
+
+        if(input || thread->vruntime < vruntime){
+            thread->vruntime = vruntime;
+        }
+    }
     
     inline void InsertThreadIntoQueue(thread_t* thread){
         GetCPULocal()->runQueue->add_back(thread);
@@ -49,6 +72,13 @@ namespace Scheduler{
         GetCPULocal()->runQueue->remove(thread);
     }
     
+    // Idle CPUs stop ticking, so they have to be told when a thread is put in their run queue
+    static inline void WakeCPU(CPU* cpu){
+        if(schedulerReady && cpu != GetCPULocal() && cpu->currentThread && cpu->currentThread->parent == cpu->idleProcess){
+            APIC::Local::SendIPI(cpu->id, ICR_DSH_DEST, ICR_MESSAGE_TYPE_FIXED, IPI_SCHEDULE);
+        }
+    }
+
     void InsertNewThreadIntoQueue(thread_t* thread){
         CPU* cpu = SMP::cpus[0];
         for(unsigned i = 1; i < SMP::processorCount; i++){
@@ -63,17 +93,153 @@ namespace Scheduler{
 
         //Log::Info("Inserting thread into run queue of CPU %d", cpu->id);
 
-        asm("sti");
+        asm("cli"); // Threads may be woken from interrupt handlers, so never hold a run queue lock with interrupts enabled
         acquireLock(&cpu->runQueueLock);
-        asm("cli");
         cpu->runQueue->add_back(thread);
+        thread->vruntime = cpu->minVruntime; // Don't let new threads run ahead of existing threads
+        thread->cpu = cpu;
+        thread->queued = true;
         releaseLock(&cpu->runQueueLock);
+
+        WakeCPU(cpu);
         asm("sti");
     }
 
-    void Initialize() {
-        memset(handles, 0, handleTableSize);
+    // Killed threads keep running while they are in the kernel, so they can release anything they hold on the way out.
+    // Once back in user mode they are never run again.
+    static inline bool CanRun(thread_t* thread){
+        return thread->state == ThreadStateRunning || (thread->state == ThreadStateZombie && !(thread->registers.cs & 0x3));
+    }
+
+    // Put a thread Schedule has taken off the run queue back in the run queue of the CPU it last ran on.
+    // The state lock must be held with interrupts disabled.
+    static void RequeueThread(thread_t* thread, bool input){
+        CPU* cpu = thread->cpu ? thread->cpu : GetCPULocal();
+
+        acquireLock(&cpu->runQueueLock);
+        PlaceWokenThread(cpu, thread, input);
+        cpu->runQueue->add_back(thread);
+        thread->cpu = cpu;
+        thread->queued = true;
+
+        // Preempt the running thread on the next tick if the woken thread is far enough ahead of it
+        thread_t* current = cpu->currentThread;
+        if(current && (current->parent == cpu->idleProcess || thread->vruntime + SCHEDULER_WAKEUP_GRANULARITY < current->vruntime)){
+            current->timeSlice = 0;
+        }
+        releaseLock(&cpu->runQueueLock);
+
+        WakeCPU(cpu);
+    }
+
+    // Mark thread as killed, a blocked thread is woken so it can leave the kernel
+    static void KillThread(thread_t* thread){
+        bool intsEnabled = CheckInterrupts();
+        asm("cli");
+        acquireLock(&thread->stateLock);
+
+        bool blocked = thread->state == ThreadStateBlocked;
+        thread->state = ThreadStateZombie;
+
+        if(blocked && !thread->queued){
+            RequeueThread(thread, false);
+        }
+
+        releaseLock(&thread->stateLock);
+        if(intsEnabled) asm("sti");
+    }
+
+    // Remove thread from the run queue of cpu if it can no longer run, the run queue lock must be held.
+    // The state lock is only try-locked as threads being woken have it held while taking a run queue lock.
+    static bool DequeueIfBlocked(CPU* cpu, thread_t* thread){
+        if(thread->state == ThreadStateRunning || acquireTestLock(&thread->stateLock)){
+            return false;
+        }
+
+        bool blocked = !CanRun(thread);
+        if(blocked){
+            cpu->runQueue->remove(thread);
+            thread->queued = false;
+        }
+
+        releaseLock(&thread->stateLock);
+        return blocked;
+    }
+
+    // Threads are only migrated when they were preempted in user mode as kernel code may be holding on to CPU local data.
+    // The thread last switched away from is skipped as the CPU may still be using its kernel stack.
+    static inline bool CanMigrateThread(CPU* cpu, thread_t* thread){
+        return thread != cpu->currentThread && thread != cpu->previousThread && thread->state == ThreadStateRunning
+            && (thread->registers.cs & 0x3) && thread->parent != cpu->idleProcess;
+    }
+
+    // Amount of threads in the run queue of cpu ready to run, the run queue lock must be held
+    static unsigned GetRunnableThreadCount(CPU* cpu){
+        unsigned count = 0;
+
+        thread_t* thread = cpu->runQueue->front;
+        for(unsigned i = 0; i < cpu->runQueue->get_length(); i++, thread = thread->next){
+            if(thread->state == ThreadStateRunning && thread->parent != cpu->idleProcess){
+                count++;
+            }
+        }
+
+        return count;
+    }
+
+    // Move a thread from the busiest CPU into the run queue of cpu, the run queue lock of cpu must be held.
+    // When idle we take a thread from any CPU with more than one, otherwise only if it evens out the load.
+    // Other run queues are only ever try-locked so CPUs balancing at the same time cannot deadlock.
+    static thread_t* PullThread(CPU* cpu, bool idle){
+        unsigned load = idle ? 0 : GetRunnableThreadCount(cpu);
+
+        CPU* busiest = nullptr;
+        unsigned busiestLoad = load + 2; // Pulling must leave the other CPU with at least as many threads as us
+        for(unsigned i = 0; i < SMP::processorCount; i++){
+            CPU* other = SMP::cpus[i];
+            if(other == cpu || acquireTestLock(&other->runQueueLock)){
+                continue;
+            }
+
+            unsigned otherLoad = GetRunnableThreadCount(other);
+            releaseLock(&other->runQueueLock);
+
+            if(otherLoad >= busiestLoad){
+                busiest = other;
+                busiestLoad = otherLoad;
+            }
+        }
+
+        if(!busiest || acquireTestLock(&busiest->runQueueLock)){
+            return nullptr;
+        }
+
+        thread_t* thread = busiest->runQueue->front;
+        for(unsigned i = 0; i < busiest->runQueue->get_length(); i++, thread = thread->next){
+            if(CanMigrateThread(busiest, thread)){
+                break;
+            }
+        }
+
+        if(!busiest->runQueue->get_length() || !CanMigrateThread(busiest, thread)){
+            releaseLock(&busiest->runQueueLock);
+            return nullptr;
+        }
+
+        busiest->runQueue->remove(thread);
+        releaseLock(&busiest->runQueueLock);
+
+        // Keep the thread's vruntime relative to the other threads in the run queue
+        thread->vruntime = thread->vruntime > busiest->minVruntime ? cpu->minVruntime + (thread->vruntime - busiest->minVruntime) : cpu->minVruntime;
+        thread->timeSlice = thread->timeSliceDefault;
+        thread->cpu = cpu;
+        cpu->runQueue->add_back(thread);
+        cpu->migrations++;
+
+        return thread;
+    }
 
+    void Initialize() {
         processes = new List<process_t*>();
 
         CPU* cpu = GetCPULocal();
@@ -112,20 +278,16 @@ namespace Scheduler{
         return ret;
     }
 
-    handle_t RegisterHandle(void* pointer){
-        handle_t handle = (handle_t)(handleCount++);
-        handles[(uint64_t)handle] = pointer;
+    handle_t RegisterHandle(process_t* process, void* pointer){
+        return process->handles.Register(pointer);
+    }
 
-        return handle;
+    void* FindHandle(process_t* process, handle_t handle){
+        return process->handles.Find(handle);
     }
 
-    void* FindHandle(handle_t handle){
-        if((uintptr_t)handle < handleTableSize || !handle)
-            return handles[(uint64_t)handle];
-        else {
-            //Log::Warning("Invalid Handle: %x, Process: %d", (uintptr_t)handle, (unsigned long)(currentProcess ? currentProcess->pid : -1));
-            return nullptr;
-        }
+    void* DestroyHandle(process_t* process, handle_t handle){
+        return process->handles.Destroy(handle);
     }
 
     process_t* FindProcessByPID(uint64_t pid){
@@ -224,7 +386,7 @@ namespace Scheduler{
         thread_t* thread = proc->threads[0];
 
         thread->stack = 0;
-        thread->priority = 1;
+        thread->priority = THREAD_PRIORITY_KERNEL;
         thread->timeSliceDefault = 1;
         thread->timeSlice = thread->timeSliceDefault;
         thread->fsBase = 0;
@@ -322,13 +484,69 @@ namespace Scheduler{
         thread.registers.ss = process->threads[0]->registers.ss;
         thread.timeSliceDefault = THREAD_TIMESLICE_DEFAULT;
         thread.timeSlice = thread.timeSliceDefault;
-        thread.priority = 4;
+        thread.priority = process->threads[0]->priority;
 
         InsertNewThreadIntoQueue(&thread);
 
         return threadID;
     }
 
+    process_t* ForkProcess(process_t* process, regs64_t* r){
+        process_t* proc = InitializeProcessStructure();
+        if(!proc){
+            return nullptr;
+        }
+
+        thread_t* current = GetCPULocal()->currentThread;
+        thread_t* thread = proc->threads[0];
+
+        for(unsigned i = 0; i < proc->fileDescriptors.get_length(); i++){
+            fs::Close(proc->fileDescriptors[i]); // Replace the default descriptors with those of process
+        }
+        proc->fileDescriptors.clear();
+
+        for(unsigned i = 0; i < process->fileDescriptors.get_length(); i++){
+            fs_fd_t* handle = process->fileDescriptors[i];
+            fs_fd_t* newHandle = nullptr;
+
+            if(handle){
+                newHandle = new fs_fd_t;
+                *newHandle = *handle;
+                newHandle->node->handleCount++;
+            }
+
+            proc->fileDescriptors.add_back(newHandle);
+        }
+
+        Memory::CloneAddressSpace(process, proc); // Memory is only copied when either process writes to it
+
+        strncpy(proc->name, process->name, NAME_MAX);
+        strncpy(proc->workingDir, process->workingDir, PATH_MAX);
+        proc->uid = process->uid;
+        proc->gid = process->gid;
+
+        proc->parent = process;
+        process->children.add_back(proc);
+
+        // Only the calling thread is duplicated, it returns from the syscall in both processes
+        thread->registers = *r;
+        thread->registers.rax = 0; // Child gets 0 from fork
+        thread->stack = current->stack;
+        thread->stackLimit = current->stackLimit;
+        thread->fsBase = current->fsBase;
+        thread->timeSliceDefault = current->timeSliceDefault;
+        thread->timeSlice = thread->timeSliceDefault;
+        thread->priority = current->priority;
+
+        asm volatile ("fxsave64 (%0)" :: "r"((uintptr_t)thread->fxState) : "memory"); // Extended register state of the calling thread
+
+        processes->add_back(proc);
+
+        InsertNewThreadIntoQueue(thread);
+
+        return proc;
+    }
+
     void EndProcess(process_t* process){
         asm("sti");
         while(process->children.get_length())
@@ -338,7 +556,7 @@ namespace Scheduler{
         for(unsigned i = 0; i < process->threads.get_length(); i++){
             thread_t* thread = process->threads[i];
             if(thread != cpu->currentThread && thread){
-                thread->state = ThreadStateZombie;
+                KillThread(thread); // Blocked threads are woken so they can leave their syscall
                 acquireLock(&thread->lock); // Make sure we acquire a lock on all threads to ensure that they are not in a syscall and are not retaining a lock
             }
         }
@@ -362,7 +580,9 @@ namespace Scheduler{
             
             process->threads[i]->waiting.clear();
 
-            thread->state = ThreadStateBlocked;
+            if(thread != cpu->currentThread){
+                thread->state = ThreadStateZombie; // Never scheduled or woken again
+            }
             thread->timeSlice = thread->timeSliceDefault = 0;
         }
 
@@ -372,14 +592,24 @@ namespace Scheduler{
             }
         }
 
-        acquireLock(&cpu->runQueueLock);
+        process->handles.Clear(); // process is freed with kfree so the destructor never runs
+
+        while(process->vmRegions.get_length()){ // Write back shared file mappings and release mapped files
+            vm_region_t region = process->vmRegions.get_front();
+            Memory::UnmapRegion(process, region.base, region.pageCount);
+        }
+
         asm("cli");
+        acquireLock(&cpu->runQueueLock);
 
         for(unsigned j = 0; j < cpu->runQueue->get_length(); j++){
-            if(cpu->runQueue->get_at(j)->parent == process) cpu->runQueue->remove_at(j);
+            if(cpu->runQueue->get_at(j)->parent == process) cpu->runQueue->remove_at(j--)->queued = false;
         }
 
         process->fileDescriptors.clear();
+
+        // Only hold one run queue lock at a time, another CPU ending a process at the same time could be waiting on ours
+        releaseLock(&cpu->runQueueLock);
         
         for(unsigned i = 0; i < SMP::processorCount; i++){
             if(i == cpu->id) continue; // Is current processor?
@@ -388,9 +618,7 @@ namespace Scheduler{
                 SMP::cpus[i]->currentThread = nullptr;
             }
 
-            asm("sti");
-            //acquireLock(&SMP::cpus[i]->runQueueLock);
-            asm("cli");
+            acquireLock(&SMP::cpus[i]->runQueueLock); // Interrupts are disabled, threads are woken from interrupt handlers
             
             for(unsigned j = 0; j < SMP::cpus[i]->runQueue->get_length(); j++){
                 thread_t* thread = SMP::cpus[i]->runQueue->get_at(j);
@@ -399,16 +627,20 @@ namespace Scheduler{
 
                 if(thread->parent == process){
                     SMP::cpus[i]->runQueue->remove(thread);
+                    thread->queued = false;
+                    j--;
                 }
             }
             
-            //releaseLock(&SMP::cpus[i]->runQueueLock);
+            releaseLock(&SMP::cpus[i]->runQueueLock);
 
             if(SMP::cpus[i]->currentThread == nullptr){
                 APIC::Local::SendIPI(i, 0, ICR_MESSAGE_TYPE_FIXED, IPI_SCHEDULE);
             }
         }
 
+        acquireLock(&cpu->runQueueLock);
+
         if(cpu->currentThread->parent == process){
             asm volatile("mov %%rax, %%cr3" :: "a"(((uint64_t)Memory::kernelPML4) - KERNEL_VIRTUAL_BASE)); // If we are using the PML4 of the current process switch to the kernel's
         }
@@ -418,6 +650,7 @@ namespace Scheduler{
         }
 
         Memory::DestroyAddressSpace(process->addressSpace);
+        process->vmRegions.clear();
 
         for(unsigned i = 0; i < process->threadCount; i++){
             process->threads[i]->waiting.~List();
@@ -441,33 +674,123 @@ namespace Scheduler{
         asm("sti");
     }
 
+    // Block until woken, lock must be held with interrupts disabled and is held again on return.
+    // The state lock is also taken by the timer interrupt, which is why interrupts have to stay disabled until we yield.
+    bool BlockCurrentThreadOnce(lock_t* volatile& lock, bool intsEnabled, uint64_t deadline, bool killable){
+        thread_t* thread = GetCPULocal()->currentThread;
+        assert(!CheckInterrupts());
+
+        if(killable && thread->state == ThreadStateZombie){
+            return false;
+        }
+
+        if(!intsEnabled){ // Cannot block, keep polling
+            if(deadline && Timer::GetSystemUptimeNs() >= deadline){
+                return false;
+            }
+
+            releaseLock(lock);
+            asm("pause");
+            acquireLock(lock);
+            return true;
+        }
+
+        // A killed thread runs until it leaves the kernel. If the wait cannot be given up,
+        // e.g. a DMA transfer may still be using its stack, it keeps checking the condition without blocking.
+        acquireLock(&thread->stateLock);
+        if(thread->state == ThreadStateZombie){
+            releaseLock(&thread->stateLock);
+
+            if(killable){
+                return false;
+            }
+        } else {
+            thread->state = ThreadStateBlocked;
+            releaseLock(&thread->stateLock);
+        }
+
+        // Checked after blocking, so the wakeup cannot be lost if the deadline passes right now
+        if(deadline && Timer::GetSystemUptimeNs() >= deadline){
+            acquireLock(&thread->stateLock);
+            if(thread->state == ThreadStateBlocked){
+                thread->state = ThreadStateRunning;
+            }
+            releaseLock(&thread->stateLock);
+            return false;
+        }
+
+        releaseLock(lock);
+        asm("sti");
+
+        Yield();
+
+        asm("cli");
+        for(;;){ // Lock the current lock, it may have been changed while we were blocked
+            lock_t* current = lock;
+            acquireLock(current);
+
+            if(current == lock){
+                break;
+            }
+
+            releaseLock(current);
+        }
+
+        return true;
+    }
+
+    void AddCurrentThreadWakeup(uint64_t deadline){
+        Timer::AddWakeup(GetCPULocal()->currentThread, deadline);
+    }
+
+    void RemoveCurrentThreadWakeup(){
+        Timer::RemoveWakeup(GetCPULocal()->currentThread);
+    }
+
+    // Blocked threads stay in the run queue until Schedule switches away from them, Schedule then removes them.
+    // UnblockThread puts them back in the run queue of the CPU they last ran on.
+    // Killed threads return straight away so they can leave the kernel, callers check for ThreadStateZombie.
 	void BlockCurrentThread(List<thread_t*>& list, lock_t& lock){
-        CPU* cpu = GetCPULocal();
+        thread_t* thread = GetCPULocal()->currentThread;
 
+        bool intsEnabled = CheckInterrupts();
+        asm("cli"); // The state lock is also taken by interrupt handlers waking threads
         acquireLock(&lock);
-        acquireLock(&cpu->runQueueLock);
-        releaseLock(&cpu->currentThread->lock);
-        list.add_back(cpu->currentThread);
-        cpu->currentThread->state = ThreadStateBlocked;
+        releaseLock(&thread->lock);
+        acquireLock(&thread->stateLock);
+        bool killed = thread->state == ThreadStateZombie;
+        if(!killed){
+            list.add_back(thread);
+            thread->state = ThreadStateBlocked;
+        }
+        releaseLock(&thread->stateLock);
         releaseLock(&lock);
-        releaseLock(&cpu->runQueueLock);
+        if(intsEnabled) asm("sti");
 
-        Yield();
+        if(!killed){
+            Yield();
+        }
     }
 
 	void BlockCurrentThread(ThreadBlocker& blocker, lock_t& lock){
-        CPU* cpu = GetCPULocal();
+        thread_t* thread = GetCPULocal()->currentThread;
 
+        bool intsEnabled = CheckInterrupts();
+        asm("cli");
         acquireLock(&lock);
-        acquireLock(&cpu->currentThread->stateLock);
-        acquireLock(&cpu->runQueueLock);
-        blocker.Block(cpu->currentThread);
-        cpu->currentThread->state = ThreadStateBlocked;
-        releaseLock(&cpu->currentThread->stateLock);
+        acquireLock(&thread->stateLock);
+        bool killed = thread->state == ThreadStateZombie;
+        if(!killed){
+            blocker.Block(thread);
+            thread->state = ThreadStateBlocked;
+        }
+        releaseLock(&thread->stateLock);
         releaseLock(&lock);
-        releaseLock(&cpu->runQueueLock);
+        if(intsEnabled) asm("sti");
 
-        Yield();
+        if(!killed){
+            Yield();
+        }
     }
 
 	void BlockCurrentThread(ThreadBlocker& blocker){
@@ -480,20 +803,43 @@ namespace Scheduler{
         BlockCurrentThread(list, none);
     }
     
-	void UnblockThread(thread_t* thread){
+	void UnblockThread(thread_t* thread, bool input){
+        bool intsEnabled = CheckInterrupts();
+        asm("cli");
         acquireLock(&thread->stateLock);
-        thread->state = ThreadStateRunning;
+
+        if(thread->state == ThreadStateBlocked){
+            thread->state = ThreadStateRunning;
+
+            if(!thread->queued){ // Schedule has already taken the thread off the run queue
+                RequeueThread(thread, input);
+            }
+        }
+
         releaseLock(&thread->stateLock);
+        if(intsEnabled) asm("sti");
 
         /*for(List<thread_t*>* l : thread->waiting){
             l->remove(thread);
         }*/
     }
 
+    void SetProcessPriority(process_t* process, uint8_t priority){
+        if(priority > THREAD_PRIORITY_MIN){
+            priority = THREAD_PRIORITY_MIN;
+        }
+
+        for(unsigned i = 0; i < process->threads.get_length(); i++){
+            process->threads[i]->priority = priority; // Takes effect the next time Schedule accounts the thread's vruntime
+        }
+    }
+
     void Tick(regs64_t* r){
         if(!schedulerReady) return;
 
-        APIC::Local::SendIPI(0, ICR_DSH_OTHER, ICR_MESSAGE_TYPE_FIXED, IPI_SCHEDULE);
+        if(!Timer::ClockEventsEnabled()){ // Otherwise every CPU has its own timer
+            APIC::Local::SendIPI(0, ICR_DSH_OTHER, ICR_MESSAGE_TYPE_FIXED, IPI_SCHEDULE);
+        }
 
         Schedule(nullptr, r);
     }
@@ -503,6 +849,14 @@ namespace Scheduler{
 
         if(cpu->currentThread) {
             cpu->currentThread->parent->activeTicks++;
+
+            if(cpu->currentThread->parent == cpu->idleProcess){
+                cpu->idleTicks++;
+            } else {
+                cpu->busyTicks++;
+                cpu->currentThread->vruntime += SCHEDULER_VRUNTIME_TICK * priorityWeights[THREAD_PRIORITY_DEFAULT] / priorityWeights[cpu->currentThread->priority];
+            }
+
             if(cpu->currentThread->timeSlice > 0) {
                 cpu->currentThread->timeSlice--;
                 return;
@@ -513,38 +867,85 @@ namespace Scheduler{
             return;
         }
 
-        if (__builtin_expect(cpu->runQueue->get_length() <= 0 || !cpu->runQueue->front, 0)){
-            cpu->currentThread = cpu->idleProcess->threads[0];
-        } else if(__builtin_expect(cpu->currentThread && cpu->currentThread->parent != cpu->idleProcess, 1)){
-            cpu->currentThread->timeSlice = cpu->currentThread->timeSliceDefault;
+        cpu->previousThread = cpu->currentThread;
 
-            asm volatile ("fxsave64 (%0)" :: "r"((uintptr_t)cpu->currentThread->fxState) : "memory");
+        if(__builtin_expect(++cpu->balanceTicks >= SCHEDULER_BALANCE_INTERVAL, 0)){
+            cpu->balanceTicks = 0;
+            PullThread(cpu, false);
+        }
 
-            cpu->currentThread->registers = *r;
+        thread_t* next = nullptr;
+        if(__builtin_expect(cpu->currentThread && cpu->currentThread->parent != cpu->idleProcess, 1)){
+            thread_t* current = cpu->currentThread;
+            current->timeSlice = current->timeSliceDefault;
 
-            cpu->currentThread = cpu->currentThread->next;
-        } else {
-            cpu->currentThread = cpu->runQueue->front;
+            asm volatile ("fxsave64 (%0)" :: "r"((uintptr_t)current->fxState) : "memory");
+
+            current->registers = *r;
+
+            if(current->queued){
+                next = current->next;
+
+                if(DequeueIfBlocked(cpu, current) && next == current){
+                    next = nullptr; // It was the only thread in the queue
+                }
+            }
         }
-            
-        if(cpu->currentThread->state == ThreadStateBlocked){
-            thread_t* first = cpu->currentThread;
 
-            do {
-                cpu->currentThread = cpu->currentThread->next;
-            } while(cpu->currentThread->state == ThreadStateBlocked && cpu->currentThread != first);
+        if(!next){
+            next = cpu->runQueue->front;
+        }
 
-            if(cpu->currentThread->state == ThreadStateBlocked){
-                cpu->currentThread = cpu->idleProcess->threads[0];
+        // Run the thread with the lowest vruntime, starting after the current thread so threads with equal vruntime take turns.
+        // The current thread has used up its time slice or yielded, so it only keeps running if nothing else can.
+        // Blocked threads are only ever passed over once before being removed from the queue,
+        // so this is proportional to the amount of runnable threads
+        thread_t* best = nullptr;
+        bool currentRunnable = false;
+        for(unsigned i = cpu->runQueue->get_length(); i && next; i--){
+            thread_t* following = next->next;
+
+            if(!DequeueIfBlocked(cpu, next) && CanRun(next)){
+                if(next == cpu->previousThread){
+                    currentRunnable = true;
+                } else if(!best || next->vruntime < best->vruntime){
+                    best = next;
+                }
+            }
+
+            next = cpu->runQueue->get_length() ? following : nullptr;
+        }
+
+        if(!best && currentRunnable){
+            best = cpu->previousThread;
+        }
+
+        if(best){
+            cpu->currentThread = best;
+
+            if(best->vruntime > cpu->minVruntime){
+                cpu->minVruntime = best->vruntime;
+            }
+        } else {
+            cpu->currentThread = cpu->idleProcess->threads[0];
+        }
+
+        if(cpu->currentThread == cpu->idleProcess->threads[0]){ // Nothing to run, try to take work from another CPU
+            if(thread_t* thread = PullThread(cpu, true)){
+                cpu->currentThread = thread;
             }
         }
 
         releaseLock(&cpu->runQueueLock);
+
+        Timer::SetNextEvent(cpu->currentThread == cpu->idleProcess->threads[0]);
+
         asm volatile ("fxrstor64 (%0)" :: "r"((uintptr_t)cpu->currentThread->fxState) : "memory");
 
 	    asm volatile ("wrmsr" :: "a"(cpu->currentThread->fsBase & 0xFFFFFFFF) /*Value low*/, "d"((cpu->currentThread->fsBase >> 32) & 0xFFFFFFFF) /*Value high*/, "c"(0xC0000100) /*Set FS Base*/);
         
         TSS::SetKernelStack(&cpu->tss, (uintptr_t)cpu->currentThread->kernelStack);
+        cpu->syscallKernelStack = (uintptr_t)cpu->currentThread->kernelStack;
 
         TaskSwitch(&cpu->currentThread->registers, cpu->currentThread->parent->addressSpace->pml4Phys);
     }
@@ -556,11 +957,11 @@ namespace Scheduler{
         process_t* proc = InitializeProcessStructure();
 
         thread_t* thread = proc->threads[0];
-        thread->registers.cs = 0x1B; // We want user mode so use user mode segments, make sure RPL is 3
-        thread->registers.ss = 0x23;
+        thread->registers.cs = 0x23; // We want user mode so use user mode segments, make sure RPL is 3
+        thread->registers.ss = 0x1B;
         thread->timeSliceDefault = THREAD_TIMESLICE_DEFAULT;
         thread->timeSlice = thread->timeSliceDefault;
-        thread->priority = 4;
+        thread->priority = THREAD_PRIORITY_DEFAULT;
 
         Memory::MapVirtualMemory4K(Memory::AllocatePhysicalMemoryBlock(),0,1,proc->addressSpace);
 
@@ -595,13 +996,27 @@ namespace Scheduler{
         char** tempArgv = (char**)kmalloc(argc * sizeof(char*));
         char** tempEnvp = (char**)kmalloc((envc) * sizeof(char*));
 
+        uint64_t argumentSize = (argc + envc + 16) * sizeof(uint64_t) + sizeof(auxv_t) * 4; // Pointers, auxiliary vector and alignment
+        for(int i = 0; i < argc; i++){
+            argumentSize += strlen(argv[i]) + 1;
+        }
+
+        for(int i = 0; envp && i < envc; i++){
+            argumentSize += strlen(envp[i]) + 1;
+        }
+
+        uint64_t argumentPages = (argumentSize + PAGE_SIZE_4K - 1) / PAGE_SIZE_4K;
+        assert(argumentPages <= 64);
+
         asm("cli");
         asm volatile("mov %%rax, %%cr3" :: "a"(proc->addressSpace->pml4Phys));
         void* _stack = (void*)Memory::Allocate4KPages(64, proc->addressSpace);
-        for(int i = 0; i < 64; i++){
-            Memory::MapVirtualMemory4K(Memory::AllocatePhysicalMemoryBlock(),(uintptr_t)_stack + PAGE_SIZE_4K * i, 1, proc->addressSpace);
+        bool mapped = Memory::MapAnonymousRegion(proc, (uintptr_t)_stack, 64); // Stack pages are allocated and zeroed on first access
+        assert(mapped);
+
+        for(uint64_t i = 64 - argumentPages; i < 64; i++){
+            Memory::HandleDemandPageFault(proc, (uintptr_t)_stack + PAGE_SIZE_4K * i); // proc is not running yet, so fault in the pages we write arguments to
         }
-        memset(_stack, 0, PAGE_SIZE_4K * 64);
 
         thread->stack = _stack; // 256KB stack size
         thread->registers.rsp = (uintptr_t)thread->stack + PAGE_SIZE_4K * 64;
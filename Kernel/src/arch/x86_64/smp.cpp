@@ -9,6 +9,8 @@
 #include <tss.h>
 #include <idt.h>
 #include <hal.h>
+#include <syscalls.h>
+#include <slab.h>
 
 #include "smpdefines.inc"
 
@@ -57,10 +59,15 @@ namespace SMP{
 
         TSS::InitializeTSS(&cpu->tss, cpu->gdt);
 
+        InitializeSyscallMSRs();
+
         APIC::Local::Enable();
 
         cpu->runQueue = new FastList<thread_t*>();
 
+        Timer::InitializeLocalTimer();
+
+        cpu->online = true;
         asm("sti");
 
         for(;;);
@@ -119,8 +126,12 @@ namespace SMP{
         cpus[0]->currentThread = nullptr;
         cpus[0]->runQueueLock = 0;
         cpus[0]->runQueue = new FastList<thread_t*>();
+        cpus[0]->online = true;
         SetCPULocal(cpus[0]);
 
+        Memory::EnableFrameCaches(); // Every CPU sets up its CPU local data before allocating
+        Memory::EnableObjectCacheMagazines();
+
         if(HAL::disableSMP) {
             TSS::InitializeTSS(&cpus[0]->tss, cpus[0]->gdt);
             ACPI::processorCount = 1;
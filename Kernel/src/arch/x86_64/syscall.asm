@@ -0,0 +1,88 @@
+BITS 64
+
+global SyscallEntry
+
+extern FastSyscallHandler
+
+; Offsets into struct CPU, checked in syscalls.cpp
+%define CPU_SYSCALL_KERNEL_STACK 8
+%define CPU_SYSCALL_USER_STACK 16
+
+%define USER_CS 0x23
+%define USER_SS 0x1B
+
+section .text
+%macro pushaq 0
+    push rax
+    push rbx
+    push rcx
+    push rdx
+    push rsi
+    push rdi
+    push rbp
+    push r8
+    push r9
+    push r10
+    push r11
+    push r12
+    push r13
+    push r14
+    push r15
+%endmacro
+
+%macro popaq 0
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop r11
+    pop r10
+    pop r9
+    pop r8
+    pop rbp
+    pop rdi
+    pop rsi
+    pop rdx
+    pop rcx
+    pop rbx
+    pop rax
+%endmacro
+
+; Entered from SYSCALL with interrupts disabled (SFMASK), RCX holding the user RIP and R11 the user RFLAGS.
+; Builds the same register frame as int 0x69 on the kernel stack of the thread so syscalls see no difference.
+; As RCX is taken by SYSCALL, argument 2 is passed in R10 instead and moved to the RCX slot of the frame.
+SyscallEntry:
+    swapgs
+    mov [gs:CPU_SYSCALL_USER_STACK], rsp
+    mov rsp, [gs:CPU_SYSCALL_KERNEL_STACK]
+
+    push qword USER_SS
+    push qword [gs:CPU_SYSCALL_USER_STACK] ; RSP
+    push r11 ; RFLAGS
+    push qword USER_CS
+    push rcx ; RIP
+    swapgs
+
+    pushaq
+    mov [rsp + 12 * 8], r10 ; RCX
+    mov rdi, rsp
+    xor rbp, rbp
+    call FastSyscallHandler
+
+    ; SYSRET faults in kernel mode with the user stack if RIP is non-canonical,
+    ; so only use it to return to the lower half
+    mov rax, [rsp + 15 * 8] ; RIP
+    shr rax, 47
+    jnz .iret
+
+    popaq
+    cli
+    pop rcx ; RIP
+    add rsp, 8 ; CS
+    pop r11 ; RFLAGS
+    pop rsp ; RSP
+    o64 sysret
+
+.iret:
+    popaq
+    iretq
@@ -20,6 +20,8 @@
 #include <lock.h>
 #include <smp.h>
 #include <pair.h>
+#include <futex.h>
+#include <fs/epoll.h>
 
 #define SYS_EXIT 1
 #define SYS_EXEC 2
@@ -94,11 +96,21 @@
 #define SYS_GET_FILE_STATUS_FLAGS 73
 #define SYS_SET_FILE_STATUS_FLAGS 74
 #define SYS_SELECT 75
+#define SYS_FORK 76
+#define SYS_SET_PRIORITY 77
+#define SYS_GET_PRIORITY 78
+#define SYS_FUTEX_REQUEUE 79
+#define SYS_EPOLL_CREATE 80
+#define SYS_EPOLL_CTL 81
+#define SYS_EPOLL_WAIT 82
 
-#define NUM_SYSCALLS 76
+#define NUM_SYSCALLS 83
 
 #define EXEC_CHILD 1
 
+#define MMAP_FILE 1 // Map a file instead of anonymous memory
+#define MMAP_SHARED 2 // Writes to a mapped file are written back to the file
+
 typedef long(*syscall_t)(regs64_t*);
 
 long SysExit(regs64_t* r){
@@ -340,11 +352,9 @@ long SysClose(regs64_t* r){
 
 	fs_fd_t* handle;
 	if((handle = Scheduler::GetCurrentProcess()->fileDescriptors[fd])){
-		fs::Close(handle);
+		fs::Close(handle); // Frees the handle
 	}
 
-	handle->node = nullptr;
-
 	Scheduler::GetCurrentProcess()->fileDescriptors[fd] = nullptr;
 	return 0;
 }
@@ -451,6 +461,7 @@ long SysMapFB(regs64_t *r){
 	mem_region_t memR;
 	memR.base = fbVirt;
 	memR.pageCount = pageCount;
+	memR.key = 0;
 	Scheduler::GetCurrentProcess()->sharedMemory.add_back(memR);
 
 	fb_info_t fbInfo;
@@ -475,10 +486,8 @@ long SysAlloc(regs64_t* r){
 
 	assert(address);
 
-	for(unsigned i = 0; i < pageCount; i++){
-		Memory::MapVirtualMemory4K(Memory::AllocatePhysicalMemoryBlock(),address + i * PAGE_SIZE_4K,1,Scheduler::GetCurrentProcess()->addressSpace);
-		memset((void*)(address + i * PAGE_SIZE_4K), 0, PAGE_SIZE_4K);
-	}
+	bool mapped = Memory::MapAnonymousRegion(Scheduler::GetCurrentProcess(), address, pageCount); // Pages are allocated and zeroed on first access
+	assert(mapped); // Allocate4KPages only returns unused ranges
 
 	*addressPointer = address;
 
@@ -854,10 +863,48 @@ long SysSetFsBase(regs64_t* r){
 	return 0;
 }
 
+/////////////////////////////
+/// \brief SysMmap(address, count, hint, flags, fd, offset) Map memory into the current process
+///
+/// \param address Pointer to store the address of the mapping
+/// \param count Amount of pages to map
+/// \param hint Address to map at, 0 to let the kernel choose
+/// \param flags MMAP_FILE to map the file referred to by fd, MMAP_SHARED to write changes back to the file
+/// \param fd File descriptor to map (if MMAP_FILE is set)
+/// \param offset Page aligned offset in the file to map from (passed in r8)
+///
+/// \return 0 on success, 1 if hint cannot be used, otherwise a negative error code
+/////////////////////////////
 long SysMmap(regs64_t* r){
+	process_t* proc = Scheduler::GetCurrentProcess();
+
 	uint64_t* address = (uint64_t*)r->rbx;
 	size_t count = r->rcx;
 	uintptr_t hint = r->rdx;
+	uint64_t flags = r->rsi;
+	uint64_t offset = r->r8;
+
+	FsNode* node = nullptr;
+	if(flags & MMAP_FILE){
+		if(r->rdi >= proc->fileDescriptors.get_length() || !proc->fileDescriptors[r->rdi]){
+			return -EBADF;
+		}
+
+		fs_fd_t* handle = proc->fileDescriptors[r->rdi];
+		if(offset & (PAGE_SIZE_4K - 1)){
+			return -EINVAL;
+		}
+
+		if(!handle->node->pageCached){
+			return -ENODEV; // Only files served by the page cache can be mapped
+		}
+
+		if((flags & MMAP_SHARED) && (handle->mode & O_ACCESS) == O_RDONLY){
+			return -EACCES;
+		}
+
+		node = handle->node;
+	}
 
 	uintptr_t _address;
 	if(hint){
@@ -870,9 +917,21 @@ long SysMmap(regs64_t* r){
 		}
 	} else _address = (uintptr_t)Memory::Allocate4KPages(count, Scheduler::GetCurrentProcess()->addressSpace);
 
-	for(size_t i = 0; i < count; i++){
-		Memory::MapVirtualMemory4K(Memory::AllocatePhysicalMemoryBlock(), _address + i * PAGE_SIZE_4K, 1, Scheduler::GetCurrentProcess()->addressSpace);
-		memset((void*)(_address + i * PAGE_SIZE_4K), 0, PAGE_SIZE_4K);
+	if(hint){
+		Memory::UnmapRegion(Scheduler::GetCurrentProcess(), _address, count); // Replace any anonymous memory already at the hint
+	}
+
+	bool mapped;
+	if(node){
+		mapped = Memory::MapFileRegion(proc, _address, count, node, offset, flags & MMAP_SHARED); // Pages are read from the page cache on first access
+	} else {
+		mapped = Memory::MapAnonymousRegion(proc, _address, count); // Pages are allocated and zeroed on first access
+	}
+
+	if(!mapped){
+		Log::Warning("sys_mmap: Could not map to address %x, memory already in use", _address);
+		*address = 0;
+		return 1;
 	}
 
 	*address = _address;
@@ -933,8 +992,7 @@ long SysWaitPID(regs64_t* r){
 long SysNanoSleep(regs64_t* r){
 	uint64_t nanoseconds = r->rbx;
 
-	uint64_t ticks = nanoseconds * Timer::GetFrequency() / 1000000000;
-	Timer::SleepCurrentThread(ticks);
+	Timer::SleepCurrentThreadNs(nanoseconds);
 
 	return 0;
 }
@@ -1025,7 +1083,7 @@ long SysMunmap(regs64_t* r){
 	size_t count = r->rcx;
 	
 	if(Memory::CheckRegion(address, count * PAGE_SIZE_4K, Scheduler::GetCurrentProcess()->addressSpace) /*Check availibilty of the requested map*/){
-		//Memory::Free4KPages((void*)address, count, Scheduler::GetCurrentProcess()->addressSpace);
+		Memory::UnmapRegion(Scheduler::GetCurrentProcess(), address, count); // Only memory from SysMmap/SysAlloc is freed
 	} else {
 		return -1;
 	}
@@ -1093,7 +1151,23 @@ long SysUnmapSharedMemory(regs64_t* r){
 	if(!Memory::CheckRegion(address, sMem->pgCount * PAGE_SIZE_4K, Scheduler::GetCurrentProcess()->addressSpace)) // Make sure the process is not screwing with kernel memory
 		return -1;
 
-	Memory::Free4KPages((void*)address, sMem->pgCount, Scheduler::GetCurrentProcess()->addressSpace);
+	process_t* currentProcess = Scheduler::GetCurrentProcess();
+
+	// Forget the mapping so it is not inherited by children anymore
+	bool mapped = false;
+	for(unsigned i = 0; i < currentProcess->sharedMemory.get_length(); i++){
+		if(currentProcess->sharedMemory[i].base == address && currentProcess->sharedMemory[i].key == key){
+			currentProcess->sharedMemory.remove_at(i);
+			mapped = true;
+			break;
+		}
+	}
+
+	if(!mapped){
+		return -1; // Never took a reference to the shared memory
+	}
+
+	Memory::Free4KPages((void*)address, sMem->pgCount, currentProcess->addressSpace);
 
 	sMem->mapCount--;
 
@@ -1474,7 +1548,9 @@ long SysSetUID(regs64_t* r){
  * SysPoll (fds, nfds, timeout) - Wait for file descriptors
  * fds - Array of pollfd structs
  * nfds - Number of pollfd structs
- * timeout - timeout period
+ * timeout - timeout period (in ms), negative to wait indefinitely
+ *
+ * The thread sleeps until one of the nodes signals a change of state or the timeout expires
  *
  * On Success - return number of file descriptors
  * On Failure - return -1
@@ -1493,113 +1569,73 @@ long SysPoll(regs64_t* r){
 
 	fs_fd_t** files = (fs_fd_t**)kmalloc(sizeof(fs_fd_t*) * nfds);
 
-	unsigned eventCount = 0; // Amount of fds with events
+	unsigned invalidCount = 0; // Amount of invalid fds, each counts as an event
 	for(unsigned i = 0; i < nfds; i++){
 		fds[i].revents = 0;
+		files[i] = nullptr;
 		if(fds[i].fd < 0) continue;
 
-		if((uint64_t)fds[i].fd >= Scheduler::GetCurrentProcess()->fileDescriptors.get_length()){
+		if((uint64_t)fds[i].fd >= proc->fileDescriptors.get_length()){
 			Log::Warning("sys_poll: Invalid File Descriptor: %d", fds[i].fd);
-			files[i] = 0;
 			fds[i].revents |= POLLNVAL;
-			eventCount++;
+			invalidCount++;
 			continue;
 		}
 
-		fs_fd_t* handle = Scheduler::GetCurrentProcess()->fileDescriptors[fds[i].fd];
+		fs_fd_t* handle = proc->fileDescriptors[fds[i].fd];
 
 		if(!handle || !handle->node){
 			Log::Warning("sys_poll: Invalid File Descriptor: %d", fds[i].fd);
-			files[i] = 0;
 			fds[i].revents |= POLLNVAL;
-			eventCount++;
+			invalidCount++;
 			continue;
 		}
 
 		files[i] = handle;
+	}
 
-		bool hasEvent = 0;
-
-		if((files[i]->node->flags & FS_NODE_TYPE) == FS_NODE_SOCKET){
-			if(!((Socket*)files[i]->node)->IsConnected() && !((Socket*)files[i]->node)->IsListening()){
-				fds[i].revents |= POLLHUP;
-				hasEvent = true;
-			}
-			
-			if(((Socket*)files[i]->node)->PendingConnections() && (fds[i].events & POLLIN)){
-				fds[i].revents |= POLLIN;
-				hasEvent = true;
-			}
-		}
+	auto pollFiles = [&]() -> unsigned {
+		unsigned eventCount = invalidCount; // Amount of fds with events
+		for(unsigned i = 0; i < nfds; i++){
+			if(!files[i]) continue;
 
-		if(files[i]->node->CanRead() && (fds[i].events & POLLIN)) { // If readable and the caller requested POLLIN
-			fds[i].revents |= POLLIN;
-			hasEvent = true;
-		}
-		
-		if(files[i]->node->CanWrite() && (fds[i].events & POLLOUT)) { // If writable and the caller requested POLLOUT
-			fds[i].revents |= POLLOUT;
-			hasEvent = true;
+			fds[i].revents = fs::PollNode(files[i]->node, fds[i].events);
+			if(fds[i].revents) eventCount++;
 		}
 
-		if(hasEvent) eventCount++;
-	}
+		return eventCount;
+	};
 
+	unsigned eventCount = pollFiles();
 	if(!eventCount && timeout){
-		timeval_t tVal = Timer::GetSystemUptimeStruct();
+		uint64_t deadline = Timer::GetSystemUptimeNs() + timeout * 1000000;
 
 		FilesystemWatcher fsWatcher;
 		for(unsigned i = 0; i < nfds; i++){
-			fsWatcher.WatchNode(files[i]->node, fds[i].events);
+			if(files[i]){
+				fsWatcher.WatchNode(files[i]->node, fds[i].events);
+			}
 		}
 
-		releaseLock(&GetCPULocal()->currentThread->lock);
-		if(timeout > 0){
-			fsWatcher.WaitTimeout(timeout);
-		} else {
-			fsWatcher.Wait();
-		}
+		releaseLock(&thread->lock);
 
-		do{
-			if(eventCount > 0){
-				break;
+		// Check again once watching, any change after this signals the watcher
+		while(!(eventCount = pollFiles()) && thread->state != ThreadStateZombie){
+			if(timeout < 0){ // Wait indefinitely
+				fsWatcher.Wait();
+				continue;
 			}
 
-			for(unsigned i = 0; i < nfds; i++){
-				if(!files[i] || !files[i]->node) continue;
-
-				bool hasEvent = 0;
-
-				if((files[i]->node->flags & FS_NODE_TYPE) == FS_NODE_SOCKET){
-					if(!((Socket*)files[i]->node)->IsConnected() && !((Socket*)files[i]->node)->IsListening()){
-						fds[i].revents |= POLLHUP;
-						hasEvent = 1;
-					}
-
-					if(((Socket*)files[i]->node)->PendingConnections() && (fds[i].events & POLLIN)){
-						fds[i].revents |= POLLIN;
-						hasEvent = 1;
-					}
-				}
-
-				if(files[i]->node->CanRead() && (fds[i].events & POLLIN)) { // If readable and the caller requested POLLIN
-					fds[i].revents |= POLLIN;
-					hasEvent = 1;
-				}
-				
-				if(files[i]->node->CanWrite() && (fds[i].events & POLLOUT)) { // If writable and the caller requested POLLOUT
-					fds[i].revents |= POLLOUT;
-					hasEvent = 1;
-				}
-
-				if(hasEvent) eventCount++;
+			uint64_t now = Timer::GetSystemUptimeNs();
+			if(now >= deadline){
+				break;
 			}
-			Scheduler::Yield();
-		} while(thread->state != ThreadStateZombie && (timeout < 0 || Timer::TimeDifference(Timer::GetSystemUptimeStruct(), tVal) < timeout)); // Wait until timeout, unless timeout is negative in which wait infinitely
+
+			fsWatcher.WaitTimeout(deadline - now);
+		}
 	}
 
-	if(files)
-		kfree(files);
+	kfree(files);
 	
 	return eventCount;
 }
@@ -1910,77 +1946,62 @@ long SysExitThread(regs64_t* r){
 }
 
 /////////////////////////////
-/// \brief SysFutexWake(futex) Wake a thread waiting on a futex
+/// \brief SysFutexWake(futex, count) Wake threads waiting on a futex
+///
+/// Futexes are identified by physical address, so a futex in shared memory wakes threads of every process mapping it
 ///
 /// \param futex - (int*) Futex pointer
+/// \param count - (int) Maximum amount of threads to wake, every thread is woken if 0 or negative
 ///
-/// \return 0 on success, error code on failure
+/// \return Amount of threads woken on success, negative error code on failure
 /////////////////////////////
 long SysFutexWake(regs64_t* r){
-	int* futex = reinterpret_cast<int*>(r->rbx);
-
-	if(!Memory::CheckUsermodePointer(r->rbx, sizeof(int), Scheduler::GetCurrentProcess()->addressSpace)){
-		return EFAULT;
-	}
-
-	process_t* currentProcess = Scheduler::GetCurrentProcess();
-
-	Scheduler::FutexThreadBlocker* blocker = currentProcess->futexWaitQueue.get(reinterpret_cast<uintptr_t>(futex));
-
-	if(!blocker){
-		return 0;
-	}
-
-	auto front = blocker->blocked.get_front();
-
-	if(front){
-		blocker->Remove(front);
-
-		Scheduler::UnblockThread(front);
+	int count = static_cast<int>(r->rcx);
+	if(count <= 0){
+		count = INT32_MAX;
 	}
 
-	return 0;
+	return Futex::Wake(Scheduler::GetCurrentProcess(), r->rbx, count);
 }
 
 /////////////////////////////
-/// \brief SysFutexWait(futex, expected) Wait on a futex.
+/// \brief SysFutexWait(futex, expected, timeout) Wait on a futex.
 ///
 /// Will wait on the futex if the value is equal to expected
 ///
 /// \param futex (void*) Futex pointer
 /// \param expected (int) Expected futex value
+/// \param timeout (const timespec*) Maximum time to wait for, waits forever if null
 ///
-/// \return 0 on success, error code on failure
+/// \return 0 on success, -ETIMEDOUT on timeout, negative error code on failure
 /////////////////////////////
 long SysFutexWait(regs64_t* r){
-	int* futex = reinterpret_cast<int*>(r->rbx);
-
-	if(!Memory::CheckUsermodePointer(r->rbx, sizeof(int), Scheduler::GetCurrentProcess()->addressSpace)){
-		return EFAULT;
-	}
+	process_t* currentProcess = Scheduler::GetCurrentProcess();
 
 	int expected = static_cast<int>(r->rcx);
+	const timespec_t* timeout = reinterpret_cast<const timespec_t*>(r->rdx);
 
-	if(*futex != expected){
-		return 0;
-	}
-
-	process_t* currentProcess = Scheduler::GetCurrentProcess();
+	uint64_t timeoutNs = 0;
+	if(timeout){
+		if(!Memory::CheckUsermodePointer(r->rdx, sizeof(timespec_t), currentProcess->addressSpace)){
+			return -EFAULT;
+		}
 
-	Scheduler::FutexThreadBlocker* blocker = currentProcess->futexWaitQueue.get(reinterpret_cast<uintptr_t>(futex));
+		if(timeout->tv_sec < 0 || timeout->tv_nsec < 0 || timeout->tv_nsec >= 1000000000){
+			return -EINVAL;
+		}
 
-	if(!blocker){
-		blocker = new Scheduler::FutexThreadBlocker();
+		if(timeout->tv_sec == 0 && timeout->tv_nsec == 0){
+			return -ETIMEDOUT;
+		}
 
-		currentProcess->futexWaitQueue.insert(reinterpret_cast<uintptr_t>(futex), blocker);
+		// Timeouts long enough to overflow the deadline (over 500 years) wait indefinitely
+		if(static_cast<uint64_t>(timeout->tv_sec) < (1ULL << 34)){
+			timeoutNs = static_cast<uint64_t>(timeout->tv_sec) * 1000000000ULL + timeout->tv_nsec;
+		}
 	}
 
-	releaseLock(&GetCPULocal()->currentThread->lock);
-
-	lock_t temp = 0;
-	Scheduler::BlockCurrentThread(*blocker, temp);
-
-	return 0;
+	return Futex::Wait(currentProcess, r->rbx, expected, timeoutNs);
 }
 
 /////////////////////////////
@@ -2060,7 +2081,7 @@ long SysSetFileStatusFlags(regs64_t* r){
 /// \param readfds (fd_set) check for readable fds
 /// \param writefds (fd_set) check for writable fds
 /// \param exceptfds (fd_set) check for exceptions on fds
-/// \param timeout (timespec) timeout period
+/// \param timeout (timespec) timeout period, null to wait indefinitely
 ///
 /// \return number of events on success, negative error code on failure
 /////////////////////////////
@@ -2076,8 +2097,8 @@ long SysSelect(regs64_t* r){
 	if(!((!readFdsMask || Memory::CheckUsermodePointer(r->rcx, sizeof(fd_set_t), currentProcess->addressSpace))
 		&& (!writeFdsMask || Memory::CheckUsermodePointer(r->rdx, sizeof(fd_set_t), currentProcess->addressSpace))
 		&& (!exceptFdsMask || Memory::CheckUsermodePointer(r->rsi, sizeof(fd_set_t), currentProcess->addressSpace))
-		&& Memory::CheckUsermodePointer(r->rdi, sizeof(timespec_t), currentProcess->addressSpace))){
-		return -EFAULT; // Only return EFAULT if read/write/exceptfds is not null
+		&& (!timeout || Memory::CheckUsermodePointer(r->rdi, sizeof(timespec_t), currentProcess->addressSpace)))){
+		return -EFAULT; // Only return EFAULT if read/write/exceptfds/timeout is not null
 	}
 
 	List<Pair<fs_fd_t*, int>> readfds;
@@ -2142,39 +2163,18 @@ long SysSelect(regs64_t* r){
 		//Log::Warning("SysSelect: ExceptFds ignored!");
 	}
 
-	int evCount = 0;
-	
-	for(auto& handle : readfds){
-		if(handle.item1->node->CanRead()){
-			FD_SET(handle.item2, readFdsMask);
-			evCount++;
-		}
-	}
-
-	for(auto& handle : writefds){
-		if(handle.item1->node->CanWrite()){
-			FD_SET(handle.item2, writeFdsMask);
-			evCount++;
-		}
-	}
-
-	if(evCount){
-		return evCount;
-	}
-
-	timeval_t timeEnd = {.seconds = timeout->tv_sec + Timer::GetSystemUptimeStruct().seconds, .milliseconds = timeout->tv_nsec / 1000000 + Timer::GetSystemUptimeStruct().milliseconds};
-	while(Timer::GetSystemUptimeStruct() < timeEnd){
-		evCount = 0;
+	auto pollFds = [&]() -> int {
+		int evCount = 0;
 
 		for(auto& handle : readfds){
-			if(handle.item1->node->CanRead()){
+			if(fs::PollNode(handle.item1->node, POLLIN)){ // Hung up sockets are readable
 				FD_SET(handle.item2, readFdsMask);
 				evCount++;
 			}
 		}
 
 		for(auto& handle : writefds){
-			if(handle.item1->node->CanWrite()){
+			if(fs::PollNode(handle.item1->node, POLLOUT) & POLLOUT){
 				FD_SET(handle.item2, writeFdsMask);
 				evCount++;
 			}
@@ -2182,16 +2182,250 @@ long SysSelect(regs64_t* r){
 
 		//for(fs_fd_t* handle : exceptfds);
 
-		if(evCount){
+		return evCount;
+	};
+
+	int evCount = pollFds();
+	if(evCount || (timeout && !timeout->tv_sec && !timeout->tv_nsec)){
+		return evCount;
+	}
+
+	uint64_t deadline = 0;
+	if(timeout){
+		deadline = Timer::GetSystemUptimeNs() + timeout->tv_sec * 1000000000 + timeout->tv_nsec;
+	}
+
+	FilesystemWatcher fsWatcher;
+	for(auto& handle : readfds){
+		fsWatcher.WatchNode(handle.item1->node, POLLIN);
+	}
+
+	for(auto& handle : writefds){
+		fsWatcher.WatchNode(handle.item1->node, POLLOUT);
+	}
+
+	thread_t* thread = GetCPULocal()->currentThread;
+	releaseLock(&thread->lock);
+
+	// Check again once watching, any change after this signals the watcher
+	while(!(evCount = pollFds()) && thread->state != ThreadStateZombie){
+		if(!deadline){ // Null timeout, wait indefinitely
+			fsWatcher.Wait();
+			continue;
+		}
+
+		uint64_t now = Timer::GetSystemUptimeNs();
+		if(now >= deadline){
 			break;
 		}
 
-		Scheduler::Yield();
+		fsWatcher.WaitTimeout(deadline - now);
 	}
 
 	return evCount;
 }
 
+/////////////////////////////
+/// \brief SysFork() Create a copy of the current process
+///
+/// Memory is shared copy-on-write between the parent and child
+///
+/// \return PID of the child in the parent, 0 in the child
+/////////////////////////////
+long SysFork(regs64_t* r){
+	process_t* proc = Scheduler::ForkProcess(Scheduler::GetCurrentProcess(), r);
+	if(!proc){
+		return -ENOMEM;
+	}
+
+	return proc->pid;
+}
+
+/////////////////////////////
+/// \brief SysSetPriority(pid, nice) Set the scheduling priority of a process
+///
+/// Only root can lower the nice value of a process or change the priority of processes owned by other users
+///
+/// \param pid - (pid_t) Process ID, 0 for the current process
+/// \param nice - (int) Nice value between -20 (highest priority) and 19
+///
+/// \return 0 on success, negative error code on failure
+/////////////////////////////
+long SysSetPriority(regs64_t* r){
+	process_t* currentProcess = Scheduler::GetCurrentProcess();
+	process_t* process = r->rbx ? Scheduler::FindProcessByPID(r->rbx) : currentProcess;
+	int nice = static_cast<int>(r->rcx);
+
+	if(!process){
+		return -ESRCH;
+	}
+
+	if(nice < -20){
+		nice = -20;
+	} else if(nice > 19){
+		nice = 19;
+	}
+
+	uint8_t priority = (nice + 20) / 5; // Each priority level covers 5 nice values
+
+	if(currentProcess->uid && (process->uid != currentProcess->uid || priority < process->threads[0]->priority)){
+		return -EPERM;
+	}
+
+	Scheduler::SetProcessPriority(process, priority);
+	return 0;
+}
+
+/////////////////////////////
+/// \brief SysFutexRequeue(futex, count, target, requeueCount, expected) Wake threads waiting on a futex and move the rest to another futex
+///
+/// Lets a condition variable broadcast wake one thread and move the others to the mutex instead of waking them all to fight over it
+///
+/// \param futex (int*) Futex pointer
+/// \param count (int) Maximum amount of threads to wake
+/// \param target (int*) Futex to move waiting threads to
+/// \param requeueCount (int) Maximum amount of threads to move, every remaining thread is moved if negative
+/// \param expected (int) Value futex must hold, nothing is done otherwise
+///
+/// \return Amount of threads woken or moved on success, -EAGAIN if futex does not hold expected, negative error code on failure
+/////////////////////////////
+long SysFutexRequeue(regs64_t* r){
+	int count = static_cast<int>(r->rcx);
+	int requeueCount = static_cast<int>(r->rsi);
+	if(count < 0){
+		return -EINVAL;
+	}
+
+	if(requeueCount < 0){
+		requeueCount = INT32_MAX;
+	}
+
+	return Futex::Requeue(Scheduler::GetCurrentProcess(), r->rbx, count, r->rdx, requeueCount, static_cast<int>(r->rdi));
+}
+
+/////////////////////////////
+/// \brief SysGetPriority(pid) Get the scheduling priority of a process
+///
+/// \param pid - (pid_t) Process ID, 0 for the current process
+///
+/// \return Nice value of the process (lowest nice value of its priority level) plus 20, in the range 0 to 39, on success, negative error code on failure
+/////////////////////////////
+long SysGetPriority(regs64_t* r){
+	process_t* process = r->rbx ? Scheduler::FindProcessByPID(r->rbx) : Scheduler::GetCurrentProcess();
+
+	if(!process){
+		return -ESRCH;
+	}
+
+	return process->threads[0]->priority * 5; // Offset by 20 so every nice value is distinct from an error code
+}
+
+// Get the epoll that fd refers to, nullptr if fd is invalid or not an epoll
+static fs::EPoll* GetEPoll(process_t* process, int fd){
+	fs_fd_t* handle;
+	if(static_cast<unsigned>(fd) >= process->fileDescriptors.get_length() || !(handle = process->fileDescriptors[fd]) || !handle->node){
+		return nullptr;
+	}
+
+	if(!handle->node->IsEPoll()){
+		return nullptr;
+	}
+
+	return static_cast<fs::EPoll*>(handle->node);
+}
+
+/////////////////////////////
+/// \brief SysEpollCreate(flags) Create an epoll, a persistent set of file descriptors to wait on
+///
+/// \param flags (int) Ignored
+///
+/// \return File descriptor of the epoll on success, negative error code on failure
+/////////////////////////////
+long SysEpollCreate(regs64_t* r){
+	process_t* currentProcess = Scheduler::GetCurrentProcess();
+
+	fs::EPoll* epoll = new fs::EPoll();
+	fs_fd_t* handle = fs::Open(epoll, 0);
+
+	int fd = currentProcess->fileDescriptors.get_length();
+	currentProcess->fileDescriptors.add_back(handle);
+
+	return fd;
+}
+
+/////////////////////////////
+/// \brief SysEpollCtl(epfd, op, fd, event) Add, modify or remove a file descriptor in an epoll
+///
+/// An interest should be removed before its file descriptor is closed
+///
+/// \param epfd (int) Epoll file descriptor
+/// \param op (int) EPOLL_CTL_ADD, EPOLL_CTL_MOD or EPOLL_CTL_DEL
+/// \param fd (int) File descriptor to watch
+/// \param event (epoll_event*) Requested events (including EPOLLET and EPOLLONESHOT) and the data to return with them, ignored by EPOLL_CTL_DEL
+///
+/// \return 0 on success, negative error code on failure
+/////////////////////////////
+long SysEpollCtl(regs64_t* r){
+	process_t* currentProcess = Scheduler::GetCurrentProcess();
+
+	int op = static_cast<int>(r->rcx);
+	int fd = static_cast<int>(r->rdx);
+	epoll_event* event = reinterpret_cast<epoll_event*>(r->rsi);
+
+	fs::EPoll* epoll = GetEPoll(currentProcess, static_cast<int>(r->rbx));
+	if(!epoll){
+		return -EBADF;
+	}
+
+	fs_fd_t* handle;
+	if(static_cast<unsigned>(fd) >= currentProcess->fileDescriptors.get_length() || !(handle = currentProcess->fileDescriptors[fd]) || !handle->node){
+		return -EBADF;
+	}
+
+	if(op != EPOLL_CTL_DEL && !Memory::CheckUsermodePointer(r->rsi, sizeof(epoll_event), currentProcess->addressSpace)){
+		return -EFAULT;
+	}
+
+	return epoll->Control(op, fd, handle->node, event);
+}
+
+/////////////////////////////
+/// \brief SysEpollWait(epfd, events, maxevents, timeout) Wait for events on the file descriptors in an epoll
+///
+/// \param epfd (int) Epoll file descriptor
+/// \param events (epoll_event*) Array to write events to
+/// \param maxevents (int) Size of events
+/// \param timeout (int) Timeout in ms, 0 to return immediately and negative to wait indefinitely
+///
+/// \return Amount of events on success, negative error code on failure
+/////////////////////////////
+long SysEpollWait(regs64_t* r){
+	process_t* currentProcess = Scheduler::GetCurrentProcess();
+
+	epoll_event* events = reinterpret_cast<epoll_event*>(r->rcx);
+	int maxEvents = static_cast<int>(r->rdx);
+	long timeout = static_cast<int>(r->rsi);
+
+	fs::EPoll* epoll = GetEPoll(currentProcess, static_cast<int>(r->rbx));
+	if(!epoll){
+		return -EBADF;
+	}
+
+	if(maxEvents <= 0){
+		return -EINVAL;
+	}
+
+	if(!Memory::CheckUsermodePointer(r->rcx, maxEvents * sizeof(epoll_event), currentProcess->addressSpace)){
+		return -EFAULT;
+	}
+
+	if(timeout){
+		releaseLock(&GetCPULocal()->currentThread->lock); // Let other threads of the process make syscalls while we wait
+	}
+
+	return epoll->Wait(events, maxEvents, timeout);
+}
+
 syscall_t syscalls[]{
 	SysDebug,
 	SysExit,					// 1
@@ -2268,7 +2502,14 @@ syscall_t syscalls[]{
 	SysDup,
 	SysGetFileStatusFlags,
 	SysSetFileStatusFlags,
-	SysSelect,
+	SysSelect,					// 75
+	SysFork,
+	SysSetPriority,
+	SysGetPriority,
+	SysFutexRequeue,
+	SysEpollCreate,				// 80
+	SysEpollCtl,
+	SysEpollWait,
 };
 
 int lastSyscall = 0;
@@ -2285,8 +2526,37 @@ void SyscallHandler(void*, regs64_t* regs) {
 	acquireLock(&thread->lock);
 	regs->rax = syscalls[regs->rax](regs); // Call syscall
 	releaseLock(&thread->lock);
+
+	while(thread->state == ThreadStateZombie){ // Killed during the syscall, never return to user mode. EndProcess takes us off the run queue
+		Scheduler::Yield();
+	}
+}
+
+extern "C" void SyscallEntry();
+
+// syscall.asm reads these through GS
+static_assert(__builtin_offsetof(CPU, syscallKernelStack) == 8, "syscall.asm expects the kernel stack at gs:8");
+static_assert(__builtin_offsetof(CPU, syscallUserStack) == 16, "syscall.asm expects the user stack at gs:16");
+
+// Called from SyscallEntry with the same register frame as int 0x69
+extern "C" void FastSyscallHandler(regs64_t* regs){
+	SyscallHandler(nullptr, regs);
+}
+
+void InitializeSyscallMSRs(){
+	uint32_t low, high;
+	asm volatile("rdmsr" : "=a"(low), "=d"(high) : "c"(MSR_EFER));
+	asm volatile("wrmsr" :: "a"(low | EFER_SCE), "d"(high), "c"(MSR_EFER)); // Enable SYSCALL/SYSRET
+
+	// SYSCALL loads CS from STAR[47:32] and SS from STAR[47:32] + 8,
+	// SYSRET loads SS from STAR[63:48] + 8 and CS from STAR[63:48] + 16 (user data then user code in the GDT)
+	uint64_t star = (0x10ULL << 48) | (0x08ULL << 32);
+	asm volatile("wrmsr" :: "a"(star & 0xFFFFFFFF), "d"(star >> 32), "c"(MSR_STAR));
+	asm volatile("wrmsr" :: "a"((uintptr_t)SyscallEntry & 0xFFFFFFFF), "d"((uintptr_t)SyscallEntry >> 32), "c"(MSR_LSTAR));
+	asm volatile("wrmsr" :: "a"(SYSCALL_RFLAGS_MASK), "d"(0), "c"(MSR_SFMASK)); // Interrupts stay off until the kernel stack is loaded
 }
 
 void InitializeSyscalls() {
-	IDT::RegisterInterruptHandler(0x69, SyscallHandler);
+	IDT::RegisterInterruptHandler(0x69, SyscallHandler); // Legacy entry, still used by anything not built for SYSCALL
+	InitializeSyscallMSRs();
 }
\ No newline at end of file
@@ -8,73 +8,120 @@
 #include <cpu.h>
 #include <logging.h>
 
+#define NS_PER_SECOND 1000000000ULL
+
+#define PIT_FREQUENCY 1193182
+#define PIT_CALIBRATION_COUNT (PIT_FREQUENCY / 100) // 10ms
+
 namespace Timer{
 
     int frequency; // Timer frequency
     int ticks = 0; // Timer tick counter
     long long uptime = 0; // System uptime in seconds since the timer was initialized
 
+    bool clockEvents = false; // Each CPU is interrupted by its own local APIC timer instead of the PIT
+    bool tscDeadline = false; // Local APIC timers are programmed with a TSC deadline instead of a count
+
+    uint64_t tscFrequency = 0; // TSC ticks per second, 0 until clock events are enabled
+    uint64_t tscBase = 0; // TSC value when clock events were enabled
+    uint64_t tscBaseNs = 0; // Uptime when clock events were enabled
+    uint64_t tscToNs = 0; // Nanoseconds per TSC tick (32.32 fixed point)
+    uint64_t nsToTSC = 0; // TSC ticks per nanosecond (32.32 fixed point)
+    uint64_t lapicFrequency = 0; // Local APIC timer ticks per second (divided by 16)
+
     struct SleepCounter{
         thread_t* thread;
-        long ticksLeft;
+        uint64_t deadline; // Uptime (in ns) to wake the thread at
     };
 
     lock_t sleepQueueLock = 0; // Prevent deadlocks
 
-    // In the sleep queue, all waiting threads have a counter as an offset from the previous waiting thread.
-    // For example there are 2 threads, thread 1 is waiting for 10 ticks and thread 2 is waiting for 15 ticks.
-    // Thread 1's ticks value will be 10, and as 15 - 10 is 5, thread 2's value will be 5 so it waits 5 ticks after thread 1
+    // Sleeping threads sorted by deadline
     List<SleepCounter> sleeping;
+    // Deadline of the front of the sleep queue, read without the lock when programming timers
+    volatile uint64_t nextDeadline = UINT64_MAX;
+
+    // Add thread to the sleep queue, sleepQueueLock must be held
+    static void InsertSleeper(thread_t* thread, uint64_t deadline){
+        unsigned i = 0;
+        while(i < sleeping.get_length() && sleeping[i].deadline <= deadline){ // Threads with the same deadline are woken in the order they went to sleep
+            i++;
+        }
+
+        if(i < sleeping.get_length()){
+            sleeping.insert({.thread = thread, .deadline = deadline}, i);
+        } else {
+            sleeping.add_back({.thread = thread, .deadline = deadline});
+        }
+
+        nextDeadline = sleeping.get_front().deadline;
+    }
+
+    // Remove thread from the sleep queue if it has not been woken yet, sleepQueueLock must be held
+    static void RemoveSleeper(thread_t* thread){
+        for(unsigned i = 0; i < sleeping.get_length(); i++){
+            if(sleeping[i].thread == thread){
+                sleeping.remove_at(i);
+                break;
+            }
+        }
+
+        nextDeadline = sleeping.get_length() ? sleeping.get_front().deadline : UINT64_MAX;
+    }
 
     class SleepBlocker : public Scheduler::ThreadBlocker {
         private:
-            long ticks = 0;
+            uint64_t deadline = 0;
         public:
-        SleepBlocker(long ticks){
-            this->ticks = ticks;
+        SleepBlocker(uint64_t deadline){
+            this->deadline = deadline;
         }
 
         void Block(thread_t* thread) final {
-            if(!sleeping.get_length()){
-                sleeping.add_back({.thread = thread, .ticksLeft = ticks}); // No sleeping threads in queue, just add
-                return;
-            }
+            InsertSleeper(thread, deadline);
+        }
 
-            long total = 0;
-            for(unsigned i = 0; i < sleeping.get_length(); i++){
-                if(total + sleeping[i].ticksLeft >= ticks){ // See if we need to insert in middle of queue
-                    ticks -= total;
-                    sleeping[i].ticksLeft -= ticks;
-                    sleeping.insert({.thread = thread, .ticksLeft = ticks}, i);
-                    return;
-                }
+        void Remove(thread_t* thread) final {
+            RemoveSleeper(thread);
+        }
+    };
 
-                total += sleeping[i].ticksLeft;
-            }
+    static inline uint64_t ReadTSC(){
+        uint32_t low, high;
+        asm volatile("rdtsc" : "=a"(low), "=d"(high));
 
-            sleeping.add_back({.thread = thread, .ticksLeft = ticks - sleeping.get_back().ticksLeft}); // Add to back
-        }
+        return (static_cast<uint64_t>(high) << 32) | low;
+    }
 
-        void Remove(thread_t* thread) final {
-            for(auto it = sleeping.begin(); it != sleeping.end(); it++){
-                SleepCounter& cnt = *it;
-                if(cnt.thread == thread){
-                    auto next = it;
-                    next++;
+    static inline uint64_t TSCToNs(uint64_t tsc){
+        return (static_cast<unsigned __int128>(tsc) * tscToNs) >> 32;
+    }
 
-                    next->ticksLeft += cnt.ticksLeft;
+    static inline uint64_t NsToTSC(uint64_t ns){
+        return (static_cast<unsigned __int128>(ns) * nsToTSC) >> 32;
+    }
 
-                    sleeping.remove(it);
-                }
-            }
+    uint64_t GetSystemUptimeNs(){
+        if(clockEvents){
+            return tscBaseNs + TSCToNs(ReadTSC() - tscBase);
         }
-    };
+
+        return uptime * NS_PER_SECOND + ticks * (NS_PER_SECOND / frequency);
+    }
 
     uint64_t GetSystemUptime(){
+        if(clockEvents){
+            return GetSystemUptimeNs() / NS_PER_SECOND;
+        }
+
         return uptime;
     }
 
     uint32_t GetTicks(){
+        if(clockEvents){
+            return (GetSystemUptimeNs() % NS_PER_SECOND) * frequency / NS_PER_SECOND;
+        }
+
         return ticks;
     }
 
@@ -82,14 +129,20 @@ namespace Timer{
         return frequency;
     }
 
+    bool ClockEventsEnabled(){
+        return clockEvents;
+    }
+
     inline uint64_t MsToTicks(long ms){
         return ms * frequency / 1000;
     }
 
     timeval_t GetSystemUptimeStruct(){
+        uint64_t ns = GetSystemUptimeNs();
+
         timeval_t tval;
-        tval.seconds = uptime;
-        tval.milliseconds = ticks * 1000 / frequency;
+        tval.seconds = ns / NS_PER_SECOND;
+        tval.milliseconds = (ns % NS_PER_SECOND) / 1000000;
         return tval;
     }
 
@@ -101,53 +154,194 @@ namespace Timer{
     }
 
     void SleepCurrentThread(timeval_t& time){
-        long ticks = time.seconds * frequency + MsToTicks(time.milliseconds);
-        SleepCurrentThread(ticks);
+        SleepCurrentThreadNs(time.seconds * NS_PER_SECOND + time.milliseconds * 1000000);
     }
 
     void Wait(long ms){
         assert(ms > 0);
 
-        uint64_t ticksPerMs = (Timer::GetFrequency() / 1000);
-        uint64_t timeMs = Timer::GetSystemUptime() * 1000 + (Timer::GetTicks() * ticksPerMs);
-    
-        while((Timer::GetSystemUptime() * 1000 + (Timer::GetTicks() * ticksPerMs)) - timeMs <= static_cast<unsigned long>(ms));
+        uint64_t end = GetSystemUptimeNs() + ms * 1000000;
+        while(GetSystemUptimeNs() < end);
     }
 
     void SleepCurrentThread(long ticks){
-        SleepBlocker blocker = SleepBlocker(ticks);
+        SleepCurrentThreadNs(ticks * (NS_PER_SECOND / frequency));
+    }
+
+    void SleepCurrentThreadNs(uint64_t ns){
+        SleepBlocker blocker = SleepBlocker(GetSystemUptimeNs() + ns);
         Scheduler::BlockCurrentThread(blocker, sleepQueueLock);
     }
 
+    void AddWakeup(thread_t* thread, uint64_t deadline){
+        acquireLock(&sleepQueueLock);
+        InsertSleeper(thread, deadline);
+        releaseLock(&sleepQueueLock);
+    }
+
+    void RemoveWakeup(thread_t* thread){
+        acquireLock(&sleepQueueLock);
+        RemoveSleeper(thread);
+        releaseLock(&sleepQueueLock);
+    }
+
+    static void WakeSleepingThreads(){
+        if(GetSystemUptimeNs() < nextDeadline || acquireTestLock(&sleepQueueLock)){
+            return;
+        }
+
+        uint64_t now = GetSystemUptimeNs();
+        while(sleeping.get_length() && sleeping.get_front().deadline <= now){
+            Scheduler::UnblockThread(sleeping.remove_at(0).thread);
+        }
+
+        nextDeadline = sleeping.get_length() ? sleeping.get_front().deadline : UINT64_MAX;
+
+        releaseLock(&sleepQueueLock);
+    }
+
+    void SetNextEvent(bool idle){
+        if(!clockEvents){
+            return;
+        }
+
+        uint64_t now = GetSystemUptimeNs();
+        uint64_t deadline = now + (idle ? TIMER_IDLE_INTERVAL * 1000000ULL : NS_PER_SECOND / frequency);
+
+        if(nextDeadline < deadline){
+            deadline = nextDeadline;
+        }
+
+        if(deadline < now + TIMER_MIN_DELAY){ // Don't let an expired deadline we failed to handle (e.g. the sleep queue was locked) flood the CPU with interrupts
+            deadline = now + TIMER_MIN_DELAY;
+        }
+
+        if(tscDeadline){
+            uint64_t tsc = tscBase + NsToTSC(deadline - tscBaseNs);
+            asm volatile("wrmsr" :: "a"(tsc & 0xFFFFFFFF), "d"(tsc >> 32), "c"(MSR_IA32_TSC_DEADLINE));
+        } else {
+            uint64_t count = (deadline - now) * lapicFrequency / NS_PER_SECOND;
+            if(count > UINT32_MAX){
+                count = UINT32_MAX;
+            } else if(!count){
+                count = 1;
+            }
+
+            APIC::Local::Write(LOCAL_APIC_TIMER_INITIAL_COUNT, count);
+        }
+    }
+
     // Timer handler
     void Handler(void*, regs64_t *r) {
+        if(clockEvents){ // The PIT may interrupt one last time after being stopped
+            return;
+        }
+
         ticks++;
         if(ticks >= frequency){
             uptime++;
             ticks -= frequency;
         }
 
-        if(sleeping.get_length() && !(acquireTestLock(&sleepQueueLock))){
-            if(sleeping.get_length()){ // Make sure the queue has not changed inbetween checking the length and acquiring the lock
-                sleeping.get_front().ticksLeft--;
+        WakeSleepingThreads();
 
-                while(sleeping.get_length() && sleeping.get_front().ticksLeft <= 0){
-                    Scheduler::UnblockThread(sleeping.remove_at(0).thread);
-                }
-            }
+        Scheduler::Tick(r);
+    }
 
-            releaseLock(&sleepQueueLock);
-        }
+    // Local APIC timer handler, called on every CPU once clock events are enabled
+    void LocalTimerHandler(void*, regs64_t* r){
+        WakeSleepingThreads();
 
+        SetNextEvent(false); // Schedule sets the next event again if the CPU goes idle
         Scheduler::Tick(r);
     }
 
+    // Busy wait for count PIT ticks using channel 2, which does not raise an interrupt
+    static void PITWait(uint16_t count){
+        outportb(0x61, (inportb(0x61) & ~0x02) | 0x01); // Enable the channel 2 gate, keep the speaker off
+
+        outportb(0x43, 0xB0); // Channel 2, lobyte/hibyte, mode 0 (interrupt on terminal count)
+        outportb(0x42, count & 0xFF);
+        outportb(0x42, count >> 8);
+
+        while(!(inportb(0x61) & 0x20)); // Output goes high once the count reaches zero
+    }
+
+    void InitializeClockEvents(){
+        cpuid_info_t cpuid = CPUID();
+        if(!(cpuid.features_edx & CPUID_EDX_TSC)){
+            Log::Warning("[Timer] No TSC, using the PIT");
+            return;
+        }
+
+        uint32_t maxExtendedLeaf, powerManagementFeatures = 0;
+        asm volatile("cpuid" : "=a"(maxExtendedLeaf) : "a"(0x80000000) : "rbx", "rcx", "rdx");
+        if(maxExtendedLeaf >= 0x80000007){
+            asm volatile("cpuid" : "=d"(powerManagementFeatures) : "a"(0x80000007) : "rbx", "rcx");
+        }
+
+        if(!(powerManagementFeatures & (1 << 8))){
+            Log::Warning("[Timer] TSC is not invariant, time may drift if the CPU changes frequency");
+        }
+
+        bool intsEnabled = CheckInterrupts();
+        asm("cli");
+
+        APIC::Local::Write(LOCAL_APIC_TIMER_DIVIDE, LOCAL_APIC_TIMER_DIVIDE_16);
+        APIC::Local::Write(LOCAL_APIC_LVT_TIMER, LOCAL_APIC_LVT_MASKED | IRQ_LOCAL_TIMER);
+        APIC::Local::Write(LOCAL_APIC_TIMER_INITIAL_COUNT, UINT32_MAX);
+
+        uint64_t tsc = ReadTSC();
+        PITWait(PIT_CALIBRATION_COUNT);
+        uint64_t tscElapsed = ReadTSC() - tsc;
+        uint32_t lapicElapsed = UINT32_MAX - APIC::Local::Read(LOCAL_APIC_TIMER_CURRENT_COUNT);
+
+        APIC::Local::Write(LOCAL_APIC_TIMER_INITIAL_COUNT, 0);
+
+        tscFrequency = tscElapsed * PIT_FREQUENCY / PIT_CALIBRATION_COUNT;
+        lapicFrequency = static_cast<uint64_t>(lapicElapsed) * PIT_FREQUENCY / PIT_CALIBRATION_COUNT;
+
+        tscToNs = (NS_PER_SECOND << 32) / tscFrequency;
+        nsToTSC = ((tscFrequency / NS_PER_SECOND) << 32) + (((tscFrequency % NS_PER_SECOND) << 32) / NS_PER_SECOND);
+
+        tscDeadline = cpuid.features_ecx & CPUID_ECX_TSC_DEADLINE;
+
+        // Carry on from the current PIT uptime
+        tscBaseNs = GetSystemUptimeNs();
+        tscBase = ReadTSC();
+
+        IDT::RegisterInterruptHandler(IRQ_LOCAL_TIMER, LocalTimerHandler);
+        clockEvents = true;
+
+        // Stop the PIT by switching it to one shot mode
+        outportb(0x43, 0x30);
+        outportb(0x40, 0);
+        outportb(0x40, 0);
+
+        InitializeLocalTimer();
+
+        if(intsEnabled) asm("sti");
+
+        Log::Info("[Timer] TSC: %d MHz, Local APIC timer: %d KHz%s", tscFrequency / 1000000, lapicFrequency / 1000, tscDeadline ? ", using TSC deadline" : "");
+    }
+
+    void InitializeLocalTimer(){
+        if(!clockEvents){
+            return;
+        }
+
+        APIC::Local::Write(LOCAL_APIC_TIMER_DIVIDE, LOCAL_APIC_TIMER_DIVIDE_16);
+        APIC::Local::Write(LOCAL_APIC_LVT_TIMER, IRQ_LOCAL_TIMER | (tscDeadline ? LOCAL_APIC_TIMER_MODE_TSC_DEADLINE : LOCAL_APIC_TIMER_MODE_ONESHOT));
+
+        SetNextEvent(false);
+    }
+
     // Initialize
     void Initialize(uint32_t freq) {
         IDT::RegisterInterruptHandler(IRQ0, Handler);
 
         frequency = freq;
-        uint32_t divisor = 1193182 / freq;
+        uint32_t divisor = PIT_FREQUENCY / freq;
 
         // Send the command byte.
         outportb(0x43, 0x36);
@@ -4,8 +4,16 @@
 #include <errno.h>
 #include <fs/filesystem.h>
 #include <fs/fsvolume.h>
+#include <fs/pagecache.h>
+#include <fs/ext2.h>
+#include <fs/dentrycache.h>
+#include <blockqueue.h>
 #include <math.h>
 #include <timer.h>
+#include <smp.h>
+#include <physicalallocator.h>
+#include <slab.h>
+#include <lock.h>
     #include <logging.h>
 	
 class URandom : public Device {
@@ -54,8 +62,307 @@ ssize_t URandom::Write(size_t offset, size_t size, uint8_t *buffer){
     return size;
 }
 
+class MemInfo : public Device {
+public:
+    MemInfo(const char* name) : Device(name, TypeGenericDevice) { 
+        flags = FS_NODE_CHARDEVICE;
+    }
+
+    ssize_t Read(size_t, size_t, uint8_t*);
+    ssize_t Write(size_t, size_t, uint8_t*);
+};
+
+ssize_t MemInfo::Read(size_t offset, size_t size, uint8_t *buffer){
+    char* info = (char*)kmalloc(192 * (SMP::processorCount + 4));
+    char num[24];
+
+    info[0] = 0;
+    strcat(info, "used: ");
+    strcat(info, itoa(Memory::usedPhysicalBlocks * PHYSALLOC_BLOCK_SIZE / 1024, num, 10));
+    strcat(info, " KB\ntotal: ");
+    strcat(info, itoa(Memory::maxPhysicalBlocks * PHYSALLOC_BLOCK_SIZE / 1024, num, 10));
+    strcat(info, " KB\n");
+
+    for(unsigned i = 0; i < SMP::processorCount; i++){
+        frame_cache_t& cache = SMP::cpus[i]->frameCache;
+
+        strcat(info, "cpu");
+        strcat(info, itoa(i, num, 10));
+        strcat(info, " frame cache: ");
+        strcat(info, itoa(cache.count, num, 10));
+        strcat(info, " cached, ");
+        strcat(info, itoa(cache.hits, num, 10));
+        strcat(info, " hits, ");
+        strcat(info, itoa(cache.misses, num, 10));
+        strcat(info, " misses, ");
+        strcat(info, itoa(cache.drains, num, 10));
+        strcat(info, " drains, ");
+        strcat(info, itoa((cache.hits + cache.misses) ? cache.hits * 100 / (cache.hits + cache.misses) : 0, num, 10));
+        strcat(info, "% hit rate\n");
+    }
+
+    strcat(info, "page cache: ");
+    strcat(info, itoa(fs::PageCache::cachedPages, num, 10));
+    strcat(info, " cached, ");
+    strcat(info, itoa(fs::PageCache::hits, num, 10));
+    strcat(info, " hits, ");
+    strcat(info, itoa(fs::PageCache::misses, num, 10));
+    strcat(info, " misses, ");
+    strcat(info, itoa(fs::PageCache::evictions, num, 10));
+    strcat(info, " evictions\n");
+
+    strcat(info, "ext2 block cache: ");
+    strcat(info, itoa(fs::Ext2::blockCacheMemoryUsage / 1024, num, 10));
+    strcat(info, " KB, ");
+    strcat(info, itoa(fs::Ext2::blockCacheHits, num, 10));
+    strcat(info, " hits, ");
+    strcat(info, itoa(fs::Ext2::blockCacheMisses, num, 10));
+    strcat(info, " misses, ");
+    strcat(info, itoa(fs::Ext2::blockCacheEvictions, num, 10));
+    strcat(info, " evictions, ");
+    strcat(info, itoa(fs::Ext2::blockCacheWritebacks, num, 10));
+    strcat(info, " writebacks\n");
+
+    strcat(info, "dentry cache: ");
+    strcat(info, itoa(fs::DentryCache::cachedEntries, num, 10));
+    strcat(info, " cached, ");
+    strcat(info, itoa(fs::DentryCache::hits, num, 10));
+    strcat(info, " hits, ");
+    strcat(info, itoa(fs::DentryCache::misses, num, 10));
+    strcat(info, " misses\n");
+
+    size_t len = strlen(info);
+    if(offset >= len){
+        kfree(info);
+        return 0;
+    }
+
+    if(size > len - offset) size = len - offset;
+    memcpy(buffer, info + offset, size);
+
+    kfree(info);
+    return size;
+}
+
+ssize_t MemInfo::Write(size_t offset, size_t size, uint8_t *buffer){
+    return -EROFS;
+}
+
+class DiskStats : public Device {
+public:
+    DiskStats(const char* name) : Device(name, TypeGenericDevice) { 
+        flags = FS_NODE_CHARDEVICE;
+    }
+
+    ssize_t Read(size_t, size_t, uint8_t*);
+    ssize_t Write(size_t, size_t, uint8_t*);
+};
+
+ssize_t DiskStats::Read(size_t offset, size_t size, uint8_t *buffer){
+    bool intsEnabled = CheckInterrupts();
+    asm("cli"); // Waiting workers hold the lock with interrupts disabled
+    acquireLock(&BlockQueue::lock);
+
+    char* info = (char*)kmalloc(256 * (BlockQueue::queues.get_length() + 1));
+    char num[24];
+
+    info[0] = 0;
+    for(BlockQueue* queue : BlockQueue::queues){
+        strcat(info, queue->disk->GetName());
+        strcat(info, ": ");
+        strcat(info, itoa(queue->queued, num, 10));
+        strcat(info, " queued, ");
+        strcat(info, itoa(queue->inFlight, num, 10));
+        strcat(info, " in flight, ");
+        strcat(info, itoa(queue->maxDepth, num, 10));
+        strcat(info, " max depth, ");
+        strcat(info, itoa(queue->completed, num, 10));
+        strcat(info, " requests, ");
+        strcat(info, itoa(queue->merged, num, 10));
+        strcat(info, " merged, ");
+        strcat(info, itoa(queue->errors, num, 10));
+        strcat(info, " errors, ");
+        strcat(info, itoa(queue->completed ? queue->totalLatency / queue->completed : 0, num, 10));
+        strcat(info, " ms average latency, ");
+        strcat(info, itoa(queue->maxLatency, num, 10));
+        strcat(info, " ms max latency\n");
+    }
+
+    releaseLock(&BlockQueue::lock);
+    if(intsEnabled) asm("sti");
+
+    size_t len = strlen(info);
+    if(offset >= len){
+        kfree(info);
+        return 0;
+    }
+
+    if(size > len - offset) size = len - offset;
+    memcpy(buffer, info + offset, size);
+
+    kfree(info);
+    return size;
+}
+
+ssize_t DiskStats::Write(size_t offset, size_t size, uint8_t *buffer){
+    return -EROFS;
+}
+
+class SchedStats : public Device {
+public:
+    SchedStats(const char* name) : Device(name, TypeGenericDevice) { 
+        flags = FS_NODE_CHARDEVICE;
+    }
+
+    ssize_t Read(size_t, size_t, uint8_t*);
+    ssize_t Write(size_t, size_t, uint8_t*);
+};
+
+ssize_t SchedStats::Read(size_t offset, size_t size, uint8_t *buffer){
+    char* info = (char*)kmalloc(192 * SMP::processorCount);
+    char num[24];
+
+    info[0] = 0;
+    for(unsigned i = 0; i < SMP::processorCount; i++){
+        CPU* cpu = SMP::cpus[i];
+
+        strcat(info, "cpu");
+        strcat(info, itoa(i, num, 10));
+        strcat(info, ": ");
+        strcat(info, itoa(cpu->runQueue->get_length(), num, 10));
+        strcat(info, " threads, ");
+        strcat(info, itoa(cpu->busyTicks, num, 10));
+        strcat(info, " busy ticks, ");
+        strcat(info, itoa(cpu->idleTicks, num, 10));
+        strcat(info, " idle ticks, ");
+        strcat(info, itoa(cpu->migrations, num, 10));
+        strcat(info, " migrations\n");
+    }
+
+    size_t len = strlen(info);
+    if(offset >= len){
+        kfree(info);
+        return 0;
+    }
+
+    if(size > len - offset) size = len - offset;
+    memcpy(buffer, info + offset, size);
+
+    kfree(info);
+    return size;
+}
+
+ssize_t SchedStats::Write(size_t offset, size_t size, uint8_t *buffer){
+    return -EROFS;
+}
+
+class SlabInfo : public Device {
+public:
+    SlabInfo(const char* name) : Device(name, TypeGenericDevice) { 
+        flags = FS_NODE_CHARDEVICE;
+    }
+
+    ssize_t Read(size_t, size_t, uint8_t*);
+    ssize_t Write(size_t, size_t, uint8_t*);
+};
+
+ssize_t SlabInfo::Read(size_t offset, size_t size, uint8_t *buffer){
+    char* info = (char*)kmalloc(4096);
+
+    size_t len = ObjectCache::GetStatistics(info, 4096);
+    if(offset >= len){
+        kfree(info);
+        return 0;
+    }
+
+    if(size > len - offset) size = len - offset;
+    memcpy(buffer, info + offset, size);
+
+    kfree(info);
+    return size;
+}
+
+ssize_t SlabInfo::Write(size_t offset, size_t size, uint8_t *buffer){
+    return -EROFS;
+}
+
+#ifdef LOCK_STATISTICS
+class LockStats : public Device {
+public:
+    LockStats(const char* name) : Device(name, TypeGenericDevice) { 
+        flags = FS_NODE_CHARDEVICE;
+    }
+
+    ssize_t Read(size_t, size_t, uint8_t*);
+    ssize_t Write(size_t, size_t, uint8_t*);
+};
+
+ssize_t LockStats::Read(size_t offset, size_t size, uint8_t *buffer){
+    char* info = (char*)kmalloc(4096);
+
+    size_t len = GetLockStatistics(info, 4096);
+    if(offset >= len){
+        kfree(info);
+        return 0;
+    }
+
+    if(size > len - offset) size = len - offset;
+    memcpy(buffer, info + offset, size);
+
+    kfree(info);
+    return size;
+}
+
+ssize_t LockStats::Write(size_t offset, size_t size, uint8_t *buffer){
+    return -EROFS;
+}
+#endif
+
+#ifdef PHYSALLOC_BENCHMARK
+class PhysAllocBench : public Device {
+    char results[1024];
+    size_t resultsLength = 0;
+public:
+    PhysAllocBench(const char* name) : Device(name, TypeGenericDevice) { 
+        flags = FS_NODE_CHARDEVICE;
+    }
+
+    ssize_t Read(size_t, size_t, uint8_t*);
+    ssize_t Write(size_t, size_t, uint8_t*);
+};
+
+ssize_t PhysAllocBench::Read(size_t offset, size_t size, uint8_t *buffer){
+    if(offset == 0){ // Only run again when reading from the start, so reading the rest of the results does not
+        resultsLength = Memory::RunAllocatorBenchmark(results, sizeof(results));
+    }
+
+    if(offset >= resultsLength){
+        return 0;
+    }
+
+    if(size > resultsLength - offset) size = resultsLength - offset;
+    memcpy(buffer, results + offset, size);
+
+    return size;
+}
+
+ssize_t PhysAllocBench::Write(size_t offset, size_t size, uint8_t *buffer){
+    return -EROFS;
+}
+#endif
+
 Null null = Null("null");
 URandom urand = URandom("urandom");
+MemInfo meminfo = MemInfo("meminfo");
+DiskStats diskstats = DiskStats("diskstats");
+SchedStats schedstats = SchedStats("schedstats");
+SlabInfo slabinfo = SlabInfo("slabinfo");
+#ifdef LOCK_STATISTICS
+LockStats lockstats = LockStats("lockstats");
+#endif
+#ifdef PHYSALLOC_BENCHMARK
+PhysAllocBench physallocbench = PhysAllocBench("physallocbench");
+#endif
 
 namespace DeviceManager{
     List<Device*> devices;
@@ -67,6 +374,7 @@ namespace DeviceManager{
     public:
         DevFS(const char* name){
             flags = FS_NODE_DIRECTORY;
+            dentryCached = true; // RegisterDevice invalidates the name of new devices
 
             vol.mountPoint = this;
             vol.mountPointDirent = DirectoryEntry(this, name);
@@ -118,11 +426,23 @@ namespace DeviceManager{
     void InitializeBasicDevices(){
         RegisterDevice(null);
         RegisterDevice(urand);
+        RegisterDevice(meminfo);
+        RegisterDevice(diskstats);
+        RegisterDevice(schedstats);
+        RegisterDevice(slabinfo);
+#ifdef LOCK_STATISTICS
+        RegisterDevice(lockstats);
+#endif
+#ifdef PHYSALLOC_BENCHMARK
+        RegisterDevice(physallocbench);
+#endif
     }
 
     void RegisterDevice(Device& dev){
         Log::Info("registering %s", dev.GetName());
         devices.add_back(&dev);
+
+        fs::DentryCache::Invalidate(&devfs, dev.GetName()); // Drop any cached lookup that failed
     }
 
     FsNode* GetDevFS(){
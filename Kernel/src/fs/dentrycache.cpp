@@ -0,0 +1,170 @@
+#include <fs/dentrycache.h>
+
+#include <lock.h>
+#include <hash.h>
+#include <string.h>
+
+namespace fs::DentryCache{
+    typedef struct Dentry {
+        FsNode* parent;
+        FsNode* node; // nullptr for names that do not exist
+        char* name;
+        unsigned bucket;
+
+        Dentry* hashNext = nullptr;
+        Dentry* lruPrev = nullptr;
+        Dentry* lruNext = nullptr;
+    } dentry_t;
+
+    dentry_t* buckets[DENTRY_CACHE_BUCKETS];
+    dentry_t* lruFront = nullptr; // Least recently used entry
+    dentry_t* lruBack = nullptr; // Most recently used entry
+
+    lock_t cacheLock = 0;
+    uint64_t generation = 0; // Incremented whenever an entry is invalidated
+
+    uint64_t cachedEntries = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+
+    static inline unsigned GetBucket(FsNode* parent, const char* name){
+        uintptr_t p = reinterpret_cast<uintptr_t>(parent);
+        return (hash(name) ^ hash(static_cast<unsigned>(p ^ (p >> 32)))) % DENTRY_CACHE_BUCKETS;
+    }
+
+    // The following require cacheLock to be held
+    static dentry_t* Find(FsNode* parent, const char* name, unsigned bucket){
+        dentry_t* dentry = buckets[bucket];
+        while(dentry && !(dentry->parent == parent && strcmp(dentry->name, name) == 0)){
+            dentry = dentry->hashNext;
+        }
+
+        return dentry;
+    }
+
+    static void LRURemove(dentry_t* dentry){
+        if(dentry->lruPrev) dentry->lruPrev->lruNext = dentry->lruNext;
+        else lruFront = dentry->lruNext;
+
+        if(dentry->lruNext) dentry->lruNext->lruPrev = dentry->lruPrev;
+        else lruBack = dentry->lruPrev;
+
+        dentry->lruPrev = dentry->lruNext = nullptr;
+    }
+
+    static void LRUAppend(dentry_t* dentry){
+        dentry->lruPrev = lruBack;
+        dentry->lruNext = nullptr;
+
+        if(lruBack) lruBack->lruNext = dentry;
+        else lruFront = dentry;
+
+        lruBack = dentry;
+    }
+
+    // Unlink dentry from the cache and drop its handles.
+    // The handles are dropped without closing the nodes, so nodes are kept around like any other node found with FindDir.
+    static void Remove(dentry_t* dentry){
+        dentry_t** link = &buckets[dentry->bucket];
+        while(*link != dentry){
+            link = &(*link)->hashNext;
+        }
+        *link = dentry->hashNext;
+
+        LRURemove(dentry);
+        cachedEntries--;
+
+        dentry->parent->handleCount--;
+        if(dentry->node){
+            dentry->node->handleCount--;
+        }
+
+        delete[] dentry->name;
+        delete dentry;
+    }
+
+    bool Lookup(FsNode* parent, const char* name, FsNode*& node, uint64_t& gen){
+        acquireLock(&cacheLock);
+
+        dentry_t* dentry = Find(parent, name, GetBucket(parent, name));
+        if(!dentry){
+            misses++;
+            gen = generation;
+
+            releaseLock(&cacheLock);
+            return false;
+        }
+
+        hits++;
+        node = dentry->node;
+
+        LRURemove(dentry);
+        LRUAppend(dentry);
+
+        releaseLock(&cacheLock);
+        return true;
+    }
+
+    void Insert(FsNode* parent, const char* name, FsNode* node, uint64_t gen){
+        unsigned bucket = GetBucket(parent, name);
+
+        acquireLock(&cacheLock);
+
+        if(gen != generation || Find(parent, name, bucket)){ // Stale or someone else got here first
+            releaseLock(&cacheLock);
+            return;
+        }
+
+        dentry_t* dentry = new dentry_t;
+        dentry->parent = parent;
+        dentry->node = node;
+        dentry->name = strdup(name);
+        dentry->bucket = bucket;
+
+        parent->handleCount++;
+        if(node){
+            node->handleCount++;
+        }
+
+        dentry->hashNext = buckets[bucket];
+        buckets[bucket] = dentry;
+        LRUAppend(dentry);
+        cachedEntries++;
+
+        while(cachedEntries > DENTRY_CACHE_MAX_ENTRIES){
+            Remove(lruFront);
+        }
+
+        releaseLock(&cacheLock);
+    }
+
+    void Invalidate(FsNode* parent, const char* name){
+        acquireLock(&cacheLock);
+
+        generation++;
+        if(dentry_t* dentry = Find(parent, name, GetBucket(parent, name))){
+            Remove(dentry);
+        }
+
+        releaseLock(&cacheLock);
+    }
+
+    void InvalidateDirectory(FsNode* dir){
+        acquireLock(&cacheLock);
+
+        generation++;
+
+        dentry_t* dentry = lruFront;
+        while(dentry){
+            dentry_t* next = dentry->lruNext;
+
+            if(dentry->parent == dir){
+                Remove(dentry);
+            }
+
+            dentry = next;
+        }
+
+        releaseLock(&cacheLock);
+    }
+}
@@ -0,0 +1,282 @@
+#include <fs/epoll.h>
+
+#include <scheduler.h>
+#include <timer.h>
+#include <cpu.h>
+#include <errno.h>
+
+namespace fs{
+    static inline int ToPollEvents(uint32_t events){
+        int pollEvents = 0;
+
+        if(events & EPOLLIN) pollEvents |= POLLIN;
+        if(events & EPOLLOUT) pollEvents |= POLLOUT;
+        if(events & EPOLLPRI) pollEvents |= POLLPRI;
+
+        return pollEvents;
+    }
+
+    static inline uint32_t ToEPollEvents(int pollEvents){
+        uint32_t events = 0;
+
+        if(pollEvents & POLLIN) events |= EPOLLIN;
+        if(pollEvents & POLLOUT) events |= EPOLLOUT;
+        if(pollEvents & POLLPRI) events |= EPOLLPRI;
+        if(pollEvents & POLLHUP) events |= EPOLLHUP;
+        if(pollEvents & POLLERR) events |= EPOLLERR;
+
+        return events;
+    }
+
+    void EPoll::Interest::Signal(){
+        if(disabled){
+            return;
+        }
+
+        epoll->QueueReady(this);
+        epoll->SignalWatchers();
+    }
+
+    EPoll::EPoll(){
+
+    }
+
+    EPoll::~EPoll(){
+        acquireLock(&interestsLock);
+        while(interests.get_length()){
+            delete interests.remove_at(0); // Stops watching and closes the node
+        }
+        releaseLock(&interestsLock);
+    }
+
+    void EPoll::Close(){
+        FsNode::Close();
+
+        if(handleCount == 0){
+            delete this;
+        }
+    }
+
+    EPoll::Interest* EPoll::FindInterest(int fd, FsNode* node){
+        for(Interest* interest : interests){
+            if(interest->fd == fd && interest->node == node){
+                return interest;
+            }
+        }
+
+        return nullptr;
+    }
+
+    void EPoll::QueueReady(Interest* interest){
+        bool intsEnabled = CheckInterrupts();
+        asm("cli");
+        acquireLock(&readyLock);
+
+        if(!interest->ready){
+            interest->ready = true;
+            interest->nextReady = nullptr;
+
+            if(readyBack){
+                readyBack->nextReady = interest;
+            } else {
+                readyFront = interest;
+            }
+            readyBack = interest;
+            readyCount++;
+        }
+
+        releaseLock(&readyLock);
+        if(intsEnabled) asm("sti");
+    }
+
+    void EPoll::UnqueueReady(Interest* interest){
+        bool intsEnabled = CheckInterrupts();
+        asm("cli");
+        acquireLock(&readyLock);
+
+        if(interest->ready){
+            Interest* prev = nullptr;
+            for(Interest* i = readyFront; i != interest; i = i->nextReady){
+                prev = i;
+            }
+
+            if(prev){
+                prev->nextReady = interest->nextReady;
+            } else {
+                readyFront = interest->nextReady;
+            }
+
+            if(readyBack == interest){
+                readyBack = prev;
+            }
+
+            interest->ready = false;
+            interest->nextReady = nullptr;
+            readyCount--;
+        }
+
+        releaseLock(&readyLock);
+        if(intsEnabled) asm("sti");
+    }
+
+    int EPoll::Control(int op, int fd, FsNode* node, epoll_event* event){
+        if(node->IsEPoll()){
+            return -EINVAL; // Nested epolls could end up signalling each other in a loop
+        }
+
+        int type = node->flags & FS_NODE_TYPE;
+        if(type == FS_NODE_FILE || type == FS_NODE_DIRECTORY){
+            return -EPERM; // Always ready, same as Linux
+        }
+
+        int ret = 0;
+
+        acquireLock(&interestsLock);
+        Interest* interest = FindInterest(fd, node);
+
+        switch(op){
+        case EPOLL_CTL_ADD:
+            if(interest){
+                ret = -EEXIST;
+                break;
+            }
+
+            interest = new Interest(this, fd, node);
+            interest->events = event->events;
+            interest->data = event->data;
+            interests.add_back(interest);
+
+            interest->WatchNode(node, ToPollEvents(event->events));
+            interest->Signal(); // Nodes only signal changes, so check whether it is ready already
+            break;
+        case EPOLL_CTL_MOD:
+            if(!interest){
+                ret = -ENOENT;
+                break;
+            }
+
+            interest->events = event->events;
+            interest->data = event->data;
+            interest->disabled = false;
+
+            interest->Signal();
+            break;
+        case EPOLL_CTL_DEL:
+            if(!interest){
+                ret = -ENOENT;
+                break;
+            }
+
+            for(unsigned i = 0; i < interests.get_length(); i++){
+                if(interests[i] == interest){
+                    interests.remove_at(i);
+                    break;
+                }
+            }
+
+            // The node could signal the interest again until it stops watching
+            interest->UnwatchNodes();
+            UnqueueReady(interest);
+
+            delete interest;
+            break;
+        default:
+            ret = -EINVAL;
+            break;
+        }
+
+        releaseLock(&interestsLock);
+        return ret;
+    }
+
+    int EPoll::CollectEvents(epoll_event* events, int maxEvents){
+        int count = 0;
+
+        acquireLock(&interestsLock);
+
+        // Only look at the interests that were ready when we started, level triggered interests are put back at the end
+        bool intsEnabled = CheckInterrupts();
+        asm("cli");
+        acquireLock(&readyLock);
+        unsigned pending = readyCount;
+        releaseLock(&readyLock);
+        if(intsEnabled) asm("sti");
+
+        while(pending-- && count < maxEvents){
+            asm("cli");
+            acquireLock(&readyLock);
+
+            Interest* interest = readyFront;
+            if(interest){
+                readyFront = interest->nextReady;
+                if(!readyFront){
+                    readyBack = nullptr;
+                }
+
+                interest->ready = false;
+                interest->nextReady = nullptr;
+                readyCount--;
+            }
+
+            releaseLock(&readyLock);
+            if(intsEnabled) asm("sti");
+
+            if(!interest){
+                break;
+            }
+
+            if(interest->disabled){
+                continue;
+            }
+
+            // Anything that changes after being taken off the ready list signals the interest again
+            uint32_t revents = ToEPollEvents(PollNode(interest->node, ToPollEvents(interest->events))) & (interest->events | EPOLLHUP | EPOLLERR);
+            if(!revents){
+                continue;
+            }
+
+            events[count].events = revents;
+            events[count].data = interest->data;
+            count++;
+
+            if(interest->events & EPOLLONESHOT){
+                interest->disabled = true;
+            } else if(!(interest->events & EPOLLET)){
+                QueueReady(interest); // Checked again by the next wait, until it is no longer ready
+            }
+        }
+
+        releaseLock(&interestsLock);
+        return count;
+    }
+
+    int EPoll::Wait(epoll_event* events, int maxEvents, long timeout){
+        int count = CollectEvents(events, maxEvents);
+        if(count || !timeout){
+            return count;
+        }
+
+        thread_t* thread = GetCPULocal()->currentThread;
+        uint64_t deadline = Timer::GetSystemUptimeNs() + timeout * 1000000;
+
+        FilesystemWatcher watcher;
+        watcher.WatchNode(this, POLLIN);
+
+        // Check again once watching, any interest becoming ready after this signals the watcher
+        while(!(count = CollectEvents(events, maxEvents)) && thread->state != ThreadStateZombie){
+            if(timeout < 0){ // Wait indefinitely
+                watcher.Wait();
+                continue;
+            }
+
+            uint64_t now = Timer::GetSystemUptimeNs();
+            if(now >= deadline){
+                break;
+            }
+
+            watcher.WaitTimeout(deadline - now);
+        }
+
+        return count;
+    }
+}
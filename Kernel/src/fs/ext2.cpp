@@ -1,15 +1,151 @@
 #include <fs/ext2.h>
 
+#include <fs/pagecache.h>
+#include <fs/dentrycache.h>
 #include <logging.h>
 #include <errno.h>
 #include <assert.h>
 #include <math.h>
+#include <scheduler.h>
+#include <timer.h>
  
-#ifdef EXT2_ENABLE_TIMER
-    #include <timer.h>
-#endif
-
 namespace fs::Ext2{
+    uint64_t blockCacheMemoryUsage = 0;
+    uint64_t blockCacheHits = 0;
+    uint64_t blockCacheMisses = 0;
+    uint64_t blockCacheEvictions = 0;
+    uint64_t blockCacheWritebacks = 0;
+
+    static List<Ext2Volume*> volumes; // Mounted volumes, flushed by the writeback thread
+    static lock_t volumesLock = 0;
+    static bool writebackThreadStarted = false;
+
+    [[noreturn]] static void WritebackThread(){
+        for(;;){
+            Timer::SleepCurrentThread(EXT2_WRITEBACK_INTERVAL * Timer::GetFrequency());
+
+            acquireLock(&volumesLock);
+            unsigned count = volumes.get_length();
+            releaseLock(&volumesLock);
+
+            for(unsigned i = 0; i < count; i++){ // Volumes are never removed
+                acquireLock(&volumesLock);
+                Ext2Volume* vol = volumes.get_at(i);
+                releaseLock(&volumesLock);
+
+                vol->SyncBlocks();
+            }
+        }
+    }
+
+    // Directory index hashes, these have to match the ones used by Linux bit for bit
+    static uint32_t LegacyHash(const char* name, int len, bool isUnsigned){
+        uint32_t hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+
+        while(len--){
+            int c = isUnsigned ? static_cast<int>(static_cast<uint8_t>(*name)) : static_cast<int>(static_cast<int8_t>(*name));
+            name++;
+
+            hash = hash1 + (hash0 ^ (c * 7152373));
+            if(hash & 0x80000000) hash -= 0x7fffffff;
+
+            hash1 = hash0;
+            hash0 = hash;
+        }
+
+        return hash0 << 1;
+    }
+
+    // Packs (up to) num * 4 characters of name into buf, padding with the length of the name
+    static void StringToHashBuffer(const char* name, int len, uint32_t* buf, int num, bool isUnsigned){
+        uint32_t pad = static_cast<uint32_t>(len) | (static_cast<uint32_t>(len) << 8);
+        pad |= pad << 16;
+
+        uint32_t val = pad;
+        if(len > num * 4) len = num * 4;
+
+        for(int i = 0; i < len; i++){
+            int c = isUnsigned ? static_cast<int>(static_cast<uint8_t>(name[i])) : static_cast<int>(static_cast<int8_t>(name[i]));
+            val = c + (val << 8);
+
+            if((i % 4) == 3){
+                *buf++ = val;
+                val = pad;
+                num--;
+            }
+        }
+
+        if(--num >= 0) *buf++ = val;
+        while(--num >= 0) *buf++ = pad;
+    }
+
+    static inline uint32_t RotateLeft(uint32_t value, unsigned shift){
+        return (value << shift) | (value >> (32 - shift));
+    }
+
+    static void HalfMD4Transform(uint32_t buf[4], const uint32_t in[8]){
+        uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+        #define F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+        #define G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+        #define H(x, y, z) ((x) ^ (y) ^ (z))
+        #define ROUND(f, a, b, c, d, x, s) (a += f(b, c, d) + (x), a = RotateLeft(a, s))
+        const uint32_t k2 = 013240474631U;
+        const uint32_t k3 = 015666365641U;
+
+        ROUND(F, a, b, c, d, in[0], 3);
+        ROUND(F, d, a, b, c, in[1], 7);
+        ROUND(F, c, d, a, b, in[2], 11);
+        ROUND(F, b, c, d, a, in[3], 19);
+        ROUND(F, a, b, c, d, in[4], 3);
+        ROUND(F, d, a, b, c, in[5], 7);
+        ROUND(F, c, d, a, b, in[6], 11);
+        ROUND(F, b, c, d, a, in[7], 19);
+
+        ROUND(G, a, b, c, d, in[1] + k2, 3);
+        ROUND(G, d, a, b, c, in[3] + k2, 5);
+        ROUND(G, c, d, a, b, in[5] + k2, 9);
+        ROUND(G, b, c, d, a, in[7] + k2, 13);
+        ROUND(G, a, b, c, d, in[0] + k2, 3);
+        ROUND(G, d, a, b, c, in[2] + k2, 5);
+        ROUND(G, c, d, a, b, in[4] + k2, 9);
+        ROUND(G, b, c, d, a, in[6] + k2, 13);
+
+        ROUND(H, a, b, c, d, in[3] + k3, 3);
+        ROUND(H, d, a, b, c, in[7] + k3, 9);
+        ROUND(H, c, d, a, b, in[2] + k3, 11);
+        ROUND(H, b, c, d, a, in[6] + k3, 15);
+        ROUND(H, a, b, c, d, in[1] + k3, 3);
+        ROUND(H, d, a, b, c, in[5] + k3, 9);
+        ROUND(H, c, d, a, b, in[0] + k3, 11);
+        ROUND(H, b, c, d, a, in[4] + k3, 15);
+
+        #undef F
+        #undef G
+        #undef H
+        #undef ROUND
+
+        buf[0] += a;
+        buf[1] += b;
+        buf[2] += c;
+        buf[3] += d;
+    }
+
+    static void TeaTransform(uint32_t buf[4], const uint32_t in[4]){
+        uint32_t sum = 0;
+        uint32_t b0 = buf[0], b1 = buf[1];
+        uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+
+        for(int n = 0; n < 16; n++){
+            sum += 0x9E3779B9;
+            b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+            b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+        }
+
+        buf[0] += b0;
+        buf[1] += b1;
+    }
+
     int Identify(PartitionDevice* part){
         ext2_superblock_t* superblock = (ext2_superblock_t*)kmalloc(sizeof(ext2_superblock_t));
 
@@ -58,8 +194,12 @@ namespace fs::Ext2{
 
             if(superext.featuresRoCompat & ReadonlyFeatures::Sparse) sparse = true;
             else sparse = false;
+
+            if(superext.featuresCompat & CompatibleFeatures::DirectoryIndexing) dirIndex = true;
+            else dirIndex = false;
         } else {
             memset(&superext, 0, sizeof(ext2_superblock_extended_t));
+            dirIndex = false;
         }
 
         blockGroupCount = (super.blockCount % super.blocksPerGroup) ? (super.blockCount / super.blocksPerGroup + 1) : (super.blockCount / super.blocksPerGroup); // Round up
@@ -72,6 +212,7 @@ namespace fs::Ext2{
         }
 
         blocksize = 1024U << super.logBlockSize;
+        blockCacheCapacity = EXT2_BLOCK_CACHE_SIZE / blocksize;
         superBlockIndex = LocationToBlock(EXT2_SUPERBLOCK_LOCATION);
 
         if(super.revLevel){
@@ -82,7 +223,7 @@ namespace fs::Ext2{
 
         Log::Info("[Ext2] Initializing Volume\tRevision: %d, Block Size: %d, %d KB/%d KB used, Last mounted on: %s", super.revLevel, blocksize, super.freeBlockCount * blocksize / 1024, super.blockCount * blocksize / 1024, superext.lastMounted);
         Log::Info("[Ext2] Block Group Count: %d, Inodes Per Block Group: %d, Inode Size: %d", blockGroupCount, super.inodesPerGroup, inodeSize);
-        Log::Info("[Ext2] Sparse Superblock? %s Large Files? %s, Filetype Extension? %s", (sparse ? "Yes" : "No"), (largeFiles ? "Yes" : "No"), (filetype ? "Yes" : "No"));
+        Log::Info("[Ext2] Sparse Superblock? %s Large Files? %s, Filetype Extension? %s, Directory Indexing? %s", (sparse ? "Yes" : "No"), (largeFiles ? "Yes" : "No"), (filetype ? "Yes" : "No"), (dirIndex ? "Yes" : "No"));
 
         blockGroups = (ext2_blockgrp_desc_t*)kmalloc(blockGroupCount * sizeof(ext2_blockgrp_desc_t));
         
@@ -106,6 +247,15 @@ namespace fs::Ext2{
 
         mountPointDirent.node = mountPoint; 
         strcpy(mountPointDirent.name, name);
+
+        acquireLock(&volumesLock);
+        volumes.add_back(this);
+        releaseLock(&volumesLock);
+
+        if(!writebackThreadStarted){
+            writebackThreadStarted = true;
+            Scheduler::CreateChildThread(Scheduler::GetCurrentProcess(), (uintptr_t)WritebackThread, (uintptr_t)kmalloc(EXT2_WRITEBACK_STACK_SIZE) + EXT2_WRITEBACK_STACK_SIZE);
+        }
     }
 
     void Ext2Volume::WriteSuperblock(){
@@ -360,6 +510,14 @@ namespace fs::Ext2{
         if(block > super.blockCount)
             return 1;
 
+        acquireLock(&blockCacheLock);
+        if(ext2_cached_block_t* cached = blockCache.get(block)){ // The cached copy may not have been written back yet
+            memcpy(buffer, cached->data, blocksize);
+            releaseLock(&blockCacheLock);
+            return 0;
+        }
+        releaseLock(&blockCacheLock);
+
         if(int e = part->Read(BlockToLBA(block), blocksize, buffer)){
             Log::Error("[Ext2] Disk error (%d) reading block %d (blocksize: %d)", e, block, blocksize);
             return e;
@@ -372,7 +530,29 @@ namespace fs::Ext2{
         if(block > super.blockCount)
             return 1;
 
-        if(int e = part->Write(BlockToLBA(block), blocksize, buffer)){
+        acquireLock(&blockCacheLock);
+        bool wasCached = false;
+        if(ext2_cached_block_t* cached = blockCache.get(block)){ // Keep the cached copy up to date, it is clean once we have written it
+            memcpy(cached->data, buffer, blocksize);
+            cached->writesInFlight++; // Keep it cached until the disk is up to date
+            wasCached = true;
+            if(cached->dirty){
+                cached->dirty = false;
+                blockCacheDirtyCount--;
+            }
+        }
+        releaseLock(&blockCacheLock);
+
+        int e = part->Write(BlockToLBA(block), blocksize, buffer);
+
+        acquireLock(&blockCacheLock);
+        ext2_cached_block_t* cached = wasCached ? blockCache.get(block) : nullptr;
+        if(cached && cached->writesInFlight){ // May have been dropped and cached again in the meantime
+            cached->writesInFlight--;
+        }
+        releaseLock(&blockCacheLock);
+
+        if(e){
             Log::Error("[Ext2] Disk error (%e) reading block %d (blocksize: %d)", e, block, blocksize);
             return e;
         }
@@ -380,24 +560,73 @@ namespace fs::Ext2{
         return 0;
     }
     
+    int Ext2Volume::ReadBlocks(uint32_t block, uint32_t count, void* buffer){
+        if(block + count - 1 > super.blockCount)
+            return 1;
+
+        if(int e = part->Read(BlockToLBA(block), count * blocksize, buffer)){
+            Log::Error("[Ext2] Disk error (%d) reading blocks %d-%d (blocksize: %d)", e, block, block + count - 1, blocksize);
+            return e;
+        }
+
+        // Cached blocks are never older than the disk, but the disk may be older than them
+        // if they are dirty, being written back, or were written while we were reading
+        acquireLock(&blockCacheLock);
+        for(uint32_t i = 0; i < count; i++){
+            if(ext2_cached_block_t* cached = blockCache.get(block + i)){
+                memcpy(reinterpret_cast<uint8_t*>(buffer) + i * blocksize, cached->data, blocksize);
+            }
+        }
+        releaseLock(&blockCacheLock);
+
+        return 0;
+    }
+
     int Ext2Volume::ReadBlockCached(uint32_t block, void* buffer){
         if(block > super.blockCount)
             return 1;
 
-        uint8_t* cachedBlock;
-        if((cachedBlock = blockCache.get(block))){
-            memcpy(buffer, cachedBlock, blocksize);
-        } else {
-            cachedBlock = (uint8_t*)kmalloc(blocksize);
-            if(int e = part->Read(BlockToLBA(block), blocksize, cachedBlock)){
-                Log::Error("[Ext2] Disk error (%d) reading block %d (blocksize: %d)", e, block, blocksize);
-                return e;
-            }
-            blockCache.insert(block, cachedBlock);
-            blockCacheMemoryUsage += blocksize;
-            
-            memcpy(buffer, cachedBlock, blocksize);
+        acquireLock(&blockCacheLock);
+        if(ext2_cached_block_t* cached = blockCache.get(block)){
+            memcpy(buffer, cached->data, blocksize);
+            TouchCachedBlock(cached);
+            blockCacheHits++;
+
+            releaseLock(&blockCacheLock);
+            return 0;
         }
+        blockCacheMisses++;
+        releaseLock(&blockCacheLock); // Don't hold the lock during disk access
+
+        uint8_t* data = (uint8_t*)kmalloc(blocksize);
+        if(int e = part->Read(BlockToLBA(block), blocksize, data)){
+            Log::Error("[Ext2] Disk error (%d) reading block %d (blocksize: %d)", e, block, blocksize);
+            kfree(data);
+            return e;
+        }
+
+        acquireLock(&blockCacheLock);
+        if(ext2_cached_block_t* cached = blockCache.get(block)){ // Someone cached the block while we were reading it
+            memcpy(buffer, cached->data, blocksize);
+            releaseLock(&blockCacheLock);
+
+            kfree(data);
+            return 0;
+        }
+
+        ext2_cached_block_t* cached = new ext2_cached_block_t;
+        cached->block = block;
+        cached->data = data;
+        blockCache.insert(block, cached);
+        TouchCachedBlock(cached);
+
+        blockCacheCount++;
+        blockCacheMemoryUsage += blocksize;
+
+        memcpy(buffer, data, blocksize);
+        EvictBlocks();
+
+        releaseLock(&blockCacheLock);
         return 0;
     }
     
@@ -405,18 +634,172 @@ namespace fs::Ext2{
         if(block > super.blockCount)
             return -1;
 
-        uint8_t* cachedBlock;
-        if((cachedBlock = blockCache.get(block))){
-            memcpy(cachedBlock, buffer, blocksize);
+        acquireLock(&blockCacheLock);
+        ext2_cached_block_t* cached = blockCache.get(block);
+        if(!cached){
+            cached = new ext2_cached_block_t;
+            cached->block = block;
+            cached->data = (uint8_t*)kmalloc(blocksize);
+            blockCache.insert(block, cached);
+
+            blockCacheCount++;
+            blockCacheMemoryUsage += blocksize;
         }
-        
-        if(int e = part->Write(BlockToLBA(block), blocksize, buffer)){
-            Log::Error("[Ext2] Disk error (%d) reading block %d (blocksize: %d)", e, block, blocksize);
-            return e;
+
+        memcpy(cached->data, buffer, blocksize);
+        TouchCachedBlock(cached);
+
+        if(!cached->dirty){ // Written back later by the writeback thread
+            cached->dirty = true;
+            blockCacheDirtyCount++;
+        }
+
+        EvictBlocks();
+
+        bool throttle = blockCacheDirtyCount > blockCacheCapacity / 2;
+        releaseLock(&blockCacheLock);
+
+        if(throttle){ // Too much of the cache is dirty, write back now instead of waiting
+            SyncBlocks();
         }
 
         return 0;
     }
+
+    void Ext2Volume::TouchCachedBlock(ext2_cached_block_t* cached){
+        if(cached == blockCacheBack){
+            return;
+        }
+
+        if(cached->lruPrev) cached->lruPrev->lruNext = cached->lruNext;
+        else if(cached == blockCacheFront) blockCacheFront = cached->lruNext;
+
+        if(cached->lruNext) cached->lruNext->lruPrev = cached->lruPrev;
+
+        cached->lruPrev = blockCacheBack;
+        cached->lruNext = nullptr;
+
+        if(blockCacheBack) blockCacheBack->lruNext = cached;
+        else blockCacheFront = cached;
+
+        blockCacheBack = cached;
+    }
+
+    // Drop clean blocks, least recently used first, until the cache is within its capacity.
+    // Dirty blocks stay until they have been written back, blocks being written back until the write has completed.
+    void Ext2Volume::EvictBlocks(){
+        ext2_cached_block_t* cached = blockCacheFront;
+
+        while(cached && blockCacheCount > blockCacheCapacity){
+            ext2_cached_block_t* next = cached->lruNext;
+
+            if(!cached->dirty && !cached->writesInFlight){
+                blockCache.remove(cached->block);
+
+                if(cached->lruPrev) cached->lruPrev->lruNext = cached->lruNext;
+                else blockCacheFront = cached->lruNext;
+
+                if(cached->lruNext) cached->lruNext->lruPrev = cached->lruPrev;
+                else blockCacheBack = cached->lruPrev;
+
+                kfree(cached->data);
+                delete cached;
+
+                blockCacheCount--;
+                blockCacheMemoryUsage -= blocksize;
+                blockCacheEvictions++;
+            }
+
+            cached = next;
+        }
+    }
+
+    void Ext2Volume::DropCachedBlock(uint32_t block){
+        acquireLock(&blockCacheLock);
+
+        ext2_cached_block_t* cached = blockCache.remove(block);
+        if(cached){
+            if(cached->lruPrev) cached->lruPrev->lruNext = cached->lruNext;
+            else blockCacheFront = cached->lruNext;
+
+            if(cached->lruNext) cached->lruNext->lruPrev = cached->lruPrev;
+            else blockCacheBack = cached->lruPrev;
+
+            if(cached->dirty){
+                blockCacheDirtyCount--;
+            }
+
+            kfree(cached->data);
+            delete cached;
+
+            blockCacheCount--;
+            blockCacheMemoryUsage -= blocksize;
+        }
+
+        releaseLock(&blockCacheLock);
+    }
+
+    void Ext2Volume::SyncBlocks(){
+        while(acquireTestLock(&syncLock)) Scheduler::Yield(); // Writes of the same block must not be reordered
+
+        List<uint32_t> dirtyBlocks;
+
+        acquireLock(&blockCacheLock);
+        for(ext2_cached_block_t* cached = blockCacheFront; cached; cached = cached->lruNext){
+            if(cached->dirty){
+                dirtyBlocks.add_back(cached->block);
+            }
+        }
+        releaseLock(&blockCacheLock);
+
+        uint8_t* buffer = (uint8_t*)kmalloc(blocksize);
+        for(uint32_t block : dirtyBlocks){
+            acquireLock(&blockCacheLock);
+
+            ext2_cached_block_t* cached = blockCache.get(block);
+            if(!cached || !cached->dirty){ // Dropped or written back in the meantime
+                releaseLock(&blockCacheLock);
+                continue;
+            }
+
+            memcpy(buffer, cached->data, blocksize); // Copy so the block can be modified while it is being written
+            cached->dirty = false; // Modifications from now on are written back next time
+            cached->writesInFlight++;
+            blockCacheDirtyCount--;
+
+            releaseLock(&blockCacheLock);
+
+            int e = part->Write(BlockToLBA(block), blocksize, buffer);
+
+            acquireLock(&blockCacheLock);
+            if((cached = blockCache.get(block))){ // May have been dropped if the block was freed
+                if(cached->writesInFlight){ // Or dropped and cached again
+                    cached->writesInFlight--;
+                }
+
+                if(e && !cached->dirty){ // Try again next time
+                    cached->dirty = true;
+                    blockCacheDirtyCount++;
+                }
+            }
+            releaseLock(&blockCacheLock);
+
+            if(e){
+                Log::Error("[Ext2] Disk error (%d) writing back block %d (blocksize: %d)", e, block, blocksize);
+                error = DiskWriteError;
+                continue;
+            }
+
+            blockCacheWritebacks++;
+        }
+        kfree(buffer);
+
+        acquireLock(&blockCacheLock);
+        EvictBlocks(); // Blocks we have written back can now be evicted
+        releaseLock(&blockCacheLock);
+
+        releaseLock(&syncLock);
+    }
     
     uint32_t Ext2Volume::AllocateBlock(){
         for(unsigned i = 0; i < blockGroupCount; i++){
@@ -601,9 +984,7 @@ namespace fs::Ext2{
         for(unsigned i = 0; i < e2inode.blockCount * (blocksize / 512); i++){
             uint32_t block = GetInodeBlock(i, e2inode);
             FreeBlock(block);
-            if(blockCache.get(block)){
-                blockCache.remove(block);
-            }
+            DropCachedBlock(block);
         }
         
         if(e2inode.blocks[EXT2_SINGLY_INDIRECT_INDEX]){
@@ -619,9 +1000,7 @@ namespace fs::Ext2{
                 
                 for(unsigned i = 0; i < (blocksize / sizeof(uint32_t)) && blockPointers[i] != 0; i++){
                     FreeBlock(blockPointers[i]);
-                    if(blockCache.get(blockPointers[i])){
-                        blockCache.remove(blockPointers[i]);
-                    }
+                    DropCachedBlock(blockPointers[i]);
                 }
 
                 FreeBlock(e2inode.blocks[EXT2_DOUBLY_INDIRECT_INDEX]);
@@ -700,13 +1079,15 @@ namespace fs::Ext2{
         for(;;){
             if(e2dirent->recordLength == 0) break;
 
-            DirectoryEntry dirent;
-            dirent.flags = e2dirent->fileType;
-            strncpy(dirent.name, e2dirent->name, e2dirent->nameLength);
-            dirent.name[e2dirent->nameLength] = 0;
-            dirent.inode = e2dirent->inode;
+            if(e2dirent->inode){ // Skip unused entries (and the blocks of a directory index)
+                DirectoryEntry dirent;
+                dirent.flags = e2dirent->fileType;
+                strncpy(dirent.name, e2dirent->name, e2dirent->nameLength);
+                dirent.name[e2dirent->nameLength] = 0;
+                dirent.inode = e2dirent->inode;
 
-            entries.add_back(dirent);
+                entries.add_back(dirent);
+            }
 
             blockOffset += e2dirent->recordLength;
             totalOffset += e2dirent->recordLength;
@@ -751,6 +1132,8 @@ namespace fs::Ext2{
 
         ext2_directory_entry_t* e2dirent = (ext2_directory_entry_t*)kmalloc(sizeof(ext2_directory_entry_t) + NAME_MAX);
 
+        ino.flags &= ~EXT2_INDEX_FL; // The directory is written out linearly, so any hash tree index is gone
+
         unsigned lastIndex = entries.get_length() - 1;
         for(unsigned i = 0; i < entries.get_length(); i++){
             DirectoryEntry ent = entries[i];
@@ -892,6 +1275,179 @@ namespace fs::Ext2{
         return 1;
     }
 
+    uint32_t Ext2Volume::DirectoryHash(const char* name, int len, int version){
+        uint32_t buf[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+        uint32_t in[8];
+        uint32_t hash = 0;
+
+        if(superext.hashSeed[0] || superext.hashSeed[1] || superext.hashSeed[2] || superext.hashSeed[3]){
+            memcpy(buf, superext.hashSeed, sizeof(buf));
+        }
+
+        switch(version){
+        case HashLegacy:
+        case HashLegacyUnsigned:
+            hash = LegacyHash(name, len, version == HashLegacyUnsigned);
+            break;
+        case HashHalfMD4:
+        case HashHalfMD4Unsigned:
+            for(const char* p = name; len > 0; len -= 32, p += 32){
+                StringToHashBuffer(p, len, in, 8, version == HashHalfMD4Unsigned);
+                HalfMD4Transform(buf, in);
+            }
+            hash = buf[1];
+            break;
+        case HashTea:
+        case HashTeaUnsigned:
+            for(const char* p = name; len > 0; len -= 16, p += 16){
+                StringToHashBuffer(p, len, in, 4, version == HashTeaUnsigned);
+                TeaTransform(buf, in);
+            }
+            hash = buf[0];
+            break;
+        }
+
+        hash &= ~1U; // The lowest bit of index hashes is used to mark collisions
+        if(hash == (0x7fffffffU << 1)){
+            hash = (0x7fffffffU - 1) << 1;
+        }
+
+        return hash;
+    }
+
+    // Looks up name using the hash tree index of node.
+    // Returns 0 on success (inode is set to 0 if the name does not exist),
+    // or a negative value if the index cannot be used and the directory has to be scanned instead.
+    int Ext2Volume::HTreeLookup(Ext2Node* node, const char* name, uint32_t& inode){
+        ext2_inode_t& ino = node->e2inode;
+        int nameLength = strlen(name);
+        int ret = -1;
+
+        uint8_t* indexBuffer = (uint8_t*)kmalloc(blocksize);
+        uint8_t* leafBuffer = (uint8_t*)kmalloc(blocksize);
+
+        ext2_dx_root_info_t* info = (ext2_dx_root_info_t*)(indexBuffer + 24); // After the '.' and '..' entries
+        ext2_dx_entry_t* entries;
+
+        uint32_t hash;
+        uint32_t leafBlock;
+        unsigned index, count;
+        bool parentCollision = false; // Names with our hash may continue past the last entry of the index block
+
+        if(ReadBlockCached(GetInodeBlock(0, ino), indexBuffer)){
+            goto done;
+        }
+
+        if(info->reservedZero || info->infoLength != sizeof(ext2_dx_root_info_t) || info->hashVersion > HashTea || info->indirectLevels >= EXT2_HTREE_MAX_LEVELS){
+            Log::Warning("[Ext2] Unsupported or corrupt directory index (inode %d)", node->inode);
+            goto done;
+        }
+
+        {
+            int version = info->hashVersion;
+            if(superext.flags & EXT2_FLAGS_UNSIGNED_HASH){
+                version += HashLegacyUnsigned;
+            }
+
+            hash = DirectoryHash(name, nameLength, version);
+        }
+
+        entries = (ext2_dx_entry_t*)(indexBuffer + 24 + info->infoLength);
+        for(unsigned level = info->indirectLevels;; level--){
+            ext2_dx_countlimit_t* countLimit = (ext2_dx_countlimit_t*)entries;
+            count = countLimit->count;
+
+            if(!count || count > countLimit->limit || (uint8_t*)(entries + countLimit->limit) > indexBuffer + blocksize){
+                Log::Warning("[Ext2] Corrupt directory index (inode %d)", node->inode);
+                goto done;
+            }
+
+            // Find the last entry with a hash <= ours, the first entry holds the count and limit in place of a hash
+            unsigned low = 1, high = count;
+            while(low < high){
+                unsigned mid = (low + high) / 2;
+
+                if(entries[mid].hash > hash) high = mid;
+                else low = mid + 1;
+            }
+            index = low - 1;
+
+            if(!level){
+                break;
+            }
+
+            if(index + 1 < count){
+                parentCollision = (entries[index + 1].hash & ~1U) == hash;
+            }
+
+            if(ReadBlockCached(GetInodeBlock(entries[index].block & 0x0FFFFFFF, ino), indexBuffer)){
+                goto done;
+            }
+            entries = (ext2_dx_entry_t*)(indexBuffer + 8); // After the empty directory entry covering the block
+        }
+
+        leafBlock = entries[index].block & 0x0FFFFFFF;
+        for(;;){
+            if(ReadBlockCached(GetInodeBlock(leafBlock, ino), leafBuffer)){
+                goto done;
+            }
+
+            for(uint32_t offset = 0; offset + sizeof(ext2_directory_entry_t) <= blocksize;){
+                ext2_directory_entry_t* e2dirent = (ext2_directory_entry_t*)(leafBuffer + offset);
+                if(e2dirent->recordLength < sizeof(ext2_directory_entry_t) || offset + e2dirent->recordLength > blocksize){
+                    Log::Warning("[Ext2] Corrupt directory entry in indexed directory (inode %d)", node->inode);
+                    goto done;
+                }
+
+                if(e2dirent->inode && e2dirent->nameLength == nameLength && strncmp(e2dirent->name, name, nameLength) == 0){
+                    inode = e2dirent->inode;
+                    ret = 0;
+                    goto done;
+                }
+
+                offset += e2dirent->recordLength;
+            }
+
+            // Names with the same hash may spill over into the next block
+            if(++index < count && (entries[index].hash & ~1U) == hash){
+                leafBlock = entries[index].block & 0x0FFFFFFF;
+                continue;
+            }
+
+            if(index >= count && parentCollision){
+                goto done; // Rare, just scan the directory
+            }
+
+            inode = 0;
+            ret = 0;
+            break;
+        }
+
+    done:
+        kfree(indexBuffer);
+        kfree(leafBuffer);
+        return ret;
+    }
+
+    // Returns the node for inode, reading it in if it is not cached
+    Ext2Node* Ext2Volume::GetNode(uint32_t inode){
+        Ext2Node* node = inodeCache.get(inode);
+
+        if(!node){ // Could not locate inode in cache
+            ext2_inode_t e2inode;
+            if(ReadInode(inode, e2inode)){
+                Log::Error("[Ext2] Failed to read inode %d", inode);
+                return nullptr; // Could not read inode
+            }
+
+            node = new Ext2Node(this, e2inode, inode);
+
+            inodeCache.insert(inode, node);
+        }
+
+        return node;
+    }
+
     FsNode* Ext2Volume::FindDir(Ext2Node* node, char* name){
         if((node->flags & FS_NODE_TYPE) != FS_NODE_DIRECTORY){
             return nullptr;
@@ -904,6 +1460,20 @@ namespace fs::Ext2{
 
         ext2_inode_t& ino = node->e2inode;
 
+        if(dirIndex && (ino.flags & EXT2_INDEX_FL)){
+            uint32_t inode;
+            if(HTreeLookup(node, name, inode) == 0){
+                if(!inode){
+                    return nullptr; // Not found
+                } else if(inode > super.inodeCount){
+                    Log::Error("[Ext2] Directory Entry %s contains invalid inode %d", name, inode);
+                    return nullptr;
+                }
+
+                return GetNode(inode);
+            } // Otherwise fall back to scanning the directory
+        }
+
         uint8_t* buffer = (uint8_t*)kmalloc(blocksize);
         memset(buffer, 0, blocksize);
         uint32_t currentBlockIndex = 0;
@@ -964,19 +1534,7 @@ namespace fs::Ext2{
             return nullptr;
         }
 
-        Ext2Node* returnNode = inodeCache.get(e2dirent->inode);
-
-        if(!returnNode){ // Could not locate inode in cache
-            ext2_inode_t direntInode;
-            if(ReadInode(e2dirent->inode, direntInode)){
-                Log::Error("[Ext2] Failed to read inode of directory (inode %d) entry %s", node->inode, e2dirent->name);
-                return nullptr; // Could not read inode
-            }
-
-            returnNode = new Ext2Node(this, direntInode, e2dirent->inode);
-
-            inodeCache.insert(e2dirent->inode, returnNode);
-        }
+        Ext2Node* returnNode = GetNode(e2dirent->inode);
 
         kfree(buffer);
         return returnNode;
@@ -1004,18 +1562,18 @@ namespace fs::Ext2{
         timeval_t readtv1 = Timer::GetSystemUptimeStruct();
         #endif
 
-        for(uint32_t block : blocks){
-            if(size <= 0) break;
-            
-            if(offset % blocksize){
+        for(unsigned i = 0; i < blocks.get_length() && size > 0;){
+            uint32_t block = blocks[i];
+
+            if(offset % blocksize || size < blocksize){ // Partial block
                 if(int e = ReadBlockCached(block, blockBuffer); e){
                     Log::Info("[Ext2] Error %i reading block %u", e, block);
                     error = DiskReadError;
                     //return -1;
                 }
 
-                size_t readSize = blocksize - (offset % blocksize);
                 size_t readOffset = (offset % blocksize);
+                size_t readSize = blocksize - readOffset;
 
                 if(readSize > size) readSize = size;
 
@@ -1024,25 +1582,26 @@ namespace fs::Ext2{
                 size -= readSize;
                 buffer += readSize;
                 offset += readSize;
-            } else if(size >= blocksize){
-                if(int e = ReadBlockCached(block, buffer); e){
-                    Log::Info("[Ext2] Error %i reading block %u", e, block);
-                    error = DiskReadError;
-                    //return -1;
-                }
-                size -= blocksize;
-                buffer += blocksize;
-                offset += blocksize;
-            } else {
-                if(int e = ReadBlockCached(block, blockBuffer); e){
-                    Log::Info("[Ext2] Error %i reading block %u", e, block);
-                    error = DiskReadError;
-                    //return -1;
-                }
-                memcpy(buffer, blockBuffer, size);
-                size = 0;
-                break;
+                i++;
+                continue;
+            }
+
+            // Read physically contiguous whole blocks straight into the buffer with one disk access
+            unsigned count = 1;
+            while(i + count < blocks.get_length() && blocks[i + count] == block + count && (count + 1) * blocksize <= size && (count + 1) * blocksize <= EXT2_MAX_READ_SIZE){
+                count++;
+            }
+
+            if(int e = ReadBlocks(block, count, buffer); e){
+                Log::Info("[Ext2] Error %i reading blocks %u-%u", e, block, block + count - 1);
+                error = DiskReadError;
+                //return -1;
             }
+
+            size -= count * blocksize;
+            buffer += count * blocksize;
+            offset += count * blocksize;
+            i += count;
         }
 
         #ifdef EXT2_ENABLE_TIMER
@@ -1329,6 +1888,8 @@ namespace fs::Ext2{
                 if(!unlinkDirectories){
                     return -EISDIR;
                 }
+
+                DentryCache::InvalidateDirectory(file); // Cached entries hold handles to the directory
             }
 
             file->nlink--;
@@ -1379,6 +1940,10 @@ namespace fs::Ext2{
             node->e2inode.blockCount = blocksNeeded * (blocksize / 512);
         }
 
+        if(static_cast<size_t>(length) < node->size){
+            PageCache::Invalidate(node, length);
+        }
+
         node->size = node->e2inode.size = length; // TODO: Actually free blocks in inode if possible
 
         SyncNode(node);
@@ -1393,6 +1958,7 @@ namespace fs::Ext2{
         }
 
         if(node->e2inode.linkCount == 0){ // No links to file
+            PageCache::Invalidate(node); // The inode number may get reused
             EraseInode(node->e2inode, node->inode);
         }
 
@@ -1419,6 +1985,7 @@ namespace fs::Ext2{
             break;
         case EXT2_S_IFDIR:
             flags = FS_NODE_DIRECTORY;
+            dentryCached = true;
             break;
         case EXT2_S_IFLNK:
             flags = FS_NODE_SYMLINK;
@@ -1428,6 +1995,7 @@ namespace fs::Ext2{
             break;
         default:
             flags = FS_NODE_FILE;
+            pageCached = true;
             break;
         }
 
@@ -1465,6 +2033,7 @@ namespace fs::Ext2{
     int Ext2Node::Create(DirectoryEntry* ent, uint32_t mode){
         flock.AcquireWrite();
         auto ret = vol->Create(this, ent, mode);
+        DentryCache::Invalidate(this, ent->name);
         flock.ReleaseWrite();
         return ret;
     }
@@ -1472,6 +2041,7 @@ namespace fs::Ext2{
     int Ext2Node::CreateDirectory(DirectoryEntry* ent, uint32_t mode){
         flock.AcquireWrite();
         auto ret = vol->CreateDirectory(this, ent, mode);
+        DentryCache::Invalidate(this, ent->name);
         flock.ReleaseWrite();
         return ret;
     }
@@ -1491,13 +2061,16 @@ namespace fs::Ext2{
 
         flock.AcquireWrite();
         auto ret = vol->Link(this, (Ext2Node*)n, d);
+        DentryCache::Invalidate(this, d->name);
         flock.ReleaseWrite();
         return ret;
     }
     
     int Ext2Node::Unlink(DirectoryEntry* d, bool unlinkDirectories){
         flock.AcquireWrite();
+        DentryCache::Invalidate(this, d->name); // Drop the handle the cache holds on the node first, so it can be freed
         auto ret = vol->Unlink(this, d, unlinkDirectories);
+        DentryCache::Invalidate(this, d->name);
         flock.ReleaseWrite();
         return ret;
     }
@@ -1511,6 +2084,7 @@ namespace fs::Ext2{
 
     void Ext2Node::Sync(){
         vol->SyncNode(this);
+        vol->SyncBlocks();
     }
 
     void Ext2Node::Close(){
@@ -143,11 +143,16 @@ namespace fs::FAT32{
         if(!node->inode || node->flags & FS_NODE_DIRECTORY) return -1;
 
         int count;
-        void* _buf = ReadClusterChain(node->inode, &count, size);
+        uint8_t* _buf = reinterpret_cast<uint8_t*>(ReadClusterChain(node->inode, &count, offset + size));
+        if(!_buf) return -1;
 
-        if(static_cast<unsigned>(count) * bootRecord->bpb.sectorsPerCluster * part->parentDisk->blocksize < size) return 0;
+        if(static_cast<unsigned>(count) * bootRecord->bpb.sectorsPerCluster * part->parentDisk->blocksize < offset + size) {
+            kfree(_buf);
+            return 0;
+        }
 
-        memcpy(buffer, _buf, size);
+        memcpy(buffer, _buf + offset, size);
+        kfree(_buf);
         return size;
     }
 
@@ -291,6 +296,8 @@ namespace fs::FAT32{
                     _node->inode = clusterNum;
                     if(dirEntries[i].attributes & FAT_ATTR_DIRECTORY) _node->flags = FS_NODE_DIRECTORY;
                     else _node->flags = FS_NODE_FILE;
+                    _node->volumeID = volumeID;
+                    _node->pageCached = _node->flags == FS_NODE_FILE;
                     break;
                 }
                 lfnCount = 0;
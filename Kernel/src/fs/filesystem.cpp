@@ -1,8 +1,68 @@
 #include <fs/filesystem.h>
 
 #include <fs/fsvolume.h>
+#include <fs/pagecache.h>
+#include <fs/dentrycache.h>
 #include <logging.h>
 #include <errno.h>
+#include <slab.h>
+#include <scheduler.h>
+#include <timer.h>
+#include <cpu.h>
+#include <net/socket.h>
+
+static ObjectCache fileDescriptorCache("fs_fd", sizeof(fs_fd_t));
+
+void* fs_fd::operator new(size_t size){
+	assert(size == sizeof(fs_fd_t));
+	
+	return fileDescriptorCache.Allocate();
+}
+
+void fs_fd::operator delete(void* fd){
+	fileDescriptorCache.Free(fd);
+}
+
+void FilesystemWatcher::Signal(){
+	bool intsEnabled = CheckInterrupts();
+	asm("cli");
+	acquireLock(&lock);
+
+	signalled = true;
+	if(waiter){ // Unblocked with the lock held so the waiter cannot have moved on to block on something else
+		Scheduler::UnblockThread(waiter);
+	}
+
+	releaseLock(&lock);
+	if(intsEnabled) asm("sti");
+}
+
+// Also gives up if the thread is killed
+bool FilesystemWatcher::WaitUntil(uint64_t deadline){
+	assert(CheckInterrupts());
+
+	asm("cli");
+	acquireLock(&lock);
+
+	waiter = GetCPULocal()->currentThread;
+	bool wasSignalled = Scheduler::BlockUntil(lock, true, [this]{ return signalled; }, deadline, true);
+	waiter = nullptr;
+
+	signalled = false;
+
+	releaseLock(&lock);
+	asm("sti");
+
+	return wasSignalled;
+}
+
+void FilesystemWatcher::Wait(){
+	WaitUntil(0);
+}
+
+bool FilesystemWatcher::WaitTimeout(uint64_t timeout){
+	return WaitUntil(Timer::GetSystemUptimeNs() + timeout);
+}
 
 namespace fs{
 	volume_id_t nextVID = 1; // Next volume ID
@@ -36,7 +96,6 @@ namespace fs{
 
 	void RegisterVolume(FsVolume* vol){
 		vol->mountPoint->parent = &root;
-		vol->volumeID = GetVolumeID();
 		volumes->add_back(vol);
 	}
 
@@ -364,13 +423,22 @@ namespace fs{
     ssize_t Read(FsNode* node, size_t offset, size_t size, uint8_t *buffer){
 		assert(node);
 
+		if(node->pageCached){
+			return PageCache::Read(node, offset, size, buffer);
+		}
+
         return node->Read(offset,size,buffer);
     }
 
     ssize_t Write(FsNode* node, size_t offset, size_t size, uint8_t *buffer){
 		assert(node);
 
-        return node->Write(offset,size,buffer);
+		ssize_t ret = node->Write(offset,size,buffer);
+		if(node->pageCached && ret > 0){
+			PageCache::Update(node, offset, ret, buffer); // Writes go straight to the filesystem, keep cached pages coherent
+		}
+
+        return ret;
     }
 
     fs_fd_t* Open(FsNode* node, uint32_t flags){
@@ -418,7 +486,7 @@ namespace fs{
         fd->node->Close();
 		fd->node = nullptr;
 
-		kfree(fd);
+		delete fd;
     }
 
     int ReadDir(FsNode* node, DirectoryEntry* dirent, uint32_t index){
@@ -433,6 +501,18 @@ namespace fs{
 		assert(node);
 
 		//if((node->flags & FS_NODE_TYPE) == FS_NODE_SYMLINK) return FindDir(node->link, name);
+
+		if(node->dentryCached){
+			FsNode* result;
+			uint64_t generation;
+			if(DentryCache::Lookup(node, name, result, generation)){
+				return result;
+			}
+
+			result = node->FindDir(name);
+			DentryCache::Insert(node, name, result, generation);
+			return result;
+		}
             
 		return node->FindDir(name);
     }
@@ -479,6 +559,31 @@ namespace fs{
 		else return -1;
 	}
 
+	int PollNode(FsNode* node, int events){
+		int revents = 0;
+
+		if((node->flags & FS_NODE_TYPE) == FS_NODE_SOCKET){
+			Socket* sock = (Socket*)node;
+			if(!sock->IsConnected() && !sock->IsListening()){
+				revents |= POLLHUP;
+			}
+
+			if(sock->PendingConnections() && (events & POLLIN)){
+				revents |= POLLIN;
+			}
+		}
+
+		if(node->CanRead() && (events & POLLIN)) { // If readable and the caller requested POLLIN
+			revents |= POLLIN;
+		}
+
+		if(node->CanWrite() && (events & POLLOUT)) { // If writable and the caller requested POLLOUT
+			revents |= POLLOUT;
+		}
+
+		return revents;
+	}
+
 	int Rename(FsNode* olddir, char* oldpath, FsNode* newdir, char* newpath){
 		assert(olddir && newdir);
 
@@ -2,6 +2,7 @@
 
 #include <errno.h>
 #include <logging.h>
+#include <cpu.h>
 
 FsNode::~FsNode(){
     
@@ -16,7 +17,7 @@ ssize_t FsNode::Write(size_t, size_t, uint8_t *){
 }
 
 fs_fd_t* FsNode::Open(size_t flags){
-    fs_fd_t* fDesc = (fs_fd_t*)kmalloc(sizeof(fs_fd_t));
+    fs_fd_t* fDesc = new fs_fd_t;
 
     fDesc->pos = 0;
     fDesc->mode = flags;
@@ -72,13 +73,42 @@ int FsNode::Ioctl(uint64_t cmd, uint64_t arg){
 }
 
 void FsNode::Watch(FilesystemWatcher& watcher, int events){
-    Log::Warning("FsNode::Watch base called");
-    
-    watcher.Signal();
+    bool intsEnabled = CheckInterrupts();
+    asm("cli");
+    acquireLock(&watchingLock);
+
+    watching.add_back(&watcher);
+
+    releaseLock(&watchingLock);
+    if(intsEnabled) asm("sti");
 }
 
 void FsNode::Unwatch(FilesystemWatcher& watcher){
-    Log::Warning("FsNode::Unwatch base called");
+    bool intsEnabled = CheckInterrupts();
+    asm("cli");
+    acquireLock(&watchingLock);
+
+    watching.remove(&watcher);
+
+    releaseLock(&watchingLock);
+    if(intsEnabled) asm("sti");
+}
+
+void FsNode::SignalWatchers(){
+    if(!watching.get_length()){ // Anything that starts watching after this checks the state of the node itself
+        return;
+    }
+
+    bool intsEnabled = CheckInterrupts();
+    asm("cli");
+    acquireLock(&watchingLock);
+
+    for(FilesystemWatcher* watcher : watching){
+        watcher->Signal();
+    }
+
+    releaseLock(&watchingLock);
+    if(intsEnabled) asm("sti");
 }
 
 
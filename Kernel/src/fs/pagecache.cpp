@@ -0,0 +1,340 @@
+#include <fs/pagecache.h>
+
+#include <memory.h>
+#include <lock.h>
+#include <hash.h>
+#include <logging.h>
+#include <errno.h>
+
+namespace fs::PageCache{
+    typedef struct CachedPage {
+        volume_id_t volume;
+        ino_t inode;
+        uint64_t index; // Index of the page within the file
+
+        uintptr_t phys; // Physical address of the page, the cache holds a reference to it
+        uint8_t* virt; // Kernel mapping of the page
+
+        unsigned pins = 0; // Amount of threads copying to or from the page
+        bool stale = false; // Page has been invalidated and will be freed once unpinned
+
+        CachedPage* hashNext = nullptr;
+        CachedPage* lruPrev = nullptr;
+        CachedPage* lruNext = nullptr;
+    } cached_page_t;
+
+    cached_page_t* buckets[PAGE_CACHE_BUCKETS];
+    cached_page_t* lruFront = nullptr; // Least recently used page
+    cached_page_t* lruBack = nullptr; // Most recently used page
+
+    lock_t cacheLock = 0;
+
+    uint64_t cachedPages = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+
+    static inline unsigned GetBucket(volume_id_t volume, ino_t inode, uint64_t index){
+        return hash(static_cast<unsigned>(volume * 31 + inode) ^ hash(static_cast<unsigned>(index))) % PAGE_CACHE_BUCKETS;
+    }
+
+    // Don't let the cache take more than a quarter of physical memory
+    static inline uint64_t GetCapacity(){
+        uint64_t capacity = Memory::maxPhysicalBlocks / 4;
+        return capacity < PAGE_CACHE_MAX_PAGES ? capacity : PAGE_CACHE_MAX_PAGES;
+    }
+
+    // The following require cacheLock to be held
+    static cached_page_t* Lookup(volume_id_t volume, ino_t inode, uint64_t index){
+        cached_page_t* page = buckets[GetBucket(volume, inode, index)];
+        while(page && !(page->volume == volume && page->inode == inode && page->index == index)){
+            page = page->hashNext;
+        }
+
+        return page;
+    }
+
+    static void Unhash(cached_page_t* page){
+        cached_page_t** link = &buckets[GetBucket(page->volume, page->inode, page->index)];
+        while(*link && *link != page){
+            link = &(*link)->hashNext;
+        }
+
+        if(*link){
+            *link = page->hashNext;
+        }
+        page->hashNext = nullptr;
+    }
+
+    static void LRURemove(cached_page_t* page){
+        if(page->lruPrev) page->lruPrev->lruNext = page->lruNext;
+        else lruFront = page->lruNext;
+
+        if(page->lruNext) page->lruNext->lruPrev = page->lruPrev;
+        else lruBack = page->lruPrev;
+
+        page->lruPrev = page->lruNext = nullptr;
+    }
+
+    static void LRUAppend(cached_page_t* page){
+        page->lruPrev = lruBack;
+        page->lruNext = nullptr;
+
+        if(lruBack) lruBack->lruNext = page;
+        else lruFront = page;
+
+        lruBack = page;
+    }
+
+    static void DestroyPage(cached_page_t* page){
+        Memory::KernelFree4KPages(page->virt, 1);
+        Memory::FreePhysicalMemoryBlock(page->phys); // Processes that map the page keep their own reference
+        delete page;
+    }
+
+    // Drop the least recently used pages until we are within the cache size.
+    // Pinned pages and pages mapped into processes (which hold a reference to the physical block) are skipped.
+    static void Evict(){
+        cached_page_t* page = lruFront;
+        uint64_t capacity = GetCapacity();
+
+        while(page && cachedPages > capacity){
+            cached_page_t* next = page->lruNext;
+
+            if(!page->pins && !Memory::IsPhysicalMemoryBlockShared(page->phys)){
+                Unhash(page);
+                LRURemove(page);
+                DestroyPage(page);
+
+                cachedPages--;
+                evictions++;
+            }
+
+            page = next;
+        }
+    }
+
+    // Returns the page at index of node pinned, reading it in if create is set.
+    // On a miss up to wanted pages are read in at once. When the previous page is cached
+    // the file is likely being read sequentially, so at least PAGE_CACHE_READAHEAD_PAGES are read.
+    static cached_page_t* AcquirePage(FsNode* node, uint64_t index, bool create, unsigned wanted = 1){
+        acquireLock(&cacheLock);
+
+        cached_page_t* page = Lookup(node->volumeID, node->inode, index);
+        if(page){
+            page->pins++;
+            hits++;
+
+            LRURemove(page);
+            LRUAppend(page);
+
+            releaseLock(&cacheLock);
+            return page;
+        } else if(!create){
+            releaseLock(&cacheLock);
+            return nullptr;
+        }
+
+        unsigned limit = wanted;
+        if((index == 0 || Lookup(node->volumeID, node->inode, index - 1)) && limit < PAGE_CACHE_READAHEAD_PAGES){
+            limit = PAGE_CACHE_READAHEAD_PAGES;
+        }
+
+        if(limit > PAGE_CACHE_MAX_READ_PAGES){
+            limit = PAGE_CACHE_MAX_READ_PAGES;
+        }
+
+        unsigned count = 1;
+        while(count < limit && (index + count) * PAGE_SIZE_4K < node->size && !Lookup(node->volumeID, node->inode, index + count)){
+            count++;
+        }
+
+        misses++;
+        releaseLock(&cacheLock); // The filesystem may block, so read the pages in without the lock
+
+        // Map the new pages next to each other so they can be read with a single call to the filesystem
+        uintptr_t phys[PAGE_CACHE_MAX_READ_PAGES];
+        uint8_t* virt = reinterpret_cast<uint8_t*>(Memory::KernelAllocate4KPages(count));
+        for(unsigned i = 0; i < count; i++){
+            phys[i] = Memory::AllocatePhysicalMemoryBlock();
+            Memory::KernelMapVirtualMemory4K(phys[i], reinterpret_cast<uintptr_t>(virt) + i * PAGE_SIZE_4K, 1);
+        }
+
+        size_t offset = index * PAGE_SIZE_4K;
+        size_t size = 0;
+        if(offset < node->size){
+            size = node->size - offset;
+            if(size > count * PAGE_SIZE_4K) size = count * PAGE_SIZE_4K;
+        }
+
+        ssize_t read = size ? node->Read(offset, size, virt) : 0;
+        if(read < 0){
+            Log::Warning("[PageCache] Error %d reading page %u of inode %u", read, index, node->inode);
+
+            Memory::KernelFree4KPages(virt, count);
+            for(unsigned i = 0; i < count; i++){
+                Memory::FreePhysicalMemoryBlock(phys[i]);
+            }
+            return nullptr;
+        }
+        memset(virt + read, 0, count * PAGE_SIZE_4K - read);
+
+        acquireLock(&cacheLock);
+
+        cached_page_t* ret = nullptr;
+        for(unsigned i = 0; i < count; i++){
+            page = new cached_page_t;
+            page->volume = node->volumeID;
+            page->inode = node->inode;
+            page->index = index + i;
+            page->phys = phys[i];
+            page->virt = virt + i * PAGE_SIZE_4K;
+
+            if(cached_page_t* existing = Lookup(page->volume, page->inode, page->index)){ // Someone else read the page in first
+                if(i == 0){
+                    existing->pins++;
+                    ret = existing;
+                }
+
+                DestroyPage(page);
+                continue;
+            }
+
+            if(i == 0){
+                page->pins = 1;
+                ret = page;
+            }
+
+            page->hashNext = buckets[GetBucket(page->volume, page->inode, page->index)];
+            buckets[GetBucket(page->volume, page->inode, page->index)] = page;
+            LRUAppend(page);
+            cachedPages++;
+        }
+
+        Evict();
+
+        releaseLock(&cacheLock);
+        return ret;
+    }
+
+    static void ReleasePage(cached_page_t* page){
+        acquireLock(&cacheLock);
+        bool destroy = !(--page->pins) && page->stale;
+        releaseLock(&cacheLock);
+
+        if(destroy){
+            DestroyPage(page);
+        }
+    }
+
+    ssize_t Read(FsNode* node, size_t offset, size_t size, uint8_t* buffer){
+        if(offset >= node->size) return 0;
+        if(offset + size > node->size) size = node->size - offset;
+
+        ssize_t ret = size;
+        while(size){
+            size_t pageOffset = offset % PAGE_SIZE_4K;
+            size_t count = PAGE_SIZE_4K - pageOffset;
+            if(count > size) count = size;
+
+            cached_page_t* page = AcquirePage(node, offset / PAGE_SIZE_4K, true, (pageOffset + size + PAGE_SIZE_4K - 1) / PAGE_SIZE_4K); // Read in the rest of the request with this page
+            if(!page){
+                return (ret - size) ? ret - size : -EIO;
+            }
+
+            memcpy(buffer, page->virt + pageOffset, count); // buffer may be in user memory, so the page is pinned rather than locked
+
+            ReleasePage(page);
+
+            size -= count;
+            buffer += count;
+            offset += count;
+        }
+
+        return ret;
+    }
+
+    void Update(FsNode* node, size_t offset, size_t size, uint8_t* buffer){
+        while(size){
+            size_t pageOffset = offset % PAGE_SIZE_4K;
+            size_t count = PAGE_SIZE_4K - pageOffset;
+            if(count > size) count = size;
+
+            if(cached_page_t* page = AcquirePage(node, offset / PAGE_SIZE_4K, false)){ // Pages that are not cached will be read from the filesystem anyway
+                memcpy(page->virt + pageOffset, buffer, count);
+                ReleasePage(page);
+            }
+
+            size -= count;
+            buffer += count;
+            offset += count;
+        }
+    }
+
+    uintptr_t GetPage(FsNode* node, uint64_t index){
+        if(index * PAGE_SIZE_4K >= node->size){
+            return 0;
+        }
+
+        cached_page_t* page = AcquirePage(node, index, true);
+        if(!page){
+            return 0;
+        }
+
+        uintptr_t phys = page->phys;
+        Memory::SharePhysicalMemoryBlock(phys);
+
+        ReleasePage(page);
+        return phys;
+    }
+
+    void SyncPage(FsNode* node, uint64_t index){
+        cached_page_t* page = AcquirePage(node, index, false);
+        if(!page){
+            return;
+        }
+
+        size_t offset = index * PAGE_SIZE_4K;
+        if(offset < node->size){ // Never extend the file
+            size_t size = node->size - offset;
+            if(size > PAGE_SIZE_4K) size = PAGE_SIZE_4K;
+
+            if(ssize_t e = node->Write(offset, size, page->virt); e < 0){
+                Log::Warning("[PageCache] Error %d writing back page %u of inode %u", e, index, node->inode);
+            }
+        }
+
+        ReleasePage(page);
+    }
+
+    void Invalidate(FsNode* node, size_t offset){
+        uint64_t firstIndex = (offset + PAGE_SIZE_4K - 1) / PAGE_SIZE_4K; // First page entirely past offset
+
+        acquireLock(&cacheLock);
+
+        cached_page_t* page = lruFront;
+        while(page){
+            cached_page_t* next = page->lruNext;
+
+            if(page->volume == node->volumeID && page->inode == node->inode){
+                if(page->index >= firstIndex){
+                    Unhash(page);
+                    LRURemove(page);
+                    cachedPages--;
+
+                    if(page->pins){
+                        page->stale = true; // Last thread to unpin frees it
+                    } else {
+                        DestroyPage(page);
+                    }
+                } else if(page->index == offset / PAGE_SIZE_4K){
+                    memset(page->virt + offset % PAGE_SIZE_4K, 0, PAGE_SIZE_4K - offset % PAGE_SIZE_4K); // Zero past the new end of file
+                }
+            }
+
+            page = next;
+        }
+
+        releaseLock(&cacheLock);
+    }
+}
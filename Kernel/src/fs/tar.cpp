@@ -71,6 +71,8 @@ namespace fs::tar{
         n->flags = TarTypeToFilesystemFlags(header->ustar.type);
         n->vol = this;
         n->volumeID = volumeID;
+        n->pageCached = (n->flags & FS_NODE_TYPE) == FS_NODE_FILE;
+        n->dentryCached = (n->flags & FS_NODE_TYPE) == FS_NODE_DIRECTORY; // Read only, so entries never change
 
         char* name = header->ustar.name;
         char* _name = strtok(header->ustar.name, "/");
@@ -134,6 +136,7 @@ namespace fs::tar{
         TarNode* volumeNode = &nodes[0];
         volumeNode->header = nullptr;
         volumeNode->flags = FS_NODE_DIRECTORY | FS_NODE_MOUNTPOINT;
+        volumeNode->dentryCached = true;
         volumeNode->inode = 0;
         volumeNode->size = size;
         volumeNode->vol = this;
@@ -0,0 +1,204 @@
+#include <futex.h>
+
+#include <scheduler.h>
+#include <cpu.h>
+#include <paging.h>
+#include <timer.h>
+#include <hash.h>
+#include <errno.h>
+
+namespace Futex{
+    struct FutexBucket;
+
+    // Lives on the stack of the waiting thread
+    struct FutexWaiter{
+        uint64_t key;
+        thread_t* thread;
+        FutexBucket* volatile bucket; // Only changed (by Requeue) with the locks of both the old and new bucket held
+        lock_t* volatile lock; // Lock of bucket
+        volatile bool woken;
+    };
+
+    struct FutexBucket{
+        lock_t lock = 0; // Taken with interrupts disabled, waiters are woken with it held
+        List<FutexWaiter*> waiters;
+    };
+
+    FutexBucket buckets[FUTEX_HASH_BUCKETS];
+
+    // Futexes are keyed by physical address, so the same futex mapped into multiple processes (e.g. in shared memory) has the same key
+    static bool GetKey(process_t* process, uintptr_t address, uint64_t& key){
+        if(address & (sizeof(int) - 1)){
+            return false;
+        }
+
+        if(!Memory::CheckUsermodePointer(address, sizeof(int), process->addressSpace)){
+            return false;
+        }
+
+        // Fault in demand paged pages and break copy on write so the frame does not change underneath the waiters.
+        // Only read the futex, it may be mapped read only.
+        (void)*reinterpret_cast<volatile int*>(address);
+        Memory::HandleCopyOnWriteFault(process, address); // Does nothing unless the page is copy on write
+
+        uint64_t frame = Memory::VirtualToPhysicalAddress(address, process->addressSpace);
+        if(!frame){
+            return false;
+        }
+
+        key = frame | (address & (PAGE_SIZE_4K - 1));
+        return true;
+    }
+
+    static inline FutexBucket* GetBucket(uint64_t key){
+        return &buckets[hash(static_cast<unsigned>(key >> 2) ^ static_cast<unsigned>(key >> 34)) % FUTEX_HASH_BUCKETS];
+    }
+
+    // Wake up to count waiters with key, bucket lock must be held.
+    // The thread is unblocked with the lock held so it cannot have moved on to block on something else.
+    static int WakeWaiters(FutexBucket* bucket, uint64_t key, int count){
+        int woken = 0;
+
+        for(unsigned i = 0; i < bucket->waiters.get_length() && woken < count;){
+            FutexWaiter* waiter = bucket->waiters.get_at(i);
+            if(waiter->key != key){
+                i++;
+                continue;
+            }
+
+            bucket->waiters.remove_at(i);
+
+            waiter->woken = true;
+            Scheduler::UnblockThread(waiter->thread);
+            woken++;
+        }
+
+        return woken;
+    }
+
+    long Wait(process_t* process, uintptr_t address, int expected, uint64_t timeout){
+        uint64_t key;
+        if(!GetKey(process, address, key)){
+            return -EFAULT;
+        }
+
+        thread_t* thread = GetCPULocal()->currentThread;
+
+        FutexWaiter waiter;
+        waiter.key = key;
+        waiter.thread = thread;
+        waiter.bucket = GetBucket(key);
+        waiter.lock = &waiter.bucket->lock;
+        waiter.woken = false;
+
+        bool intsEnabled = CheckInterrupts();
+        asm("cli");
+        acquireLock(waiter.lock);
+
+        // Checked with the bucket lock held, any thread changing the value and waking waiters after this will see us in the bucket
+        if(*reinterpret_cast<volatile int*>(address) != expected){
+            releaseLock(waiter.lock);
+            if(intsEnabled) asm("sti");
+            return 0;
+        }
+
+        waiter.bucket->waiters.add_back(&waiter);
+
+        releaseLock(&thread->lock); // Let other threads of the process make syscalls while we wait
+
+        uint64_t deadline = timeout ? Timer::GetSystemUptimeNs() + timeout : 0;
+
+        long ret = 0;
+        if(!Scheduler::BlockUntil(waiter.lock, intsEnabled, [&]{ return waiter.woken; }, deadline, true)){ // Timed out or killed, we are still in the bucket
+            FutexBucket* bucket = waiter.bucket; // Cannot change while we hold its lock
+            for(unsigned i = 0; i < bucket->waiters.get_length(); i++){
+                if(bucket->waiters.get_at(i) == &waiter){
+                    bucket->waiters.remove_at(i);
+                    break;
+                }
+            }
+
+            ret = deadline ? -ETIMEDOUT : -EINTR;
+        }
+
+        releaseLock(waiter.lock);
+        if(intsEnabled) asm("sti");
+
+        return ret;
+    }
+
+    long Wake(process_t* process, uintptr_t address, int count){
+        uint64_t key;
+        if(!GetKey(process, address, key)){
+            return -EFAULT;
+        }
+
+        FutexBucket* bucket = GetBucket(key);
+
+        bool intsEnabled = CheckInterrupts();
+        asm("cli"); // Waiters hold bucket locks with interrupts disabled
+        acquireLock(&bucket->lock);
+        int woken = WakeWaiters(bucket, key, count);
+        releaseLock(&bucket->lock);
+        if(intsEnabled) asm("sti");
+
+        return woken;
+    }
+
+    long Requeue(process_t* process, uintptr_t address, int count, uintptr_t target, int requeueCount, int expected){
+        uint64_t key, targetKey;
+        if(!GetKey(process, address, key) || !GetKey(process, target, targetKey)){
+            return -EFAULT;
+        }
+
+        FutexBucket* bucket = GetBucket(key);
+        FutexBucket* targetBucket = GetBucket(targetKey);
+
+        bool intsEnabled = CheckInterrupts();
+        asm("cli");
+
+        // Always lock the bucket with the lower address first
+        if(bucket < targetBucket){
+            acquireLock(&bucket->lock);
+            acquireLock(&targetBucket->lock);
+        } else if(bucket > targetBucket){
+            acquireLock(&targetBucket->lock);
+            acquireLock(&bucket->lock);
+        } else {
+            acquireLock(&bucket->lock);
+        }
+
+        long ret = -EAGAIN;
+        if(*reinterpret_cast<volatile int*>(address) == expected){
+            ret = WakeWaiters(bucket, key, count);
+
+            int requeued = 0;
+            for(unsigned i = 0; i < bucket->waiters.get_length() && requeued < requeueCount;){
+                FutexWaiter* waiter = bucket->waiters.get_at(i);
+                if(waiter->key != key){
+                    i++;
+                    continue;
+                }
+
+                bucket->waiters.remove_at(i);
+
+                waiter->key = targetKey;
+                waiter->bucket = targetBucket;
+                waiter->lock = &targetBucket->lock;
+                targetBucket->waiters.add_back(waiter);
+
+                requeued++;
+            }
+
+            ret += requeued;
+        }
+
+        releaseLock(&bucket->lock);
+        if(bucket != targetBucket){
+            releaseLock(&targetBucket->lock);
+        }
+        if(intsEnabled) asm("sti");
+
+        return ret;
+    }
+}
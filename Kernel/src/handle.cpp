@@ -0,0 +1,120 @@
+#include <handle.h>
+
+#include <memory.h>
+
+// Add another chunk of free slots, lock must be held
+void HandleTable::AddChunk(){
+    Directory* dir = directory;
+
+    if(!dir || chunkCount >= dir->capacity){ // Grow the directory, readers can keep using the old one as chunks are never moved
+        unsigned capacity = dir ? dir->capacity * 2 : HANDLE_TABLE_INITIAL_CHUNKS;
+
+        Directory* newDir = reinterpret_cast<Directory*>(kmalloc(sizeof(Directory) + capacity * sizeof(Slot*)));
+        if(!newDir){
+            return;
+        }
+
+        newDir->capacity = capacity;
+        newDir->retired = dir;
+        for(unsigned i = 0; i < capacity; i++){
+            newDir->chunks[i] = (dir && i < dir->capacity) ? dir->chunks[i] : nullptr;
+        }
+
+        __atomic_store_n(&directory, newDir, __ATOMIC_RELEASE);
+        dir = newDir;
+    }
+
+    Slot* chunk = reinterpret_cast<Slot*>(kmalloc(sizeof(Slot) * HANDLE_TABLE_CHUNK_SIZE));
+    if(!chunk){
+        return;
+    }
+
+    uint32_t base = chunkCount * HANDLE_TABLE_CHUNK_SIZE;
+    for(uint32_t i = 0; i < HANDLE_TABLE_CHUNK_SIZE; i++){
+        chunk[i].pointer = nullptr;
+        chunk[i].generation = 0;
+        chunk[i].nextFree = (i + 1 < HANDLE_TABLE_CHUNK_SIZE) ? base + i + 1 : freeList;
+    }
+
+    freeList = base;
+
+    __atomic_store_n(&dir->chunks[chunkCount++], chunk, __ATOMIC_RELEASE);
+}
+
+handle_t HandleTable::Register(void* pointer){
+    acquireLock(&lock);
+
+    if(freeList == UINT32_MAX){
+        AddChunk();
+
+        if(freeList == UINT32_MAX){
+            releaseLock(&lock);
+            return nullptr;
+        }
+    }
+
+    uint32_t index = freeList;
+    Slot& slot = directory->chunks[index / HANDLE_TABLE_CHUNK_SIZE][index % HANDLE_TABLE_CHUNK_SIZE];
+    freeList = slot.nextFree;
+
+    __atomic_store_n(&slot.pointer, pointer, __ATOMIC_RELEASE);
+    handleCount++;
+
+    handle_t handle = HANDLE_VALUE(index, slot.generation);
+
+    releaseLock(&lock);
+    return handle;
+}
+
+void* HandleTable::Destroy(handle_t handle){
+    acquireLock(&lock);
+
+    uint32_t index = HANDLE_INDEX(handle);
+    if(!directory || index >= chunkCount * HANDLE_TABLE_CHUNK_SIZE){
+        releaseLock(&lock);
+        return nullptr;
+    }
+
+    Slot& slot = directory->chunks[index / HANDLE_TABLE_CHUNK_SIZE][index % HANDLE_TABLE_CHUNK_SIZE];
+    void* pointer = slot.pointer;
+    if(!pointer || slot.generation != HANDLE_GENERATION(handle)){
+        releaseLock(&lock);
+        return nullptr;
+    }
+
+    // Invalidate the handle before clearing the slot so lookups never return a pointer for the wrong generation
+    __atomic_store_n(&slot.generation, slot.generation + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&slot.pointer, nullptr, __ATOMIC_RELEASE);
+
+    slot.nextFree = freeList;
+    freeList = index;
+    handleCount--;
+
+    releaseLock(&lock);
+    return pointer;
+}
+
+void HandleTable::Clear(){
+    acquireLock(&lock);
+
+    Directory* dir = directory;
+    directory = nullptr;
+
+    if(dir){
+        for(unsigned i = 0; i < chunkCount; i++){
+            kfree(dir->chunks[i]);
+        }
+    }
+
+    while(dir){
+        Directory* retired = dir->retired;
+        kfree(dir);
+        dir = retired;
+    }
+
+    chunkCount = 0;
+    freeList = UINT32_MAX;
+    handleCount = 0;
+
+    releaseLock(&lock);
+}
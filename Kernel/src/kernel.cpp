@@ -31,9 +31,7 @@ video_mode_t videoMode;
 extern "C"
 void IdleProcess(){
 	for(;;) {
-		asm("sti");
-		Scheduler::Yield();
-		asm("hlt");
+		asm("sti; hlt"); // Wait for the timer, or an IPI when a thread is added to our run queue
 	}
 }
 
@@ -4,6 +4,8 @@
 #include <timer.h>
 #include <cpu.h>
 #include <logging.h>
+#include <string.h>
+#include <hash.h>
 
 void Semaphore::Wait(){
     thread_t* thread = GetCPULocal()->currentThread;
@@ -31,4 +33,202 @@ void Semaphore::WaitTimeout(long timeout){
         releaseLock(&cThread->stateLock);
         Timer::SleepCurrentThread(timeout); // TODO: Find a better way to do this
     }
-}
\ No newline at end of file
+}
+
+void ReadWriteLock::Wait(Waiter& waiter, bool intsEnabled){
+    // Grant is called with lock held, so it cannot unblock us before we are blocked
+    Scheduler::BlockUntil(lock, intsEnabled, [&]{ return waiter.granted; });
+
+    releaseLock(&lock);
+    if(intsEnabled) asm("sti");
+}
+
+void ReadWriteLock::Grant(Waiter* waiter){
+    waiter->granted = true;
+    Scheduler::UnblockThread(waiter->waiter);
+}
+
+void ReadWriteLock::AcquireRead(){
+    bool intsEnabled = CheckInterrupts();
+    asm("cli");
+    acquireLock(&lock);
+
+    if(!writerActive && !writers.get_length()){
+        activeReaders++;
+
+        releaseLock(&lock);
+        if(intsEnabled) asm("sti");
+        return;
+    }
+
+    Waiter waiter = {GetCPULocal()->currentThread, false};
+    readers.add_back(&waiter);
+
+    Wait(waiter, intsEnabled); // The releasing writer counts us in activeReaders
+}
+
+void ReadWriteLock::AcquireWrite(){
+    bool intsEnabled = CheckInterrupts();
+    asm("cli");
+    acquireLock(&lock);
+
+    if(!writerActive && !activeReaders){
+        writerActive = true;
+
+        releaseLock(&lock);
+        if(intsEnabled) asm("sti");
+        return;
+    }
+
+    Waiter waiter = {GetCPULocal()->currentThread, false};
+    writers.add_back(&waiter);
+
+    Wait(waiter, intsEnabled); // The lock is handed to us with writerActive still set
+}
+
+void ReadWriteLock::ReleaseRead(){
+    bool intsEnabled = CheckInterrupts();
+    asm("cli");
+    acquireLock(&lock);
+
+    assert(activeReaders);
+    if(!--activeReaders && writers.get_length()){
+        writerActive = true;
+        Grant(writers.remove_at(0));
+    }
+
+    releaseLock(&lock);
+    if(intsEnabled) asm("sti");
+}
+
+void ReadWriteLock::ReleaseWrite(){
+    bool intsEnabled = CheckInterrupts();
+    asm("cli");
+    acquireLock(&lock);
+
+    assert(writerActive);
+    if(readers.get_length()){
+        writerActive = false;
+
+        while(readers.get_length()){
+            activeReaders++;
+            Grant(readers.remove_at(0));
+        }
+    } else if(writers.get_length()){
+        Grant(writers.remove_at(0)); // Hand over directly, writerActive stays set
+    } else {
+        writerActive = false;
+    }
+
+    releaseLock(&lock);
+    if(intsEnabled) asm("sti");
+}
+
+#ifdef LOCK_STATISTICS
+#define LOCK_STATISTICS_ENTRIES 1024
+#define LOCK_STATISTICS_SHOWN 32
+
+// Locks are told apart by address, so a lock in freed memory shares its entry with whatever lock reuses the address
+struct LockStatistics {
+    lock_t* volatile lock;
+    void* site; // First place the lock was acquired from
+    uint64_t acquisitions;
+    uint64_t contended;
+    uint64_t spinCycles;
+};
+
+static LockStatistics lockStatistics[LOCK_STATISTICS_ENTRIES];
+static uint64_t untrackedAcquisitions = 0; // Acquisitions of locks that did not fit in the table
+
+// Called on every acquisition from any context, so must not take any locks itself
+void RecordLockAcquisition(lock_t* lock, uint64_t spinCycles, void* site){
+    unsigned index = hash(static_cast<unsigned>(reinterpret_cast<uintptr_t>(lock) >> 2));
+
+    for(unsigned i = 0; i < LOCK_STATISTICS_ENTRIES; i++){
+        LockStatistics* entry = &lockStatistics[(index + i) % LOCK_STATISTICS_ENTRIES];
+
+        if(!entry->lock && __sync_bool_compare_and_swap(&entry->lock, nullptr, lock)){
+            entry->site = site;
+        }
+
+        if(entry->lock != lock){
+            continue;
+        }
+
+        __atomic_fetch_add(&entry->acquisitions, 1, __ATOMIC_RELAXED);
+        if(spinCycles){
+            __atomic_fetch_add(&entry->contended, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&entry->spinCycles, spinCycles, __ATOMIC_RELAXED);
+        }
+        return;
+    }
+
+    __atomic_fetch_add(&untrackedAcquisitions, 1, __ATOMIC_RELAXED);
+}
+
+size_t GetLockStatistics(char* buffer, size_t size){
+    char line[256];
+    char num[24];
+    size_t len = 0;
+
+    buffer[0] = 0;
+
+    // Pick out the locks with the most spin cycles, the counters keep changing underneath us so the numbers are only approximate
+    bool shown[LOCK_STATISTICS_ENTRIES] = {};
+    for(unsigned n = 0; n < LOCK_STATISTICS_SHOWN; n++){
+        LockStatistics* top = nullptr;
+        unsigned topIndex = 0;
+
+        for(unsigned i = 0; i < LOCK_STATISTICS_ENTRIES; i++){
+            LockStatistics* entry = &lockStatistics[i];
+            if(!entry->lock || shown[i]){
+                continue;
+            }
+
+            if(!top || entry->spinCycles > top->spinCycles || (entry->spinCycles == top->spinCycles && entry->acquisitions > top->acquisitions)){
+                top = entry;
+                topIndex = i;
+            }
+        }
+
+        if(!top){
+            break;
+        }
+        shown[topIndex] = true;
+
+        line[0] = 0;
+        strcat(line, "lock 0x");
+        strcat(line, itoa(reinterpret_cast<uintptr_t>(top->lock), num, 16));
+        strcat(line, " at 0x");
+        strcat(line, itoa(reinterpret_cast<uintptr_t>(top->site), num, 16));
+        strcat(line, ": ");
+        strcat(line, itoa(top->acquisitions, num, 10));
+        strcat(line, " acquisitions, ");
+        strcat(line, itoa(top->contended, num, 10));
+        strcat(line, " contended, ");
+        strcat(line, itoa(top->spinCycles, num, 10));
+        strcat(line, " spin cycles\n");
+
+        size_t lineLength = strlen(line);
+        if(len + lineLength >= size){
+            return len;
+        }
+
+        strcpy(buffer + len, line);
+        len += lineLength;
+    }
+
+    line[0] = 0;
+    strcat(line, "untracked: ");
+    strcat(line, itoa(untrackedAcquisitions, num, 10));
+    strcat(line, " acquisitions\n");
+
+    size_t lineLength = strlen(line);
+    if(len + lineLength < size){
+        strcpy(buffer + len, line);
+        len += lineLength;
+    }
+
+    return len;
+}
+#endif
@@ -67,7 +67,7 @@ int64_t IPSocket::SendTo(void* buffer, size_t len, int flags, const sockaddr* sr
 }
 
 void IPSocket::Close(){
-	if(port){
+	if(port && handleCount == 1){ // Last handle
 		Network::ReleasePort(port);
 	}
 
@@ -99,28 +99,24 @@ int64_t Socket::SendTo(void* buffer, size_t len, int flags, const sockaddr* src,
 }
 
 fs_fd_t* Socket::Open(size_t flags){
-    fs_fd_t* fDesc = (fs_fd_t*)kmalloc(sizeof(fs_fd_t));
+    fs_fd_t* fDesc = new fs_fd_t;
 
     fDesc->pos = 0;
     fDesc->mode = flags;
     fDesc->node = this;
 
+    handleCount++;
+
     return fDesc;
 }
 
 void Socket::Close(){
+    handleCount--;
+
     if(handleCount == 0)
         delete this;
 }
 
-void Socket::Watch(FilesystemWatcher& watcher, int events){
-    assert(!"Socket::Watch called from socket base");
-}
-
-void Socket::Unwatch(FilesystemWatcher& watcher){
-    assert(!"Socket::Unwatch called from socket base");
-}
-
 LocalSocket::LocalSocket(int type, int protocol) : Socket(type, protocol){
     domain = UnixDomain;
     flags = FS_NODE_SOCKET;
@@ -135,9 +131,7 @@ int LocalSocket::ConnectTo(Socket* client){
 
     pending.add_back(client);
 
-    while(watching.get_length()){
-        watching.remove_at(0)->Signal();
-    }
+    SignalWatchers();
 
     while(!client->connected){
         // TODO: Actually block the task
@@ -160,9 +154,7 @@ void LocalSocket::DisconnectPeer(){
 void LocalSocket::OnDisconnect(){
     connected = false;
 
-    while(watching.get_length()){
-        watching.remove_at(0)->Signal(); // Signal all watching on disconnect
-    }
+    SignalWatchers(); // Watchers see POLLHUP
 
     peer = nullptr;
 }
@@ -183,6 +175,7 @@ Socket* LocalSocket::Accept(sockaddr* addr, socklen_t* addrlen, int mode){
     LocalSocket* client = (LocalSocket*) next;
 
     LocalSocket* sock = new LocalSocket(*client);
+    sock->handleCount = 0; // Copied from the client, the accepted socket has no handles yet
     sock->outbound = client->inbound; // Outbound to client
     sock->inbound = client->outbound; // Inbound to server
     sock->role = ServerRole;
@@ -190,6 +183,7 @@ Socket* LocalSocket::Accept(sockaddr* addr, socklen_t* addrlen, int mode){
     client->peer = sock;
 
     sock->connected = client->connected = true;
+    client->SignalWatchers();
 
     return sock;
 }
@@ -309,9 +303,15 @@ int64_t LocalSocket::ReceiveFrom(void* buffer, size_t len, int flags, sockaddr*
 
     if(flags & MSG_PEEK){
         return inbound->Peek(buffer, len);
-    } else {
-        return inbound->Read(buffer, len);
     }
+
+    int64_t read = inbound->Read(buffer, len);
+
+    if(peer){
+        peer->SignalWatchers(); // Space has been freed, the peer may be waiting for POLLOUT
+    }
+
+    return read;
 }
 
 int64_t LocalSocket::SendTo(void* buffer, size_t len, int flags, const sockaddr* src, socklen_t addrlen){
@@ -338,17 +338,15 @@ int64_t LocalSocket::SendTo(void* buffer, size_t len, int flags, const sockaddr*
 
     int64_t written = outbound->Write(buffer, len);
 
-    if(peer && peer->CanRead()){
-        while(peer->watching.get_length()){
-            peer->watching.remove_at(0)->Signal();
-        }
+    if(peer){
+        peer->SignalWatchers();
     }
 
     return written;
 }
 
 fs_fd_t* LocalSocket::Open(size_t flags){
-    fs_fd_t* fDesc = (fs_fd_t*)kmalloc(sizeof(fs_fd_t));
+    fs_fd_t* fDesc = new fs_fd_t;
 
     fDesc->pos = 0;
     fDesc->mode = flags;
@@ -360,29 +358,13 @@ fs_fd_t* LocalSocket::Open(size_t flags){
 }
 
 void LocalSocket::Close(){
-    if(peer){
+    if(peer && handleCount == 1){ // Last handle
         DisconnectPeer();
     }
 
     Socket::Close();
 }
 
-void LocalSocket::Watch(FilesystemWatcher& watcher, int events){
-    if(!(events & (POLLIN | POLLPRI))){
-        return;
-    }
-
-    if(CanRead() | !IsConnected()){ // POLLHUP does not care if it is requested
-        return;
-    }
-
-    watching.add_back(&watcher);
-}
-
-void LocalSocket::Unwatch(FilesystemWatcher& watcher){
-    watching.remove(&watcher);
-}
-
 namespace SocketManager{
     List<SocketBinding> sockets;
 
@@ -8,7 +8,7 @@
 #define DEFAULT_TABLE_SIZE 65535
 
 namespace Memory {
-    int* lock = 0;
+    lock_t lock = 0;
 
     shared_mem_t** table = nullptr;
     unsigned tableSize = 0;
@@ -107,6 +107,7 @@ namespace Memory {
         mem_region_t mReg;
         mReg.base = (uintptr_t)mapping;
         mReg.pageCount = sMem->pgCount;
+        mReg.key = key;
         proc->sharedMemory.add_back(mReg);
         
         releaseLock(&lock);
@@ -114,6 +115,16 @@ namespace Memory {
         return mapping;
     }
 
+    void ReferenceSharedMemory(uint64_t key){
+        acquireLock(&lock);
+
+        if(shared_mem_t* sMem = GetSharedMemory(key)){
+            sMem->mapCount++;
+        }
+
+        releaseLock(&lock);
+    }
+
     void DestroySharedMemory(uint64_t key){
         //acquireLock(&lock);
         
@@ -0,0 +1,326 @@
+#include <slab.h>
+
+#include <cpu.h>
+#include <memory.h>
+#include <paging.h>
+#include <physicalallocator.h>
+#include <string.h>
+#include <assert.h>
+#include <logging.h>
+
+ObjectCache* ObjectCache::caches = nullptr;
+lock_t ObjectCache::cachesLock = 0;
+
+static bool magazinesEnabled = false;
+
+// Size classes for SlabAllocate, used by small general purpose allocations such as list nodes
+static ObjectCache sizeCaches[] = {
+    ObjectCache("size-32", 32),
+    ObjectCache("size-64", 64),
+    ObjectCache("size-128", 128),
+    ObjectCache("size-256", 256),
+    ObjectCache("size-512", 512),
+};
+
+static_assert(SLAB_MAX_OBJECT_SIZE == 512, "Size classes must cover every size up to SLAB_MAX_OBJECT_SIZE");
+
+// Allocate and map a new slab, lock must be held
+bool ObjectCache::Grow(){
+    if(!registered){
+        acquireLock(&cachesLock);
+        nextCache = caches;
+        caches = this;
+        releaseLock(&cachesLock);
+
+        registered = true;
+    }
+
+    Slab* slab = reinterpret_cast<Slab*>(Memory::KernelAllocate4KPages(1));
+    if(!slab){
+        return false;
+    }
+
+    Memory::KernelMapVirtualMemory4K(Memory::AllocatePhysicalMemoryBlock(), (uintptr_t)slab, 1);
+
+    slab->cache = this;
+    slab->inUse = 0;
+    SlabPush(slab, &partial);
+
+    // Thread every object onto the free list of the slab
+    uint8_t* object = reinterpret_cast<uint8_t*>(slab) + SlabHeaderSize();
+    slab->freeList = object;
+    for(unsigned i = 0; i < objectsPerSlab - 1; i++){
+        *reinterpret_cast<void**>(object) = object + objectSize;
+        object += objectSize;
+    }
+    *reinterpret_cast<void**>(object) = nullptr;
+
+    slabCount++;
+    return true;
+}
+
+void ObjectCache::SlabUnlink(Slab* slab, Slab** list){
+    if(slab->prev){
+        slab->prev->next = slab->next;
+    } else {
+        *list = slab->next;
+    }
+
+    if(slab->next){
+        slab->next->prev = slab->prev;
+    }
+
+    slab->next = slab->prev = nullptr;
+}
+
+void ObjectCache::SlabPush(Slab* slab, Slab** list){
+    slab->prev = nullptr;
+    slab->next = *list;
+    if(*list){
+        (*list)->prev = slab;
+    }
+    *list = slab;
+}
+
+void* ObjectCache::AllocateFromSlab(){
+    Slab* slab = partial;
+    if(!slab){
+        if(empty){ // Reuse an empty slab before asking for more pages
+            slab = empty;
+            SlabUnlink(slab, &empty);
+            SlabPush(slab, &partial);
+            emptyCount--;
+        } else if(!Grow()){
+            return nullptr;
+        } else {
+            slab = partial;
+        }
+    }
+
+    void* object = slab->freeList;
+    slab->freeList = *reinterpret_cast<void**>(object);
+    slab->inUse++;
+    objectsInUse++;
+
+    if(!slab->freeList){
+        SlabUnlink(slab, &partial);
+        SlabPush(slab, &full);
+    }
+
+    return object;
+}
+
+void ObjectCache::FreeToSlab(void* object){
+    Slab* slab = reinterpret_cast<Slab*>((uintptr_t)object & ~(uintptr_t)(SLAB_SIZE - 1));
+    assert(slab->cache == this);
+
+    bool wasFull = !slab->freeList;
+
+    *reinterpret_cast<void**>(object) = slab->freeList;
+    slab->freeList = object;
+    slab->inUse--;
+    objectsInUse--;
+
+    if(wasFull){
+        SlabUnlink(slab, &full);
+        SlabPush(slab, &partial);
+    }
+
+    if(!slab->inUse){
+        SlabUnlink(slab, &partial);
+
+        if(emptyCount < SLAB_MAX_EMPTY_SLABS){
+            SlabPush(slab, &empty);
+            emptyCount++;
+        } else { // Give the page back
+            Memory::FreePhysicalMemoryBlock(Memory::VirtualToPhysicalAddress((uintptr_t)slab));
+            Memory::KernelFree4KPages(slab, 1);
+            slabCount--;
+        }
+    }
+}
+
+// Get the magazine of the current CPU, interrupts must be disabled.
+// Magazines are allocated on first use by each CPU, which can only be done if interrupts were enabled by the caller.
+ObjectCache::Magazine* ObjectCache::GetMagazine(bool canAllocate){
+    if(!magazinesEnabled){
+        return nullptr;
+    }
+
+    uint64_t id = GetCPULocal()->id;
+    if(id >= SLAB_MAX_CPUS){
+        return nullptr;
+    }
+
+    if(magazines[id] || !canAllocate){
+        return magazines[id];
+    }
+
+    asm("sti");
+    Magazine* magazine = reinterpret_cast<Magazine*>(kmalloc(sizeof(Magazine)));
+    if(magazine){
+        memset(magazine, 0, sizeof(Magazine));
+
+        if(!__sync_bool_compare_and_swap(&magazines[id], nullptr, magazine)){
+            kfree(magazine);
+        }
+    }
+    asm("cli");
+
+    id = GetCPULocal()->id; // We may have been moved to another CPU
+    return magazines[id];
+}
+
+void* ObjectCache::Allocate(){
+    bool intsEnabled = CheckInterrupts();
+    asm("cli"); // Make sure we stay on this CPU, objects may also be allocated from interrupt handlers
+
+    void* object = nullptr;
+    Magazine* magazine = GetMagazine(intsEnabled);
+    if(magazine){
+        if(magazine->count){
+            magazine->hits++;
+        } else { // Refill from the slabs
+            magazine->misses++;
+
+            acquireLock(&lock);
+            while(magazine->count < SLAB_MAGAZINE_BATCH && (object = AllocateFromSlab())){
+                magazine->objects[magazine->count++] = object;
+            }
+            releaseLock(&lock);
+        }
+
+        object = magazine->count ? magazine->objects[--magazine->count] : nullptr;
+    } else {
+        acquireLock(&lock);
+        object = AllocateFromSlab();
+        releaseLock(&lock);
+    }
+
+    if(intsEnabled) asm("sti");
+    return object;
+}
+
+void ObjectCache::Free(void* object){
+    if(!object){
+        return;
+    }
+
+    bool intsEnabled = CheckInterrupts();
+    asm("cli");
+
+    Magazine* magazine = GetMagazine(intsEnabled);
+    if(magazine){
+        if(magazine->count >= SLAB_MAGAZINE_SIZE){ // Give the oldest objects back to the slabs
+            magazine->drains++;
+
+            acquireLock(&lock);
+            for(unsigned i = 0; i < SLAB_MAGAZINE_BATCH; i++){
+                FreeToSlab(magazine->objects[i]);
+            }
+            releaseLock(&lock);
+
+            magazine->count -= SLAB_MAGAZINE_BATCH;
+            memcpy(magazine->objects, magazine->objects + SLAB_MAGAZINE_BATCH, magazine->count * sizeof(void*));
+        }
+
+        magazine->objects[magazine->count++] = object;
+    } else {
+        acquireLock(&lock);
+        FreeToSlab(object);
+        releaseLock(&lock);
+    }
+
+    if(intsEnabled) asm("sti");
+}
+
+size_t ObjectCache::GetStatistics(char* buffer, size_t size){
+    char line[256];
+    char num[24];
+    size_t len = 0;
+
+    buffer[0] = 0;
+
+    bool intsEnabled = CheckInterrupts();
+    asm("cli"); // cachesLock is taken by Grow with interrupts disabled
+
+    acquireLock(&cachesLock);
+    for(ObjectCache* cache = caches; cache; cache = cache->nextCache){
+        uint64_t hits = 0, misses = 0, drains = 0, cached = 0;
+        for(unsigned i = 0; i < SLAB_MAX_CPUS; i++){
+            if(Magazine* magazine = cache->magazines[i]){
+                hits += magazine->hits;
+                misses += magazine->misses;
+                drains += magazine->drains;
+                cached += magazine->count;
+            }
+        }
+
+        line[0] = 0;
+        strcat(line, cache->name);
+        strcat(line, ": ");
+        strcat(line, itoa(cache->objectSize, num, 10));
+        strcat(line, " bytes, ");
+        strcat(line, itoa(cache->slabCount, num, 10));
+        strcat(line, " slabs, ");
+        strcat(line, itoa(cache->objectsInUse - cached, num, 10));
+        strcat(line, " in use, ");
+        strcat(line, itoa(cached, num, 10));
+        strcat(line, " cached, ");
+        strcat(line, itoa(hits, num, 10));
+        strcat(line, " hits, ");
+        strcat(line, itoa(misses, num, 10));
+        strcat(line, " misses, ");
+        strcat(line, itoa(drains, num, 10));
+        strcat(line, " drains\n");
+
+        size_t lineLength = strlen(line);
+        if(len + lineLength >= size){
+            break;
+        }
+
+        strcpy(buffer + len, line);
+        len += lineLength;
+    }
+    releaseLock(&cachesLock);
+
+    if(intsEnabled) asm("sti");
+    return len;
+}
+
+namespace Memory{
+    void EnableObjectCacheMagazines(){
+        magazinesEnabled = true;
+    }
+
+    static inline ObjectCache* SizeCache(size_t size){
+        if(size <= 32){
+            return &sizeCaches[0];
+        } else if(size <= 64){
+            return &sizeCaches[1];
+        } else if(size <= 128){
+            return &sizeCaches[2];
+        } else if(size <= 256){
+            return &sizeCaches[3];
+        } else {
+            return &sizeCaches[4];
+        }
+    }
+
+    void* SlabAllocate(size_t size){
+        if(size > SLAB_MAX_OBJECT_SIZE){
+            return kmalloc(size);
+        }
+
+        return SizeCache(size)->Allocate();
+    }
+
+    void SlabFree(void* object, size_t size){
+        if(size > SLAB_MAX_OBJECT_SIZE){
+            kfree(object);
+            return;
+        }
+
+        SizeCache(size)->Free(object);
+    }
+}
@@ -13,13 +13,22 @@ namespace AHCI{
 	hba_mem_t* ahciHBA;
 
 	Port* ports[32];
+	bool interruptsEnabled = false;
 
 	PCIDevice* controllerPCIDevice;
 	uint8_t ahciClassCode = PCI_CLASS_STORAGE;
 	uint8_t ahciSubclass = PCI_SUBCLASS_SATA;
 	
     void InterruptHandler(void*, regs64_t* r){
-        Log::Info("[AHCI] Interrupt!");
+		uint32_t is = ahciHBA->is;
+
+		for(int i = 0; i < 32; i++){
+			if(((is >> i) & 1) && ports[i]){
+				ports[i]->OnInterrupt();
+			}
+		}
+
+		ahciHBA->is = is; // Clear after the port interrupt status so the controller does not raise it again
     }
 
 	int Init(){
@@ -55,7 +64,10 @@ namespace AHCI{
 			Timer::Wait(1);
 		}
 
-		IDT::RegisterInterruptHandler(irq, InterruptHandler);
+		if(irq != 0xFF){
+			IDT::RegisterInterruptHandler(irq, InterruptHandler);
+			interruptsEnabled = true;
+		}
 
 		/*ahciHBA->ghc = AHCI_GHC_ENABLE | 1; // Reset Controller
 		while(ahciHBA->ghc & 1){
@@ -69,6 +81,10 @@ namespace AHCI{
 
 		ahciHBA->is = 0xffffffff;
 
+		if(interruptsEnabled){
+			ahciHBA->ghc |= AHCI_GHC_IE;
+		}
+
 		for(int i = 0; i < 32; i++){
 			if((pi >> i) & 1){
 				if(((ahciHBA->ports[i].ssts >> 8) & 0x0F) != HBA_PORT_IPM_ACTIVE || (ahciHBA->ports[i].ssts & HBA_PxSSTS_DET) != HBA_PxSSTS_DET_PRESENT) continue;
@@ -6,8 +6,8 @@
 #include <gpt.h>
 #include <ata.h>
 #include <timer.h>
-
-#define HBA_PxIS_TFES   (1 << 30)
+#include <cpu.h>
+#include <scheduler.h>
 
 namespace AHCI{
 	Port::Port(int num, hba_port_t* portStructure, hba_mem_t* hbaMem){
@@ -45,15 +45,23 @@ namespace AHCI{
         fis->rfis.fis_type = FIS_TYPE_REG_D2H;
         fis->sdbfis[0] = FIS_TYPE_DEV_BITS;
 
-        for(int i = 0; i < 8 /*Support for 8 command slots*/; i++){
+        commandSlotCount = AHCI_CAP_NCS(hbaMem->cap);
+        for(int i = 0; i < commandSlotCount; i++){
             commandList[i].prdtl = 1;
 
-            phys = Memory::AllocatePhysicalMemoryBlock();
+            phys = Memory::AllocatePhysicalMemoryBlocks(AHCI_COMMAND_TABLE_PAGES); // Large enough for a PRDT covering AHCI_MAX_TRANSFER_SIZE
             commandList[i].ctba = (uint32_t)(phys & 0xFFFFFFFF);
             commandList[i].ctbau = (uint32_t)(phys >> 32);
 
             commandTables[i] = (hba_cmd_tbl_t*)Memory::GetIOMapping(phys);
-            memset(commandTables[i],0,PAGE_SIZE_4K);
+            memset(commandTables[i],0,PAGE_SIZE_4K * AHCI_COMMAND_TABLE_PAGES);
+
+            // Each slot gets its own buffer so commands can be outstanding at the same time
+            slotBufferPhys[i] = Memory::AllocatePhysicalMemoryBlock();
+            slotBuffers[i] = reinterpret_cast<uint8_t*>(Memory::KernelAllocate4KPages(1));
+            Memory::KernelMapVirtualMemory4K(slotBufferPhys[i], reinterpret_cast<uintptr_t>(slotBuffers[i]), 1);
+
+            slotWaiters[i] = nullptr;
         }
 
         registers->sctl |= (SCTL_PORT_IPM_NOPART | SCTL_PORT_IPM_NOSLUM | SCTL_PORT_IPM_NODSLP);
@@ -63,7 +71,7 @@ namespace AHCI{
         }
 
         registers->is = 0; // Clear interrupts
-        registers->ie = 1;
+        registers->ie = HBA_PxIS_DHRS | HBA_PxIS_PSS | HBA_PxIS_DSS | HBA_PxIS_SDBS | HBA_PxIS_ERROR;
         registers->fbs &= ~(0xFFFFF000U);
 
         registers->cmd |= HBA_PxCMD_POD;
@@ -131,13 +139,17 @@ namespace AHCI{
             return;
         }
 
-        bufPhys = Memory::AllocatePhysicalMemoryBlock();
-        bufVirt = Memory::KernelAllocate4KPages(1);
-        Memory::KernelMapVirtualMemory4K(bufPhys, (uintptr_t)bufVirt, 1);
+        freeSlots = static_cast<uint32_t>((1ULL << commandSlotCount) - 1);
+        slotSemaphore.SetValue(commandSlotCount);
 
+        ports[num] = this; // Commands are completed from the interrupt handler, including the ones issued below
         status = AHCIStatus::Active;
 
-        Identify();
+        registers->serr = registers->serr; // Clear errors
+        registers->is = 0xffffffff;
+        startCMD(registers); // Leave the command engine running so commands can be queued
+
+        Identify(hbaMem);
 
         Log::Info("[AHCI] Port - SSTS: %x, SCTL: %x, SERR: %x, SACT: %x, Cmd/Status: %x, FBS: %x, IE: %x", registers->ssts, registers->sctl, registers->serr, registers->sact, registers->cmd, registers->fbs, registers->ie);
 
@@ -154,243 +166,240 @@ namespace AHCI{
         InitializePartitions();
     }
 
-    int Port::ReadDiskBlock(uint64_t lba, uint32_t count, void* _buffer){
-        uint64_t blockCount = ((count + 511) / 512);
-        uint8_t* buffer = reinterpret_cast<uint8_t*>(_buffer);
-        
-        while(blockCount >= 8 && count){
-            uint64_t size;
-            if(count < 512 * 8) size = count;
-            else size = 512 * 8;
-
-            if(!size) continue;
+    int Port::ReadDiskBlock(uint64_t lba, uint32_t count, void* buffer){
+        disk_segment_t segment = {reinterpret_cast<uint8_t*>(buffer), count};
+        return Transfer(lba, &segment, 1, false);
+    }
 
-            if(Access(lba, 8, 0)){ // LBA, 2 blocks, read
-                return 1; // Error Reading Sectors
-            }
+    int Port::WriteDiskBlock(uint64_t lba, uint32_t count, void* buffer){
+        disk_segment_t segment = {reinterpret_cast<uint8_t*>(buffer), count};
+        return Transfer(lba, &segment, 1, true);
+    }
 
-            memcpy(buffer, bufVirt, size);
-            buffer += size;
-            lba += 8;
-            blockCount -= 8;
-            count -= size;
-        }
+    int Port::ReadDiskBlocks(uint64_t lba, const disk_segment_t* segments, unsigned count){
+        return Transfer(lba, segments, count, false);
+    }
 
-        while(blockCount >= 2 && count){
-            uint64_t size;
-            if(count < 512 * 2) size = count;
-            else size = 512 * 2;
+    int Port::WriteDiskBlocks(uint64_t lba, const disk_segment_t* segments, unsigned count){
+        return Transfer(lba, segments, count, true);
+    }
 
-            if(!size) continue;
+    // Split the transfer into commands and keep as many of them outstanding as there are free slots.
+    // Whole sectors are transferred straight to and from the pages of the segments where possible,
+    // anything else (e.g. user memory or a partial sector) goes through the slot bounce buffer.
+    int Port::Transfer(uint64_t lba, const disk_segment_t* segments, unsigned segmentCount, bool write){
+        struct {
+            int slot;
+            uint8_t* buffer;
+            uint32_t size;
+            bool bounce;
+        } pending[AHCI_MAX_COMMAND_SLOTS]; // Issued commands, oldest first
+        unsigned first = 0;
+        unsigned last = 0;
+
+        unsigned segment = 0; // Current segment
+        uint32_t offset = 0; // Offset into the current segment
+
+        while(segment < segmentCount && !segments[segment].size){
+            segment++;
+        }
 
-            if(Access(lba, 2, 0)){ // LBA, 2 blocks, read
-                return 1; // Error Reading Sectors
+        int error = 0;
+        while((segment < segmentCount && !error) || first != last){
+            int slot = -1;
+            if(segment < segmentCount && !error){
+                slot = AcquireSlot(first == last); // Only block when holding no slots, otherwise wait on our own commands
             }
 
-            memcpy(buffer, bufVirt, size);
-            buffer += size;
-            lba += 2;
-            blockCount -= 2;
-            count -= size;
-        }
-
-        while(blockCount-- && count){
-            uint64_t size;
-            if(count < 512) size = count;
-            else size = 512;
+            if(slot >= 0){
+                uint8_t* buffer = segments[segment].buffer + offset;
+                uint32_t size = MapBuffer(slot, segments + segment, segmentCount - segment, offset);
 
-            if(!size) continue;
+                bool bounce = !size;
+                if(bounce){ // Bounce buffered commands never cross a segment
+                    size = segments[segment].size - offset;
+                    if(size > AHCI_SLOT_BUFFER_SIZE) size = AHCI_SLOT_BUFFER_SIZE;
 
-            if(Access(lba, 1, 0)){ // LBA, 1 block, read
-                return 1; // Error Reading Sectors
-            }
+                    SetSlotBuffer(slot, (size + 511) / 512 * 512);
+                }
 
-            memcpy(buffer, bufVirt, size);
-            buffer += size;
-            lba++;
-        }
+                uint32_t sectors = (size + 511) / 512;
 
-        portLock.SetValue(1);
-        return 0;
-    }
+                if(write && bounce){
+                    memcpy(slotBuffers[slot], buffer, size);
+                    memset(slotBuffers[slot] + size, 0, sectors * 512 - size);
+                }
 
-    
-    int Port::WriteDiskBlock(uint64_t lba, uint32_t count, void* _buffer){
-        uint64_t blockCount = ((count / 512 * 512) < count) ? ((count / 512) + 1) : (count / 512);
-        uint8_t* buffer = reinterpret_cast<uint8_t*>(_buffer);
+                if(ncq){
+                    Issue(slot, write ? ATA_CMD_WRITE_FPDMA_QUEUED : ATA_CMD_READ_FPDMA_QUEUED, lba, sectors);
+                } else {
+                    Issue(slot, write ? ATA_CMD_WRITE_DMA_EX : ATA_CMD_READ_DMA_EX, lba, sectors);
+                }
 
-        while(blockCount-- && count){
-            uint64_t size;
-            if(count < 512) size = count;
-            else size = 512;
+                pending[last++ % AHCI_MAX_COMMAND_SLOTS] = {slot, buffer, size, bounce};
 
-            if(!size) continue;
+                lba += sectors;
 
-            memcpy(bufVirt, buffer, size);
+                offset += size;
+                while(segment < segmentCount && offset >= segments[segment].size){
+                    offset -= segments[segment].size;
+                    segment++;
+                }
+                continue;
+            }
 
-            if(Access(lba, 1, 1)){ // LBA, 1 block, write
-                return 1; // Error Reading Sectors
+            auto& command = pending[first++ % AHCI_MAX_COMMAND_SLOTS];
+            if(WaitForCompletion(command.slot)){
+                error = 1; // Error reading or writing sectors
+            } else if(!write && command.bounce){
+                memcpy(command.buffer, slotBuffers[command.slot], command.size);
             }
 
-            buffer += size;
-            lba++;
+            ReleaseSlot(command.slot);
         }
 
-        return 0;
+        return error;
     }
 
-    int Port::Access(uint64_t lba, uint32_t count, int write){
-        portLock.Wait();
-
-        registers->ie = 0xffffffff; 
-        registers->is = 0; 
-        int spin = 0;
-
-        int slot = FindCmdSlot();
-        if(slot == -1){
-            Log::Warning("[SATA] Could not find command slot!");
-            
-            portLock.Signal();
-            return 2;
+    int Port::AcquireSlot(bool wait){
+        if(wait){
+            slotSemaphore.Wait();
+        } else if(!slotSemaphore.TryWait()){
+            return -1;
         }
 
-        hba_cmd_header_t* commandHeader = &commandList[slot];
+        acquireLock(&slotLock);
+        int slot = __builtin_ctz(freeSlots); // The semaphore guarantees a free slot
+        freeSlots &= ~(1U << slot);
+        releaseLock(&slotLock);
 
-        commandHeader->cfl = sizeof(fis_reg_h2d_t) / sizeof(uint32_t);
+        return slot;
+    }
 
-        commandHeader->a = 0;
-        commandHeader->w = write;
-        commandHeader->c = 1;
-        commandHeader->p = 1;
+    void Port::ReleaseSlot(int slot){
+        acquireLock(&slotLock);
+        freeSlots |= 1U << slot;
+        releaseLock(&slotLock);
 
-        commandHeader->prdbc = 0;
-        commandHeader->pmp = 0;
+        slotSemaphore.Signal();
+    }
 
-        hba_cmd_tbl_t* commandTable = commandTables[slot];
-        memset(commandTable, 0, sizeof(hba_cmd_tbl_t));
+    void Port::SetSlotBuffer(int slot, uint32_t size){
+        hba_prdt_entry_t& entry = commandTables[slot]->prdt_entry[0];
 
-        commandTable->prdt_entry[0].dba = bufPhys & 0xFFFFFFFF;
-        commandTable->prdt_entry[0].dbau = (bufPhys >> 32) & 0xFFFFFFFF;
-        commandTable->prdt_entry[0].dbc = 512 * count - 1; // 512 bytes per sector
-        commandTable->prdt_entry[0].i = 1;
+        entry.dba = slotBufferPhys[slot] & 0xFFFFFFFF;
+        entry.dbau = (slotBufferPhys[slot] >> 32) & 0xFFFFFFFF;
+        entry.rsv0 = 0;
+        entry.dbc = size - 1;
+        entry.i = 1;
 
-        fis_reg_h2d_t* cmdfis = (fis_reg_h2d_t*)(commandTable->cfis); 
-        memset(commandTable->cfis, 0, sizeof(fis_reg_h2d_t));
+        commandList[slot].prdtl = 1;
+    }
 
-        cmdfis->fis_type = FIS_TYPE_REG_H2D;
-        cmdfis->c = 1;  // Command
-        cmdfis->pmport = 0; // Port multiplier
+    uint32_t Port::MapBuffer(int slot, const disk_segment_t* segments, unsigned count, uint32_t offset){
+        hba_prdt_entry_t* prdt = commandTables[slot]->prdt_entry;
 
-        if(write){
-            cmdfis->command = ATA_CMD_WRITE_DMA_EX;
-        } else {
-            cmdfis->command = ATA_CMD_READ_DMA_EX;
-        }
- 
-        cmdfis->lba0 = lba & 0xFF;
-        cmdfis->lba1 = (lba >> 8) & 0xFF;
-        cmdfis->lba2 = (lba >> 16) & 0xFF;
-        cmdfis->device = 1 << 6;
- 
-        cmdfis->lba3 = (lba >> 24) & 0xFF;
-        cmdfis->lba4 = (lba >> 32) & 0xFF;
-        cmdfis->lba5 = (lba >> 40) & 0xFF;
- 
-        cmdfis->countl = count & 0xff;
-        cmdfis->counth = count >> 8;
+        unsigned entries = 0;
+        uint32_t mapped = 0;
+        uint64_t entryStart = 0;
+        uint32_t entrySize = 0;
 
-        cmdfis->control = 0;
+        bool done = false;
+        for(unsigned i = 0; i < count && !done; i++, offset = 0){
+            uintptr_t virt = reinterpret_cast<uintptr_t>(segments[i].buffer) + offset;
+            uint32_t size = segments[i].size - offset;
 
-        spin = 0xFFFFF;
-        while ((registers->tfd & (ATA_DEV_BUSY | ATA_DEV_DRQ)) && spin) {
-            spin--;
-        }
+            if(virt & 1){ // The controller requires word aligned buffers
+                break;
+            }
 
-        if(spin <= 0){
-            Log::Warning("[SATA] Port Hung");
-            
-            portLock.Signal();
-            return 3;
+            for(uint32_t segmentMapped = 0; segmentMapped < size;){
+                uint32_t chunk = PAGE_SIZE_4K - ((virt + segmentMapped) & (PAGE_SIZE_4K - 1));
+                if(chunk > size - segmentMapped) chunk = size - segmentMapped;
+                if(chunk > AHCI_MAX_TRANSFER_SIZE - mapped) chunk = AHCI_MAX_TRANSFER_SIZE - mapped;
+
+                uint64_t phys = Memory::VirtualToPhysicalAddress(virt + segmentMapped);
+                if(!chunk || !phys){
+                    done = true;
+                    break;
+                }
+
+                if(entrySize && entryStart + entrySize == phys && entrySize + chunk <= AHCI_MAX_PRDT_ENTRY_SIZE){
+                    entrySize += chunk; // Physically contiguous with the last page
+                } else {
+                    if(entrySize){
+                        prdt[entries].dba = entryStart & 0xFFFFFFFF;
+                        prdt[entries].dbau = entryStart >> 32;
+                        prdt[entries].rsv0 = 0;
+                        prdt[entries].dbc = entrySize - 1;
+                        prdt[entries].i = 0;
+                        entries++;
+                    }
+
+                    if(entries >= AHCI_PRDT_ENTRIES){
+                        entrySize = 0;
+                        done = true;
+                        break;
+                    }
+
+                    entryStart = phys;
+                    entrySize = chunk;
+                }
+
+                segmentMapped += chunk;
+                mapped += chunk;
+            }
         }
 
-        registers->ie = registers->is = 0xffffffff;
-
-        startCMD(registers);
-        registers->ci |= 1 << slot;
-
-        //Log::Info("SERR: %x, Slot: %x, PxCMD: %x, Int status: %x, Ci: %x, TFD: %x", registers->serr, slot, registers->cmd, registers->is, registers->ci, registers->tfd);
+        if(entrySize){
+            prdt[entries].dba = entryStart & 0xFFFFFFFF;
+            prdt[entries].dbau = entryStart >> 32;
+            prdt[entries].rsv0 = 0;
+            prdt[entries].dbc = entrySize - 1;
+            prdt[entries].i = 0;
+            entries++;
+        }
 
-        while(registers->ci & (1 << slot)) {
-            if (registers->is & HBA_PxIS_TFES)   // Task file error
-            {
-                Log::Warning("[SATA] Disk Error (SERR: %x)", registers->serr);
-                
-                stopCMD(registers);
-                portLock.Signal();
-                return 1;
+        // Partial sectors go through the bounce buffer, trim the PRDT back to a sector boundary
+        uint32_t excess = mapped & 511;
+        mapped -= excess;
+        while(excess && entries){
+            uint32_t entryBytes = prdt[entries - 1].dbc + 1;
+            if(entryBytes > excess){
+                prdt[entries - 1].dbc = entryBytes - excess - 1;
+                break;
             }
-        }
 
-        spin = 0xFFFFF;
-        while ((registers->tfd & (ATA_DEV_BUSY | ATA_DEV_DRQ)) && spin) {
-            spin--;
+            excess -= entryBytes;
+            entries--;
         }
 
-        stopCMD(registers);
-        
-        if(spin <= 0){
-            Log::Warning("[SATA] Port Hung");
-            
-            portLock.Signal();
-            return 3;
+        if(!mapped){
+            return 0;
         }
-        
-       // Log::Info("SERR: %x, Slot: %x, PxCMD: %x, Int status: %x, Ci: %x, TFD: %x", registers->serr, slot, registers->cmd, registers->is, registers->ci, registers->tfd);
-        
-        if (registers->is & HBA_PxIS_TFES) {
-            Log::Warning("[SATA] Disk Error (SERR: %x)", registers->serr);
-            
-            portLock.Signal();
-            return 1;
-        }
-
-        portLock.Signal();
-        return 0;
-    }
 
-    void Port::Identify(){
+        prdt[entries - 1].i = 1;
+        commandList[slot].prdtl = entries;
 
-        registers->ie = 0xffffffff; 
-        registers->is = 0; 
-        int spin = 0;
-
-        registers->tfd = 0;
+        return mapped;
+    }
 
-        int slot = FindCmdSlot();
-        if(slot == -1){
-            Log::Warning("[SATA] Could not find command slot!");
-            return ;
-        }
+    void Port::Issue(int slot, uint8_t command, uint64_t lba, uint32_t count){
+        bool queued = (command == ATA_CMD_READ_FPDMA_QUEUED || command == ATA_CMD_WRITE_FPDMA_QUEUED);
 
         hba_cmd_header_t* commandHeader = &commandList[slot];
 
         commandHeader->cfl = sizeof(fis_reg_h2d_t) / sizeof(uint32_t);
 
         commandHeader->a = 0;
-        commandHeader->w = 0;
-        commandHeader->c = 1;
-        commandHeader->p = 1;
+        commandHeader->w = (command == ATA_CMD_WRITE_DMA_EX || command == ATA_CMD_WRITE_FPDMA_QUEUED);
+        commandHeader->c = 0; // The command completes when the device sends a register or set device bits FIS
+        commandHeader->p = !queued;
 
         commandHeader->prdbc = 0;
         commandHeader->pmp = 0;
 
         hba_cmd_tbl_t* commandTable = commandTables[slot];
-        memset(commandTable, 0, sizeof(hba_cmd_tbl_t));
-
-        commandTable->prdt_entry[0].dba = bufPhys & 0xFFFFFFFF;
-        commandTable->prdt_entry[0].dbau = (bufPhys >> 32) & 0xFFFFFFFF;
-        commandTable->prdt_entry[0].dbc = 512 - 1; // 512 bytes per sector
-        commandTable->prdt_entry[0].i = 1;
 
         fis_reg_h2d_t* cmdfis = (fis_reg_h2d_t*)(commandTable->cfis); 
         memset(commandTable->cfis, 0, sizeof(fis_reg_h2d_t));
@@ -398,76 +407,137 @@ namespace AHCI{
         cmdfis->fis_type = FIS_TYPE_REG_H2D;
         cmdfis->c = 1;  // Command
         cmdfis->pmport = 0; // Port multiplier
-        cmdfis->command = ATA_CMD_IDENTIFY;
- 
-        cmdfis->lba0 = 0;
-        cmdfis->lba1 = 0;
-        cmdfis->lba2 = 0;
-        cmdfis->device = 0;
- 
-        cmdfis->lba3 = 0;
-        cmdfis->lba4 = 0;
-        cmdfis->lba5 = 0;
- 
-        cmdfis->countl = 0;
-        cmdfis->counth = 0;
+        cmdfis->command = command;
+
+        if(command != ATA_CMD_IDENTIFY){
+            cmdfis->lba0 = lba & 0xFF;
+            cmdfis->lba1 = (lba >> 8) & 0xFF;
+            cmdfis->lba2 = (lba >> 16) & 0xFF;
+            cmdfis->device = 1 << 6;
+    
+            cmdfis->lba3 = (lba >> 24) & 0xFF;
+            cmdfis->lba4 = (lba >> 32) & 0xFF;
+            cmdfis->lba5 = (lba >> 40) & 0xFF;
+
+            if(queued){ // The sector count goes in the feature register and the count register holds the tag
+                cmdfis->featurel = count & 0xff;
+                cmdfis->featureh = count >> 8;
+                cmdfis->countl = slot << 3;
+            } else {
+                cmdfis->countl = count & 0xff;
+                cmdfis->counth = count >> 8;
+            }
+        }
 
         cmdfis->control = 0;
 
-        while ((registers->tfd & (ATA_DEV_BUSY | ATA_DEV_DRQ)) && spin < 1000000) {
-            spin++;
-        }
+        bool intsEnabled = CheckInterrupts();
+        asm("cli");
+        acquireLock(&issueLock);
 
-        if(spin >= 1000000){
-            Log::Warning("[SATA] Port Hung");
-            return;
+        slotWaiters[slot] = GetCPULocal()->currentThread;
+        activeSlots |= 1U << slot;
+        failedSlots &= ~(1U << slot);
+
+        if(queued){
+            registers->sact = 1U << slot;
         }
+        registers->ci = 1U << slot;
+
+        releaseLock(&issueLock);
+        if(intsEnabled) asm("sti");
+    }
 
-        registers->ie = registers->is = 0xffffffff;
+    int Port::WaitForCompletion(int slot){
+        bool intsEnabled = CheckInterrupts();
+        asm("cli");
+        acquireLock(&issueLock);
 
-        startCMD(registers);
-        registers->ci |= 1 << slot;
+        // Block until the interrupt handler completes the command, checking ourselves in case it has already finished.
+        // The wait is not killable as the device still uses the slot and the caller's pages,
+        // a killed thread keeps running until the command completes and the caller releases the slot.
+        Scheduler::BlockUntil(issueLock, interruptsEnabled && intsEnabled, [&]{
+            CheckCompletions();
+            return !(activeSlots & (1U << slot));
+        });
 
-        //Log::Info("SERR: %x, Slot: %x, PxCMD: %x, Int status: %x, Ci: %x, TFD: %x", registers->serr, slot, registers->cmd, registers->is, registers->ci, registers->tfd);
+        int error = (failedSlots >> slot) & 1;
 
-        while(registers->ci & (1 << slot)) {
-            if (registers->is & HBA_PxIS_TFES)   // Task file error
-            {
-                Log::Warning("[SATA] Disk Error (SERR: %x)", registers->serr);
-                stopCMD(registers);
-                return;
-            }
+        slotWaiters[slot] = nullptr;
+
+        releaseLock(&issueLock);
+        if(intsEnabled) asm("sti");
+        return error;
+    }
+
+    void Port::CheckCompletions(){
+        uint32_t is = registers->is;
+        registers->is = is;
+
+        uint32_t completed;
+        if(is & HBA_PxIS_ERROR){
+            Log::Warning("[AHCI] Port error (IS: %x, TFD: %x, SERR: %x, outstanding: %x)", is, registers->tfd, registers->serr, activeSlots);
+
+            // The device aborts every outstanding command on error,
+            // so fail them all and restart the command engine to clear PxCI and PxSACT
+            completed = activeSlots;
+            failedSlots |= completed;
+
+            stopCMD(registers);
+            registers->serr = registers->serr;
+            registers->is = 0xffffffff;
+            startCMD(registers);
+        } else {
+            completed = activeSlots & ~(registers->sact | registers->ci);
         }
-        
-        stopCMD(registers);
 
-        spin = 0xFFFFF;
-        while ((registers->tfd & (ATA_DEV_BUSY | ATA_DEV_DRQ)) && spin) {
-            spin--;
+        activeSlots &= ~completed;
+
+        while(completed){
+            int slot = __builtin_ctz(completed);
+            completed &= completed - 1;
+
+            thread_t* thread = slotWaiters[slot];
+            if(thread && thread->state == ThreadStateBlocked){
+                Scheduler::UnblockThread(thread);
+            }
         }
+    }
 
-       // Log::Info("SERR: %x, Slot: %x, PxCMD: %x, Int status: %x, Ci: %x, TFD: %x", registers->serr, slot, registers->cmd, registers->is, registers->ci, registers->tfd);
-        
-        if (registers->is & HBA_PxIS_TFES) {
-            Log::Warning("[SATA] Disk Error (SERR: %x)", registers->serr);
-            stopCMD(registers);
+    void Port::OnInterrupt(){
+        acquireLock(&issueLock); // Interrupts are already disabled
+        CheckCompletions();
+        releaseLock(&issueLock);
+    }
+
+    void Port::Identify(hba_mem_t* hbaMem){
+        int slot = AcquireSlot();
+
+        SetSlotBuffer(slot, 512);
+        Issue(slot, ATA_CMD_IDENTIFY, 0, 1);
+
+        if(WaitForCompletion(slot)){
+            Log::Warning("[SATA] Error identifying disk");
+            
+            ReleaseSlot(slot);
             return;
         }
-        return;
-    }
 
-    int Port::FindCmdSlot(){
-        // If not set in SACT and CI, the slot is free
-        uint32_t slots = (registers->sact | registers->ci);
-        for (int i=0; i<8; i++)
-        {
-            if ((slots&1) == 0)
-                return i;
-            slots >>= 1;
+        uint16_t* identify = reinterpret_cast<uint16_t*>(slotBuffers[slot]);
+        if((identify[ATA_IDENTIFY_SATA_CAPABILITIES] & ATA_SATA_CAP_NCQ) && (hbaMem->cap & AHCI_CAP_NCQ)){
+            int queueDepth = (identify[ATA_IDENTIFY_QUEUE_DEPTH] & 0x1f) + 1;
+            
+            ncq = true;
+            if(queueDepth < commandSlotCount){
+                // No commands are outstanding, so the slots past the queue depth can just be taken away
+                commandSlotCount = queueDepth;
+                freeSlots &= static_cast<uint32_t>((1ULL << commandSlotCount) - 1);
+                slotSemaphore.SetValue(commandSlotCount - 1); // We still hold a slot
+            }
         }
 
-        return -1;
+        Log::Info("[SATA] %d command slots, NCQ: %Y", commandSlotCount, ncq);
+
+        ReleaseSlot(slot);
     }
 }
-
-
@@ -10,6 +10,8 @@
 #include <devicemanager.h>
 #include <apic.h>
 #include <timer.h>
+#include <scheduler.h>
+#include <cpu.h>
 
 namespace ATA{
 
@@ -18,8 +20,7 @@ namespace ATA{
 	int controlPort0 = 0x3f6;
 	int controlPort1 = 0x376;
 
-	lock_t irqWatcherLock = 0;
-	Semaphore irqWatcher = Semaphore(0);
+	ata_channel_t channels[2];
 
 	ATADiskDevice* drives[4];
 
@@ -89,9 +90,38 @@ namespace ATA{
 		return 0;
 	}
 
-	void IRQHandler(regs64_t* r){
-		Log::Info("Disk IRQ");
-		//irqWatcher.Signal();
+	// Complete the command on the channel if the device has raised an interrupt, channel.lock must be held
+	static void CheckCompletion(ata_channel_t& channel){
+		uint8_t busMasterStatus = inportb(channel.busMaster + ATA_BMR_STATUS);
+		if(!(busMasterStatus & ATA_BMR_STATUS_INTERRUPT)){
+			return; // Not finished or not ours
+		}
+
+		channel.status = ReadRegister(channel.port, ATA_REGISTER_STATUS); // Reading the status register acknowledges the interrupt
+		outportb(channel.busMaster + ATA_BMR_STATUS, busMasterStatus | ATA_BMR_STATUS_INTERRUPT | ATA_BMR_STATUS_ERROR); // Clear Error and Interrupt Bits
+
+		if(channel.done || !channel.waiter){
+			return; // Spurious
+		}
+
+		channel.busMasterStatus = busMasterStatus;
+		channel.done = true;
+
+		Scheduler::UnblockThread(channel.waiter);
+	}
+
+	void IRQHandler(void* data, regs64_t* r){
+		ata_channel_t* channel = reinterpret_cast<ata_channel_t*>(data);
+
+		acquireLock(&channel->lock);
+		CheckCompletion(*channel);
+		releaseLock(&channel->lock);
+	}
+
+	// Used when both channels are in PCI native mode and share the interrupt of the controller
+	void SharedIRQHandler(void*, regs64_t* r){
+		IRQHandler(&channels[0], r);
+		IRQHandler(&channels[1], r);
 	}
 
 	int Init(){
@@ -136,15 +166,42 @@ namespace ATA{
 		assert(controllerPCIDevice->BarIsIOPort(4));
         busMasterPort = controllerPCIDevice->GetBaseAddressRegister(4);
 		controllerPCIDevice->EnableBusMastering();
+		controllerPCIDevice->EnableIOSpace();
 		
-		Log::Info("[ATA] Using Ports: Primary %x, Secondary %x", port0, port1);
+		Log::Info("[ATA] Using Ports: Primary %x, Secondary %x, Bus Master %x", port0, port1, busMasterPort);
+
+		channels[0].port = 0;
+		channels[0].busMaster = busMasterPort;
+		channels[1].port = 1;
+		channels[1].busMaster = busMasterPort + ATA_BMR_CMD_SECONDARY;
+
+		// Channels in compatibility mode use IRQ 14 and 15, in PCI native mode they use the interrupt of the controller
+		uint8_t progIF = controllerPCIDevice->GetProgIF();
+		if((progIF & ATA_PROGIF_PRIMARY_NATIVE) || (progIF & ATA_PROGIF_SECONDARY_NATIVE)){
+			uint8_t vector = controllerPCIDevice->AllocateVector(PCIVectors::PCIVectorLegacy);
+			if(vector != 0xFF){
+				controllerPCIDevice->EnableInterrupts();
+				IDT::RegisterInterruptHandler(vector, SharedIRQHandler);
+
+				channels[0].interruptsEnabled = channels[1].interruptsEnabled = true;
+			} else {
+				Log::Warning("[ATA] Could not allocate an interrupt, completions will be polled");
+			}
+		} else {
+			IDT::RegisterInterruptHandler(IRQ0 + ATA_PRIMARY_IRQ, IRQHandler, &channels[0]);
+			APIC::IO::MapLegacyIRQ(ATA_PRIMARY_IRQ);
+			IDT::RegisterInterruptHandler(IRQ0 + ATA_SECONDARY_IRQ, IRQHandler, &channels[1]);
+			APIC::IO::MapLegacyIRQ(ATA_SECONDARY_IRQ);
+
+			channels[0].interruptsEnabled = channels[1].interruptsEnabled = true;
+		}
 
 		for(int i = 0; i < 2; i++){ // Port
-			WriteControlRegister(i, 0, ReadControlRegister(i, 0) | 4); // Software Reset
+			WriteControlRegister(i, 0, ReadControlRegister(i, 0) | ATA_CONTROL_SRST); // Software Reset
 			
-			for(int z = 0; z < 4; z++) inportb(controlPort0);
+			for(int z = 0; z < 4; z++) ReadControlRegister(i, 0);
 
-			WriteControlRegister(i, 0, 0);
+			WriteControlRegister(i, 0, 0); // Also clears nIEN so the drives raise interrupts
 
 			for(int j = 0; j < 2; j++){ // Drive (master/slave)
 				if(DetectDrive(i, j)){
@@ -167,19 +224,19 @@ namespace ATA{
     }
 
 	int Access(ATADiskDevice* drive, uint64_t lba, uint16_t count, bool write){
-		if(count > 1){
-			Log::Warning("ATA::Read was called with count > 1");
-			return 1;
-		}
+		ata_channel_t& channel = channels[drive->port];
+		thread_t* thread = GetCPULocal()->currentThread;
+
+		channel.semaphore.Wait();
 
-		outportb(busMasterPort + ATA_BMR_CMD, 0);
-		outportd(busMasterPort + ATA_BMR_PRDT_ADDRESS, drive->prdtPhys);
+		outportb(channel.busMaster + ATA_BMR_CMD, 0);
+		outportd(channel.busMaster + ATA_BMR_PRDT_ADDRESS, drive->prdtPhys);
 
-		outportb(busMasterPort + ATA_BMR_STATUS, inportb(busMasterPort +  ATA_BMR_STATUS) | 4 | 2); // Clear Error and Interrupt Bits
+		outportb(channel.busMaster + ATA_BMR_STATUS, inportb(channel.busMaster + ATA_BMR_STATUS) | ATA_BMR_STATUS_INTERRUPT | ATA_BMR_STATUS_ERROR); // Clear Error and Interrupt Bits
 
 		WriteRegister(drive->port, ATA_REGISTER_DRIVE_HEAD, 0x40 | (drive->drive << 4));
 
-		for(int i = 0; i < 4; i++) inportb(controlPort0);
+		for(int i = 0; i < 4; i++) ReadControlRegister(drive->port, 0);
 
 		while(ReadRegister(drive->port, ATA_REGISTER_STATUS) & ATA_DEV_BUSY);
 
@@ -189,7 +246,7 @@ namespace ATA{
 		WriteRegister(drive->port, ATA_REGISTER_LBA_MID, (lba >> 32) & 0xFF);
 		WriteRegister(drive->port, ATA_REGISTER_LBA_HIGH, (lba >> 40) & 0xFF);
 		
-		for(int i = 0; i < 4; i++) inportb(controlPort0);
+		for(int i = 0; i < 4; i++) ReadControlRegister(drive->port, 0);
 
 		WriteRegister(drive->port, ATA_REGISTER_SECTOR_COUNT, count & 0xFF);
 		
@@ -197,38 +254,43 @@ namespace ATA{
 		WriteRegister(drive->port, ATA_REGISTER_LBA_MID, (lba >> 8) & 0xFF);
 		WriteRegister(drive->port, ATA_REGISTER_LBA_HIGH, (lba >> 16) & 0xFF);
 
-		for(int i = 0; i < 4; i++) inportb(controlPort0);
+		for(int i = 0; i < 4; i++) ReadControlRegister(drive->port, 0);
 
-		while(ReadRegister(drive->port, ATA_REGISTER_STATUS) & 0x80 || !(ReadRegister(drive->port, ATA_REGISTER_STATUS) & 0x40));
+		while(ReadRegister(drive->port, ATA_REGISTER_STATUS) & ATA_DEV_BUSY || !(ReadRegister(drive->port, ATA_REGISTER_STATUS) & ATA_DEV_DRDY));
 
-		if(write){
-			WriteRegister(drive->port, ATA_REGISTER_COMMAND, 0x35); // 48-bit write DMA
-		} else {
-			WriteRegister(drive->port, ATA_REGISTER_COMMAND, 0x25); // 48-bit read DMA
-		}
+		bool intsEnabled = CheckInterrupts();
+		asm("cli");
+		acquireLock(&channel.lock);
 
-		if(write){
-			outportb(busMasterPort + ATA_BMR_CMD, 0 /*Write*/ | 1 /*Start*/);
-		} else {
-			outportb(busMasterPort + ATA_BMR_CMD, 8 /*Read*/ | 1 /*Start*/);
-		}
+		channel.waiter = thread;
+		channel.done = false;
 
-		uint8_t status = ReadRegister(drive->port, ATA_REGISTER_STATUS);
-		while(status & ATA_DEV_BUSY){
-			if(status & ATA_DEV_ERR){
-				break;
-			}
+		WriteRegister(drive->port, ATA_REGISTER_COMMAND, write ? ATA_CMD_WRITE_DMA_EX : ATA_CMD_READ_DMA_EX);
+		outportb(channel.busMaster + ATA_BMR_CMD, (write ? 0 : ATA_BMR_CMD_READ) | ATA_BMR_CMD_START);
 
-			status = ReadRegister(drive->port, ATA_REGISTER_STATUS);
-		}
+		// Sleep until the device interrupts instead of spinning on the status register
+		Scheduler::BlockUntil(channel.lock, channel.interruptsEnabled && intsEnabled, [&]{
+			CheckCompletion(channel);
+			return channel.done;
+		});
 
-		outportb(busMasterPort + ATA_BMR_CMD, 0);
+		channel.waiter = nullptr;
+		uint8_t busMasterStatus = channel.busMasterStatus;
+		uint8_t status = channel.status;
 
-		if(ReadRegister(drive->port, ATA_REGISTER_STATUS) & 0x1){
-			Log::Warning("Disk Error %x", ReadRegister(drive->port, ATA_REGISTER_ERROR));
-			return 1;
+		releaseLock(&channel.lock);
+		if(intsEnabled) asm("sti");
+
+		outportb(channel.busMaster + ATA_BMR_CMD, 0);
+
+		int error = 0;
+		if((status & (ATA_DEV_ERR | ATA_DEV_DF)) || (busMasterStatus & ATA_BMR_STATUS_ERROR)){
+			Log::Warning("[ATA] Disk Error %x (Status: %x, Bus Master Status: %x)", ReadRegister(drive->port, ATA_REGISTER_ERROR), status, busMasterStatus);
+			error = 1;
 		}
 
-		return 0;
+		channel.semaphore.Signal();
+
+		return error;
 	}
 }
\ No newline at end of file
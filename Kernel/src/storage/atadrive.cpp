@@ -11,16 +11,20 @@ namespace ATA{
         this->port = port;
         this->drive = drive;
 
-        prdBufferPhys = Memory::AllocatePhysicalMemoryBlock();
-        prdBuffer = (uint8_t*)Memory::KernelAllocate4KPages(1);
+        // The bus master can only address the first 4GB
+        prdBufferPhys = Memory::AllocatePhysicalMemoryBlocks(ATA_MAX_TRANSFER_SIZE / PAGE_SIZE_4K, ATA_DMA_LIMIT);
+        prdtPhys = Memory::AllocatePhysicalMemoryBlocks(1, ATA_DMA_LIMIT);
+        if(!prdBufferPhys || !prdtPhys){
+            Log::Error("[ATA] Could not allocate DMA buffers below 4GB");
+            return;
+        }
 
-        prdtPhys = Memory::AllocatePhysicalMemoryBlock();
-        prdt = (uint64_t*)Memory::GetIOMapping(prdtPhys);
+        prdBuffer = (uint8_t*)Memory::KernelAllocate4KPages(ATA_MAX_TRANSFER_SIZE / PAGE_SIZE_4K);
+        Memory::KernelMapVirtualMemory4K(prdBufferPhys, (uintptr_t)prdBuffer, ATA_MAX_TRANSFER_SIZE / PAGE_SIZE_4K);
 
-        Memory::KernelMapVirtualMemory4K(prdBufferPhys, (uintptr_t)prdBuffer, 1);
-        Memory::KernelMapVirtualMemory4K(prdtPhys, (uintptr_t)prdt, 1);
+        prdt = (uint64_t*)Memory::GetIOMapping(prdtPhys);
 
-        prd = ATA_PRD_BUFFER((uint64_t)prdBufferPhys) | ((uint64_t)PAGE_SIZE_4K << 32) | ATA_PRD_END; // Assign the buffer, transfer size (4K) and designate the PRDT entry as the last one
+        prd = ATA_PRD_BUFFER((uint64_t)prdBufferPhys) | ATA_PRD_TRANSFER_SIZE((uint64_t)PAGE_SIZE_4K) | ATA_PRD_END; // Assign the buffer, transfer size (4K) and designate the PRDT entry as the last one
         *prdt = prd;
 
         switch(GPT::Parse(this)){
@@ -40,56 +44,105 @@ namespace ATA{
         InitializePartitions();
     }
 
-    int ATADiskDevice::ReadDiskBlock(uint64_t lba, uint32_t count, void* _buffer){
-        uint64_t blockCount = ((count / 512 * 512) < count) ? ((count / 512) + 1) : (count / 512);
-        uint8_t* buffer = reinterpret_cast<uint8_t*>(_buffer);
+    int ATADiskDevice::ReadDiskBlock(uint64_t lba, uint32_t count, void* buffer){
+        return Transfer(lba, count, reinterpret_cast<uint8_t*>(buffer), false);
+    }
+    
+    int ATADiskDevice::WriteDiskBlock(uint64_t lba, uint32_t count, void* buffer){
+        return Transfer(lba, count, reinterpret_cast<uint8_t*>(buffer), true);
+    }
 
-        while(blockCount-- && count){
-            uint64_t size;
-            if(count < 512) size = count;
-            else size = 512;
+    int ATADiskDevice::Transfer(uint64_t lba, uint32_t count, uint8_t* buffer, bool write){
+        if(!prdBufferPhys || !prdtPhys){
+            return 1; // No DMA buffers
+        }
 
-            if(!size) continue;
+        while(count){
+            uint32_t size = count;
+            if(size > ATA_MAX_TRANSFER_SIZE){
+                size = ATA_MAX_TRANSFER_SIZE;
+            }
+
+            uint32_t blocks = (size + 511) / 512;
 
             driveLock.Wait();
-            if(ATA::Access(this, lba, 1, false)){
+
+            // DMA straight to and from the caller's pages when we can, otherwise go through the bounce buffer
+            bool bounce = (size % 512) || !MapBuffer(buffer, size);
+            if(bounce){
+                if(write){
+                    memcpy(prdBuffer, buffer, size);
+                    memset(prdBuffer + size, 0, blocks * 512 - size);
+                }
+
+                if(!MapBuffer(prdBuffer, blocks * 512)){ // Never DMA through a stale PRDT
+                    Log::Warning("[ATA] Could not map the bounce buffer for DMA");
+
+                    driveLock.Signal();
+                    return 1;
+                }
+            }
+
+            if(ATA::Access(this, lba, blocks, write)){
                 driveLock.Signal();
                 return 1; // Error Reading Sectors
             }
+
+            if(bounce && !write){
+                memcpy(buffer, prdBuffer, size);
+            }
+
             driveLock.Signal();
 
-            memcpy(buffer, prdBuffer, size);
+            lba += blocks;
             buffer += size;
-            lba++;
+            count -= size;
         }
 
         return 0;
     }
-    
-    int ATADiskDevice::WriteDiskBlock(uint64_t lba, uint32_t count, void* _buffer){
-        uint64_t blockCount = ((count / 512 * 512) < count) ? ((count / 512) + 1) : (count / 512);
-        uint8_t* buffer = reinterpret_cast<uint8_t*>(_buffer);
 
-        while(blockCount-- && count){
-            uint64_t size;
-            if(count < 512) size = count;
-            else size = 512;
+    int ATADiskDevice::MapBuffer(uint8_t* buffer, uint32_t size){
+        if(reinterpret_cast<uintptr_t>(buffer) & 0x3){
+            return 0; // Regions must be dword aligned
+        }
 
-            if(!size) continue;
+        unsigned entry = 0;
+        uintptr_t address = reinterpret_cast<uintptr_t>(buffer);
+        while(size){
+            uint32_t length = PAGE_SIZE_4K - (address & (PAGE_SIZE_4K - 1));
+            if(length > size){
+                length = size;
+            }
 
-            memcpy(prdBuffer, buffer, size);
+            uintptr_t phys = Memory::VirtualToPhysicalAddress(address);
+            if(!phys || phys + length > 0xFFFFFFFF){
+                return 0; // Untranslatable or outside of the 32-bit address space of the bus master
+            }
 
-            driveLock.Wait();
-            if(ATA::Access(this, lba, 1, true)){
-                driveLock.Signal();
-                return 1; // Error Reading Sectors
+            bool merged = false;
+            if(entry){
+                uint64_t lastPhys = ATA_PRD_BUFFER(prdt[entry - 1]);
+                uint32_t lastSize = (prdt[entry - 1] >> 32) & 0xFFFF;
+                if(!lastSize) lastSize = ATA_PRD_MAX_SIZE; // A size of 0 means 64K
+
+                // Merge with the previous region if it is physically contiguous and would not cross a 64K boundary
+                if(lastPhys + lastSize == phys && lastSize + length <= ATA_PRD_MAX_SIZE
+                    && (lastPhys & ~(ATA_PRD_MAX_SIZE - 1ULL)) == ((phys + length - 1) & ~(ATA_PRD_MAX_SIZE - 1ULL))){
+                    prdt[entry - 1] = lastPhys | ATA_PRD_TRANSFER_SIZE((uint64_t)(lastSize + length));
+                    merged = true;
+                }
             }
-            driveLock.Signal();
 
-            buffer += size;
-            lba++;
+            if(!merged){
+                prdt[entry++] = ATA_PRD_BUFFER((uint64_t)phys) | ATA_PRD_TRANSFER_SIZE((uint64_t)length);
+            }
+
+            address += length;
+            size -= length;
         }
 
-        return 0;
+        prdt[entry - 1] |= ATA_PRD_END;
+        return 1;
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,264 @@
+#include <blockqueue.h>
+
+#include <scheduler.h>
+#include <cpu.h>
+#include <memory.h>
+#include <logging.h>
+
+List<BlockQueue*> BlockQueue::queues;
+lock_t BlockQueue::lock = 0;
+
+// Lives on the stack of the idle worker
+struct IdleWorker {
+    thread_t* thread;
+    bool woken;
+};
+
+static List<IdleWorker*> idleWorkers; // Protected by BlockQueue::lock
+static bool workersStarted = false;
+
+// Lives on the stack of the waiting thread
+struct SyncRequest {
+    thread_t* thread;
+    lock_t lock = 0;
+    bool done = false;
+};
+
+// Block the current thread until the request has completed
+static void WaitForRequest(SyncRequest& sync){
+    bool intsEnabled = CheckInterrupts();
+    asm("cli");
+    acquireLock(&sync.lock);
+
+    Scheduler::BlockUntil(sync.lock, intsEnabled, [&]{ return sync.done; });
+
+    releaseLock(&sync.lock);
+    if(intsEnabled) asm("sti");
+}
+
+static void SyncRequestCallback(block_request_t* request){
+    SyncRequest* sync = reinterpret_cast<SyncRequest*>(request->data);
+
+    // The waiter can only see done once we release the lock, so it cannot return and exit while we still use sync or the thread
+    bool intsEnabled = CheckInterrupts();
+    asm("cli");
+    acquireLock(&sync->lock);
+
+    sync->done = true;
+    Scheduler::UnblockThread(sync->thread);
+
+    releaseLock(&sync->lock);
+    if(intsEnabled) asm("sti");
+}
+
+BlockQueue::BlockQueue(DiskDevice* disk) : disk(disk){
+    bool intsEnabled = CheckInterrupts();
+    asm("cli");
+    acquireLock(&lock);
+    queues.add_back(this);
+
+    bool startWorkers = !workersStarted;
+    workersStarted = true;
+    releaseLock(&lock);
+    if(intsEnabled) asm("sti");
+
+    if(startWorkers){
+        for(int i = 0; i < BLOCK_QUEUE_WORKERS; i++){
+            Scheduler::CreateChildThread(Scheduler::GetCurrentProcess(), (uintptr_t)WorkerThread, (uintptr_t)kmalloc(BLOCK_QUEUE_WORKER_STACK_SIZE) + BLOCK_QUEUE_WORKER_STACK_SIZE);
+        }
+    }
+}
+
+void BlockQueue::Submit(block_request_t* request){
+    request->submitTime = Timer::GetSystemUptimeStruct();
+    request->status = 0;
+
+    bool intsEnabled = CheckInterrupts();
+    asm("cli"); // Idle workers are woken with the lock held
+    acquireLock(&lock);
+
+    block_request_t** link = &pending;
+    while(*link && (*link)->lba <= request->lba){ // Keep the queue sorted by LBA, after requests to the same block
+        link = &(*link)->next;
+    }
+
+    request->next = *link;
+    *link = request;
+
+    queued++;
+    if(queued + inFlight > maxDepth){
+        maxDepth = queued + inFlight;
+    }
+
+    if(idleWorkers.get_length()){
+        IdleWorker* worker = idleWorkers.remove_at(0);
+
+        worker->woken = true;
+        Scheduler::UnblockThread(worker->thread);
+    }
+
+    releaseLock(&lock);
+    if(intsEnabled) asm("sti");
+}
+
+int BlockQueue::Read(uint64_t lba, uint32_t size, void* buffer){
+    SyncRequest sync;
+    sync.thread = GetCPULocal()->currentThread;
+
+    block_request_t request;
+    request.lba = lba;
+    request.size = size;
+    request.buffer = reinterpret_cast<uint8_t*>(buffer);
+    request.write = false;
+    request.callback = SyncRequestCallback;
+    request.data = &sync;
+
+    Submit(&request);
+    WaitForRequest(sync);
+
+    return request.status;
+}
+
+int BlockQueue::Write(uint64_t lba, uint32_t size, void* buffer){
+    SyncRequest sync;
+    sync.thread = GetCPULocal()->currentThread;
+
+    block_request_t request;
+    request.lba = lba;
+    request.size = size;
+    request.buffer = reinterpret_cast<uint8_t*>(buffer);
+    request.write = true;
+    request.callback = SyncRequestCallback;
+    request.data = &sync;
+
+    Submit(&request);
+    WaitForRequest(sync);
+
+    return request.status;
+}
+
+// Take the next request off the queue along with any requests that directly follow it on disk, lock must be held.
+// Requests are dispatched in ascending order of LBA, wrapping around to the start once the end of the queue is reached (C-SCAN).
+block_request_t* BlockQueue::Dequeue(){
+    if(!pending){
+        return nullptr;
+    }
+
+    block_request_t** link = &pending;
+    while(*link && (*link)->lba < nextLBA){
+        link = &(*link)->next;
+    }
+
+    if(!*link){
+        link = &pending; // Wrap around
+    }
+
+    block_request_t* request = *link;
+    block_request_t* last = request;
+    uint32_t size = request->size;
+    unsigned count = 1;
+
+    // Merge requests in the same direction that start right where the previous one ends
+    block_request_t* next = request->next;
+    while(next && count < BLOCK_QUEUE_MAX_SEGMENTS && next->write == request->write && !(last->size % disk->blocksize)
+        && last->lba + last->size / disk->blocksize == next->lba && size + next->size <= BLOCK_QUEUE_MAX_MERGE_SIZE){
+        size += next->size;
+        count++;
+
+        last = next;
+        next = next->next;
+    }
+
+    *link = next;
+    last->next = nullptr;
+
+    nextLBA = last->lba + (last->size + disk->blocksize - 1) / disk->blocksize;
+
+    queued -= count;
+    inFlight += count;
+    merged += count - 1;
+
+    return request;
+}
+
+void BlockQueue::Dispatch(block_request_t* request){
+    disk_segment_t segments[BLOCK_QUEUE_MAX_SEGMENTS];
+    unsigned count = 0;
+
+    for(block_request_t* r = request; r; r = r->next){
+        segments[count++] = {r->buffer, r->size};
+    }
+
+    int status;
+    if(request->write){
+        status = disk->WriteDiskBlocks(request->lba, segments, count);
+    } else {
+        status = disk->ReadDiskBlocks(request->lba, segments, count);
+    }
+
+    timeval_t now = Timer::GetSystemUptimeStruct();
+
+    bool intsEnabled = CheckInterrupts();
+    asm("cli");
+    acquireLock(&lock);
+    for(block_request_t* r = request; r; r = r->next){
+        uint64_t latency = Timer::TimeDifference(now, r->submitTime);
+
+        totalLatency += latency;
+        if(latency > maxLatency){
+            maxLatency = latency;
+        }
+    }
+
+    inFlight -= count;
+    completed += count;
+    if(status){
+        errors += count;
+    }
+    releaseLock(&lock);
+    if(intsEnabled) asm("sti");
+
+    while(request){
+        block_request_t* next = request->next; // The request may be freed by the callback
+
+        request->status = status;
+        if(request->callback){
+            request->callback(request);
+        }
+
+        request = next;
+    }
+}
+
+void BlockQueue::WorkerThread(){
+    thread_t* thread = GetCPULocal()->currentThread;
+
+    for(;;){
+        BlockQueue* queue = nullptr;
+        block_request_t* request = nullptr;
+
+        asm("cli");
+        acquireLock(&lock);
+        for(BlockQueue* q : queues){
+            if((request = q->Dequeue())){
+                queue = q;
+                break;
+            }
+        }
+
+        if(!request){ // Sleep until a request is submitted
+            IdleWorker idle = {thread, false};
+            idleWorkers.add_back(&idle);
+
+            Scheduler::BlockUntil(lock, true, [&]{ return idle.woken; });
+
+            releaseLock(&lock);
+            asm("sti");
+            continue;
+        }
+        releaseLock(&lock);
+        asm("sti");
+
+        queue->Dispatch(request);
+    }
+}
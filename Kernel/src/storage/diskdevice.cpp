@@ -1,5 +1,6 @@
 #include <device.h>
 
+#include <blockqueue.h>
 #include <fs/fat32.h>
 #include <fs/ext2.h>
 #include <logging.h>
@@ -15,6 +16,8 @@ DiskDevice::DiskDevice() : Device(TypeDiskDevice){
     itoa(nextDeviceNumber++, buf + 2, 10);
 
     SetName(buf);
+
+    queue = new BlockQueue(this);
 }
 
 int DiskDevice::InitializePartitions(){
@@ -60,6 +63,30 @@ int DiskDevice::WriteDiskBlock(uint64_t lba, uint32_t count, void* buffer){
     return -1;
 }
 
+int DiskDevice::ReadDiskBlocks(uint64_t lba, const disk_segment_t* segments, unsigned count){
+    for(unsigned i = 0; i < count; i++){
+        if(int e = ReadDiskBlock(lba, segments[i].size, segments[i].buffer)){
+            return e;
+        }
+
+        lba += segments[i].size / blocksize;
+    }
+
+    return 0;
+}
+
+int DiskDevice::WriteDiskBlocks(uint64_t lba, const disk_segment_t* segments, unsigned count){
+    for(unsigned i = 0; i < count; i++){
+        if(int e = WriteDiskBlock(lba, segments[i].size, segments[i].buffer)){
+            return e;
+        }
+
+        lba += segments[i].size / blocksize;
+    }
+
+    return 0;
+}
+
 ssize_t DiskDevice::Read(size_t off, size_t size, uint8_t* buffer){
     if(off % blocksize){
         return -EINVAL; // Block aligned reads only
@@ -1,8 +1,510 @@
+#include <nvme.h>
+
 #include <pci.h>
+#include <idt.h>
+#include <smp.h>
+#include <cpu.h>
+#include <paging.h>
+#include <physicalallocator.h>
+#include <scheduler.h>
+#include <timer.h>
+#include <memory.h>
 #include <logging.h>
+#include <gpt.h>
 
 namespace NVMe{
-    char* deviceName = "Generic NVMe Controller";
+    List<Controller*> controllers;
+
+    static void QueueInterruptHandler(void* data, regs64_t*){
+        reinterpret_cast<Queue*>(data)->OnInterrupt();
+    }
+
+    // Used when the controller has no MSI-X, every queue then shares one interrupt
+    static void SharedInterruptHandler(void* data, regs64_t*){
+        for(Queue* queue : *reinterpret_cast<List<Queue*>*>(data)){
+            queue->OnInterrupt();
+        }
+    }
+
+    Queue::Queue(Controller* controller, uint16_t id, uint16_t size) : id(id), size(size), controller(controller){
+        sqPhys = Memory::AllocatePhysicalMemoryBlocks((size * sizeof(nvme_command_t) + PAGE_SIZE_4K - 1) / PAGE_SIZE_4K);
+        cqPhys = Memory::AllocatePhysicalMemoryBlocks((size * sizeof(nvme_completion_t) + PAGE_SIZE_4K - 1) / PAGE_SIZE_4K);
+
+        sq = reinterpret_cast<nvme_command_t*>(Memory::GetIOMapping(sqPhys));
+        cq = reinterpret_cast<nvme_completion_t*>(Memory::GetIOMapping(cqPhys));
+
+        memset(sq, 0, size * sizeof(nvme_command_t));
+        memset((void*)cq, 0, size * sizeof(nvme_completion_t)); // Phase tags start cleared
+
+        // One entry is always left empty so the submission queue can never fill up
+        unsigned commandCount = size - 1;
+        if(commandCount > NVME_MAX_QUEUE_COMMANDS){
+            commandCount = NVME_MAX_QUEUE_COMMANDS;
+        }
+
+        for(unsigned i = 0; i < NVME_MAX_QUEUE_COMMANDS; i++){
+            commands[i] = {nullptr, false, 0, 0, 0, nullptr};
+        }
+
+        freeCommandIDs = (commandCount >= 64) ? ~0ULL : ((1ULL << commandCount) - 1);
+        commandSemaphore.SetValue(commandCount);
+    }
+
+    int Queue::Execute(nvme_command_t& command, uint32_t* result, const uintptr_t* pages, unsigned pageCount){
+        thread_t* thread = GetCPULocal()->currentThread;
+
+        commandSemaphore.Wait();
+
+        bool intsEnabled = CheckInterrupts();
+        asm("cli");
+        acquireLock(&lock);
+
+        uint16_t commandID = __builtin_ctzll(freeCommandIDs); // The semaphore guarantees a free ID
+        freeCommandIDs &= ~(1ULL << commandID);
+
+        releaseLock(&lock);
+        if(intsEnabled) asm("sti");
+
+        // Build the PRPs, the first entry may have an offset and the rest are page aligned.
+        // Anything past two pages goes in the PRP list of the command ID.
+        if(pageCount){
+            command.prp1 = pages[0];
+        }
+
+        if(pageCount == 2){
+            command.prp2 = pages[1];
+        } else if(pageCount > 2){
+            if(!commands[commandID].prpList){
+                commands[commandID].prpListPhys = Memory::AllocatePhysicalMemoryBlock();
+                commands[commandID].prpList = reinterpret_cast<uint64_t*>(Memory::KernelAllocate4KPages(1));
+                Memory::KernelMapVirtualMemory4K(commands[commandID].prpListPhys, reinterpret_cast<uintptr_t>(commands[commandID].prpList), 1);
+            }
+
+            for(unsigned i = 1; i < pageCount; i++){
+                commands[commandID].prpList[i - 1] = pages[i];
+            }
+
+            command.prp2 = commands[commandID].prpListPhys;
+        }
+
+        command.commandID = commandID;
+
+        asm("cli");
+        acquireLock(&lock);
+
+        commands[commandID].waiter = thread;
+        commands[commandID].done = false;
+
+        sq[sqTail] = command;
+        sqTail = (sqTail + 1) % size;
+        *controller->SubmissionDoorbell(id) = sqTail;
+
+        // Block until the interrupt handler completes the command, checking ourselves in case it has already finished
+        Scheduler::BlockUntil(lock, interruptsEnabled && intsEnabled, [&]{
+            CheckCompletions();
+            return commands[commandID].done;
+        });
+
+        int status = commands[commandID].status;
+        if(result){
+            *result = commands[commandID].result;
+        }
+
+        commands[commandID].waiter = nullptr;
+        freeCommandIDs |= 1ULL << commandID;
+
+        releaseLock(&lock);
+        if(intsEnabled) asm("sti");
+
+        commandSemaphore.Signal();
+
+        return status;
+    }
+
+    void Queue::OnInterrupt(){
+        acquireLock(&lock);
+        CheckCompletions();
+        releaseLock(&lock);
+    }
+
+    void Queue::CheckCompletions(){
+        bool processed = false;
+
+        while((cq[cqHead].status & NVME_COMPLETION_PHASE) == phase){
+            uint16_t commandID = cq[cqHead].commandID;
+
+            if(commandID < NVME_MAX_QUEUE_COMMANDS && !(freeCommandIDs & (1ULL << commandID))){
+                commands[commandID].status = NVME_COMPLETION_STATUS(cq[cqHead].status);
+                commands[commandID].result = cq[cqHead].result;
+                commands[commandID].done = true;
+
+                if(thread_t* waiter = commands[commandID].waiter){
+                    Scheduler::UnblockThread(waiter);
+                }
+            } else {
+                Log::Warning("[NVMe] Completion for unknown command %d on queue %d", commandID, id);
+            }
+
+            if(++cqHead >= size){
+                cqHead = 0;
+                phase ^= 1; // The controller inverts the phase tag every time it wraps around
+            }
+
+            processed = true;
+        }
+
+        if(processed){
+            *controller->CompletionDoorbell(id) = cqHead;
+        }
+    }
+
+    Namespace::Namespace(Controller* controller, uint32_t id, nvme_identify_namespace_t& identify) : id(id), controller(controller){
+        blockCount = identify.size;
+        blocksize = 1 << identify.lbaFormats[identify.formattedLBASize & 0xF].lbaDataSize;
+
+        Log::Info("[NVMe] Namespace %d: %d blocks, block size: %d", id, blockCount, blocksize);
+
+        switch(GPT::Parse(this)){
+        case 0:
+            Log::Error("[NVMe] Disk has a corrupted or non-existant GPT. MBR disks are NOT supported.");
+            break;
+        case -1:
+            Log::Error("[NVMe] Disk Error while Parsing GPT for NVMe Namespace");
+            break;
+        }
+        Log::Info("[NVMe] Found %d partitions!", partitions.get_length());
+
+        InitializePartitions();
+    }
+
+    int Namespace::ReadDiskBlock(uint64_t lba, uint32_t count, void* buffer){
+        return Transfer(lba, count, reinterpret_cast<uint8_t*>(buffer), false);
+    }
+
+    int Namespace::WriteDiskBlock(uint64_t lba, uint32_t count, void* buffer){
+        return Transfer(lba, count, reinterpret_cast<uint8_t*>(buffer), true);
+    }
+
+    int Namespace::Transfer(uint64_t lba, uint32_t count, uint8_t* buffer, bool write){
+        Queue* queue = controller->GetIOQueue();
+        uintptr_t pages[NVME_MAX_TRANSFER_SIZE / PAGE_SIZE_4K + 1];
+
+        while(count){
+            uint32_t size = count;
+            if(size > controller->maxTransferSize){
+                size = controller->maxTransferSize;
+            }
+
+            uint32_t blocks = (size + blocksize - 1) / blocksize;
+
+            // Try to DMA straight to and from the caller's pages,
+            // the buffer must be dword aligned and we cannot transfer part of a block
+            uint8_t* transferBuffer = buffer;
+            bool bounce = (reinterpret_cast<uintptr_t>(buffer) & 0x3) || (size % blocksize);
+
+            unsigned pageCount = 0;
+            for(uintptr_t page = reinterpret_cast<uintptr_t>(buffer) & ~(PAGE_SIZE_4K - 1); !bounce && page < reinterpret_cast<uintptr_t>(buffer) + size; page += PAGE_SIZE_4K){
+                uintptr_t phys = Memory::VirtualToPhysicalAddress(page);
+                if(!phys){
+                    bounce = true; // Not in a mapping we can translate
+                }
+
+                pages[pageCount++] = phys;
+            }
+
+            if(bounce){
+                transferBuffer = reinterpret_cast<uint8_t*>(kmalloc(blocks * blocksize));
+                if(write){
+                    memcpy(transferBuffer, buffer, size);
+                    memset(transferBuffer + size, 0, blocks * blocksize - size);
+                }
+
+                pageCount = 0;
+                for(uintptr_t page = reinterpret_cast<uintptr_t>(transferBuffer) & ~(PAGE_SIZE_4K - 1); page < reinterpret_cast<uintptr_t>(transferBuffer) + blocks * blocksize; page += PAGE_SIZE_4K){
+                    pages[pageCount++] = Memory::VirtualToPhysicalAddress(page);
+                }
+            }
+
+            pages[0] += reinterpret_cast<uintptr_t>(transferBuffer) & (PAGE_SIZE_4K - 1);
+
+            nvme_command_t command;
+            memset(&command, 0, sizeof(nvme_command_t));
+            command.opcode = write ? NVME_CMD_WRITE : NVME_CMD_READ;
+            command.namespaceID = id;
+            command.cdw10 = lba & 0xFFFFFFFF;
+            command.cdw11 = lba >> 32;
+            command.cdw12 = blocks - 1; // Zero based amount of blocks
+
+            int status = queue->Execute(command, nullptr, pages, pageCount);
+
+            if(bounce){
+                if(!status && !write){
+                    memcpy(buffer, transferBuffer, size);
+                }
+
+                kfree(transferBuffer);
+            }
+
+            if(status){
+                Log::Warning("[NVMe] Error %x %s %d blocks at LBA %x", status, write ? "writing" : "reading", blocks, lba);
+                return 1;
+            }
+
+            lba += blocks;
+            buffer += size;
+            count -= size;
+        }
+
+        return 0;
+    }
+
+    Controller::Controller(PCIDevice* device) : pciDevice(device){
+        pciDevice->EnableBusMastering();
+        pciDevice->EnableMemorySpace();
+
+        uintptr_t baseAddress = pciDevice->GetBaseAddressRegister(0);
+        registers = reinterpret_cast<nvme_registers_t*>(Memory::GetIOMapping(baseAddress));
+
+        uint64_t cap = registers->cap;
+        doorbellStride = NVME_CAP_DSTRD(cap);
+
+        Log::Info("[NVMe] Base Address: %x, Version: %x, Max Queue Entries: %d, Doorbell Stride: %d", baseAddress, registers->version, NVME_CAP_MQES(cap), doorbellStride);
+
+        if(!(cap & NVME_CAP_CSS_NVM)){
+            Log::Error("[NVMe] Controller does not support the NVM command set!");
+            error = true;
+            return;
+        } else if(NVME_CAP_MPSMIN(cap)){
+            Log::Error("[NVMe] Controller does not support 4K pages!");
+            error = true;
+            return;
+        }
+
+        // Reset the controller before setting up the admin queues
+        registers->cc = registers->cc & ~NVME_CC_ENABLE;
+        if(!WaitForReady(false)){
+            Log::Error("[NVMe] Timed out disabling controller!");
+            error = true;
+            return;
+        }
+
+        uint16_t adminQueueSize = NVME_ADMIN_QUEUE_SIZE;
+        if(adminQueueSize > NVME_CAP_MQES(cap)){
+            adminQueueSize = NVME_CAP_MQES(cap);
+        }
+
+        adminQueue = new Queue(this, 0, adminQueueSize);
+        registers->aqa = ((adminQueueSize - 1) << 16) | (adminQueueSize - 1);
+        registers->asq = adminQueue->sqPhys;
+        registers->acq = adminQueue->cqPhys;
+
+        registers->cc = NVME_CC_ENABLE | NVME_CC_CSS_NVM | NVME_CC_MPS(0) | NVME_CC_AMS_RR | NVME_CC_IOSQES(6) | NVME_CC_IOCQES(4);
+        if(!WaitForReady(true)){
+            Log::Error("[NVMe] Timed out enabling controller (CSTS: %x)!", registers->csts);
+            error = true;
+            return;
+        }
+
+        // The admin queue is only used during initialization so its completions are polled
+        uintptr_t identifyPhys = Memory::AllocatePhysicalMemoryBlock();
+        nvme_identify_controller_t* identify = reinterpret_cast<nvme_identify_controller_t*>(Memory::GetIOMapping(identifyPhys));
+
+        nvme_command_t command;
+        memset(&command, 0, sizeof(nvme_command_t));
+        command.opcode = NVME_ADMIN_IDENTIFY;
+        command.cdw10 = NVME_IDENTIFY_CONTROLLER;
+
+        if(int status = adminQueue->Execute(command, nullptr, &identifyPhys, 1)){
+            Log::Error("[NVMe] Error %x identifying controller!", status);
+            Memory::FreePhysicalMemoryBlock(identifyPhys);
+            error = true;
+            return;
+        }
+
+        char model[41];
+        memcpy(model, identify->modelNumber, 40);
+        model[40] = 0;
+
+        if(identify->mdts && identify->mdts < 20){ // Anything larger is above our own limit
+            uint32_t limit = static_cast<uint32_t>(PAGE_SIZE_4K) << identify->mdts;
+            if(limit < maxTransferSize){
+                maxTransferSize = limit;
+            }
+        }
+
+        uint32_t namespaceCount = identify->namespaceCount;
+        Memory::FreePhysicalMemoryBlock(identifyPhys);
+
+        Log::Info("[NVMe] Model: %s, Namespaces: %d, Max Transfer Size: %d", model, namespaceCount, maxTransferSize);
+
+        if(CreateIOQueues()){
+            error = true;
+            return;
+        }
+
+        IdentifyNamespaces();
+    }
+
+    Queue* Controller::GetIOQueue(){
+        Queue* queue = cpuQueues[GetCPULocal()->id];
+        if(!queue){
+            queue = ioQueues.get_front();
+        }
+
+        return queue;
+    }
+
+    bool Controller::WaitForReady(bool ready){
+        long timeout = NVME_CAP_TO(registers->cap) * 500;
+        timeval_t start = Timer::GetSystemUptimeStruct();
+
+        while(!!(registers->csts & NVME_CSTS_READY) != ready){
+            if(registers->csts & NVME_CSTS_FATAL){
+                return false;
+            } else if(Timer::TimeDifference(Timer::GetSystemUptimeStruct(), start) > timeout){
+                return false;
+            }
+
+            Timer::Wait(1);
+        }
+
+        return true;
+    }
+
+    int Controller::CreateIOQueues(){
+        uint64_t cpus[256]; // APIC IDs
+        unsigned cpuCount = 0;
+        for(unsigned i = 0; i < 256; i++){
+            if(SMP::cpus[i]){
+                cpus[cpuCount++] = i;
+            }
+        }
+
+        // Ask for a queue pair per CPU, the controller may give us less
+        nvme_command_t command;
+        memset(&command, 0, sizeof(nvme_command_t));
+        command.opcode = NVME_ADMIN_SET_FEATURES;
+        command.cdw10 = NVME_FEATURE_NUMBER_OF_QUEUES;
+        command.cdw11 = ((cpuCount - 1) << 16) | (cpuCount - 1); // Zero based
+
+        uint32_t result;
+        if(int status = adminQueue->Execute(command, &result)){
+            Log::Error("[NVMe] Error %x setting the number of queues!", status);
+            return 1;
+        }
+
+        unsigned queueCount = cpuCount;
+        if((result & 0xFFFF) + 1 < queueCount) queueCount = (result & 0xFFFF) + 1;
+        if((result >> 16) + 1 < queueCount) queueCount = (result >> 16) + 1;
+
+        // Entry 0 of the MSI-X table is for the admin queue, each I/O queue gets its own vector on its own CPU.
+        // Otherwise every queue shares a single interrupt.
+        bool msix = pciDevice->MSIXVectorCount() >= 2;
+        if(msix && pciDevice->MSIXVectorCount() - 1 < queueCount){
+            queueCount = pciDevice->MSIXVectorCount() - 1;
+        }
+
+        uint8_t sharedVector = 0xFF;
+        if(!msix){
+            sharedVector = pciDevice->AllocateVector(PCIVectors::PCIVectorAny);
+            if(sharedVector != 0xFF){
+                pciDevice->EnableInterrupts();
+                IDT::RegisterInterruptHandler(sharedVector, SharedInterruptHandler, &ioQueues);
+            } else {
+                Log::Warning("[NVMe] Could not allocate an interrupt, completions will be polled");
+            }
+        }
+
+        uint16_t queueSize = NVME_IO_QUEUE_SIZE;
+        if(queueSize > NVME_CAP_MQES(registers->cap)){
+            queueSize = NVME_CAP_MQES(registers->cap);
+        }
+
+        for(unsigned i = 0; i < queueCount; i++){
+            uint16_t queueID = i + 1;
+            uint16_t interruptIndex = msix ? queueID : 0;
+
+            uint8_t vector = sharedVector;
+            if(msix){
+                vector = pciDevice->AllocateMSIXVector(interruptIndex, cpus[i]);
+            }
+
+            Queue* queue = new Queue(this, queueID, queueSize);
+
+            memset(&command, 0, sizeof(nvme_command_t));
+            command.opcode = NVME_ADMIN_CREATE_CQ;
+            command.prp1 = queue->cqPhys;
+            command.cdw10 = ((queueSize - 1) << 16) | queueID;
+            command.cdw11 = (interruptIndex << 16) | NVME_QUEUE_PHYS_CONTIGUOUS | (vector != 0xFF ? NVME_CQ_IRQ_ENABLED : 0);
+
+            if(int status = adminQueue->Execute(command)){
+                Log::Error("[NVMe] Error %x creating completion queue %d!", status, queueID);
+                delete queue;
+                break;
+            }
+
+            memset(&command, 0, sizeof(nvme_command_t));
+            command.opcode = NVME_ADMIN_CREATE_SQ;
+            command.prp1 = queue->sqPhys;
+            command.cdw10 = ((queueSize - 1) << 16) | queueID;
+            command.cdw11 = (queueID << 16) | NVME_QUEUE_PHYS_CONTIGUOUS; // Completions go to the completion queue with the same ID
+
+            if(int status = adminQueue->Execute(command)){
+                Log::Error("[NVMe] Error %x creating submission queue %d!", status, queueID);
+                delete queue; // The controller has the completion queue but will never post to it
+                break;
+            }
+
+            if(vector != 0xFF){
+                if(msix){
+                    IDT::RegisterInterruptHandler(vector, QueueInterruptHandler, queue);
+                }
+                queue->interruptsEnabled = true;
+            }
+
+            ioQueues.add_back(queue);
+            cpuQueues[cpus[i]] = queue;
+        }
+
+        if(!ioQueues.get_length()){
+            Log::Error("[NVMe] Failed to create any I/O queues!");
+            return 1;
+        }
+
+        // Remaining CPUs share the queues we did get
+        for(unsigned i = ioQueues.get_length(); i < cpuCount; i++){
+            cpuQueues[cpus[i]] = ioQueues[i % ioQueues.get_length()];
+        }
+
+        Log::Info("[NVMe] Created %d I/O queues (%d entries, %s)", ioQueues.get_length(), queueSize, msix ? "MSI-X" : (sharedVector != 0xFF ? "shared interrupt" : "polled"));
+        return 0;
+    }
+
+    void Controller::IdentifyNamespaces(){
+        uintptr_t identifyPhys = Memory::AllocatePhysicalMemoryBlock();
+        nvme_identify_namespace_t* identify = reinterpret_cast<nvme_identify_namespace_t*>(Memory::GetIOMapping(identifyPhys));
+
+        for(uint32_t nsid = 1; nsid <= NVME_MAX_NAMESPACES; nsid++){
+            nvme_command_t command;
+            memset(&command, 0, sizeof(nvme_command_t));
+            command.opcode = NVME_ADMIN_IDENTIFY;
+            command.namespaceID = nsid;
+            command.cdw10 = NVME_IDENTIFY_NAMESPACE;
+
+            if(adminQueue->Execute(command, nullptr, &identifyPhys, 1)){
+                break; // Past the last namespace
+            } else if(!identify->size){
+                continue; // Inactive namespace
+            }
+
+            Namespace* ns = new Namespace(this, nsid, *identify);
+            namespaces.add_back(ns);
+
+            DeviceManager::RegisterDevice(*ns);
+        }
+
+        Memory::FreePhysicalMemoryBlock(identifyPhys);
+    }
 
     void Initialize(){
         if(!PCI::FindGenericDevice(PCI_CLASS_STORAGE, PCI_SUBCLASS_NVM)){
@@ -11,6 +513,15 @@ namespace NVMe{
         }
 
         Log::Info("Initializing NVMe Controller...");
-        
+
+        for(PCIDevice* device : PCI::GetGenericPCIDevices(PCI_CLASS_STORAGE, PCI_SUBCLASS_NVM)){
+            Controller* controller = new Controller(device);
+            if(controller->error){
+                Log::Error("[NVMe] Failed to initialize controller!");
+                continue;
+            }
+
+            controllers.add_back(controller);
+        }
     }
-}
\ No newline at end of file
+}
@@ -1,5 +1,6 @@
 #include <device.h>
 
+#include <blockqueue.h>
 #include <string.h>
 
 PartitionDevice::PartitionDevice(uint64_t startLBA, uint64_t endLBA, DiskDevice* disk) : Device(TypePartitionDevice){
@@ -36,13 +37,13 @@ int PartitionDevice::ReadAbsolute(uint64_t offset, uint32_t count, void* buffer)
 int PartitionDevice::Read(uint64_t lba, uint32_t count, void* buffer){
     if(lba * parentDisk->blocksize + count > (endLBA - startLBA) * parentDisk->blocksize) return 2;
 
-    return parentDisk->ReadDiskBlock(lba + startLBA, count, buffer);
+    return parentDisk->queue->Read(lba + startLBA, count, buffer);
 }
 
 int PartitionDevice::Write(uint64_t lba, uint32_t count, void* buffer){
     if(lba * parentDisk->blocksize + count > (endLBA - startLBA) * parentDisk->blocksize) return 2;
 
-    return parentDisk->WriteDiskBlock(lba + startLBA, count, buffer);
+    return parentDisk->queue->Write(lba + startLBA, count, buffer);
 }
 
 PartitionDevice::~PartitionDevice(){
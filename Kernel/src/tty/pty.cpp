@@ -109,26 +109,6 @@ int PTYDevice::Ioctl(uint64_t cmd, uint64_t arg){
 	return 0;
 }
 
-void PTYDevice::Watch(FilesystemWatcher& watcher, int events){
-	if(device == PTYMasterDevice){
-		pty->WatchMaster(watcher, events);
-	} else if(device == PTYSlaveDevice) {
-		pty->WatchSlave(watcher, events);
-	} else {
-		assert(!"PTYDevice::Watch: PTYDevice is designated neither slave nor master");
-	}
-}
-
-void PTYDevice::Unwatch(FilesystemWatcher& watcher){
-	if(device == PTYMasterDevice){
-		pty->UnwatchMaster(watcher);
-	} else if(device == PTYSlaveDevice) {
-		pty->UnwatchSlave(watcher);
-	} else {
-		assert(!"PTYDevice::Unwatch: PTYDevice is designated neither slave nor master");
-	}
-}
-
 bool PTYDevice::CanRead() {
 	if(device == PTYMasterDevice){
 		return !!pty->master.bufferPos;
@@ -192,11 +172,11 @@ size_t PTY::Master_Write(char* buffer, size_t count){
 	if(slaveBlocker.blocked.get_length()){
 		if(IsCanonical()){
 			while(slave.lines && slaveBlocker.blocked.get_length()){
-				Scheduler::UnblockThread(slaveBlocker.blocked.remove_at(0));
+				Scheduler::UnblockThread(slaveBlocker.blocked.remove_at(0), true); // Input from the terminal
 			}
 		} else {
 			while(slave.bufferPos && slaveBlocker.blocked.get_length()){
-				Scheduler::UnblockThread(slaveBlocker.blocked.remove_at(0));
+				Scheduler::UnblockThread(slaveBlocker.blocked.remove_at(0), true); // Input from the terminal
 			}
 		}
 	}
@@ -211,18 +191,12 @@ size_t PTY::Master_Write(char* buffer, size_t count){
 		}
 	}
 
-	if(IsCanonical()){
-		if(slave.lines && watchingSlave.get_length()){
-			while(watchingSlave.get_length()){
-				watchingSlave.remove_at(0)->Signal(); // Signal all watching
-			}
-		}
-	} else {
-		if(slave.bufferPos && watchingSlave.get_length()){
-			while(watchingSlave.get_length()){
-				watchingSlave.remove_at(0)->Signal(); // Signal all watching
-			}
-		}
+	if(slaveFile.CanRead()){
+		slaveFile.SignalWatchers();
+	}
+
+	if(masterFile.CanRead()){ // Echoed input
+		masterFile.SignalWatchers();
 	}
 
 	return ret;
@@ -231,43 +205,9 @@ size_t PTY::Master_Write(char* buffer, size_t count){
 size_t PTY::Slave_Write(char* buffer, size_t count){
 	size_t written = master.Write(buffer, count);
 
-	if(master.bufferPos && watchingMaster.get_length()){
-		while(watchingMaster.get_length()){
-			watchingMaster.remove_at(0)->Signal(); // Signal all watching
-		}
+	if(masterFile.CanRead()){
+		masterFile.SignalWatchers();
 	}
 	
 	return written;
 }
-
-void PTY::WatchMaster(FilesystemWatcher& watcher, int events){
-	if(!(events & (POLLIN))){ // We don't really block on writes and nothing else applies except POLLIN
-		watcher.Signal();
-		return;
-	} else if(masterFile.CanRead()){
-		watcher.Signal();
-		return;
-	}
-
-	watchingMaster.add_back(&watcher);
-}
-
-void PTY::WatchSlave(FilesystemWatcher& watcher, int events){
-	if(!(events & (POLLIN))){ // We don't really block on writes and nothing else applies except POLLIN
-		watcher.Signal();
-		return;
-	} else if(slaveFile.CanRead()){
-		watcher.Signal();
-		return;
-	}
-
-	watchingSlave.add_back(&watcher);
-}
-
-void PTY::UnwatchMaster(FilesystemWatcher& watcher){
-	watchingMaster.remove(&watcher);
-}
-
-void PTY::UnwatchSlave(FilesystemWatcher& watcher){
-	watchingSlave.remove(&watcher);
-}
\ No newline at end of file
@@ -38,10 +38,12 @@ namespace Lemon{
     };
 
     class MessageServer : public MessageHandler{
-        std::vector<pollfd> fds;
         std::deque<std::shared_ptr<LemonMessageInfo>> queue;
 
         pollfd sock;
+        int epollFd; // Watches the listening socket and every client, so only clients with data are read
+
+        void Accept();
 
         std::vector<pollfd> GetFileDescriptors();
     public:
@@ -0,0 +1,65 @@
+#pragma once
+
+#ifndef __lemon__
+    #error "Lemon OS Only"
+#endif
+
+#include <stdint.h>
+
+#ifndef EPOLLIN
+    #define EPOLLIN 0x001
+    #define EPOLLPRI 0x002
+    #define EPOLLOUT 0x004
+    #define EPOLLERR 0x008
+    #define EPOLLHUP 0x010
+    #define EPOLLONESHOT (1u << 30)
+    #define EPOLLET (1u << 31)
+
+    #define EPOLL_CTL_ADD 1
+    #define EPOLL_CTL_DEL 2
+    #define EPOLL_CTL_MOD 3
+#endif
+
+namespace Lemon{
+    struct EPollEvent {
+        uint32_t events; // EPOLL* events
+        uint64_t data; // Returned with the events, usually the file descriptor
+    } __attribute__((packed));
+
+    /////////////////////////////
+    /// \brief Create an epoll instance
+    ///
+    /// An epoll instance keeps a persistent set of file descriptors and only reports the ones that have become ready,
+    /// so waiting does not have to check every file descriptor each time.
+    ///
+    /// \return File descriptor of the epoll instance, -1 on failure (errno is set)
+    /////////////////////////////
+    int EPollCreate();
+
+    /////////////////////////////
+    /// \brief Add, modify or remove a file descriptor watched by an epoll instance
+    ///
+    /// File descriptors should be removed before they are closed.
+    ///
+    /// \param epfd Epoll file descriptor
+    /// \param op EPOLL_CTL_ADD, EPOLL_CTL_MOD or EPOLL_CTL_DEL
+    /// \param fd File descriptor to watch
+    /// \param events Requested events, EPOLLET for edge triggered and EPOLLONESHOT to only report once until modified
+    /// \param data Returned with events for fd
+    ///
+    /// \return 0 on success, -1 on failure (errno is set)
+    /////////////////////////////
+    int EPollControl(int epfd, int op, int fd, uint32_t events, uint64_t data);
+
+    /////////////////////////////
+    /// \brief Wait for events on the file descriptors watched by an epoll instance
+    ///
+    /// \param epfd Epoll file descriptor
+    /// \param events Array of at least maxEvents events to fill
+    /// \param maxEvents Maximum amount of events to return
+    /// \param timeout Timeout in ms, 0 returns immediately and -1 waits indefinitely
+    ///
+    /// \return Amount of events, -1 on failure (errno is set)
+    /////////////////////////////
+    int EPollWait(int epfd, EPollEvent* events, int maxEvents, long timeout);
+}
@@ -62,4 +62,26 @@ namespace Lemon{
     /// \param list Reference to a std::vector<lemon_process_info_t>
     /////////////////////////////
     void GetProcessList(std::vector<lemon_process_info_t>& list);
+
+    /////////////////////////////
+    /// \brief Set the scheduling priority of a process
+    ///
+    /// Only root can lower the nice value of a process
+    ///
+    /// \param pid Process ID, 0 for the current process
+    /// \param nice Nice value between -20 (highest priority) and 19
+    ///
+    /// \return 0 on success, -1 on failure (errno is set)
+    /////////////////////////////
+    int SetPriority(uint64_t pid, int nice);
+
+    /////////////////////////////
+    /// \brief Get the scheduling priority of a process
+    ///
+    /// \param pid Process ID, 0 for the current process
+    /// \param nice Reference to the nice value
+    ///
+    /// \return 0 on success, -1 on failure (errno is set)
+    /////////////////////////////
+    int GetPriority(uint64_t pid, int& nice);
 }
\ No newline at end of file
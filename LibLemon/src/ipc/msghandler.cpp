@@ -1,6 +1,7 @@
 #include <core/message.h>
 #include <core/msghandler.h>
 #include <lemon/util.h>
+#include <lemon/epoll.h>
 
 #include <assert.h>
 #include <stdlib.h>
@@ -8,6 +9,8 @@
 #include <unistd.h>
 #include <string.h>
 
+#define MESSAGE_SERVER_MAX_EVENTS 32
+
 namespace Lemon {
     MessageClient::MessageClient(){
         int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
@@ -25,6 +28,8 @@ namespace Lemon {
         sock.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
         assert(sock.fd > 0);
 
+        sock.events = POLLIN;
+
         int e = bind(sock.fd, (sockaddr*)&address, len);
         
         if(e){
@@ -40,6 +45,12 @@ namespace Lemon {
             close(sock.fd);
             assert(!e);
         }
+
+        epollFd = EPollCreate();
+        assert(epollFd > 0);
+
+        e = EPollControl(epollFd, EPOLL_CTL_ADD, sock.fd, EPOLLIN, sock.fd);
+        assert(!e);
     }
 
     void MessageClient::Connect(sockaddr_un& address, socklen_t len){
@@ -52,41 +63,52 @@ namespace Lemon {
         }
     }
 
-    std::shared_ptr<LemonMessageInfo> MessageServer::Poll(){
-    retry:
+    void MessageServer::Accept(){
         int fd = 0;
         while((fd = accept(sock.fd, nullptr, nullptr)) > 0){
-            fds.push_back({ .fd = fd, .events = POLLIN, .revents = 0 });
+            if(EPollControl(epollFd, EPOLL_CTL_ADD, fd, EPOLLIN, fd)){
+                perror("Warning: EPollControl: ");
+                close(fd);
+            }
         }
+    }
 
+    std::shared_ptr<LemonMessageInfo> MessageServer::Poll(){
+    retry:
         if(queue.size() > 0){
             auto element = queue.front();
             queue.pop_front();
             return element;
         }
 
-        if(!fds.size()) {
-            return std::shared_ptr<LemonMessageInfo>(nullptr);
-        }
+        EPollEvent events[MESSAGE_SERVER_MAX_EVENTS];
 
-        int evCount = poll(fds.data(), fds.size(), 0);
+        // Only clients that have data or hung up are reported, instead of polling every client
+        int evCount = EPollWait(epollFd, events, MESSAGE_SERVER_MAX_EVENTS, 0);
         if(evCount > 0){
-            for(size_t i = 0; i < fds.size(); i++){
-                if(fds[i].revents & (POLLNVAL | POLLHUP)){
-                    int fd = fds[i].fd;
-                    fds.erase(fds.begin() + i);
+            for(int i = 0; i < evCount; i++){
+                int fd = static_cast<int>(events[i].data);
+
+                if(fd == sock.fd){
+                    Accept();
+                    continue;
+                }
+
+                if(events[i].events & (EPOLLHUP | EPOLLERR)){
+                    EPollControl(epollFd, EPOLL_CTL_DEL, fd, 0, 0); // Must be removed before the client is closed
                     
                     std::shared_ptr<LemonMessageInfo> newMsg = std::shared_ptr<LemonMessageInfo>((LemonMessageInfo*)malloc(sizeof(LemonMessageInfo)));
                     newMsg->msg.protocol = 0; // Disconnected
                     newMsg->clientFd = fd;
 
-                    return newMsg;
+                    queue.push_back(newMsg);
+                    continue;
                 }
 
-                if(!(fds[i].revents & POLLIN)) continue; // We only care about POLLIN
+                if(!(events[i].events & EPOLLIN)) continue; // We only care about EPOLLIN
                 LemonMessage msg;
 
-                ssize_t len = recv(fds[i].fd, &msg, sizeof(LemonMessage), 0);
+                ssize_t len = recv(fd, &msg, sizeof(LemonMessage), 0);
                 if(len < static_cast<ssize_t>(sizeof(LemonMessage))){
                     printf("invalid length: %ld\n", len);
                     continue;
@@ -95,7 +117,7 @@ namespace Lemon {
                 if(msg.magic != LEMON_MESSAGE_MAGIC){
                     printf("Invalid magic: %x, discarding data.\n", msg.magic);
                     while(msg.magic != LEMON_MESSAGE_MAGIC && len >= static_cast<ssize_t>(sizeof(LemonMessage))){
-                        len = recv(fds[i].fd, &msg, sizeof(msg), MSG_DONTWAIT); // Discard everything until we find a message
+                        len = recv(fd, &msg, sizeof(msg), MSG_DONTWAIT); // Discard everything until we find a message
                     }
                 }
 
@@ -106,8 +128,8 @@ namespace Lemon {
                 
                 std::shared_ptr<LemonMessageInfo> newMsg((LemonMessageInfo*)malloc(sizeof(LemonMessageInfo) + msg.length));
                 newMsg->msg = msg;
-                newMsg->clientFd = fds[i].fd;
-                len = recv(fds[i].fd, newMsg->msg.data, msg.length, 0);
+                newMsg->clientFd = fd;
+                len = recv(fd, newMsg->msg.data, msg.length, 0);
 
                 if(len < msg.length){
                     printf("Warning: invalid message length %u. Only read %ld bytes\n", msg.length, len);
@@ -289,8 +311,8 @@ namespace Lemon {
     }
 
     std::vector<pollfd> MessageServer::GetFileDescriptors(){
-        std::vector<pollfd> rfds = fds;
-        rfds.push_back(sock);
+        std::vector<pollfd> rfds;
+        rfds.push_back({ .fd = epollFd, .events = POLLIN, .revents = 0 }); // Readable whenever a client or the listening socket is ready
         return rfds;
     }
 
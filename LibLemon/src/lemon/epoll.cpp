@@ -0,0 +1,46 @@
+#include <lemon/epoll.h>
+#include <lemon/syscall.h>
+
+#include <errno.h>
+
+#ifndef SYS_EPOLL_CREATE
+    #define SYS_EPOLL_CREATE 80
+    #define SYS_EPOLL_CTL 81
+    #define SYS_EPOLL_WAIT 82
+#endif
+
+static_assert(sizeof(Lemon::EPollEvent) == 12, "EPollEvent must match the kernel epoll_event");
+
+namespace Lemon{
+    int EPollCreate(){
+        long ret = syscall(SYS_EPOLL_CREATE, 0, 0, 0, 0, 0);
+        if(ret < 0){
+            errno = -ret;
+            return -1;
+        }
+
+        return ret;
+    }
+
+    int EPollControl(int epfd, int op, int fd, uint32_t events, uint64_t data){
+        EPollEvent event = { .events = events, .data = data };
+
+        long ret = syscall(SYS_EPOLL_CTL, epfd, op, fd, &event, 0);
+        if(ret < 0){
+            errno = -ret;
+            return -1;
+        }
+
+        return 0;
+    }
+
+    int EPollWait(int epfd, EPollEvent* events, int maxEvents, long timeout){
+        long ret = syscall(SYS_EPOLL_WAIT, epfd, events, maxEvents, timeout, 0);
+        if(ret < 0){
+            errno = -ret;
+            return -1;
+        }
+
+        return ret;
+    }
+}
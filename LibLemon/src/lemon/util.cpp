@@ -5,6 +5,11 @@
 #include <stdint.h>
 #include <errno.h>
 
+#ifndef SYS_SET_PRIORITY
+    #define SYS_SET_PRIORITY 77
+    #define SYS_GET_PRIORITY 78
+#endif
+
 extern char** environ;
 
 pid_t lemon_spawn(const char* path, int argc, char* const argv[], int flags){
@@ -46,4 +51,25 @@ namespace Lemon{
             list.push_back(pInfo);
         }
     }
+
+    int SetPriority(uint64_t pid, int nice){
+        long ret = syscall(SYS_SET_PRIORITY, pid, nice, 0, 0, 0);
+        if(ret < 0){
+            errno = -ret;
+            return -1;
+        }
+
+        return 0;
+    }
+
+    int GetPriority(uint64_t pid, int& nice){
+        long ret = syscall(SYS_GET_PRIORITY, pid, 0, 0, 0, 0);
+        if(ret < 0){
+            errno = -ret;
+            return -1;
+        }
+
+        nice = ret - 20; // The kernel returns the nice value offset by 20
+        return 0;
+    }
 }
\ No newline at end of file
@@ -14,6 +14,7 @@
 
 #ifdef __lemon__
     #include <lemon/spawn.h>
+    #include <lemon/util.h>
 #endif
 
 #include "lemonwm.h"
@@ -24,6 +25,10 @@ surface_t renderSurface;
 extern rgba_colour_t backgroundColor;
 
 int main(){
+    #ifdef __lemon__
+    Lemon::SetPriority(0, -5); // Keep the desktop responsive when competing with background jobs
+    #endif
+
     CreateFramebufferSurface(fbSurface);
     renderSurface = fbSurface;
     renderSurface.buffer = new uint8_t[fbSurface.width * fbSurface.height * 4];